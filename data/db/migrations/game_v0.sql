@@ -0,0 +1,21 @@
+PRAGMA foreign_keys=OFF;
+BEGIN TRANSACTION;
+CREATE TABLE kv_int (
+    key                 TEXT PRIMARY KEY,
+    value               INTEGER NOT NULL
+);
+INSERT INTO kv_int VALUES('k',7);
+CREATE TABLE kv_real (
+    key                 TEXT PRIMARY KEY,
+    value               REAL NOT NULL
+);
+CREATE TABLE kv_text (
+    key                 TEXT PRIMARY KEY,
+    value               TEXT NOT NULL
+);
+CREATE TABLE kv_blob (
+    key                 TEXT PRIMARY KEY,
+    value               BLOB NOT NULL,
+    type                INTEGER
+);
+COMMIT;
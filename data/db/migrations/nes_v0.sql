@@ -0,0 +1,39 @@
+PRAGMA foreign_keys=OFF;
+BEGIN TRANSACTION;
+CREATE TABLE kv_int (
+    key                 TEXT PRIMARY KEY,
+    value               INTEGER NOT NULL
+);
+CREATE TABLE kv_real (
+    key                 TEXT PRIMARY KEY,
+    value               REAL NOT NULL
+);
+CREATE TABLE kv_text (
+    key                 TEXT PRIMARY KEY,
+    value               TEXT NOT NULL
+);
+CREATE TABLE kv_blob (
+    key                 TEXT PRIMARY KEY,
+    value               BLOB NOT NULL,
+    type                INTEGER
+);
+CREATE TABLE nes_rom (
+    id              INTEGER PRIMARY KEY,
+    name            TEXT,
+    rom             BLOB NOT NULL,
+    header          BLOB NOT NULL
+);
+CREATE TABLE nes_tas (
+    id              INTEGER PRIMARY KEY,
+    rom_id          INTEGER REFERENCES rom(id) ON DELETE CASCADE NOT NULL,
+    name            TEXT,
+    start_string    BLOB,
+    inputs          BLOB NOT NULL
+);
+CREATE TABLE nes_pattern_table (
+    id              INTEGER PRIMARY KEY,
+    name            TEXT,
+    pattern_table   BLOB NOT NULL
+);
+INSERT INTO nes_pattern_table VALUES(1,'p',X'00');
+COMMIT;
@@ -0,0 +1,12 @@
+PRAGMA foreign_keys=OFF;
+BEGIN TRANSACTION;
+CREATE TABLE rec_recording (
+    id                  INTEGER,
+    import_path         TEXT NOT NULL,
+    iso_timestamp       TEXT NOT NULL,
+    unix_timestamp      INTEGER NOT NULL,
+    offset_millis       INTEGER NOT NULL,
+    elapsed_millis      INTEGER NOT NULL
+);
+INSERT INTO rec_recording VALUES(1,'r','',0,0,0);
+COMMIT;
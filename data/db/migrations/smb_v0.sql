@@ -0,0 +1,82 @@
+PRAGMA foreign_keys=OFF;
+BEGIN TRANSACTION;
+CREATE TABLE kv_int (
+    key                 TEXT PRIMARY KEY,
+    value               INTEGER NOT NULL
+);
+CREATE TABLE kv_real (
+    key                 TEXT PRIMARY KEY,
+    value               REAL NOT NULL
+);
+CREATE TABLE kv_text (
+    key                 TEXT PRIMARY KEY,
+    value               TEXT NOT NULL
+);
+CREATE TABLE kv_blob (
+    key                 TEXT PRIMARY KEY,
+    value               BLOB NOT NULL,
+    type                INTEGER
+);
+CREATE TABLE nes_rom (
+    id              INTEGER PRIMARY KEY,
+    name            TEXT,
+    rom             BLOB NOT NULL,
+    header          BLOB NOT NULL
+);
+CREATE TABLE nes_tas (
+    id              INTEGER PRIMARY KEY,
+    rom_id          INTEGER REFERENCES rom(id) ON DELETE CASCADE NOT NULL,
+    name            TEXT,
+    start_string    BLOB,
+    inputs          BLOB NOT NULL
+);
+CREATE TABLE nes_pattern_table (
+    id              INTEGER PRIMARY KEY,
+    name            TEXT,
+    pattern_table   BLOB NOT NULL
+);
+CREATE TABLE sound_effect (
+    effect          INTEGER PRIMARY KEY,
+    wav_data        BLOB NOT NULL
+);
+CREATE TABLE music_track (
+    track           INTEGER PRIMARY KEY,
+    wav_data        BLOB NOT NULL
+);
+CREATE TABLE nametable_page (
+    id              INTEGER PRIMARY KEY,
+    area_id         INTEGER NOT NULL,
+    page            INTEGER NOT NULL,
+    frame_palette   BLOB NOT NULL,
+    nametable       BLOB NOT NULL
+);
+CREATE TABLE minimap_page (
+    id              INTEGER PRIMARY KEY,
+    area_id         INTEGER NOT NULL,
+    page            INTEGER NOT NULL,
+    minimap         BLOB NOT NULL
+);
+CREATE TABLE nt_extract_record (
+    id                      INTEGER PRIMARY KEY,
+    nes_tas_id              INTEGER REFERENCES nes_tas(id) ON DELETE RESTRICT NOT NULL,
+    frame                   INTEGER NOT NULL,
+    area_id                 INTEGER NOT NULL,
+    page                    INTEGER NOT NULL,
+    nt_index                INTEGER NOT NULL
+);
+CREATE TABLE route (
+    id                      INTEGER PRIMARY KEY,
+    name                    TEXT NOT NULL UNIQUE
+);
+INSERT INTO route VALUES(1,'r');
+CREATE TABLE route_section (
+    id                      INTEGER PRIMARY KEY,
+    route_id                INTEGER REFERENCES route(id) ON DELETE RESTRICT NOT NULL,
+    area_id                 INTEGER NOT NULL,
+    world                   INTEGER NOT NULL,
+    level                   INTEGER NOT NULL,
+    left                    INTEGER NOT NULL,
+    right                   INTEGER NOT NULL,
+    xloc                    INTEGER NOT NULL
+);
+COMMIT;
@@ -0,0 +1,13 @@
+PRAGMA foreign_keys=OFF;
+BEGIN TRANSACTION;
+CREATE TABLE app_cache (
+    name            TEXT PRIMARY KEY,
+    window_x        INTEGER NOT NULL,
+    window_y        INTEGER NOT NULL,
+    width           INTEGER NOT NULL,
+    height          INTEGER NOT NULL,
+    display         INTEGER NOT NULL,
+    ini_data        TEXT NOT NULL
+);
+INSERT INTO app_cache VALUES('a',1,2,3,4,0,'');
+COMMIT;
@@ -23,8 +23,11 @@
 
 #include <array>
 #include <cstdint>
+#include <vector>
+#include <utility>
 
 #include "openssl/md5.h"
+#include "openssl/sha.h"
 
 namespace opensslext
 {
@@ -32,6 +35,17 @@ namespace opensslext
 typedef std::array<uint8_t, MD5_DIGEST_LENGTH> MD5Sum;
 MD5Sum ComputeMD5Sum(const uint8_t* data, size_t num_bytes);
 
+typedef std::array<uint8_t, SHA256_DIGEST_LENGTH> SHA256Sum;
+// The HMAC is over the concatenation of all the parts
+typedef std::vector<std::pair<const uint8_t*, size_t>> DataParts;
+SHA256Sum ComputeHMACSHA256(const uint8_t* key, size_t key_bytes, const DataParts& parts);
+
+// Compare digests without leaking where they differ through timing
+bool ConstantTimeEquals(const uint8_t* a, const uint8_t* b, size_t num_bytes);
+
+// Cryptographically secure, throws std::runtime_error on failure
+void RandomBytes(uint8_t* data, size_t num_bytes);
+
 }
 
 #endif
@@ -23,6 +23,7 @@
 
 #include <vector>
 #include <cstdint>
+#include <functional>
 
 #include "SDL.h"
 #include "SDL_mixer.h"
@@ -37,10 +38,17 @@ public:
     ~SDLExtMixInit();
 };
 
+// An SDL_RWops over 'size' bytes read a piece at a time with 'read' (to
+// 'data', 'count' bytes at 'offset', false or a throw on failure), so SDL can
+// load from say a database blob in place. Freed with SDL_RWclose
+typedef std::function<bool(void* data, size_t count, size_t offset)> SDLExtReadAt;
+SDL_RWops* SDLExtRWFromReadAt(size_t size, SDLExtReadAt read);
+
 class SDLExtMixChunk
 {
 public:
     SDLExtMixChunk(const std::vector<uint8_t>& wav_data);
+    SDLExtMixChunk(SDL_RWops* rwops); // decoded now, then closed
     ~SDLExtMixChunk();
 
     SDLExtMixChunk(const SDLExtMixChunk&) = delete;
@@ -51,7 +59,8 @@ public:
 class SDLExtMixMusic
 {
 public:
-    SDLExtMixMusic(const std::vector<uint8_t>& wav_data);
+    // Mix_Music reads as it plays, so it keeps the data (move it in)
+    SDLExtMixMusic(std::vector<uint8_t> wav_data);
     ~SDLExtMixMusic();
 
     SDLExtMixMusic(const SDLExtMixMusic&) = delete;
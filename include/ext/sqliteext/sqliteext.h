@@ -24,6 +24,9 @@
 #include <string>
 #include <functional>
 #include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
 
 #include <sqlite3.h>
 
@@ -39,7 +42,9 @@ void BindIntOrThrow(sqlite3_stmt* stmt, int pos, int value);
 void BindInt64OrThrow(sqlite3_stmt* stmt, int pos, int64_t value);
 void BindStrOrThrow(sqlite3_stmt* stmt, int pos, const std::string& str);
 void BindBlbOrThrow(sqlite3_stmt* stmt, int pos, const void* data, size_t size); // SQLITE_STATIC only
+void BindZeroBlbOrThrow(sqlite3_stmt* stmt, int pos, size_t size); // to fill with SQLiteExtBlobWriter
 void StepAndFinalizeOrThrow(sqlite3_stmt* stmt);
+void StepDoneOrThrow(sqlite3_stmt* stmt); // like StepAndFinalizeOrThrow, for statements kept around
 
 bool ExecForSingleNullableString(sqlite3* db, const std::string& query, std::string* str);
 bool ExecForSingleNullableInt(sqlite3* db, const std::string& query, int* v);
@@ -56,6 +61,50 @@ uint8_t column_uint8_t(sqlite3_stmt* stmt, int column);
 
 ////////////////////////////////////////////////////////////////////////////////
 
+class SQLiteExtDB;
+
+// A prepared statement out of SQLiteExtDB's cache. Converts to sqlite3_stmt*
+// for the Bind*OrThrow helpers and the sqlite3_ functions, but is never to be
+// finalized. When it goes out of scope (or on Release) the statement is reset
+// and its bindings cleared, so BindBlbOrThrow's SQLITE_STATIC pointers don't
+// outlive the call. Must not outlive the SQLiteExtDB it came from
+class SQLiteExtStatement
+{
+public:
+    SQLiteExtStatement();
+    SQLiteExtStatement(SQLiteExtDB* db, sqlite3_stmt* stmt);
+    ~SQLiteExtStatement();
+    SQLiteExtStatement(const SQLiteExtStatement&) = delete;
+    SQLiteExtStatement& operator=(const SQLiteExtStatement&) = delete;
+    SQLiteExtStatement(SQLiteExtStatement&& other) noexcept;
+    SQLiteExtStatement& operator=(SQLiteExtStatement&& other) noexcept;
+
+    sqlite3_stmt* get() const {
+        return m_Stmt;
+    }
+    operator sqlite3_stmt*() const {
+        return m_Stmt;
+    }
+    void Release();
+
+private:
+    SQLiteExtDB* m_db;
+    sqlite3_stmt* m_Stmt;
+};
+// A cached statement is reset, not finalized
+void StepAndFinalizeOrThrow(const SQLiteExtStatement& stmt) = delete;
+
+// A step that brings one layer of a database's schema (say GameDatabase's
+// tables, then NESDatabase's on top of them) to 'Version'. Steps are listed
+// in order, starting from version 1 which creates the layer's tables as they
+// first were
+struct SQLiteExtMigration
+{
+    int Version;
+    const char* Description;
+    std::function<void(SQLiteExtDB* db)> Apply;
+};
+
 class SQLiteExtDB
 {
 public:
@@ -67,6 +116,7 @@ public:
 
     void BeginTransaction();
     void Commit();
+    void Rollback(); // never throws, it is for unwinding
 
     // calls 'system', so not suitable for most situations.
     int SystemLaunchSQLite3WithExamples();
@@ -75,23 +125,125 @@ public:
             std::function<bool(int argc, char** data, char** columns)> cback = nullptr);
     int ExecFileOrThrow(const std::string& path);
 
+    // Prepared statements are cached by their sql, the least recently used
+    // finalized past the capacity. A statement already out (say the same
+    // query nested in a loop over its rows) is prepared again and finalized
+    // when released. sqlite re-prepares cached statements after the schema
+    // changes. Close finalizes them all
+    SQLiteExtStatement PrepareOrThrow(const std::string& query);
+
+    static constexpr size_t DEFAULT_STATEMENT_CACHE_CAPACITY = 64;
+    void SetStatementCacheCapacity(size_t capacity); // 0 to not cache
+    size_t GetStatementCacheCapacity() const;
+    void ClearStatementCache(); // finalizes those not out
+
+    struct StatementCacheCounters
+    {
+        uint64_t Hits;
+        uint64_t Misses;
+        uint64_t Evictions;
+        size_t Statements;
+    };
+    StatementCacheCounters GetStatementCacheCounters() const;
+
+    // Each layer's version is kept in schema_version, 0 for one that was
+    // never migrated (including databases from before there were versions).
+    // MigrateOrThrow applies the steps past it in one transaction, rolled back
+    // if any throws, and throws for a version newer than the last step.
+    // Before the first step on a database that already had tables it is
+    // backed up to '<path>.<layer>-v<version>.bak' unless turned off
+    int GetSchemaVersion(const std::string& layer);
+    void MigrateOrThrow(const std::string& layer, const std::vector<SQLiteExtMigration>& migrations);
+    static void SetBackupBeforeMigrate(bool backup); // true by default
+    void BackupOrThrow(const std::string& path);
+
+    static const char* SchemaVersionSchema();
+
     sqlite3* m_Database;
     std::string m_DatabasePath;
+
+private:
+    friend class SQLiteExtStatement;
+    void ReleaseStatement(sqlite3_stmt* stmt);
+    void EvictStatements(size_t capacity);
+
+    struct CachedStatement
+    {
+        std::string Query;
+        sqlite3_stmt* Stmt;
+        bool Out;
+    };
+    typedef std::list<CachedStatement> CachedStatementList;
+
+    size_t m_StatementCapacity;
+    CachedStatementList m_Statements; // most recently used first
+    std::unordered_map<std::string, CachedStatementList::iterator> m_StatementsByQuery;
+    std::unordered_map<sqlite3_stmt*, CachedStatementList::iterator> m_StatementsOut;
+    StatementCacheCounters m_StatementCounters;
+
+    bool m_HadTables; // when opened
+    bool m_BackedUp;
+};
+
+// A blob read (or written) in place a piece at a time with sqlite3_blob_open,
+// rather than copied out whole by a SELECT or bound whole to an INSERT. The
+// row is by its rowid (an INTEGER PRIMARY KEY is one). The blob expires if
+// its row changes, and must not outlive the SQLiteExtDB it came from
+class SQLiteExtBlobReader
+{
+public:
+    SQLiteExtBlobReader(SQLiteExtDB* db, const char* table, const char* column, int64_t rowid);
+    ~SQLiteExtBlobReader();
+    SQLiteExtBlobReader(const SQLiteExtBlobReader&) = delete;
+    SQLiteExtBlobReader& operator=(const SQLiteExtBlobReader&) = delete;
+
+    size_t Size() const;
+    void ReadOrThrow(void* data, size_t size, size_t offset);
+    void ReadAllOrThrow(std::vector<uint8_t>* data);
+
+protected:
+    SQLiteExtBlobReader(SQLiteExtDB* db, const char* table, const char* column, int64_t rowid, bool write);
+    sqlite3_blob* m_Blob;
+    SQLiteExtDB* m_db;
+};
+
+// The blob can't change size, the row is inserted (or updated) with
+// BindZeroBlbOrThrow for the size first
+class SQLiteExtBlobWriter : public SQLiteExtBlobReader
+{
+public:
+    SQLiteExtBlobWriter(SQLiteExtDB* db, const char* table, const char* column, int64_t rowid);
+    ~SQLiteExtBlobWriter();
+
+    void WriteOrThrow(const void* data, size_t size, size_t offset);
 };
 
+// Rolled back unless Commit is called, so a scope left by an exception
+// doesn't keep half of its changes
 class SQLiteExtTransaction
 {
 public:
     SQLiteExtTransaction(SQLiteExtDB* db)
         : m_db(db)
+        , m_Committed(false)
     {
         m_db->BeginTransaction();
     }
     ~SQLiteExtTransaction() {
+        if (!m_Committed) {
+            m_db->Rollback();
+        }
+    }
+    SQLiteExtTransaction(const SQLiteExtTransaction&) = delete;
+    SQLiteExtTransaction& operator=(const SQLiteExtTransaction&) = delete;
+
+    void Commit() {
         m_db->Commit();
+        m_Committed = true;
     }
 private:
     SQLiteExtDB* m_db;
+    bool m_Committed;
 };
 
 }
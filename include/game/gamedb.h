@@ -25,6 +25,9 @@
 #ifndef STATIC_GAME_GAMEDB_HEADER
 #define STATIC_GAME_GAMEDB_HEADER
 
+#include <memory>
+#include <unordered_map>
+
 #include "ext/sqliteext/sqliteext.h"
 #include "ext/opencvext/opencvext.h"
 
@@ -53,13 +56,18 @@ public:
     std::string GetText(const char* key, std::string default_value);
     void SetText(const char* key, const std::string& str);
 
-    // Full blobs (good for small ish raw files), stored in kv_blob
+    // Full blobs (good for small ish raw files), stored in kv_blob (throws on
+    // unknown key). Each set bumps the row's 'modified' counter
     void GetBlob(const char* key, std::vector<uint8_t>* result);
     void SetBlob(const char* key, const uint8_t* ptr, size_t size);
-    // THIS POINTER ONLY VALID UNTIL A TYPE CONVERSION (see https://www.sqlite.org/c3ref/column_blob.html)
+    // THIS POINTER ONLY VALID UNTIL THE NEXT GetBlob
     const void* GetBlob(const char* key);
+    // Or read in place a piece at a time, nullptr for an unknown key
+    std::unique_ptr<sqliteext::SQLiteExtBlobReader> OpenBlob(const char* key);
 
     // useful to have an image now and then huh! (these are compressed as pngs in the database)!, stored in kv_blob
+    // The decoded images are cached by key and 'modified', so a png is only
+    // decoded again once it's set again. Returns a copy of the cached one
     cv::Mat GetImage(const char* key);
     void SetImage(const char* key, cv::Mat img);
 
@@ -67,11 +75,24 @@ public:
     // int SQLiteExtDB::ExecOrThrow(const std::string& query,
     //        std::function<bool(int argc, char** data, char** columns)> cback = nullptr);
 
-    // Schemas for the simple key value stuff
+    // Schemas for the simple key value stuff, as version 1 of the 'game'
+    // layer created them. Later versions are the steps in Migrations
+    static const std::vector<sqliteext::SQLiteExtMigration>& Migrations();
     static const char* KVIntSchema();
     static const char* KVDoubleSchema();
     static const char* KVStringSchema();
     static const char* KVBlobSchema();
+
+private:
+    void DoSetBlob(const char* key, const uint8_t* ptr, size_t size, int type);
+
+    std::vector<uint8_t> m_Blob; // for GetBlob's pointer
+    struct CachedImage
+    {
+        int64_t Modified;
+        cv::Mat Image;
+    };
+    std::unordered_map<std::string, CachedImage> m_Images;
 };
 
 }
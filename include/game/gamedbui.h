@@ -106,21 +106,18 @@ public:
     virtual T GetValue(sqlite3_stmt* stmt, int column) = 0;
     virtual void DoColumn(const std::string& key, T* value, bool* selected, sqliteext::ui::BasicColumnType type, bool* changed, int* scroll) = 0;
     void Delete(std::string key) {
-        sqlite3_stmt* stmt;
-        sqliteext::PrepareOrThrow(m_Database->m_Database, "DELETE FROM " + m_Table + " WHERE key = ?;", &stmt);
+        auto stmt = m_Database->PrepareOrThrow("DELETE FROM " + m_Table + " WHERE key = ?;");
         sqliteext::BindStrOrThrow(stmt, 1, key);
-        sqliteext::StepAndFinalizeOrThrow(stmt);
+        sqliteext::StepDoneOrThrow(stmt);
     }
     void Refresh() {
         m_KV.clear();
-        sqlite3_stmt* stmt;
-        sqliteext::PrepareOrThrow(m_Database->m_Database, "SELECT key, value FROM " + m_Table, &stmt);
+        auto stmt = m_Database->PrepareOrThrow("SELECT key, value FROM " + m_Table);
         while (sqlite3_step(stmt) == SQLITE_ROW) {
             m_KV.emplace_back();
             m_KV.back().first = sqliteext::column_str(stmt, 0);
             m_KV.back().second = GetValue(stmt, 1);
         }
-        sqlite3_finalize(stmt);
     }
     virtual bool DoInsertControls() = 0;
 
@@ -92,6 +92,8 @@ public:
             nes::PatternTable* pattern_table);
 
 
+    // Version 1 of the 'nes' layer, later versions are the steps in Migrations
+    static const std::vector<sqliteext::SQLiteExtMigration>& Migrations();
     static const char* ROMSchema();
     static const char* TASSchema();
     static const char* PatternTableSchema();
@@ -32,6 +32,8 @@
 #ifndef STATIC_NES_PPUX_HEADER
 #define STATIC_NES_PPUX_HEADER
 
+#include <bitset>
+
 #include "nes/nes.h"
 #include "util/rect.h"
 
@@ -39,6 +41,7 @@ namespace sta::nes
 {
 
 struct PPUxPriorityInfo;
+class PPUxCommandList;
 
 struct OAMxEntry
 {
@@ -51,6 +54,21 @@ struct OAMxEntry
 // Helper to update the oamx in a specific way
 void NextOAMx(OAMxEntry* oamx, int x8, int y8, uint8_t tileIndex, uint8_t attributes);
 
+// A few bytes of a full nametable (tiles, then attributes) to draw in place
+// of what is there. So that a shared, cached nametable can be drawn with
+// changes without copying it or changing it.
+struct NametableOverlay
+{
+    void Clear();
+    bool Empty() const;
+    void Set(int offset, uint8_t value); // replaces any earlier value at offset
+    uint8_t Get(int offset, uint8_t original) const;
+
+private:
+    std::bitset<NAMETABLE_SIZE> m_Present;
+    std::vector<std::pair<uint16_t, uint8_t>> m_Values; // sorted by offset
+};
+
 struct Nametablex
 {
     int X, Y; // In 'Game' Pixels
@@ -70,7 +88,70 @@ struct RenderInfo
     const uint8_t* PaletteBGR;   // 0x00C0 in size
 };
 
+// The tiles of a pattern table decoded to one palette index (0-3) per pixel,
+// for every tile and every flip. Rendering a row of a tile is then a lookup
+// rather than picking the two bitplanes apart pixel by pixel.
+struct DecodedPatternTable
+{
+    PatternTable Source;
+    std::array<uint8_t, 4 * 256 * 64> Pixels; // [flip][tile][y][x], flip: 1 horizontal | 2 vertical
+
+    const uint8_t* Tile(uint8_t tileIndex, bool flipHorizontal, bool flipVertical) const;
+};
+typedef std::shared_ptr<const DecodedPatternTable> DecodedPatternTablePtr;
+void DecodeTile(const uint8_t* tileData, bool flipHorizontal, bool flipVertical, uint8_t* pixels); // 16 bytes -> 64
+void DecodePatternTable(const uint8_t* patternTable, DecodedPatternTable* decoded);
+// Cached by address and decoded again if the contents change. Thread safe
+DecodedPatternTablePtr GetDecodedPatternTable(const uint8_t* patternTable);
+
+// A string as RenderString or RenderStringX lay it out, the glyphs of each
+// line side by side. Names, titles and timers mostly don't change from frame
+// to frame, so each is decoded once and then drawn a line at a time rather
+// than a tile at a time. Palette and scale are applied when drawn.
+struct TextSprite
+{
+    struct Line
+    {
+        int Columns; // 8 per glyph
+        std::vector<uint8_t> Pixels; // [y][x], 8 rows, palette indices (0-3)
+    };
+    std::vector<Line> Lines;
+    DecodedPatternTablePtr Glyphs; // so the address in the cache key stays this one
+};
+typedef std::shared_ptr<const TextSprite> TextSpritePtr;
+// stringX for the RenderStringX rules ('\n' and the negative characters).
+// Cached by glyphs and string. Thread safe
+TextSpritePtr GetTextSprite(DecodedPatternTablePtr glyphs, const std::string& str, bool stringX);
+
+// Text layout in screen pixels, for RenderString, and RenderStringX which
+// is as wide as its widest line
+int MeasureString(const std::string& str, int scale);
+int MeasureStringX(const std::string& strX, int scalx);
+// At most maxWidth wide, and if it had to be cut short then ending in
+// ellipsis (which is also cut if even that doesn't fit)
+std::string FitString(const std::string& str, int maxWidth, int scale,
+        const std::string& ellipsis = "...");
+enum class TextAlign
+{
+    LEFT,
+    CENTER,
+    RIGHT
+};
+// Where to draw text that is width wide so that its left, center or right is
+// at x. For example RenderString(AlignText(right, MeasureString(s, 2),
+// TextAlign::RIGHT), y, s, ...)
+int AlignText(int x, int width, TextAlign align);
+
 // Per item specific rendering options
+// Opacity compositing. EffectInfo::Opacity is quantized to an 8 bit alpha,
+// a = round(clamp(opacity, 0, 1) * 255), and each channel becomes
+//     dst = round((src * a + dst * (255 - a)) / 255)
+// which is always within 1 of the exact dst + (src - dst) * opacity.
+uint8_t OpacityToAlpha(float opacity);
+uint8_t BlendChannel(uint8_t dst, uint8_t src, uint8_t alpha);
+// n bytes (any length), AVX2 or SSE2 when compiled for them
+void BlendBGR(uint8_t* dst, const uint8_t* src, size_t n, uint8_t alpha);
+
 struct EffectInfo
 {
     float Opacity;
@@ -91,18 +172,56 @@ enum class PPUxPriorityStatus
     ENABLED
 };
 
+// What a PPUx draws. PALETTE_INDEX keeps, for every pixel, the index into
+// paletteBGR that would have been drawn (one byte). That way a frame can be
+// drawn once at 1x and then resolved to BGR at whatever integer scale is
+// needed, and with whatever palette (so recoloring is a palette swap, not a
+// re-render).
+// Alongside the indices is an alpha plane: 0 where nothing has been drawn,
+// else the OpacityToAlpha of the last thing drawn there. The blending is
+// deferred to Resolve, over whatever is already in its output. So unlike BGR
+// the last translucent draw to a pixel replaces, rather than blends with,
+// what was drawn there before it in the same PPUx.
+enum class PPUxOutputFormat
+{
+    BGR,
+    PALETTE_INDEX
+};
+
+// Nearest neighbour integer upscale of width x height pixels of bytesPerPixel
+// each. dst is (width * scale) x (height * scale).
+void UpscaleNearest(const uint8_t* src, int width, int height, int bytesPerPixel,
+        int scale, uint8_t* dst);
+
 class PPUx {
 public:
     // When putting into a pre-existing opencv mat: PPUx ppux(mat.cols, mat.rows, mat.data);
     PPUx(int width, int height, uint8_t* bgrout, PPUxPriorityStatus priorityStatus); // your data
     PPUx(int width, int height, PPUxPriorityStatus priorityStatus); // my data
+    PPUx(int width, int height, PPUxPriorityStatus priorityStatus, PPUxOutputFormat format); // my data
     ~PPUx();
 
     // example: cv::Mat m(ppux.GetHeight(), ppux.GetWidth(), CV_8UC3, ppux.GetBGROut());
     int GetWidth() const;
     int GetHeight() const;
-    uint8_t* GetBGROut();
+    uint8_t* GetBGROut(); // nullptr unless BGR
     const uint8_t* GetBGROut() const;
+    uint8_t* GetIndexOut(); // nullptr unless PALETTE_INDEX
+    const uint8_t* GetIndexOut() const;
+    const uint8_t* GetAlphaOut() const; // nullptr unless PALETTE_INDEX
+    PPUxOutputFormat GetOutputFormat() const;
+
+    // Write the output as BGR scaled up by an integer factor, looking the
+    // indices up in paletteBGR if PALETTE_INDEX (and compositing them over
+    // bgrOut by the alpha plane). paletteBGR needs an entry for every index
+    // drawn, which may go past the 64 NES colors (up to 0xff).
+    // bgrOut must be RequiredBGROutSize(width * scale, height * scale)
+    void Resolve(const uint8_t* paletteBGR, uint8_t* bgrOut, int scale = 1) const;
+    // Into a PPUx exactly scale times the size, both the pixels (resolved if
+    // this is PALETTE_INDEX and other is BGR) and the priority. So drawing can
+    // be done at 1x, and the outlines stroked either here before or in other
+    // after (with a scaled radius).
+    void UpscaleTo(PPUx* other, int scale, const uint8_t* paletteBGR);
 
     PPUxPriorityStatus GetPriorityStatus() const;
     void SetPriorityStatus(PPUxPriorityStatus status);
@@ -117,6 +236,8 @@ public:
     std::vector<uint8_t>& GetPriorityInfo(); // be careful
     void FillBackground(uint8_t paletteIndex, const uint8_t* paletteBGR);
     void FillBackground(uint8_t paletteIndex, const RenderInfo& render);
+    // Respecting the crop (x and y) and blending with the opacity
+    void FillBackground(uint8_t paletteIndex, const uint8_t* paletteBGR, const EffectInfo& effects);
 
     // Note conventional order is y, tile, attributes, x
     void RenderOAMEntry(
@@ -143,7 +264,8 @@ public:
             const uint8_t* patternTable, // 0x1000 in size
             const uint8_t* framePalette, // 0x0020 in size
             const uint8_t* paletteBGR,   // 0x00C0 in size
-            int scale, const EffectInfo& effects);
+            int scale, const EffectInfo& effects,
+            const NametableOverlay* overlay = nullptr); // only for a full nametable
 
 
     void RenderOAMxEntry(
@@ -153,6 +275,20 @@ public:
     void RenderNametableX(
             const Nametablex& ntx,
             const RenderInfo& render,
+            const EffectInfo& effects,
+            const NametableOverlay* overlay = nullptr);
+
+    // A full nametable drawn before (at scale, opaque, into BGR) copied back
+    // in, with the same result as drawing it again with RenderNametable. The
+    // colors are copied, and where backgroundMask is nonzero (the tile pixel
+    // wasn't the backdrop) so is the background priority. Tiles set in
+    // skipTiles are left alone, to be drawn some other way. BGR output and
+    // opaque effects only.
+    void BlitNametableImage(
+            int x, int y, int scale,
+            const uint8_t* bgr,            // (256 * scale) x (240 * scale) x 3
+            const uint8_t* backgroundMask, // (256 * scale) x (240 * scale)
+            const std::bitset<NAMETABLE_ATTRIBUTE_OFFSET>* skipTiles, // [row * 32 + column], or nullptr
             const EffectInfo& effects);
 
     // Render a string (as a sprite) with in front of background priority
@@ -210,12 +346,23 @@ public:
     // if a sprite is there so you get weird glitches. This is the default
     // (correct) behaviour. Use this function to turn it off if you're picky.
     void SetSpritePriorityGlitch(bool value);
+    bool GetSpritePriorityGlitch() const;
 
     void DrawBorderedBox(
             int x, int y, int w, int h,
             std::array<uint8_t, 9> paletteEntries,
             const uint8_t* paletteBGR, int outlineWidth = 1);
 
+    // The original pixel at a time renderer. Slow, but kept around so that the
+    // faster row based one can be checked against it ('static ppux check')
+    void SetReferenceRendering(bool value);
+    bool GetReferenceRendering() const;
+
+    // Draw a recorded list, same result as list.Replay(this, offsetY). But
+    // the resources are gathered up front, sorted, and each pattern table
+    // decoded once for the whole list rather than looked up for every tile.
+    void Execute(const PPUxCommandList& list, int offsetY = 0);
+
 private:
     enum Render88Flags : uint8_t
     {
@@ -233,10 +380,44 @@ private:
             const uint8_t* tileData,
             const uint8_t* paletteBGR,
             int scalx, int scaly, const EffectInfo& effects);
+    void RenderTile88Reference(
+            int x, int y, Render88Flags flags,
+            const uint8_t* tilePalette,
+            const uint8_t* tileData,
+            const uint8_t* paletteBGR,
+            int scalx, int scaly, const EffectInfo& effects);
+    // pixels are 64 palette indices as from DecodedPatternTable::Tile, which
+    // already accounts for the flip flags. Or 8 rows of any number of columns,
+    // like a line of a TextSprite
+    void BlitTile88(
+            int x, int y, Render88Flags flags,
+            const uint8_t* tilePalette,
+            const uint8_t* pixels,
+            const uint8_t* paletteBGR,
+            int scalx, int scaly, const EffectInfo& effects,
+            int columns = 8);
+    // Each line at 8 * scaly below the last
+    void BlitTextSprite(int x, int y, const TextSprite& sprite,
+            const uint8_t* tilePalette, const uint8_t* paletteBGR,
+            int scalx, int scaly, const EffectInfo& effects);
+    // The decoded pattern table, from those bound by Execute if there
+    DecodedPatternTablePtr DecodedFor(const uint8_t* patternTable);
+    std::vector<std::pair<const uint8_t*, DecodedPatternTablePtr>> m_BoundPatternTables; // sorted
 
-    void PutPixel(int x, int y, const uint8_t* bgr, // blue green red
+    // Either of the above
+    void RenderPatternTableTile88(
+            int x, int y, Render88Flags flags,
+            const uint8_t* tilePalette,
+            const uint8_t* patternTable, uint8_t tileIndex,
+            const uint8_t* paletteBGR,
+            int scalx, int scaly, const EffectInfo& effects);
+
+    void PutPixel(int x, int y, const uint8_t* bgr, // blue green red, or see PixelValue
             bool overridePriority, bool isSprite, bool spritePriority, bool isBackground,
             const EffectInfo& effects);
+    // The priority rules of PutPixel for pixel i (priority must be enabled),
+    // returns false if the pixel should not be drawn
+    bool UpdatePixelPriority(size_t i, bool isSprite, bool spritePriority, bool isBackground, bool opaque);
 
     enum PPUxPriorityInfoEntry : uint8_t
     {
@@ -259,19 +440,159 @@ private:
         int ix;
     };
     void DoStrokeOutline(const std::vector<Offset>& offsets, uint8_t paletteIndex, const uint8_t* paletteBGR);
+    // Same result as DoStrokeOutline, but via a distance transform over the
+    // bounding box of the pixels to outline. Exact euclidean
+    // (Felzenszwalb-Huttenlocher) when rounded, else chebyshev, in both cases
+    // compared against the radius the offsets were built from.
+    void DoStrokeOutlineTransform(const std::vector<Offset>& offsets, bool rounded,
+            float outlineRadius, int mr, uint8_t paletteIndex, const uint8_t* paletteBGR);
     void ClearStrokePriority();
 
 
 private:
     int m_Width, m_Height;
     std::vector<uint8_t> m_MyBGR;
-    uint8_t* m_BGROut;
+    uint8_t* m_BGROut; // or the palette indices, see m_OutputFormat
+    PPUxOutputFormat m_OutputFormat;
+    int m_PixelSize; // bytes per pixel of m_BGROut
+    std::vector<uint8_t> m_Alpha; // PALETTE_INDEX only, see PPUxOutputFormat
+
+    // What to write for paletteIndex, either its BGR or the index itself
+    // (so paletteIndex must stay valid while in use)
+    const uint8_t* PixelValue(const uint8_t* paletteBGR, const uint8_t* paletteIndex) const;
+    uint8_t AlphaFor(const EffectInfo& effects) const;
+    // For PALETTE_INDEX the opacity is only recorded in m_Alpha, the pixels
+    // are written as if opaque
+    bool DeferredAlpha() const;
 
     PPUxPriorityStatus m_PriorityStatus;
     std::vector<uint8_t> m_PriorityInfo;
     bool m_Outlining;
 
     bool m_SpritePriorityGlitch;
+
+    bool m_ReferenceRendering;
+    std::vector<uint8_t> m_RowIndices; // scratch for BlitTile88
+    std::vector<uint8_t> m_RowBGR;
+    std::vector<int> m_OutlineDistance; // scratch for DoStrokeOutlineTransform
+
+    // Priority is tracked in PRIORITY_TILE_SIZE square tiles of pixels. Only
+    // the tiles written since the last reset need to be cleared, stroked or
+    // copied. GetPriorityInfo hands out the whole buffer so it marks
+    // everything dirty.
+    static constexpr int PRIORITY_TILE_SIZE = 8;
+    void MarkPriorityDirty(int x0, int x1, int y); // columns [x0, x1) of row y
+    template <typename F> void ForEachDirtyPriorityRow(F&& f); // f(x, y, n)
+    void ResetPriorityWithin(int x0, int x1, int y0, int y1); // leaves the tiles dirty
+    int m_PriorityTilesX;
+    std::vector<uint8_t> m_PriorityTileDirty;
+    std::vector<int> m_DirtyPriorityTiles;
+    bool m_PriorityAllDirty;
+};
+
+enum class PPUxCommandType : uint8_t
+{
+    SPRITE_PRIORITY_GLITCH,
+    FILL_BACKGROUND,
+    RESET_PRIORITY,
+    RESET_SPRITE_PRIORITY_ONLY,
+    NAMETABLE,
+    NAMETABLE_ENTRY,
+    OAM_ENTRY,
+    PALETTE_DATA,
+    STRING,
+    STRING_X,
+    BORDERED_BOX,
+    BEGIN_OUTLINE,
+    STROKE_OUTLINE_O,
+    STROKE_OUTLINE_X,
+};
+
+// One recorded call, only the fields its type uses are set
+struct PPUxCommand
+{
+    PPUxCommandType Type;
+    int X, Y;
+    int Width, Height; // nametable in tiles, palette data and boxes in pixels
+    int ScaleX, ScaleY;
+    uint8_t TileIndex;
+    uint8_t Attributes; // or RenderPaletteDataFlags, or a flag (glitch on, plain fill)
+    uint8_t PaletteIndex; // to fill or outline with
+    int OutlineWidth;
+    float OutlineRadius;
+    const uint8_t* PatternTable;
+    const uint8_t* Data; // nametable tiles or palette data
+    const uint8_t* AttrData;
+    const uint8_t* PaletteBGR;
+    FramePalette Palette; // frame palette, tile palette (4) or box entries (9)
+    std::string Text;
+    EffectInfo Effects;
+    int Top, Bottom; // the rows [Top, Bottom) that it may draw to
+};
+
+// The PPUx calls (same names and arguments) recorded to be replayed later, for
+// example in bands on several threads (see nes/ppuxbands.h), or hashed to
+// skip a frame that hasn't changed. Palettes, text and OAMx entries are
+// copied, but pattern tables, nametables, palette data and paletteBGR are
+// pointed to (those pointers are the resource handles) and must outlive the
+// list.
+class PPUxCommandList
+{
+public:
+    PPUxCommandList();
+    ~PPUxCommandList();
+
+    void Clear();
+    const std::vector<PPUxCommand>& GetCommands() const;
+    // Of all the strokes, so how far a pixel's result can depend on others
+    float GetMaxOutlineRadius() const;
+    // Of the commands and the contents of everything they point to (the
+    // paletteBGR taken as its usual 0x00C0). Equal hashes draw the same thing,
+    // so a frame whose list hashes as the last one did doesn't need drawing.
+    uint64_t Hash() const;
+
+    // Draw everything into ppux, as if it had been called directly. offsetY is
+    // added to every y (and crop), and calls that can't draw within ppux are
+    // skipped.
+    void Replay(PPUx* ppux, int offsetY = 0) const;
+
+    void SetSpritePriorityGlitch(bool value);
+    void ResetPriority();
+    void ResetSpritePriorityOnly();
+    void FillBackground(uint8_t paletteIndex, const uint8_t* paletteBGR);
+    void FillBackground(uint8_t paletteIndex, const uint8_t* paletteBGR, const EffectInfo& effects);
+    void RenderOAMEntry(int x, int y, uint8_t tileIndex, uint8_t oamAttributes,
+            const uint8_t* patternTable, const uint8_t* framePalette, const uint8_t* paletteBGR,
+            int scale, const EffectInfo& effects);
+    void RenderNametableEntry(int x, int y, uint8_t tileIndex, uint8_t attributes,
+            const uint8_t* patternTable, const uint8_t* framePalette, const uint8_t* paletteBGR,
+            int scale, const EffectInfo& effects);
+    void RenderNametable(int x, int y, int width, int height,
+            const uint8_t* tileStart, const uint8_t* attrStart,
+            const uint8_t* patternTable, const uint8_t* framePalette, const uint8_t* paletteBGR,
+            int scale, const EffectInfo& effects);
+    void RenderOAMxEntry(const OAMxEntry& oamx, const RenderInfo& render, const EffectInfo& effects);
+    void RenderNametableX(const Nametablex& ntx, const RenderInfo& render, const EffectInfo& effects);
+    void RenderString(int x, int y, const std::string& str,
+            const uint8_t* patternTable, const uint8_t* tilePalette, const uint8_t* paletteBGR,
+            int scale, const EffectInfo& effects);
+    void RenderStringX(int x, int y, const std::string& strX,
+            const uint8_t* patternTable, const uint8_t* tilePalette, const uint8_t* paletteBGR,
+            int scalx, int scaly, const EffectInfo& effects);
+    void RenderPaletteData(int x, int y, int width, int height, const uint8_t* data,
+            const uint8_t* paletteBGR, PPUx::RenderPaletteDataFlags flags, const EffectInfo& effects);
+    void DrawBorderedBox(int x, int y, int w, int h, std::array<uint8_t, 9> paletteEntries,
+            const uint8_t* paletteBGR, int outlineWidth = 1);
+    void BeginOutline();
+    void StrokeOutlineO(float outlineRadius, uint8_t paletteIndex, const uint8_t* paletteBGR);
+    void StrokeOutlineX(float outlineRadius, uint8_t paletteIndex, const uint8_t* paletteBGR);
+
+private:
+    PPUxCommand& Add(PPUxCommandType type, int top, int bottom);
+
+private:
+    std::vector<PPUxCommand> m_Commands;
+    float m_MaxOutlineRadius;
 };
 
 }
@@ -0,0 +1,82 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2023 Matthew Deutsch
+//
+// Static is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Static is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Static; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+////////////////////////////////////////////////////////////////////////////////
+//
+// Rendering a PPUxCommandList on several threads, for the big (1920x1080, up
+// to eight players) canvases. The canvas is cut into horizontal bands and each
+// band replays the whole list, clipped to its rows, on a worker. Every band
+// also draws the rows around it out to the largest outline radius so the
+// outlines that cross band edges come out right. The result is the same as
+// replaying the list on one thread, whatever the thread count.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef STATIC_NES_PPUXBANDS_HEADER
+#define STATIC_NES_PPUXBANDS_HEADER
+
+#include <condition_variable>
+
+#include "nes/ppux.h"
+
+namespace sta::nes
+{
+
+class PPUxBandRenderer
+{
+public:
+    // threads <= 0 for one per hardware thread
+    PPUxBandRenderer(int threads = 0);
+    ~PPUxBandRenderer();
+
+    int GetThreadCount() const;
+
+    // Same as ppux->Execute(list). The list starts from what is already in ppux
+    // (pixels and priority), but not from its outlining state, so
+    // BeginOutline should be in the list. BGR output only.
+    void Render(const PPUxCommandList& list, PPUx* ppux);
+
+private:
+    void WorkerLoop();
+    void RunBands(std::function<void(int)> job); // job(band) for every band, on the workers
+    // The rows [y0, y1) of the band, and [top, bottom) with the halo
+    void BandRows(int height, int band, int halo, int* y0, int* y1, int* top, int* bottom) const;
+    void RenderBand(const PPUxCommandList& list, PPUx* ppux, int band, int halo);
+    void CopyBand(PPUx* ppux, int band, int halo);
+
+private:
+    int m_ThreadCount;
+    std::vector<std::thread> m_Workers;
+    std::vector<std::vector<uint8_t>> m_BandPixels;
+    std::vector<std::vector<uint8_t>> m_BandPriority;
+    std::vector<uint8_t>* m_Priority; // of the PPUx being rendered, if enabled
+
+    std::mutex m_Mutex;
+    std::condition_variable m_WorkCV;
+    std::condition_variable m_DoneCV;
+    std::function<void(int)> m_Job; // band index
+    int m_Bands;
+    int m_NextBand;
+    int m_BandsDone;
+    std::exception_ptr m_Error;
+    bool m_Quit;
+};
+
+}
+
+#endif
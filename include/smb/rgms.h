@@ -363,6 +363,189 @@ struct SMBSerialProcessorThreadInfo
     int ErrorCount;
 };
 
+// 'rgms transmit' sends one of these every SMB_HEARTBEAT_MILLIS (topic
+// "smbhb") even when no frames are flowing, so that the receiver can tell a
+// quiet serial line apart from a transmitter that has gone away entirely.
+inline constexpr int64_t SMB_HEARTBEAT_MILLIS = 250;
+struct SMBTransmitterHeartbeat
+{
+    int64_t Elapsed; // millis since the transmitter started
+    uint64_t Sequence;
+
+    int ByteCount;
+    double ApproxBytesPerSecond;
+    int MessageCount;
+    double ApproxMessagesPerSecond;
+    int ErrorCount;
+    int FramesSent;
+};
+void HeartbeatFromThreadInfo(const SMBSerialProcessorThreadInfo& info, SMBTransmitterHeartbeat* heartbeat);
+void HeartbeatToBytes(const SMBTransmitterHeartbeat& heartbeat, std::vector<uint8_t>* buffer);
+bool BytesToHeartbeat(const uint8_t* bytes, size_t size, SMBTransmitterHeartbeat* heartbeat);
+
+// Transmitters may run on other machines, so their steady clocks are unrelated
+// to the receiver's. The transmitter answers time requests on a REP socket at
+// its publish port + SMB_CLOCK_PORT_OFFSET and the receiver estimates the offset (and skew) of the
+// transmitter clock in the style of NTP. Every published frame carries the
+// transmitter time it was read off the serial line which the receiver maps
+// into its own clock. All times here are in microseconds.
+inline constexpr int64_t SMB_CLOCK_SYNC_MILLIS = 1000;
+inline constexpr int64_t SMB_CLOCK_SYNC_FAST_MILLIS = 100; // until the window is full
+inline constexpr int64_t SMB_CLOCK_TIMEOUT_MILLIS = 1000;
+
+int64_t ToMicros(util::mclock::time_point t);
+util::mclock::time_point FromMicros(int64_t micros);
+
+// Feeds are commonly on consecutive ports (one per seat), so the clock port is
+// far enough away to not land on another feed's
+inline constexpr int SMB_CLOCK_PORT_OFFSET = 1000;
+
+// publish endpoint "tcp://host:5555" -> clock endpoint "tcp://host:6555"
+std::string ClockEndpointFromFeedEndpoint(const std::string& endpoint);
+
+// The transmitter's view of time. Offset and Skew are zero except for testing
+// where they simulate a host whose clock disagrees with the receiver's.
+struct TransmitterClock
+{
+    int64_t OffsetMicros;
+    double SkewPPM;
+
+    int64_t FromLocal(util::mclock::time_point t) const;
+    int64_t Now() const;
+};
+
+struct ClockSample
+{
+    int64_t T0; // receiver, request sent
+    int64_t T1; // transmitter, request received
+    int64_t T2; // transmitter, reply sent
+    int64_t T3; // receiver, reply received
+};
+int64_t ClockSampleOffset(const ClockSample& sample); // transmitter - receiver
+int64_t ClockSampleDelay(const ClockSample& sample); // round trip minus transmitter time
+
+void ClockRequestToBytes(int64_t t0, std::vector<uint8_t>* buffer);
+bool BytesToClockRequest(const uint8_t* bytes, size_t size, int64_t* t0);
+void ClockReplyToBytes(const ClockSample& sample, std::vector<uint8_t>* buffer);
+bool BytesToClockReply(const uint8_t* bytes, size_t size, ClockSample* sample);
+
+struct ClockEstimate
+{
+    bool Valid;
+    int64_t OffsetMicros; // transmitter - receiver, at the latest sample
+    double SkewPPM;       // how much faster the transmitter clock runs
+    double JitterMicros;  // rms of the sample offsets about the fit
+    int64_t DelayMicros;  // smallest round trip in the window
+    int SampleCount;
+};
+
+class ClockOffsetEstimator
+{
+public:
+    ClockOffsetEstimator(size_t windowSize = 16);
+    ~ClockOffsetEstimator();
+
+    void AddSample(const ClockSample& sample);
+    void Reset();
+
+    bool IsWindowFull() const;
+    const ClockEstimate& GetEstimate() const;
+
+    // Without an estimate these assume the clocks agree
+    int64_t TransmitterToReceiver(int64_t transmitterMicros) const;
+    int64_t ReceiverToTransmitter(int64_t receiverMicros) const;
+
+private:
+    void Recompute();
+
+private:
+    size_t m_WindowSize;
+    std::deque<ClockSample> m_Samples;
+
+    ClockEstimate m_Estimate;
+    double m_Reference; // receiver time of the fit origin
+    double m_Offset;
+    double m_Skew;
+};
+// Against a transmitter clock with a known offset and skew. Returns the number
+// of checks that failed
+int CheckClockOffsetEstimator();
+
+// Optional authentication of the published messages. Each message gets one
+// extra part at the end: a random per process nonce, a sequence number (per
+// seat name) and an HMAC-SHA256 (keyed with the tournament FeedKey) over those
+// and every other part, the name included. Receivers with a key drop anything
+// unsigned, tampered with, or replayed (sequence not increasing, or an old
+// nonce). A new nonce is taken as a restart when its sequence is within
+// FEED_AUTH_START_WINDOW, so losing the first few messages of a session (a
+// SUB reconnecting) doesn't lock the seat out.
+struct FeedAuthenticationCounters
+{
+    int Accepted;
+    int Unsigned;
+    int BadSignature;
+    int Replayed;
+};
+
+enum class FeedAuthenticationResult
+{
+    ACCEPTED,
+    UNSIGNED,
+    BAD_SIGNATURE,
+    REPLAYED,
+};
+
+typedef std::vector<std::pair<const uint8_t*, size_t>> FeedMessageParts;
+
+bool ParseFeedKey(const std::string& hex, std::vector<uint8_t>* key);
+std::string GenerateFeedKey();
+
+class FeedAuthenticator
+{
+public:
+    FeedAuthenticator();
+    ~FeedAuthenticator();
+
+    void SetKey(const std::vector<uint8_t>& key);
+    bool HasKey() const;
+
+    // transmitter side, 'auth' is to be sent as the last part. Each name
+    // has its own sequence, as receivers check them per name
+    void Sign(const std::string& name, const FeedMessageParts& parts, std::vector<uint8_t>* auth);
+
+    // receiver side. Whether the last part of a message is an authentication part
+    static bool IsAuthenticationPart(const uint8_t* bytes, size_t size);
+    FeedAuthenticationResult Verify(const std::string& name, const FeedMessageParts& parts,
+            const uint8_t* auth, size_t authSize);
+
+private:
+    std::vector<uint8_t> m_Key;
+
+    uint64_t m_Nonce;
+    std::unordered_map<std::string, uint64_t> m_Sequences;
+
+    // Highest sequence seen in one transmitter session
+    struct Session {
+        uint64_t Nonce;
+        uint64_t Sequence;
+    };
+    struct Sender {
+        std::deque<Session> Recent;
+        std::deque<uint64_t> PastNonces;
+    };
+    std::unordered_map<std::string, Sender> m_Senders;
+};
+// Valid traffic, replays, tampering, wrong keys and restarted transmitters.
+// Returns the number of checks that failed
+int CheckFeedAuthenticator();
+
+// Sends the parts (topic, name, ...) as one multipart message, signed when the
+// authenticator has a key
+void PublishFeedMessage(zmq::socket_t* socket, FeedAuthenticator* authenticator,
+        const FeedMessageParts& parts, std::vector<uint8_t>* authbuffer);
+// Replies to every pending request on a clock REP socket
+void AnswerClockRequests(zmq::socket_t* socket, const TransmitterClock& clock);
+
 class ISMBSerialSource
 {
 public:
@@ -417,9 +600,16 @@ public:
     void StartRecording(const std::string& recordingPath);
     void StopRecording();
 
+    // Called from the serial thread whenever new output is available, so that
+    // consumers can wait on something instead of polling. Keep it quick.
+    void SetOutputCallback(std::function<void()> callback);
+
 private:
     void SerialThread();
 
+    std::mutex m_CallbackMutex;
+    std::function<void()> m_OutputCallback;
+
     std::string m_InformationString;
     mutable std::mutex m_OutputMutex;
     //SMBMessageProcessorOutputPtr m_OutputLatest;
@@ -507,6 +697,11 @@ public:
     virtual SMBMessageProcessorOutputPtr GetLatestProcessorOutput() override;
     virtual SMBMessageProcessorOutputPtr GetNextProcessorOutput() override;
 
+    // False if no heartbeat has been received from this transmitter yet
+    bool GetLatestHeartbeat(SMBTransmitterHeartbeat* heartbeat, util::mclock::time_point* receivedAt);
+    ClockEstimate GetClockEstimate();
+    FeedAuthenticationCounters GetAuthenticationCounters();
+
 private:
     size_t m_tag;
 };
@@ -524,6 +719,16 @@ struct PlayerColors
 NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(PlayerColors, RepresentativeColor, OutlineColor, MarioColors, FireMarioColors);
 void InitializePlayerColors(PlayerColors* colors, bool mario = true);
 
+// Mario's sprite palettes drawn into a PALETTE_INDEX PPUx as slots past the 64
+// NES colors (mario 0-2 then fire mario 0-2), so that a player's colors are a
+// different paletteBGR to resolve with rather than a different render.
+constexpr uint8_t PLAYER_COLOR_SLOTS = 0x40;
+constexpr int PLAYER_PALETTE_ENTRIES = PLAYER_COLOR_SLOTS + 6;
+typedef std::array<uint8_t, PLAYER_PALETTE_ENTRIES * 3> PlayerPaletteBGR;
+void ApplyPlayerColorSlots(nes::OAMxEntry* oamx);
+// colors may be nullptr for mario's usual colors
+void MakePlayerPaletteBGR(const uint8_t* paletteBGR, const PlayerColors* colors, PlayerPaletteBGR* out);
+
 bool IsMarioTile(uint8_t tileIndex);
 
 struct ControllerColors
@@ -976,10 +1181,14 @@ struct SMBCompTournament
 
     std::string TowerName;
     int CurrentRound;
+
+    // hex, shared with the transmitters. Empty for unauthenticated feeds
+    std::string FeedKey;
 };
-NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(SMBCompTournament,
+// with default so that configurations from before FeedKey still load
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(SMBCompTournament,
     DisplayName, ScoreName, FileName, Category,
-    Seats, Players, PointIncrements, DNFInc, DNSInc, Schedule
+    Seats, Players, PointIncrements, DNFInc, DNSInc, Schedule, FeedKey
 );
 void InitializeSMBCompTournament(SMBCompTournament* tournament);
 
@@ -1239,12 +1448,61 @@ void InitializeSMBCompStaticData(const sta::RuntimeConfig* info, SMBCompStaticDa
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// The health of a feed is judged from two things, when the last frame arrived
+// and when the transmitter last said it was alive (heartbeat). Frames stopping
+// while heartbeats continue means the console / serial line went quiet, both
+// stopping means the transmitter (or the network) is gone.
+enum class FeedHealthState
+{
+    LIVE,       // frames are arriving
+    STALE,      // no recent frames, but the transmitter is still alive
+    LOST,       // nothing at all (no frames, no heartbeats)
+    RECOVERING, // frames are arriving again after STALE / LOST
+};
+std::string ToString(FeedHealthState state);
+
+struct FeedHealthParameters
+{
+    int64_t StaleMillis;   // no frames for this long -> STALE
+    int64_t LostMillis;    // no frames or heartbeats for this long -> LOST
+    int64_t RecoverMillis; // frames for this long after STALE / LOST -> LIVE
+
+    static FeedHealthParameters Defaults();
+};
+
+struct FeedHealth
+{
+    FeedHealthParameters Params;
+    FeedHealthState State;
+    util::mclock::time_point StateSince;
+
+    bool AnyFrame;
+    util::mclock::time_point LastFrame;
+    bool AnyHeartbeat;
+    util::mclock::time_point LastHeartbeat;
+    SMBTransmitterHeartbeat Heartbeat;
+};
+// All of these take the current time so that they can be driven by a fake clock
+void InitializeFeedHealth(FeedHealth* health, util::mclock::time_point now,
+        FeedHealthParameters params = FeedHealthParameters::Defaults());
+void FeedHealthOnFrame(FeedHealth* health, util::mclock::time_point now);
+void FeedHealthOnHeartbeat(FeedHealth* health, const SMBTransmitterHeartbeat& heartbeat,
+        util::mclock::time_point now);
+void StepFeedHealth(FeedHealth* health, util::mclock::time_point now);
+std::string FeedHealthDescription(const FeedHealth& health, util::mclock::time_point now);
+// Driven through each state by a fake clock. Returns the number of checks that
+// failed
+int CheckFeedHealth();
+
 struct SMBCompFeed
 {
     uint32_t UniquePlayerID;
 
     SMBMessageProcessorOutputPtr CachedOutput;
 
+    FeedHealth Health;
+    SMBMessageProcessorOutputPtr HealthLastOutput;
+
 //    std::unique_ptr<video::LiveVideoThread> LiveVideoThread;
     ISMBSerialSource* Source;
 
@@ -1264,6 +1522,9 @@ SMBCompFeed* GetPlayerFeed(const SMBCompPlayer& player, SMBCompFeeds* feeds);
 void InitializeFeedSerialThread(const SMBCompPlayer& player, const SMBCompStaticData& data, SMBCompFeed* feed);
 //void InitializeFeedLiveVideoThread(const SMBCompPlayer& player, SMBCompFeed* feed);
 void InitializeFeedRecording(SMBCompFeed* feed, const SMBCompStaticData& data, const std::string& path);
+// Key for every feed received over zmq, hex as in SMBCompTournament::FeedKey
+void SetSMBZMQFeedKey(const std::string& hexkey);
+void StepSMBCompFeedHealth(SMBCompFeed* feed, util::mclock::time_point now);
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -2130,6 +2391,8 @@ public:
     void GetAllRecordings(std::vector<db::rec_recording>* recordings);
     void InsertRecording(const db::rec_recording& recording);
 
+    // Version 1 of the 'rec_review' layer, later versions are the steps in Migrations
+    static const std::vector<sqliteext::SQLiteExtMigration>& Migrations();
     static const char* RecRecordingSchema();
 };
 
@@ -2198,6 +2461,85 @@ private:
     RecReviewDB m_Database;
 };
 
+////////////////////////////////////////////////////////////////////////////////
+// Serves recordings over zmq the same way 'rgms transmit' serves consoles, so
+// that a whole broadcast can be rehearsed from archives. Each recording is
+// placed relative to one shared program clock which is paced by the server's
+// own thread and controlled over a REP socket with plain text commands:
+//
+//   play | pause | speed <x> | seek <millis> | seek <name> <millis> | status
+//
+// 'seek <millis>' moves the program clock, so all seats stay in sync.
+struct ReplayServerRecording
+{
+    std::string Path;
+    std::string Name;
+    int64_t Offset; // recording millis at program time 0
+};
+
+struct ReplayServerParameters
+{
+    std::string Target;
+    std::string ControlTarget;
+    int64_t TickMillis;
+    bool Play;
+    double Speed;
+    std::vector<uint8_t> Key;
+
+    static ReplayServerParameters Defaults();
+};
+
+// The recordings in the database that cover the given unix time (millis),
+// named seat1, seat2, ... and offset to start at that time
+void ReplayServerRecordingsAt(RecReviewDB* db, int64_t unixMillis,
+        std::vector<ReplayServerRecording>* recordings);
+
+class ReplayServer
+{
+public:
+    ReplayServer(smb::SMBNametableCachePtr nametables,
+            const std::vector<ReplayServerRecording>& recordings,
+            ReplayServerParameters params = ReplayServerParameters::Defaults());
+    ~ReplayServer();
+
+    // As if received on the control socket, returns the reply
+    std::string HandleCommand(const std::string& command);
+    nlohmann::json Status();
+
+private:
+    void TimerThread();
+    void Tick(util::mclock::time_point now);
+
+private:
+    ReplayServerParameters m_Params;
+
+    struct Served {
+        ReplayServerRecording Info;
+        std::unique_ptr<SMBSerialRecording> Recording;
+        int64_t TotalMillis;
+        bool Jumped;
+        int Sent;
+        SMBTransmitterHeartbeat Heartbeat;
+    };
+
+    std::mutex m_Mutex;
+    std::vector<Served> m_Served;
+    bool m_Playing;
+    double m_Speed;
+    double m_ProgramMillis;
+    util::mclock::time_point m_LastTick;
+
+    zmq::context_t m_Context;
+    zmq::socket_t m_Socket;
+    zmq::socket_t m_ControlSocket;
+    zmq::socket_t m_ClockSocket;
+    bool m_ClockBound;
+    FeedAuthenticator m_Authenticator;
+
+    std::atomic<bool> m_ShouldStop;
+    std::thread m_Thread;
+};
+
 }
 
 #endif
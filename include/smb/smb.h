@@ -21,6 +21,12 @@
 #ifndef STATIC_SMB_SMB_HEADER
 #define STATIC_SMB_SMB_HEADER
 
+#include <list>
+#include <map>
+#include <span>
+#include <tuple>
+#include <unordered_map>
+
 #include "nes/nes.h"
 #include "nes/ppux.h"
 
@@ -113,6 +119,10 @@ enum class AreaID : uint16_t
 };
 const std::vector<AreaID>& KnownAreaIDs();
 AreaID AreaIDFromRAM(uint8_t area_data_low, uint8_t area_data_high);
+// The x of the left of the screen in the area. block_buffer_84_disc tells
+// apart the mazes in 8-4, which reuse the same pages
+int AreaPointerXFromData(uint8_t screenedge_pageloc, uint8_t screenedge_x_pos,
+        AreaID aid, uint8_t block_buffer_84_disc);
 std::string ToString(AreaID area_id);
 
 // Sound effects
@@ -202,11 +212,69 @@ struct SMBNametableDiff
     uint8_t Value;
 };
 
+// Whole nametable pages drawn once and kept, so that views that show the same
+// pages many times over (one per player) copy them rather than draw every
+// tile again. Keyed by area, page, scale and a hash of the palettes and
+// pattern table, with the least recently used pages dropped once over budget.
+// The pages themselves are assumed not to change. Thread safe
+class NametablePageImageCache
+{
+public:
+    static constexpr size_t DEFAULT_BUDGET = 64 * 1024 * 1024;
+
+    NametablePageImageCache(size_t budgetBytes = DEFAULT_BUDGET);
+    ~NametablePageImageCache() = default;
+
+    struct Image
+    {
+        int Scale;
+        std::vector<uint8_t> BGR;            // (256 * Scale) x (240 * Scale) x 3
+        std::vector<uint8_t> BackgroundMask; // (256 * Scale) x (240 * Scale), nonzero off the backdrop
+        nes::DecodedPatternTablePtr Decoded; // so the address in the key stays this one
+
+        size_t Bytes() const;
+    };
+    typedef std::shared_ptr<const Image> ImagePtr;
+
+    // nullptr when the budget is 0
+    ImagePtr Get(AreaID id, int page, const nes::NameTable& nametable,
+            const uint8_t* patternTable, const uint8_t* framePalette,
+            const uint8_t* paletteBGR, int scale);
+
+    void SetBudget(size_t budgetBytes); // 0 turns the cache off
+    size_t GetBudget() const;
+    void Clear();
+
+    struct Counters
+    {
+        uint64_t Hits;
+        uint64_t Misses;
+        uint64_t Evictions;
+        size_t Bytes;
+        size_t Pages;
+    };
+    Counters GetCounters() const;
+
+private:
+    typedef std::tuple<AreaID, int, int, uint64_t> Key; // id, page, scale, palette hash
+    void EvictToBudget();
+
+    mutable std::mutex m_Mutex;
+    size_t m_Budget;
+    size_t m_Bytes;
+    uint64_t m_Hits;
+    uint64_t m_Misses;
+    uint64_t m_Evictions;
+    std::list<Key> m_Order; // most recently used first
+    std::map<Key, std::pair<ImagePtr, std::list<Key>::iterator>> m_Images;
+};
+
 class INametableCache
 {
 public:
     INametableCache(const uint8_t* smb_chr1)
-        : m_smb_chr1(smb_chr1) {}
+        : m_smb_chr1(smb_chr1)
+        , m_PageImages(std::make_shared<NametablePageImageCache>()) {}
     ~INametableCache() = default;
 
     virtual const nes::NameTable* Nametable(AreaID id, int page) const = 0;
@@ -218,11 +286,15 @@ public:
             const uint8_t* pt = nullptr, // IGNORED
             const MinimapPalette* minimap = nullptr, // make nonnull to render minimap instead
             const uint8_t* fpal = nullptr, // make nonnull to overwrite found nametable
-            const std::vector<SMBNametableDiff>* diffs = nullptr) const; // first diffs is priority
+            const std::vector<SMBNametableDiff>* diffs = nullptr) const; // later diffs at the same offset win
+
+    // Used by RenderTo for opaque nametables into BGR (set its budget to 0
+    // to draw every tile instead)
+    NametablePageImageCache* PageImages() const;
 
 private:
     const uint8_t* m_smb_chr1;
-    mutable nes::NameTable BufferTable;
+    std::shared_ptr<NametablePageImageCache> m_PageImages;
 };
 
 
@@ -284,12 +356,14 @@ public:
         return m_Route.empty();
     }
     WorldSection& emplace_back() {
+        m_Indexed = false;
         return m_Route.emplace_back();
     }
     WorldSection& back() {
         return m_Route.back();
     }
     void clear() {
+        m_Indexed = false;
         m_Route.clear();
     }
     iterator begin() {
@@ -331,8 +405,19 @@ public:
         return std::max(TotalWidth() - width, 0);
     }
 
+    // For InCategory and the visible sections to binary search rather than
+    // look through every section (GetRoute does this once the sections are
+    // loaded). Adding or clearing sections drops the index, changing them in
+    // place needs this called again.
+    void BuildIndex();
+
     void GetVisibleSections(int xloc, int width,
             std::vector<WorldSection>* sections) const;
+    // The sections from the first visible one to the last, as they are in the
+    // route (XLoc not made relative to xloc). Nothing is allocated. Sections
+    // laid out one after the other don't nest, so these are exactly the ones
+    // GetVisibleSections finds
+    std::span<const WorldSection> VisibleSections(int xloc, int width) const;
 
     // TODO rgms...
     void RenderMinimapTo(nes::PPUx* ppux, int categoryX,
@@ -347,6 +432,23 @@ public:
     }
 private:
     std::vector<WorldSection> m_Route;
+
+    // From BuildIndex
+    static uint64_t AreaKey(AreaID id, int world, int level); // any world and level for some areas
+    struct AreaSections
+    {
+        std::vector<int> Left;         // sorted
+        std::vector<int> MaxRight;     // the largest Right of those up to here
+        std::vector<size_t> Section;   // index into m_Route
+    };
+    bool m_Indexed = false;
+    bool m_SortedByXLoc = false;
+    std::unordered_map<uint64_t, AreaSections> m_AreaSections;
+    std::vector<int> m_CategoryX;      // InCategory's x of each section's left edge
+    std::vector<int> m_XLoc;
+    std::vector<int> m_MaxXLocRight;   // the largest XLoc + Width() of those up to here
+
+    bool VisibleRange(int xloc, int width, size_t* first, size_t* last) const;
 };
 
 
@@ -357,6 +459,12 @@ void RenderMinimapToPPUx(int x, int y, int sx, int ex,
 void RenderMinimapToPPUx(int x, int y, const nes::EffectInfo& effects,
         const MinimapImage& img, const MinimapPalette& miniPal,
         const nes::Palette& nesPal, nes::PPUx* ppux);
+// A minimap drawn from a nametable page, for pages that minimap.sql doesn't
+// have. The backdrop is left clear and the rest is in the three minimap
+// shades by how bright it is in the default palette
+void MinimapFromNametable(const nes::NameTable& nametable,
+        const nes::FramePalette& framePalette, const uint8_t* patternTable,
+        MinimapImage* minimap);
 bool IsMarioTile(uint8_t tile_index);
 
 }
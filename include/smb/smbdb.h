@@ -99,6 +99,9 @@ public:
 
     bool GetSoundEffectWav(SoundEffect effect, std::vector<uint8_t>* data);
     bool GetMusicTrackWav(MusicTrack track, std::vector<uint8_t>* data);
+    // To read in place, nullptr when there is none
+    std::unique_ptr<sqliteext::SQLiteExtBlobReader> OpenSoundEffectWav(SoundEffect effect);
+    std::unique_ptr<sqliteext::SQLiteExtBlobReader> OpenMusicTrackWav(MusicTrack track);
     bool GetMinimapPage(AreaID area_id, int page, db::minimap_page* mini_page);
     bool GetAllNametablePages(std::vector<db::nametable_page>* pages);
     bool GetAllMinimapPages(std::vector<db::minimap_page>* pages);
@@ -107,6 +110,9 @@ public:
     bool GetRouteNames(std::vector<std::string>* names);
     bool GetRoute(const std::string& name, db::route* route);
 
+    // The 'smb' layer, version 1 has these up to RouteSectionSchema and
+    // version 2 adds build_manifest. Later versions are the steps in Migrations
+    static const std::vector<sqliteext::SQLiteExtMigration>& Migrations();
     static const char* SoundEffectSchema();
     static const char* MusicTrackSchema();
     static const char* NametablePageSchema();
@@ -114,6 +120,7 @@ public:
     static const char* NTExtractRecordSchema();
     static const char* RouteSchema();
     static const char* RouteSectionSchema();
+    static const char* BuildManifestSchema();
 
 private:
     SMBNametableCachePtr m_NametableCache;
@@ -130,6 +137,11 @@ public:
     const db::nametable_page& GetNametable(AreaID id, int page) const;
     const db::nametable_page* MaybeGetNametable(AreaID id, int page) const;
 
+    // Minimap pages are read from the database the first time they are asked
+    // for. A page minimap.sql doesn't have is drawn from its nametable page
+    // (MinimapFromNametable) and written back to minimap_page when it can be.
+    // A database that can't be opened, read or written only costs the
+    // caching, the page is still drawn. Thread safe
     bool KnownMinimap(AreaID id, int page) const;
     const MinimapImage* Minimap(AreaID id, int page) const final;
     const db::minimap_page& GetMinimap(AreaID id, int page) const;
@@ -137,17 +149,72 @@ public:
 
 private:
     std::unordered_map<AreaID, std::vector<db::nametable_page>> m_nametables;
-    std::unordered_map<AreaID, std::vector<db::minimap_page>> m_minimaps;
+
+    // The cache can outlive the database it came from, so it has its own
+    // (plain, never migrating) connection for the minimaps, opened on the
+    // first one
+    std::string m_DatabasePath;
+    nes::NESDatabase::RomSPtr m_Rom;
+    mutable std::mutex m_MinimapMutex;
+    mutable std::unique_ptr<sqliteext::SQLiteExtDB> m_MinimapDatabase;
+    mutable std::map<std::pair<AreaID, int>, std::unique_ptr<db::minimap_page>> m_minimaps; // nullptr when there is none
 };
 
-//
+// The database is built in stages (InitStageNames, in order). Each has its
+// input files, hashed by content, and the stages it depends on. Those hashes
+// are kept in build_manifest, and a stage only runs again when they change
+// (or it is forced), so changing one routes.sql doesn't extract every nametable
+// page over again. The stages depending on one that runs run after it, forced
+// or not
+struct InitOptions
+{
+    int Threads;                    // as for ExtractNametablePages
+    bool DryRun;                    // only print what would rebuild
+    std::vector<std::string> Force; // stages to rebuild anyway, "all" for every one
+
+    static InitOptions Defaults();
+};
+const std::vector<std::string>& InitStageNames();
 bool InitializeSMBDatabase(SMBDatabase* database, const std::string& smb_data_path,
-        const std::vector<uint8_t>& smb_rom);
+        const std::vector<uint8_t>& smb_rom, const InitOptions& options);
+
+// Replay the TASes of nt_extract_record and read the nametable page at each of
+// its records. The TASes are spread over 'threads' emulators (0 for one per
+// hardware thread), the pages are in the same order however many there are
+bool ExtractNametablePages(SMBDatabase* database, int threads,
+        std::vector<db::nametable_page>* pages);
+uint64_t NametablePageHash(const db::nametable_page& page); // area, page, nametable and palette
 
 //
 bool InsertSoundEffect(SMBDatabase* database, SoundEffect effect, const std::string& wavpath);
 bool InsertMusicTrack(SMBDatabase* database, MusicTrack track, const std::string& wavpath);
 bool InsertNametablePage(SMBDatabase* database, const db::nametable_page& nt);
+bool InsertMinimapPage(SMBDatabase* database, db::minimap_page* mini_page); // sets id
+bool InsertRoute(SMBDatabase* database, db::route* route); // replaces one with the same name, sets id
+
+// What is wrong with a route: sections without Left < Right, that overlap
+// the one before (in xloc, or in x within the same level). Areas the game
+// doesn't have, worlds and levels out of range, and pages without a
+// nametable. Empty if nothing is
+struct RouteProblem
+{
+    int SectionIndex; // -1 for the route as a whole
+    std::string Message;
+};
+void ValidateRoute(const Route& route, const SMBNametableCache& nametables,
+        std::vector<RouteProblem>* problems);
+
+// Run a TAS and follow Mario through the route the way the split timing does
+// (InCategory while the game engine runs). Every section must be entered, in
+// order, and none left for an earlier one
+struct RouteReplay
+{
+    int FirstFailingSection; // -1 if there is none
+    int Frame;               // the frame it went wrong on
+    std::string Message;
+    std::vector<int> EnterFrame; // the first frame in each section, -1 if never
+};
+bool ReplayRoute(SMBDatabase* database, const Route& route, int tas_id, RouteReplay* replay);
 
 }
 
@@ -70,6 +70,8 @@ public:
     bool LoadAppCache(db::AppCache* cache);
     void SaveAppCache(const db::AppCache& cache);
 
+    // Version 1 of the 'static' layer, later versions are the steps in Migrations
+    static const std::vector<sqliteext::SQLiteExtMigration>& Migrations();
     static const char* AppCacheSchema();
 };
 
@@ -18,6 +18,13 @@
 //
 ////////////////////////////////////////////////////////////////////////////////
 
+#include <stdexcept>
+
+#include "openssl/crypto.h"
+#include "openssl/core_names.h"
+#include "openssl/evp.h"
+#include "openssl/rand.h"
+
 #include "ext/opensslext/opensslext.h"
 
 using namespace opensslext;
@@ -25,7 +32,51 @@ using namespace opensslext;
 MD5Sum opensslext::ComputeMD5Sum(const uint8_t* data, size_t num_bytes)
 {
     MD5Sum sum;
-    MD5(reinterpret_cast<const unsigned char*>(data), num_bytes,
-        reinterpret_cast<unsigned char*>(sum.data()));
+    if (!EVP_Digest(data, num_bytes, reinterpret_cast<unsigned char*>(sum.data()), nullptr, EVP_md5(), nullptr)) {
+        throw std::runtime_error("EVP_Digest failed");
+    }
+    return sum;
+}
+
+SHA256Sum opensslext::ComputeHMACSHA256(const uint8_t* key, size_t key_bytes, const DataParts& parts)
+{
+    // Fetched once, the implementation lookup is as costly as a short message
+    static EVP_MAC* mac = EVP_MAC_fetch(nullptr, "HMAC", nullptr);
+    if (!mac) {
+        throw std::runtime_error("EVP_MAC_fetch failed");
+    }
+    EVP_MAC_CTX* ctx = EVP_MAC_CTX_new(mac);
+    if (!ctx) {
+        throw std::runtime_error("EVP_MAC_CTX_new failed");
+    }
+
+    SHA256Sum sum;
+    char digest[] = "SHA256";
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+        OSSL_PARAM_construct_end(),
+    };
+    size_t len = 0;
+    bool ok = EVP_MAC_init(ctx, reinterpret_cast<const unsigned char*>(key), key_bytes, params);
+    for (auto & [data, num_bytes] : parts) {
+        ok = ok && EVP_MAC_update(ctx, reinterpret_cast<const unsigned char*>(data), num_bytes);
+    }
+    ok = ok && EVP_MAC_final(ctx, reinterpret_cast<unsigned char*>(sum.data()), &len, sum.size());
+    EVP_MAC_CTX_free(ctx);
+    if (!ok || len != sum.size()) {
+        throw std::runtime_error("HMAC failed");
+    }
     return sum;
 }
+
+bool opensslext::ConstantTimeEquals(const uint8_t* a, const uint8_t* b, size_t num_bytes)
+{
+    return CRYPTO_memcmp(a, b, num_bytes) == 0;
+}
+
+void opensslext::RandomBytes(uint8_t* data, size_t num_bytes)
+{
+    if (RAND_bytes(reinterpret_cast<unsigned char*>(data), static_cast<int>(num_bytes)) != 1) {
+        throw std::runtime_error("RAND_bytes failed");
+    }
+}
@@ -20,6 +20,7 @@
 
 #include <iostream>
 #include <stdexcept>
+#include <algorithm>
 
 #include "ext/sdlext/sdlext.h"
 
@@ -43,9 +44,90 @@ SDLExtMixInit::~SDLExtMixInit()
     //Mix_Quit();
 }
 
+namespace {
+
+struct ReadAtSource
+{
+    size_t Size;
+    size_t Position;
+    SDLExtReadAt Read;
+};
+
+}
+
+static ReadAtSource* GetReadAtSource(SDL_RWops* context)
+{
+    return reinterpret_cast<ReadAtSource*>(context->hidden.unknown.data1);
+}
+
+SDL_RWops* sdlext::SDLExtRWFromReadAt(size_t size, SDLExtReadAt read)
+{
+    SDL_RWops* rwops = SDL_AllocRW();
+    if (!rwops) throw std::runtime_error(SDL_GetError());
+
+    rwops->type = SDL_RWOPS_UNKNOWN;
+    rwops->hidden.unknown.data1 = new ReadAtSource{size, 0, std::move(read)};
+    rwops->size = [](SDL_RWops* context) -> Sint64 {
+        return static_cast<Sint64>(GetReadAtSource(context)->Size);
+    };
+    rwops->seek = [](SDL_RWops* context, Sint64 offset, int whence) -> Sint64 {
+        ReadAtSource* source = GetReadAtSource(context);
+        Sint64 base = 0;
+        if (whence == RW_SEEK_CUR) {
+            base = static_cast<Sint64>(source->Position);
+        } else if (whence == RW_SEEK_END) {
+            base = static_cast<Sint64>(source->Size);
+        }
+        Sint64 position = base + offset;
+        if (position < 0 || position > static_cast<Sint64>(source->Size)) {
+            return SDL_SetError("seek out of range");
+        }
+        source->Position = static_cast<size_t>(position);
+        return position;
+    };
+    rwops->read = [](SDL_RWops* context, void* ptr, size_t size, size_t maxnum) -> size_t {
+        ReadAtSource* source = GetReadAtSource(context);
+        if (size == 0) {
+            return 0;
+        }
+        size_t num = std::min(maxnum, (source->Size - source->Position) / size);
+        if (num == 0) {
+            return 0;
+        }
+        // Not to throw through SDL
+        bool ok = false;
+        try {
+            ok = source->Read(ptr, num * size, source->Position);
+        } catch (std::exception& e) {
+            SDL_SetError("%s", e.what());
+            return 0;
+        }
+        if (!ok) {
+            SDL_SetError("read failed");
+            return 0;
+        }
+        source->Position += num * size;
+        return num;
+    };
+    rwops->write = [](SDL_RWops*, const void*, size_t, size_t) -> size_t {
+        SDL_SetError("read only");
+        return 0;
+    };
+    rwops->close = [](SDL_RWops* context) -> int {
+        delete GetReadAtSource(context);
+        SDL_FreeRW(context);
+        return 0;
+    };
+    return rwops;
+}
+
 SDLExtMixChunk::SDLExtMixChunk(const std::vector<uint8_t>& wav_data)
+    : SDLExtMixChunk(SDL_RWFromConstMem(wav_data.data(), wav_data.size()))
+{
+}
+
+SDLExtMixChunk::SDLExtMixChunk(SDL_RWops* rwops)
 {
-    SDL_RWops* rwops = SDL_RWFromConstMem(wav_data.data(), wav_data.size());
     if (!rwops) throw std::runtime_error(SDL_GetError());
     Chunk = Mix_LoadWAV_RW(rwops, SDL_TRUE);
     if (!Chunk) throw std::runtime_error(Mix_GetError());
@@ -56,8 +138,8 @@ SDLExtMixChunk::~SDLExtMixChunk()
     Mix_FreeChunk(Chunk);
 }
 
-SDLExtMixMusic::SDLExtMixMusic(const std::vector<uint8_t>& wav_data)
-    : m_WavData(wav_data)
+SDLExtMixMusic::SDLExtMixMusic(std::vector<uint8_t> wav_data)
+    : m_WavData(std::move(wav_data))
 {
     SDL_RWops* rwops = SDL_RWFromConstMem(m_WavData.data(), m_WavData.size());
     if (!rwops) throw std::runtime_error(SDL_GetError());
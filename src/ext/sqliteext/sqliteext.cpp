@@ -70,6 +70,14 @@ void sqliteext::BindBlbOrThrow(sqlite3_stmt* stmt, int pos, const void* data, si
     }
 }
 
+void sqliteext::BindZeroBlbOrThrow(sqlite3_stmt* stmt, int pos, size_t size)
+{
+    if (sqlite3_bind_zeroblob64(stmt, pos, size)) {
+        sqlite3* db = sqlite3_db_handle(stmt);
+        throw std::runtime_error("bind failed: " + std::string(sqlite3_errmsg(db)));
+    }
+}
+
 void sqliteext::BindStrOrThrow(sqlite3_stmt* stmt, int pos, const std::string& str)
 {
     if (sqlite3_bind_text(stmt, pos, str.c_str(), str.size(), SQLITE_TRANSIENT)) {
@@ -196,6 +204,14 @@ void sqliteext::StepAndFinalizeOrThrow(sqlite3_stmt* stmt)
     sqlite3_finalize(stmt);
 }
 
+void sqliteext::StepDoneOrThrow(sqlite3_stmt* stmt)
+{
+    if (sqlite3_step(stmt) != SQLITE_DONE) {
+        sqlite3* db = sqlite3_db_handle(stmt);
+        throw std::runtime_error("step failed: " + std::string(sqlite3_errmsg(db)));
+    }
+}
+
 std::string sqliteext::column_str(sqlite3_stmt* stmt, int column)
 {
     // TODO error handling?
@@ -217,8 +233,60 @@ uint8_t sqliteext::column_uint8_t(sqlite3_stmt* stmt, int column)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+SQLiteExtStatement::SQLiteExtStatement()
+    : m_db(nullptr)
+    , m_Stmt(nullptr)
+{
+}
+
+SQLiteExtStatement::SQLiteExtStatement(SQLiteExtDB* db, sqlite3_stmt* stmt)
+    : m_db(db)
+    , m_Stmt(stmt)
+{
+}
+
+SQLiteExtStatement::~SQLiteExtStatement()
+{
+    Release();
+}
+
+SQLiteExtStatement::SQLiteExtStatement(SQLiteExtStatement&& other) noexcept
+    : m_db(other.m_db)
+    , m_Stmt(other.m_Stmt)
+{
+    other.m_db = nullptr;
+    other.m_Stmt = nullptr;
+}
+
+SQLiteExtStatement& SQLiteExtStatement::operator=(SQLiteExtStatement&& other) noexcept
+{
+    if (this != &other) {
+        Release();
+        m_db = other.m_db;
+        m_Stmt = other.m_Stmt;
+        other.m_db = nullptr;
+        other.m_Stmt = nullptr;
+    }
+    return *this;
+}
+
+void SQLiteExtStatement::Release()
+{
+    if (m_Stmt) {
+        m_db->ReleaseStatement(m_Stmt);
+    }
+    m_db = nullptr;
+    m_Stmt = nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 SQLiteExtDB::SQLiteExtDB(const std::string& path)
     : m_DatabasePath(path)
+    , m_StatementCapacity(DEFAULT_STATEMENT_CACHE_CAPACITY)
+    , m_StatementCounters{0, 0, 0, 0}
+    , m_HadTables(false)
+    , m_BackedUp(false)
 {
     Open();
 }
@@ -228,10 +296,97 @@ SQLiteExtDB::~SQLiteExtDB()
     Close();
 }
 
+SQLiteExtStatement SQLiteExtDB::PrepareOrThrow(const std::string& query)
+{
+    auto it = m_StatementsByQuery.find(query);
+    if (it != m_StatementsByQuery.end() && !it->second->Out) {
+        m_Statements.splice(m_Statements.begin(), m_Statements, it->second);
+        it->second->Out = true;
+        m_StatementsOut.emplace(it->second->Stmt, it->second);
+        m_StatementCounters.Hits++;
+        return SQLiteExtStatement(this, it->second->Stmt);
+    }
+    m_StatementCounters.Misses++;
+
+    sqlite3_stmt* stmt;
+    sqliteext::PrepareOrThrow(m_Database, query, &stmt);
+    if (it == m_StatementsByQuery.end() && m_StatementCapacity > 0) {
+        EvictStatements(m_StatementCapacity - 1);
+        m_Statements.push_front({query, stmt, true});
+        m_StatementsByQuery.emplace(query, m_Statements.begin());
+        m_StatementsOut.emplace(stmt, m_Statements.begin());
+    }
+    return SQLiteExtStatement(this, stmt);
+}
+
+void SQLiteExtDB::ReleaseStatement(sqlite3_stmt* stmt)
+{
+    auto it = m_StatementsOut.find(stmt);
+    if (it == m_StatementsOut.end()) {
+        // Not cached, or the cache was cleared while it was out
+        sqlite3_finalize(stmt);
+        return;
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    it->second->Out = false;
+    m_StatementsOut.erase(it);
+    EvictStatements(m_StatementCapacity);
+}
+
+void SQLiteExtDB::EvictStatements(size_t capacity)
+{
+    // From the least recently used, skipping those out
+    auto it = m_Statements.end();
+    while (m_Statements.size() > capacity && it != m_Statements.begin()) {
+        --it;
+        if (it->Out) {
+            continue;
+        }
+        sqlite3_finalize(it->Stmt);
+        m_StatementsByQuery.erase(it->Query);
+        it = m_Statements.erase(it);
+        m_StatementCounters.Evictions++;
+    }
+}
+
+void SQLiteExtDB::SetStatementCacheCapacity(size_t capacity)
+{
+    m_StatementCapacity = capacity;
+    EvictStatements(m_StatementCapacity);
+}
+
+size_t SQLiteExtDB::GetStatementCacheCapacity() const
+{
+    return m_StatementCapacity;
+}
+
+void SQLiteExtDB::ClearStatementCache()
+{
+    // Those out are finalized on release
+    for (auto & cached : m_Statements) {
+        if (!cached.Out) {
+            sqlite3_finalize(cached.Stmt);
+        }
+    }
+    m_Statements.clear();
+    m_StatementsByQuery.clear();
+    m_StatementsOut.clear();
+}
+
+SQLiteExtDB::StatementCacheCounters SQLiteExtDB::GetStatementCacheCounters() const
+{
+    StatementCacheCounters counters = m_StatementCounters;
+    counters.Statements = m_Statements.size();
+    return counters;
+}
+
 void SQLiteExtDB::Close()
 {
+    ClearStatementCache();
     if (m_Database) {
-        sqlite3_close(m_Database);
+        // Closes once any statements still prepared on it are finalized
+        sqlite3_close_v2(m_Database);
     }
     m_Database = nullptr;
 }
@@ -239,6 +394,8 @@ void SQLiteExtDB::Close()
 void SQLiteExtDB::Open()
 {
     sqliteext::OpenOrThrow(m_DatabasePath, &m_Database);
+    m_HadTables = ExecForSingleInt(m_Database, "SELECT COUNT(*) FROM sqlite_master;") > 0;
+    m_BackedUp = false;
 }
 
 void SQLiteExtDB::BeginTransaction()
@@ -251,6 +408,11 @@ void SQLiteExtDB::Commit()
     ExecOrThrow("COMMIT;");
 }
 
+void SQLiteExtDB::Rollback()
+{
+    sqlite3_exec(m_Database, "ROLLBACK;", nullptr, nullptr, nullptr);
+}
+
 int SQLiteExtDB::ExecOrThrow(const std::string& query,
         std::function<bool(int argc, char** data, char** columns)> cback)
 {
@@ -263,6 +425,149 @@ int SQLiteExtDB::ExecFileOrThrow(const std::string& path)
     return ExecOrThrow(contents);
 }
 
+SQLiteExtBlobReader::SQLiteExtBlobReader(SQLiteExtDB* db, const char* table, const char* column, int64_t rowid)
+    : SQLiteExtBlobReader(db, table, column, rowid, false)
+{
+}
+
+SQLiteExtBlobReader::SQLiteExtBlobReader(SQLiteExtDB* db, const char* table, const char* column, int64_t rowid, bool write)
+    : m_Blob(nullptr)
+    , m_db(db)
+{
+    int ret = sqlite3_blob_open(db->m_Database, "main", table, column, rowid, write ? 1 : 0, &m_Blob);
+    if (ret != SQLITE_OK) {
+        std::ostringstream os;
+        os << "unable to open blob " << table << "." << column << " of row " << rowid << ": "
+           << sqlite3_errmsg(db->m_Database);
+        sqlite3_blob_close(m_Blob);
+        throw std::runtime_error(os.str());
+    }
+}
+
+SQLiteExtBlobReader::~SQLiteExtBlobReader()
+{
+    sqlite3_blob_close(m_Blob);
+}
+
+size_t SQLiteExtBlobReader::Size() const
+{
+    return static_cast<size_t>(sqlite3_blob_bytes(m_Blob));
+}
+
+void SQLiteExtBlobReader::ReadOrThrow(void* data, size_t size, size_t offset)
+{
+    if (sqlite3_blob_read(m_Blob, data, static_cast<int>(size), static_cast<int>(offset)) != SQLITE_OK) {
+        throw std::runtime_error(sqlite3_errmsg(m_db->m_Database));
+    }
+}
+
+void SQLiteExtBlobReader::ReadAllOrThrow(std::vector<uint8_t>* data)
+{
+    data->resize(Size());
+    ReadOrThrow(data->data(), data->size(), 0);
+}
+
+SQLiteExtBlobWriter::SQLiteExtBlobWriter(SQLiteExtDB* db, const char* table, const char* column, int64_t rowid)
+    : SQLiteExtBlobReader(db, table, column, rowid, true)
+{
+}
+
+SQLiteExtBlobWriter::~SQLiteExtBlobWriter()
+{
+}
+
+void SQLiteExtBlobWriter::WriteOrThrow(const void* data, size_t size, size_t offset)
+{
+    if (sqlite3_blob_write(m_Blob, data, static_cast<int>(size), static_cast<int>(offset)) != SQLITE_OK) {
+        throw std::runtime_error(sqlite3_errmsg(m_db->m_Database));
+    }
+}
+
+const char* SQLiteExtDB::SchemaVersionSchema()
+{
+    return R"(CREATE TABLE IF NOT EXISTS schema_version (
+    layer               TEXT PRIMARY KEY,
+    version             INTEGER NOT NULL
+);)";
+}
+
+static bool s_BackupBeforeMigrate = true;
+
+void SQLiteExtDB::SetBackupBeforeMigrate(bool backup)
+{
+    s_BackupBeforeMigrate = backup;
+}
+
+int SQLiteExtDB::GetSchemaVersion(const std::string& layer)
+{
+    ExecOrThrow(SchemaVersionSchema());
+    auto stmt = PrepareOrThrow("SELECT version FROM schema_version WHERE layer = ?;");
+    BindStrOrThrow(stmt, 1, layer);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        return sqlite3_column_int(stmt, 0);
+    }
+    return 0;
+}
+
+void SQLiteExtDB::MigrateOrThrow(const std::string& layer, const std::vector<SQLiteExtMigration>& migrations)
+{
+    int latest = 0;
+    for (auto & migration : migrations) {
+        if (migration.Version <= latest) {
+            throw std::runtime_error("migrations of '" + layer + "' out of order");
+        }
+        latest = migration.Version;
+    }
+
+    int version = GetSchemaVersion(layer);
+    if (version > latest) {
+        std::ostringstream os;
+        os << "database '" << m_DatabasePath << "' has '" << layer << "' at version " << version
+           << ", newer than this build knows (" << latest << ")";
+        throw std::runtime_error(os.str());
+    }
+    if (version == latest) {
+        return;
+    }
+
+    if (s_BackupBeforeMigrate && m_HadTables && !m_BackedUp) {
+        BackupOrThrow(m_DatabasePath + "." + layer + "-v" + std::to_string(version) + ".bak");
+        m_BackedUp = true;
+    }
+
+    SQLiteExtTransaction transaction(this);
+    for (auto & migration : migrations) {
+        if (migration.Version > version) {
+            migration.Apply(this);
+        }
+    }
+    auto stmt = PrepareOrThrow("INSERT OR REPLACE INTO schema_version (layer, version) VALUES (?, ?);");
+    BindStrOrThrow(stmt, 1, layer);
+    BindIntOrThrow(stmt, 2, latest);
+    StepDoneOrThrow(stmt);
+    stmt.Release();
+    transaction.Commit();
+}
+
+void SQLiteExtDB::BackupOrThrow(const std::string& path)
+{
+    sqlite3* backup;
+    OpenOrThrow(path, &backup);
+    sqlite3_backup* copy = sqlite3_backup_init(backup, "main", m_Database, "main");
+    int ret = SQLITE_ERROR;
+    if (copy) {
+        ret = sqlite3_backup_step(copy, -1);
+        sqlite3_backup_finish(copy);
+    }
+    if (ret != SQLITE_DONE) {
+        std::ostringstream os;
+        os << "unable to back up database '" << m_DatabasePath << "' to '" << path << "': " << sqlite3_errmsg(backup);
+        sqlite3_close(backup);
+        throw std::runtime_error(os.str());
+    }
+    sqlite3_close(backup);
+}
+
 int SQLiteExtDB::SystemLaunchSQLite3WithExamples()
 {
     std::string cmd = "sqlite3 " + m_DatabasePath;
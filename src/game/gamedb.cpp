@@ -26,16 +26,29 @@ using namespace sta::game;
 GameDatabase::GameDatabase(const std::string& path)
     : SQLiteExtDB(path)
 {
-    ExecOrThrow(KVIntSchema());
-    ExecOrThrow(KVDoubleSchema());
-    ExecOrThrow(KVStringSchema());
-    ExecOrThrow(KVBlobSchema());
+    MigrateOrThrow("game", Migrations());
 }
 
 GameDatabase::~GameDatabase()
 {
 }
 
+const std::vector<sqliteext::SQLiteExtMigration>& GameDatabase::Migrations()
+{
+    static std::vector<sqliteext::SQLiteExtMigration> s_Migrations = {
+        {1, "key value tables", [](sqliteext::SQLiteExtDB* db){
+            db->ExecOrThrow(KVIntSchema());
+            db->ExecOrThrow(KVDoubleSchema());
+            db->ExecOrThrow(KVStringSchema());
+            db->ExecOrThrow(KVBlobSchema());
+        }},
+        {2, "kv_blob modified counter for the image cache", [](sqliteext::SQLiteExtDB* db){
+            db->ExecOrThrow("ALTER TABLE kv_blob ADD COLUMN modified INTEGER NOT NULL DEFAULT 0;");
+        }},
+    };
+    return s_Migrations;
+}
+
 const char* GameDatabase::KVIntSchema()
 {
     return R"(CREATE TABLE IF NOT EXISTS kv_int (
@@ -77,16 +90,12 @@ const char* GameDatabase::KVBlobSchema()
 template<typename T>
 static bool DoMySelect(GameDatabase* db, const char* table, const char* key, std::function<T(sqlite3_stmt*, int)> func, T* value)
 {
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(db->m_Database,
-            "SELECT value FROM " + std::string(table) + " WHERE key = ?", &stmt);
+    auto stmt = db->PrepareOrThrow("SELECT value FROM " + std::string(table) + " WHERE key = ?");
     sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
     while (sqlite3_step(stmt) == SQLITE_ROW) {
         *value = func(stmt, 0);
-        sqlite3_finalize(stmt);
         return true;
     }
-    sqlite3_finalize(stmt);
     return false;
 }
 
@@ -102,18 +111,16 @@ static T DoMySelect2(GameDatabase* db, const char* table, const char* key, std::
 
 static void DoMyUpdate(GameDatabase* db, const char* table, const char* key, std::function<void(sqlite3_stmt*, int)> bind)
 {
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(db->m_Database,
-            "INSERT OR IGNORE INTO " + std::string(table) + " (key, value) VALUES (?, ?)", &stmt);
+    auto stmt = db->PrepareOrThrow(
+            "INSERT OR IGNORE INTO " + std::string(table) + " (key, value) VALUES (?, ?)");
     sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
     bind(stmt, 2);
-    sqliteext::StepAndFinalizeOrThrow(stmt);
+    sqliteext::StepDoneOrThrow(stmt);
 
-    sqliteext::PrepareOrThrow(db->m_Database,
-            "UPDATE " + std::string(table) + " SET value = ? WHERE key = ?", &stmt);
+    stmt = db->PrepareOrThrow("UPDATE " + std::string(table) + " SET value = ? WHERE key = ?");
     bind(stmt, 1);
     sqlite3_bind_text(stmt, 2, key, -1, SQLITE_STATIC);
-    sqliteext::StepAndFinalizeOrThrow(stmt);
+    sqliteext::StepDoneOrThrow(stmt);
 }
 
 int GameDatabase::GetInt(const char* key)
@@ -169,3 +176,80 @@ void GameDatabase::SetText(const char* key, const std::string& value)
         sqliteext::BindStrOrThrow(stmt, pos, value);
     });
 }
+
+std::unique_ptr<sqliteext::SQLiteExtBlobReader> GameDatabase::OpenBlob(const char* key)
+{
+    auto stmt = PrepareOrThrow("SELECT rowid FROM kv_blob WHERE key = ?");
+    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
+        return nullptr;
+    }
+    return std::make_unique<sqliteext::SQLiteExtBlobReader>(this, "kv_blob", "value", sqlite3_column_int64(stmt, 0));
+}
+
+void GameDatabase::GetBlob(const char* key, std::vector<uint8_t>* result)
+{
+    auto blob = OpenBlob(key);
+    if (!blob) {
+        throw std::runtime_error("Unknown key: '" + std::string(key) + "' for table 'kv_blob'");
+    }
+    blob->ReadAllOrThrow(result);
+}
+
+const void* GameDatabase::GetBlob(const char* key)
+{
+    GetBlob(key, &m_Blob);
+    return m_Blob.data();
+}
+
+void GameDatabase::SetBlob(const char* key, const uint8_t* ptr, size_t size)
+{
+    DoSetBlob(key, ptr, size, BASIC_BLOB);
+}
+
+void GameDatabase::DoSetBlob(const char* key, const uint8_t* ptr, size_t size, int type)
+{
+    // 'modified' past every other so it's never one a cached image had
+    auto stmt = PrepareOrThrow(R"(
+        INSERT OR REPLACE INTO kv_blob (key, value, type, modified)
+            VALUES (?, ?, ?, (SELECT COALESCE(MAX(modified), 0) + 1 FROM kv_blob))
+    )");
+    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+    sqliteext::BindBlbOrThrow(stmt, 2, ptr, size);
+    sqliteext::BindIntOrThrow(stmt, 3, type);
+    sqliteext::StepDoneOrThrow(stmt);
+}
+
+cv::Mat GameDatabase::GetImage(const char* key)
+{
+    int64_t modified;
+    {
+        auto stmt = PrepareOrThrow("SELECT modified FROM kv_blob WHERE key = ?");
+        sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) != SQLITE_ROW) {
+            throw std::runtime_error("Unknown key: '" + std::string(key) + "' for table 'kv_blob'");
+        }
+        modified = sqlite3_column_int64(stmt, 0);
+    }
+
+    auto it = m_Images.find(key);
+    if (it == m_Images.end() || it->second.Modified != modified) {
+        std::vector<uint8_t> png;
+        GetBlob(key, &png);
+        cv::Mat img = cv::imdecode(png, cv::IMREAD_UNCHANGED);
+        if (img.empty()) {
+            throw std::runtime_error("Not an image: '" + std::string(key) + "'");
+        }
+        it = m_Images.insert_or_assign(key, CachedImage{modified, img}).first;
+    }
+    return it->second.Image.clone();
+}
+
+void GameDatabase::SetImage(const char* key, cv::Mat img)
+{
+    std::vector<uint8_t> png;
+    if (!cv::imencode(".png", img, png)) {
+        throw std::runtime_error("Unable to encode image: '" + std::string(key) + "'");
+    }
+    DoSetBlob(key, png.data(), png.size(), PNG_BLOB);
+}
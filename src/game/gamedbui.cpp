@@ -170,24 +170,21 @@ KVBlobComponent::~KVBlobComponent()
 void KVBlobComponent::Refresh()
 {
     m_BlobInfo.clear();
-    sqlite3_stmt* stmt;
 
-    sqliteext::PrepareOrThrow(m_Database->m_Database, "SELECT key, LENGTH(value), type FROM kv_blob ORDER BY key", &stmt);
+    auto stmt = m_Database->PrepareOrThrow("SELECT key, LENGTH(value), type FROM kv_blob ORDER BY key");
     while (sqlite3_step(stmt) == SQLITE_ROW) {
         m_BlobInfo.emplace_back();
         m_BlobInfo.back().Key = sqliteext::column_str(stmt, 0);
         m_BlobInfo.back().Size = sqlite3_column_int(stmt, 1);
         m_BlobInfo.back().Type = sqlite3_column_int(stmt, 2);
     }
-    sqlite3_finalize(stmt);
 }
 
 void KVBlobComponent::Delete(const std::string& key)
 {
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database->m_Database, "DELETE FROM kv_blob WHERE key = ?;", &stmt);
+    auto stmt = m_Database->PrepareOrThrow("DELETE FROM kv_blob WHERE key = ?;");
     sqliteext::BindStrOrThrow(stmt, 1, key);
-    sqliteext::StepAndFinalizeOrThrow(stmt);
+    sqliteext::StepDoneOrThrow(stmt);
 }
 
 void KVBlobComponent::OnFrame()
@@ -69,15 +69,25 @@ void sta::nes::column_pattern_table(sqlite3_stmt* stmt, int column, nes::Pattern
 NESDatabase::NESDatabase(const std::string& path)
     : game::GameDatabase(path)
 {
-    ExecOrThrow(NESDatabase::ROMSchema());
-    ExecOrThrow(NESDatabase::TASSchema());
-    ExecOrThrow(NESDatabase::PatternTableSchema());
+    MigrateOrThrow("nes", Migrations());
 }
 
 NESDatabase::~NESDatabase()
 {
 }
 
+const std::vector<sqliteext::SQLiteExtMigration>& NESDatabase::Migrations()
+{
+    static std::vector<sqliteext::SQLiteExtMigration> s_Migrations = {
+        {1, "roms, tases and pattern tables", [](sqliteext::SQLiteExtDB* db){
+            db->ExecOrThrow(NESDatabase::ROMSchema());
+            db->ExecOrThrow(NESDatabase::TASSchema());
+            db->ExecOrThrow(NESDatabase::PatternTableSchema());
+        }},
+    };
+    return s_Migrations;
+}
+
 const char* NESDatabase::ROMSchema()
 {
     return R"(CREATE TABLE IF NOT EXISTS nes_rom (
@@ -113,14 +123,13 @@ int NESDatabase::InsertROM(const std::string& name, const std::vector<uint8_t>&
     if (rom.size() < 16) {
         return -1;
     }
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         INSERT INTO nes_rom (name, rom, header) VALUES (?, ?, ?);
-    )", &stmt);
+    )");
     sqliteext::BindStrOrThrow(stmt, 1, name);
     sqliteext::BindBlbOrThrow(stmt, 2, rom.data(), rom.size());
     sqliteext::BindBlbOrThrow(stmt, 3, rom.data(), 16);
-    sqliteext::StepAndFinalizeOrThrow(stmt);
+    sqliteext::StepDoneOrThrow(stmt);
     return sqlite3_last_insert_rowid(m_Database);
 }
 
@@ -129,10 +138,9 @@ void NESDatabase::SelectAllROMs(std::vector<db::nes_rom>* roms)
     assert(roms);
     roms->clear();
 
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         SELECT id, name, rom, header FROM nes_rom ORDER BY id ASC;
-    )", &stmt);
+    )");
 
     while (sqlite3_step(stmt) == SQLITE_ROW) {
         roms->emplace_back();
@@ -151,17 +159,15 @@ void NESDatabase::SelectAllROMs(std::vector<db::nes_rom>* roms)
             rom.header[i] = dat[i];
         }
     }
-    sqlite3_finalize(stmt);
 }
 
 void NESDatabase::DeleteROM(int id)
 {
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         DELETE FROM nes_rom WHERE id = ?;
-    )", &stmt);
+    )");
     sqliteext::BindIntOrThrow(stmt, 1, id);
-    sqliteext::StepAndFinalizeOrThrow(stmt);
+    sqliteext::StepDoneOrThrow(stmt);
 }
 
 NESDatabase::RomSPtr NESDatabase::GetRomCached(int rom_id)
@@ -171,22 +177,23 @@ NESDatabase::RomSPtr NESDatabase::GetRomCached(int rom_id)
         return it->second;
     }
 
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         SELECT rom FROM nes_rom WHERE id = ?;
-    )", &stmt);
+    )");
     sqliteext::BindIntOrThrow(stmt, 1, rom_id);
 
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
+    RomSPtr ptr = nullptr;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
         int sz = sqlite3_column_bytes(stmt, 0);
         const uint8_t* dat = reinterpret_cast<const uint8_t*>(sqlite3_column_blob(stmt, 0));
 
         std::vector<uint8_t> rom(dat, dat + sz);
-        RomSPtr ptr = std::make_shared<const std::vector<uint8_t>>(std::move(rom));
+        ptr = std::make_shared<const std::vector<uint8_t>>(std::move(rom));
         m_CachedRoms[rom_id] = ptr;
-        return ptr;
     }
-    return nullptr;
+    // stmt is reset either way when it goes out of scope, a statement left
+    // mid step holds a read lock that keeps other connections from writing
+    return ptr;
 }
 
 void NESDatabase::SelectAllTasesLight(std::vector<db::nes_tas>* tases)
@@ -194,10 +201,9 @@ void NESDatabase::SelectAllTasesLight(std::vector<db::nes_tas>* tases)
     assert(tases);
     tases->clear();
 
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         SELECT id, rom_id, name FROM nes_tas ORDER BY id ASC;
-    )", &stmt);
+    )");
 
     while (sqlite3_step(stmt) == SQLITE_ROW) {
         tases->emplace_back();
@@ -205,17 +211,14 @@ void NESDatabase::SelectAllTasesLight(std::vector<db::nes_tas>* tases)
         tases->back().rom_id = sqlite3_column_int(stmt, 1);
         tases->back().name = sqliteext::column_str(stmt, 2);
     }
-    sqlite3_finalize(stmt);
-
 }
 
 bool NESDatabase::SelectTAS(int tas_id, db::nes_tas* tas,
         std::vector<nes::ControllerState>* inputs)
 {
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         SELECT id, rom_id, name, start_string, inputs FROM nes_tas WHERE id = ?;
-    )", &stmt);
+    )");
     sqliteext::BindIntOrThrow(stmt, 1, tas_id);
 
     bool ret = false;
@@ -234,41 +237,37 @@ bool NESDatabase::SelectTAS(int tas_id, db::nes_tas* tas,
         }
         ret = true;
     }
-    sqlite3_finalize(stmt);
     return ret;
 }
 
 void NESDatabase::DeleteTAS(int id)
 {
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         DELETE FROM nes_tas WHERE id = ?;
-    )", &stmt);
+    )");
     sqliteext::BindIntOrThrow(stmt, 1, id);
-    sqliteext::StepAndFinalizeOrThrow(stmt);
+    sqliteext::StepDoneOrThrow(stmt);
 }
 
 void NESDatabase::UpdateTASName(int id, const std::string& name)
 {
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         UPDATE nes_tas SET name = ? WHERE id = ?;
-    )", &stmt);
+    )");
     sqliteext::BindStrOrThrow(stmt, 1, name);
     sqliteext::BindIntOrThrow(stmt, 2, id);
-    sqliteext::StepAndFinalizeOrThrow(stmt);
+    sqliteext::StepDoneOrThrow(stmt);
 }
 
 int NESDatabase::InsertNewTAS(int rom_id, const std::string& name, const std::vector<nes::ControllerState>& inputs)
 {
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         INSERT INTO nes_tas (rom_id, name, inputs) VALUES (?, ?, ?);
-    )", &stmt);
+    )");
     sqliteext::BindIntOrThrow(stmt, 1, rom_id);
     sqliteext::BindStrOrThrow(stmt, 2, name);
     sqliteext::BindBlbOrThrow(stmt, 3, inputs.data(), inputs.size());
-    sqliteext::StepAndFinalizeOrThrow(stmt);
+    sqliteext::StepDoneOrThrow(stmt);
     return sqlite3_last_insert_rowid(m_Database);
 }
 
@@ -280,10 +279,9 @@ int NESDatabase::InsertNewTAS(int rom_id, const std::string& name)
 
 bool NESDatabase::GetRomByName(const std::string& name, std::vector<uint8_t>* rom)
 {
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         SELECT rom FROM nes_rom WHERE name = ?;
-    )", &stmt);
+    )");
     sqliteext::BindStrOrThrow(stmt, 1, name);
 
     bool ret = false;
@@ -295,16 +293,14 @@ bool NESDatabase::GetRomByName(const std::string& name, std::vector<uint8_t>* ro
         }
         ret = true;
     }
-    sqlite3_finalize(stmt);
     return ret;
 }
 
 bool NESDatabase::GetPatternTableByName(const std::string& name,
         nes::PatternTable* pattern_table) {
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         SELECT pattern_table FROM nes_pattern_table WHERE name = ?;
-    )", &stmt);
+    )");
     sqliteext::BindStrOrThrow(stmt, 1, name);
 
     bool ret = false;
@@ -312,6 +308,5 @@ bool NESDatabase::GetPatternTableByName(const std::string& name,
         column_pattern_table(stmt, 0, pattern_table);
         ret = true;
     }
-    sqlite3_finalize(stmt);
     return ret;
 }
@@ -19,6 +19,17 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include <map>
+#include <cmath>
+#include <limits>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "nes/ppux.h"
 #include "util/bitmanip.h"
@@ -42,14 +53,443 @@ void sta::nes::NextOAMx(OAMxEntry* oamx, int x8, int y8, uint8_t tileIndex, uint
     oamx->Attributes = attributes;
 }
 
+uint8_t sta::nes::OpacityToAlpha(float opacity)
+{
+    if (!(opacity > 0.0f)) { // nan too
+        return 0;
+    }
+    if (opacity >= 1.0f) {
+        return 255;
+    }
+    return static_cast<uint8_t>(std::lround(opacity * 255.0f));
+}
+
+// t / 255 rounded to nearest, exact for 0 <= t <= 255 * 255
+static inline uint16_t Div255(uint16_t t)
+{
+    t += 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+uint8_t sta::nes::BlendChannel(uint8_t dst, uint8_t src, uint8_t alpha)
+{
+    return static_cast<uint8_t>(Div255(src * alpha + dst * (255 - alpha)));
+}
+
+#if defined(__AVX2__)
+static inline __m256i Blend16(__m256i d, __m256i s, __m256i a, __m256i ia)
+{
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(s, a), _mm256_mullo_epi16(d, ia));
+    t = _mm256_add_epi16(t, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+#elif defined(__SSE2__)
+static inline __m128i Blend16(__m128i d, __m128i s, __m128i a, __m128i ia)
+{
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, ia));
+    t = _mm_add_epi16(t, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+#endif
+
+void sta::nes::BlendBGR(uint8_t* dst, const uint8_t* src, size_t n, uint8_t alpha)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i zero = _mm256_setzero_si256();
+    __m256i a = _mm256_set1_epi16(alpha);
+    __m256i ia = _mm256_set1_epi16(255 - alpha);
+    for (; i + 32 <= n; i += 32) {
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i lo = Blend16(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(s, zero), a, ia);
+        __m256i hi = Blend16(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(s, zero), a, ia);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_packus_epi16(lo, hi));
+    }
+#elif defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i a = _mm_set1_epi16(alpha);
+    __m128i ia = _mm_set1_epi16(255 - alpha);
+    for (; i + 16 <= n; i += 16) {
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i lo = Blend16(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(s, zero), a, ia);
+        __m128i hi = Blend16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(s, zero), a, ia);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for (; i < n; i++) {
+        dst[i] = BlendChannel(dst[i], src[i], alpha);
+    }
+}
+
+// Each of the width pixels repeated scale times
+static void UpscaleRow(const uint8_t* src, int width, int bytesPerPixel, int scale, uint8_t* dst)
+{
+    if (scale == 1) {
+        std::memcpy(dst, src, static_cast<size_t>(width) * bytesPerPixel);
+        return;
+    }
+
+    int x = 0;
+#if defined(__SSE2__) || defined(__AVX2__)
+    if (bytesPerPixel == 1 && (scale == 2 || scale == 4)) {
+        for (; x + 16 <= width; x += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+            __m128i lo = _mm_unpacklo_epi8(v, v);
+            __m128i hi = _mm_unpackhi_epi8(v, v);
+            if (scale == 2) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 2), lo);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 2 + 16), hi);
+            } else {
+                __m128i* out = reinterpret_cast<__m128i*>(dst + x * 4);
+                _mm_storeu_si128(out + 0, _mm_unpacklo_epi16(lo, lo));
+                _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(lo, lo));
+                _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(hi, hi));
+                _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(hi, hi));
+            }
+        }
+    }
+#endif
+
+    uint8_t* out = dst + static_cast<size_t>(x) * scale * bytesPerPixel;
+    if (bytesPerPixel == 3) {
+        for (; x < width; x++) {
+            const uint8_t* p = src + x * 3;
+            for (int s = 0; s < scale; s++) {
+                out[0] = p[0];
+                out[1] = p[1];
+                out[2] = p[2];
+                out += 3;
+            }
+        }
+    } else {
+        for (; x < width; x++) {
+            const uint8_t* p = src + x * bytesPerPixel;
+            for (int s = 0; s < scale; s++) {
+                std::memcpy(out, p, bytesPerPixel);
+                out += bytesPerPixel;
+            }
+        }
+    }
+}
+
+void sta::nes::UpscaleNearest(const uint8_t* src, int width, int height, int bytesPerPixel,
+        int scale, uint8_t* dst)
+{
+    size_t srcRow = static_cast<size_t>(width) * bytesPerPixel;
+    size_t dstRow = srcRow * scale;
+    for (int y = 0; y < height; y++) {
+        uint8_t* out = dst + y * scale * dstRow;
+        UpscaleRow(src + y * srcRow, width, bytesPerPixel, scale, out);
+        for (int j = 1; j < scale; j++) {
+            std::memcpy(out + j * dstRow, out, dstRow);
+        }
+    }
+}
+
+// The palette as 4 bytes (b, g, r, 0) per index, for the indices up to the
+// largest of the n used. So paletteBGR isn't read past what is needed
+static void BuildPaletteLUT(const uint8_t* paletteBGR, const uint8_t* indices, size_t n,
+        std::array<uint32_t, 256>* lut)
+{
+    int largest = n ? *std::max_element(indices, indices + n) : 0;
+    for (int i = 0; i < 256; i++) {
+        uint8_t entry[4] = {0, 0, 0, 0};
+        if (i <= largest) {
+            std::memcpy(entry, paletteBGR + i * 3, 3);
+        }
+        std::memcpy(lut->data() + i, entry, 4);
+    }
+}
+
+// The BGR of n indices, a 4 byte store per pixel so out needs 4 bytes past
+// n * 3. AVX2 gathers 8 at a time when compiled for it
+static void GatherBGR(const uint32_t* lut, const uint8_t* indices, int n, uint8_t* out)
+{
+    int x = 0;
+#if defined(__AVX2__)
+    const __m256i pack = _mm256_setr_epi8(
+            0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+            0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    for (; x + 8 <= n; x += 8) {
+        __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(indices + x)));
+        __m256i c = _mm256_i32gather_epi32(reinterpret_cast<const int*>(lut), idx, 4);
+        c = _mm256_shuffle_epi8(c, pack);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x * 3), _mm256_castsi256_si128(c));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x * 3 + 12), _mm256_extracti128_si256(c, 1));
+    }
+#endif
+    for (; x < n; x++) {
+        std::memcpy(out + x * 3, lut + indices[x], 4);
+    }
+}
+
+// Each of the n pixels of src over dst by its own alpha, in runs of the same
+// alpha so that it rounds exactly as BlendBGR does when drawing into BGR
+static void CompositeBGR(uint8_t* dst, const uint8_t* src, const uint8_t* alpha, int n)
+{
+    int x = 0;
+    while (x < n) {
+        uint8_t a = alpha[x];
+        int e = x + 1;
+        while (e < n && alpha[e] == a) {
+            e++;
+        }
+        size_t bytes = static_cast<size_t>(e - x) * 3;
+        if (a == 255) {
+            std::memcpy(dst + x * 3, src + x * 3, bytes);
+        } else if (a != 0) {
+            BlendBGR(dst + x * 3, src + x * 3, bytes, a);
+        }
+        x = e;
+    }
+}
+
+const uint8_t* DecodedPatternTable::Tile(uint8_t tileIndex, bool flipHorizontal, bool flipVertical) const
+{
+    int flip = (flipHorizontal ? 1 : 0) | (flipVertical ? 2 : 0);
+    return Pixels.data() + (flip * 256 + static_cast<int>(tileIndex)) * 64;
+}
+
+void sta::nes::DecodeTile(const uint8_t* tileData, bool flipHorizontal, bool flipVertical, uint8_t* pixels)
+{
+    const uint8_t* p1 = tileData;
+    const uint8_t* p2 = tileData + 8;
+    for (int iy = 0; iy < 8; iy++) {
+        int oy = flipVertical ? 7 - iy : iy;
+        for (int ix = 0; ix < 8; ix++) {
+            int sh = flipHorizontal ? ix : 7 - ix;
+            *pixels++ = ((p1[oy] >> sh) & 0x01) | (((p2[oy] >> sh) & 0x01) << 1);
+        }
+    }
+}
+
+void sta::nes::DecodePatternTable(const uint8_t* patternTable, DecodedPatternTable* decoded)
+{
+    std::copy(patternTable, patternTable + PATTERNTABLE_SIZE, decoded->Source.begin());
+    uint8_t* out = decoded->Pixels.data();
+    for (int flip = 0; flip < 4; flip++) {
+        for (int tile = 0; tile < 256; tile++) {
+            DecodeTile(patternTable + tile * 16, flip & 1, flip & 2, out);
+            out += 64;
+        }
+    }
+}
+
+DecodedPatternTablePtr sta::nes::GetDecodedPatternTable(const uint8_t* patternTable)
+{
+    static std::mutex s_Mutex;
+    static std::unordered_map<const uint8_t*, DecodedPatternTablePtr> s_Cache;
+
+    std::lock_guard<std::mutex> lock(s_Mutex);
+    auto it = s_Cache.find(patternTable);
+    if (it != s_Cache.end() &&
+        std::memcmp(it->second->Source.data(), patternTable, PATTERNTABLE_SIZE) == 0) {
+        return it->second;
+    }
+
+    // Pattern tables are few and long lived, but don't grow without bound
+    // when they are not
+    if (s_Cache.size() >= 64) {
+        s_Cache.clear();
+    }
+    auto decoded = std::make_shared<DecodedPatternTable>();
+    DecodePatternTable(patternTable, decoded.get());
+    s_Cache[patternTable] = decoded;
+    return decoded;
+}
+
+
+void NametableOverlay::Clear()
+{
+    m_Present.reset();
+    m_Values.clear();
+}
+
+bool NametableOverlay::Empty() const
+{
+    return m_Values.empty();
+}
+
+void NametableOverlay::Set(int offset, uint8_t value)
+{
+    if (offset < 0 || offset >= NAMETABLE_SIZE) {
+        throw std::out_of_range("NametableOverlay::Set, offset outside of the nametable");
+    }
+    auto key = static_cast<uint16_t>(offset);
+    auto it = std::lower_bound(m_Values.begin(), m_Values.end(), key,
+            [](const auto& v, uint16_t o){
+                return v.first < o;
+            });
+    if (it != m_Values.end() && it->first == key) {
+        it->second = value;
+    } else {
+        m_Values.insert(it, {key, value});
+    }
+    m_Present.set(offset);
+}
+
+uint8_t NametableOverlay::Get(int offset, uint8_t original) const
+{
+    if (!m_Present.test(offset)) {
+        return original;
+    }
+    auto key = static_cast<uint16_t>(offset);
+    auto it = std::lower_bound(m_Values.begin(), m_Values.end(), key,
+            [](const auto& v, uint16_t o){
+                return v.first < o;
+            });
+    return it->second;
+}
+
+// The ü RenderStringX draws for -61 (the first byte of it in UTF-8)
+static const std::array<uint8_t, 16> STRINGX_U_UMLAUT = {
+    0b11000110,
+    0b00000000,
+    0b11000110,
+    0b11000110,
+    0b11000110,
+    0b11000110,
+    0b01111100,
+    0b00000000,
+    0b00000000,
+    0b00000000,
+    0b00000000,
+    0b00000000,
+    0b00000000,
+    0b00000000,
+    0b00000000,
+    0b00000000,
+};
+
+static TextSpritePtr MakeTextSprite(DecodedPatternTablePtr glyphs, const std::string& str, bool stringX)
+{
+    static const std::array<uint8_t, 64> umlaut = []{
+        std::array<uint8_t, 64> pixels;
+        DecodeTile(STRINGX_U_UMLAUT.data(), false, false, pixels.data());
+        return pixels;
+    }();
+
+    // The glyphs of each line, then laid out side by side
+    std::vector<std::vector<const uint8_t*>> lines(1);
+    for (auto c : str) {
+        if (stringX) {
+            if (static_cast<int>(c) == -61) {
+                lines.back().push_back(umlaut.data());
+            }
+            if (static_cast<int>(c) < 0) {
+                continue;
+            }
+            if (c == '\n') {
+                lines.emplace_back();
+                continue;
+            }
+        }
+        lines.back().push_back(glyphs->Tile(static_cast<uint8_t>(c), false, false));
+    }
+
+    auto sprite = std::make_shared<TextSprite>();
+    sprite->Glyphs = glyphs;
+    sprite->Lines.resize(lines.size());
+    for (size_t l = 0; l < lines.size(); l++) {
+        auto& line = sprite->Lines[l];
+        line.Columns = static_cast<int>(lines[l].size()) * 8;
+        line.Pixels.resize(line.Columns * 8);
+        uint8_t* out = line.Pixels.data();
+        for (int iy = 0; iy < 8; iy++) {
+            for (auto glyph : lines[l]) {
+                std::memcpy(out, glyph + iy * 8, 8);
+                out += 8;
+            }
+        }
+    }
+    return sprite;
+}
+
+TextSpritePtr sta::nes::GetTextSprite(DecodedPatternTablePtr glyphs, const std::string& str, bool stringX)
+{
+    static std::mutex s_Mutex;
+    static std::map<std::tuple<const DecodedPatternTable*, bool, std::string>, TextSpritePtr> s_Cache;
+
+    auto key = std::make_tuple(glyphs.get(), stringX, str);
+    std::lock_guard<std::mutex> lock(s_Mutex);
+    auto it = s_Cache.find(key);
+    if (it != s_Cache.end()) {
+        return it->second;
+    }
+
+    // Timers are a new string every frame, so this does fill up
+    if (s_Cache.size() >= 4096) {
+        s_Cache.clear();
+    }
+    auto sprite = MakeTextSprite(glyphs, str, stringX);
+    s_Cache.emplace(std::move(key), sprite);
+    return sprite;
+}
+
+int sta::nes::MeasureString(const std::string& str, int scale)
+{
+    return static_cast<int>(str.size()) * 8 * scale;
+}
+
+int sta::nes::MeasureStringX(const std::string& strX, int scalx)
+{
+    int widest = 0;
+    int columns = 0;
+    for (auto c : strX) {
+        if (static_cast<int>(c) == -61) {
+            columns++;
+        }
+        if (static_cast<int>(c) < 0) {
+            continue;
+        }
+        if (c == '\n') {
+            widest = std::max(widest, columns);
+            columns = 0;
+        } else {
+            columns++;
+        }
+    }
+    widest = std::max(widest, columns);
+    return widest * 8 * scalx;
+}
+
+std::string sta::nes::FitString(const std::string& str, int maxWidth, int scale,
+        const std::string& ellipsis)
+{
+    size_t fits = static_cast<size_t>(std::max(maxWidth / (8 * scale), 0));
+    if (str.size() <= fits) {
+        return str;
+    }
+    if (ellipsis.size() >= fits) {
+        return ellipsis.substr(0, fits);
+    }
+    return str.substr(0, fits - ellipsis.size()) + ellipsis;
+}
+
+int sta::nes::AlignText(int x, int width, TextAlign align)
+{
+    switch (align) {
+        case TextAlign::CENTER: return x - width / 2;
+        case TextAlign::RIGHT: return x - width;
+        default: return x;
+    }
+}
+
 
 PPUx::PPUx(int width, int height, uint8_t* bgrout, PPUxPriorityStatus priorityStatus)
     : m_Width(width)
     , m_Height(height)
     , m_BGROut(bgrout)
+    , m_OutputFormat(PPUxOutputFormat::BGR)
+    , m_PixelSize(3)
     , m_PriorityStatus(priorityStatus)
     , m_Outlining(false)
     , m_SpritePriorityGlitch(true)
+    , m_ReferenceRendering(false)
+    , m_PriorityTilesX(0)
+    , m_PriorityAllDirty(false)
 {
     if (m_Width <= 0 || m_Height <= 0) {
         throw std::invalid_argument("invalid size for ppux");
@@ -64,14 +504,42 @@ PPUx::PPUx(int width, int height, PPUxPriorityStatus priorityStatus)
     , m_Height(height)
     , m_MyBGR(PPUx::RequiredBGROutSize(width, height), 0x00)
     , m_BGROut(m_MyBGR.data())
+    , m_OutputFormat(PPUxOutputFormat::BGR)
+    , m_PixelSize(3)
     , m_PriorityStatus(priorityStatus)
     , m_Outlining(false)
+    , m_SpritePriorityGlitch(true)
+    , m_ReferenceRendering(false)
+    , m_PriorityTilesX(0)
+    , m_PriorityAllDirty(false)
 {
     if (m_Width <= 0 || m_Height <= 0) {
         throw std::invalid_argument("invalid size for ppux");
     }
 }
 
+PPUx::PPUx(int width, int height, PPUxPriorityStatus priorityStatus, PPUxOutputFormat format)
+    : m_Width(width)
+    , m_Height(height)
+    , m_OutputFormat(format)
+    , m_PixelSize(format == PPUxOutputFormat::BGR ? 3 : 1)
+    , m_PriorityStatus(priorityStatus)
+    , m_Outlining(false)
+    , m_SpritePriorityGlitch(true)
+    , m_ReferenceRendering(false)
+    , m_PriorityTilesX(0)
+    , m_PriorityAllDirty(false)
+{
+    if (m_Width <= 0 || m_Height <= 0) {
+        throw std::invalid_argument("invalid size for ppux");
+    }
+    m_MyBGR.assign(static_cast<size_t>(m_Width) * m_Height * m_PixelSize, 0x00);
+    m_BGROut = m_MyBGR.data();
+    if (m_OutputFormat == PPUxOutputFormat::PALETTE_INDEX) {
+        m_Alpha.assign(static_cast<size_t>(m_Width) * m_Height, 0x00);
+    }
+}
+
 PPUx::~PPUx()
 {
 }
@@ -88,12 +556,138 @@ int PPUx::GetHeight() const
 
 uint8_t* PPUx::GetBGROut()
 {
-    return m_BGROut;
+    return m_OutputFormat == PPUxOutputFormat::BGR ? m_BGROut : nullptr;
 }
 
 const uint8_t* PPUx::GetBGROut() const
 {
-    return m_BGROut;
+    return m_OutputFormat == PPUxOutputFormat::BGR ? m_BGROut : nullptr;
+}
+
+uint8_t* PPUx::GetIndexOut()
+{
+    return m_OutputFormat == PPUxOutputFormat::PALETTE_INDEX ? m_BGROut : nullptr;
+}
+
+const uint8_t* PPUx::GetIndexOut() const
+{
+    return m_OutputFormat == PPUxOutputFormat::PALETTE_INDEX ? m_BGROut : nullptr;
+}
+
+const uint8_t* PPUx::GetAlphaOut() const
+{
+    return m_Alpha.empty() ? nullptr : m_Alpha.data();
+}
+
+PPUxOutputFormat PPUx::GetOutputFormat() const
+{
+    return m_OutputFormat;
+}
+
+const uint8_t* PPUx::PixelValue(const uint8_t* paletteBGR, const uint8_t* paletteIndex) const
+{
+    if (m_OutputFormat == PPUxOutputFormat::PALETTE_INDEX) {
+        return paletteIndex;
+    }
+    return paletteBGR + *paletteIndex * 3;
+}
+
+uint8_t PPUx::AlphaFor(const EffectInfo& effects) const
+{
+    return OpacityToAlpha(effects.Opacity);
+}
+
+bool PPUx::DeferredAlpha() const
+{
+    return !m_Alpha.empty();
+}
+
+void PPUx::Resolve(const uint8_t* paletteBGR, uint8_t* bgrOut, int scale) const
+{
+    if (scale <= 0) {
+        throw std::invalid_argument("invalid scale to PPUx::Resolve");
+    }
+    if (m_OutputFormat == PPUxOutputFormat::BGR) {
+        UpscaleNearest(m_BGROut, m_Width, m_Height, 3, scale, bgrOut);
+        return;
+    }
+
+    std::array<uint32_t, 256> lut;
+    BuildPaletteLUT(paletteBGR, m_BGROut, static_cast<size_t>(m_Width) * m_Height, &lut);
+
+    int scaledWidth = m_Width * scale;
+    size_t rowSize = static_cast<size_t>(scaledWidth) * 3;
+    std::vector<uint8_t> row(static_cast<size_t>(m_Width) * 3 + 4);
+    std::vector<uint8_t> scaledRow, scaledAlpha;
+    for (int y = 0; y < m_Height; y++) {
+        const uint8_t* in = m_BGROut + static_cast<size_t>(y) * m_Width;
+        const uint8_t* alpha = m_Alpha.data() + static_cast<size_t>(y) * m_Width;
+        auto [amin, amax] = std::minmax_element(alpha, alpha + m_Width);
+        if (*amax == 0) {
+            continue; // nothing drawn
+        }
+
+        GatherBGR(lut.data(), in, m_Width, row.data());
+        uint8_t* out = bgrOut + static_cast<size_t>(y) * scale * rowSize;
+        if (*amin == 255) {
+            UpscaleRow(row.data(), m_Width, 3, scale, out);
+            for (int j = 1; j < scale; j++) {
+                std::memcpy(out + j * rowSize, out, rowSize);
+            }
+            continue;
+        }
+
+        const uint8_t* src = row.data();
+        if (scale != 1) {
+            scaledRow.resize(rowSize);
+            scaledAlpha.resize(scaledWidth);
+            UpscaleRow(row.data(), m_Width, 3, scale, scaledRow.data());
+            UpscaleRow(alpha, m_Width, 1, scale, scaledAlpha.data());
+            src = scaledRow.data();
+            alpha = scaledAlpha.data();
+        }
+        for (int j = 0; j < scale; j++) {
+            CompositeBGR(out + j * rowSize, src, alpha, scaledWidth);
+        }
+    }
+}
+
+void PPUx::UpscaleTo(PPUx* other, int scale, const uint8_t* paletteBGR)
+{
+    if (scale <= 0 || other->m_Width != m_Width * scale || other->m_Height != m_Height * scale) {
+        throw std::invalid_argument("PPUx::UpscaleTo, other must be exactly scale times the size");
+    }
+    if (other->m_OutputFormat == PPUxOutputFormat::BGR) {
+        Resolve(paletteBGR, other->m_BGROut, scale);
+    } else if (m_OutputFormat == PPUxOutputFormat::PALETTE_INDEX) {
+        UpscaleNearest(m_BGROut, m_Width, m_Height, 1, scale, other->m_BGROut);
+        UpscaleNearest(m_Alpha.data(), m_Width, m_Height, 1, scale, other->m_Alpha.data());
+    } else {
+        throw std::invalid_argument("PPUx::UpscaleTo, can't go from BGR to palette indices");
+    }
+
+    if (!PriorityEnabled() || !other->PriorityEnabled() ||
+            m_PriorityInfo.size() != RequiredPriorityInfoDataSize(m_Width, m_Height)) {
+        return;
+    }
+    other->ResetPriority();
+    if (m_PriorityAllDirty) {
+        UpscaleNearest(m_PriorityInfo.data(), m_Width, m_Height, 1, scale, other->m_PriorityInfo.data());
+        other->m_PriorityAllDirty = true;
+        return;
+    }
+    ForEachDirtyPriorityRow([&](int x, int y, int w){
+        const uint8_t* in = m_PriorityInfo.data() + static_cast<size_t>(y) * m_Width + x;
+        uint8_t* out = other->m_PriorityInfo.data() +
+            static_cast<size_t>(y * scale) * other->m_Width + x * scale;
+        UpscaleRow(in, w, 1, scale, out);
+        for (int j = 1; j < scale; j++) {
+            std::memcpy(out + static_cast<size_t>(j) * other->m_Width, out, w * scale);
+        }
+        for (int j = 0; j < scale; j++) {
+            other->MarkPriorityDirty(x * scale, (x + w) * scale, y * scale + j);
+        }
+    });
 }
 
 size_t PPUx::RequiredBGROutSize(int width, int height)
@@ -110,11 +704,191 @@ void PPUx::RenderTile88(int x, int y, Render88Flags flags,
         const uint8_t* tilePalette, const uint8_t* tileData,
         const uint8_t* paletteBGR,
         int scalx, int scaly, const EffectInfo& effects)
+{
+    if (m_ReferenceRendering) {
+        RenderTile88Reference(x, y, flags, tilePalette, tileData, paletteBGR, scalx, scaly, effects);
+    } else {
+        std::array<uint8_t, 64> pixels;
+        DecodeTile(tileData, flags & R88_FLIP_HORIZONTAL, flags & R88_FLIP_VERTICAL, pixels.data());
+        BlitTile88(x, y, flags, tilePalette, pixels.data(), paletteBGR, scalx, scaly, effects);
+    }
+}
+
+DecodedPatternTablePtr PPUx::DecodedFor(const uint8_t* patternTable)
+{
+    auto it = std::lower_bound(m_BoundPatternTables.begin(), m_BoundPatternTables.end(), patternTable,
+            [](const auto& bound, const uint8_t* p){
+                return bound.first < p;
+            });
+    if (it != m_BoundPatternTables.end() && it->first == patternTable) {
+        return it->second;
+    }
+    return GetDecodedPatternTable(patternTable);
+}
+
+void PPUx::RenderPatternTableTile88(int x, int y, Render88Flags flags,
+        const uint8_t* tilePalette,
+        const uint8_t* patternTable, uint8_t tileIndex,
+        const uint8_t* paletteBGR,
+        int scalx, int scaly, const EffectInfo& effects)
+{
+    if (m_ReferenceRendering) {
+        RenderTile88Reference(x, y, flags, tilePalette, patternTable + static_cast<int>(tileIndex) * 16,
+                paletteBGR, scalx, scaly, effects);
+    } else {
+        auto decoded = DecodedFor(patternTable);
+        BlitTile88(x, y, flags, tilePalette,
+                decoded->Tile(tileIndex, flags & R88_FLIP_HORIZONTAL, flags & R88_FLIP_VERTICAL),
+                paletteBGR, scalx, scaly, effects);
+    }
+}
+
+void PPUx::BlitTile88(int x, int y, Render88Flags flags,
+        const uint8_t* tilePalette, const uint8_t* pixels,
+        const uint8_t* paletteBGR,
+        int scalx, int scaly, const EffectInfo& effects, int columns)
 {
     if (scalx <= 0 || scaly <= 0) {
         throw std::runtime_error("invalid scale to PPUx::RenderTile88");
     }
+    uint8_t alpha = AlphaFor(effects);
 
+    // The columns that may be written, same rules as PutPixel
+    int x0 = std::max(x, 0);
+    int x1 = std::min(x + columns * scalx, m_Width);
+    if (effects.CropWithin) {
+        x0 = std::max(x0, effects.Crop.X);
+        x1 = std::min(x1, effects.Crop.X + effects.Crop.Width + 1);
+    }
+    if (x0 >= x1) {
+        return;
+    }
+    int n = x1 - x0;
+
+    bool isSprite = flags & R88_IS_SPRITE;
+    bool spritePriority = flags & R88_SPRITE_PRIORITY;
+    bool opaque = effects.Opacity == 1.0f;
+    bool priority = PriorityEnabled();
+    if (priority && m_PriorityInfo.size() != RequiredPriorityInfoDataSize(m_Width, m_Height)) {
+        ResetPriority();
+    }
+    // Opaque backgrounds don't depend on what is already there, so each row
+    // is expanded to BGR once and copied for every scaled row
+    bool copyRows = opaque && !isSprite;
+    bool deferred = DeferredAlpha();
+
+    int ps = m_PixelSize;
+    std::array<const uint8_t*, 4> colors;
+    for (int i = 0; i < 4; i++) {
+        colors[i] = PixelValue(paletteBGR, tilePalette + i);
+    }
+    m_RowIndices.resize(n);
+    m_RowBGR.resize(n * ps);
+
+    int ty = y;
+    for (int iy = 0; iy < 8; iy++) {
+        const uint8_t* row = pixels + iy * columns;
+        bool expanded = false;
+
+        for (int yc = 0; yc < scaly; yc++, ty++) {
+            if (effects.CropWithin) {
+                auto& crop = effects.Crop;
+                if (ty < crop.Y) continue;
+                if (ty > (crop.Y + crop.Height)) return;
+            }
+            if (ty < 0) continue;
+            if (ty >= m_Height) return;
+
+            if (!expanded) {
+                int px = x;
+                uint8_t* idx = m_RowIndices.data();
+                for (int ix = 0; ix < columns; ix++) {
+                    for (int xc = 0; xc < scalx; xc++, px++) {
+                        if (px >= x0 && px < x1) {
+                            *idx++ = row[ix];
+                        }
+                    }
+                }
+                if (copyRows && ps == 3) {
+                    uint8_t* bgr = m_RowBGR.data();
+                    for (int k = 0; k < n; k++) {
+                        const uint8_t* c = colors[m_RowIndices[k]];
+                        *bgr++ = c[0];
+                        *bgr++ = c[1];
+                        *bgr++ = c[2];
+                    }
+                } else if (copyRows) {
+                    for (int k = 0; k < n; k++) {
+                        m_RowBGR[k] = *colors[m_RowIndices[k]];
+                    }
+                }
+                expanded = true;
+            }
+
+            size_t i = static_cast<size_t>(ty) * m_Width + static_cast<size_t>(x0);
+            uint8_t* out = m_BGROut + i * ps;
+            if (priority) {
+                MarkPriorityDirty(x0, x1, ty);
+            }
+            if (copyRows) {
+                std::memcpy(out, m_RowBGR.data(), n * ps);
+                if (deferred) {
+                    std::memset(m_Alpha.data() + i, alpha, n);
+                }
+                if (priority) {
+                    uint8_t* pri = m_PriorityInfo.data() + i;
+                    for (int k = 0; k < n; k++) {
+                        if (m_RowIndices[k] != 0) {
+                            pri[k] = PPUPRI_BG;
+                        }
+                        if (m_Outlining) {
+                            pri[k] |= PPUPRI_TO_OUTLINE;
+                        }
+                    }
+                }
+                continue;
+            }
+
+            // Translucent rows are gathered into m_RowBGR (pixels that are
+            // not written keep the destination color, which blends to itself)
+            // and then blended all at once
+            uint8_t* src = m_RowBGR.data();
+            for (int k = 0; k < n; k++, i++) {
+                uint8_t paletteIndex = m_RowIndices[k];
+                bool write = !(isSprite && paletteIndex == 0);
+
+                if (write && priority) {
+                    write = UpdatePixelPriority(i, isSprite, spritePriority,
+                            opaque && paletteIndex != 0, opaque);
+                }
+
+                const uint8_t* bgr = write ? colors[paletteIndex] : out + k * ps;
+                if (opaque || deferred) {
+                    if (write) {
+                        std::memcpy(out + k * ps, bgr, ps);
+                        if (deferred) {
+                            m_Alpha[i] = alpha;
+                        }
+                    }
+                } else {
+                    std::memcpy(src + k * ps, bgr, ps);
+                }
+            }
+            if (!opaque && !deferred) {
+                BlendBGR(out, src, n * ps, alpha);
+            }
+        }
+    }
+}
+
+void PPUx::RenderTile88Reference(int x, int y, Render88Flags flags,
+        const uint8_t* tilePalette, const uint8_t* tileData,
+        const uint8_t* paletteBGR,
+        int scalx, int scaly, const EffectInfo& effects)
+{
+    if (scalx <= 0 || scaly <= 0) {
+        throw std::runtime_error("invalid scale to PPUx::RenderTile88");
+    }
 
     const uint8_t* p1 = tileData;
     const uint8_t* p2 = tileData + 8;
@@ -166,7 +940,7 @@ void PPUx::RenderTile88(int x, int y, Render88Flags flags,
                 }
 
                 // for the columns of this individual pixel
-                const uint8_t* bgr = paletteBGR + tilePalette[paletteIndex] * 3;
+                const uint8_t* bgr = PixelValue(paletteBGR, tilePalette + paletteIndex);
                 for (int xc = 0; xc < scalx; xc++, tx++) {
                     // WRITING the pixel
                     PutPixel(tx, ty, bgr, false,
@@ -200,6 +974,7 @@ void PPUx::SetPriority(int tx, int ty, PPUxPriorityInfoEntry entry) {
         throw std::invalid_argument("invalid pixel to set priority info!?");
     }
 
+    MarkPriorityDirty(tx, tx + 1, ty);
     m_PriorityInfo[v] = entry;
 }
 
@@ -217,7 +992,11 @@ void PPUx::FillBackground(uint8_t paletteIndex, const uint8_t* paletteBGR)
     ResetPriority();
     size_t n = m_Height * m_Width * 3;
     uint8_t* out = m_BGROut;
-    if (paletteIndex == nes::PALETTE_ENTRY_BLACK) {
+    if (m_OutputFormat == PPUxOutputFormat::PALETTE_INDEX) {
+        std::fill(out, out + m_Height * m_Width, paletteIndex);
+        std::fill(m_Alpha.begin(), m_Alpha.end(), 0xff);
+        return;
+    } else if (paletteIndex == nes::PALETTE_ENTRY_BLACK) {
         std::fill(out, out + n, 0x00);
         return;
     } else if (paletteIndex == nes::PALETTE_ENTRY_WHITE) {
@@ -225,13 +1004,51 @@ void PPUx::FillBackground(uint8_t paletteIndex, const uint8_t* paletteBGR)
         return;
     }
 
-    const uint8_t* in = paletteBGR + paletteIndex * 3;
-    for (int y = 0; y < m_Height; y++) {
-        for (int x = 0; x < m_Width; x++) {
-            for (int i = 0; i < 3; i++) {
-                *(out + i) = *(in + i);
-            }
-            out += 3;
+    FillBackground(paletteIndex, paletteBGR, EffectInfo::Defaults());
+}
+
+void PPUx::FillBackground(uint8_t paletteIndex, const uint8_t* paletteBGR, const EffectInfo& effects)
+{
+    uint8_t alpha = AlphaFor(effects);
+
+    int x0 = 0, x1 = m_Width;
+    int y0 = 0, y1 = m_Height;
+    if (effects.CropWithin) {
+        auto& crop = effects.Crop;
+        x0 = std::max(x0, crop.X);
+        x1 = std::min(x1, crop.X + crop.Width + 1);
+        y0 = std::max(y0, crop.Y);
+        y1 = std::min(y1, crop.Y + crop.Height + 1);
+    }
+    if (x0 >= x1 || y0 >= y1) {
+        return;
+    }
+    // What's outside the crop isn't covered, so keeps its priority
+    if (effects.CropWithin) {
+        ResetPriorityWithin(x0, x1, y0, y1);
+    } else {
+        ResetPriority();
+    }
+    int n = x1 - x0;
+
+    // One row of the color, copied or blended into every row
+    int ps = m_PixelSize;
+    const uint8_t* in = PixelValue(paletteBGR, &paletteIndex);
+    m_RowBGR.resize(n * ps);
+    for (int k = 0; k < n; k++) {
+        std::memcpy(m_RowBGR.data() + k * ps, in, ps);
+    }
+
+    for (int y = y0; y < y1; y++) {
+        size_t i = static_cast<size_t>(y) * m_Width + x0;
+        uint8_t* out = m_BGROut + i * ps;
+        if (effects.Opacity == 1.0f || DeferredAlpha()) {
+            std::memcpy(out, m_RowBGR.data(), n * ps);
+        } else {
+            BlendBGR(out, m_RowBGR.data(), n * ps, alpha);
+        }
+        if (DeferredAlpha()) {
+            std::memset(m_Alpha.data() + i, alpha, n);
         }
     }
 }
@@ -258,8 +1075,6 @@ void PPUx::RenderOAMEntry(int x, int y, uint8_t tileIndex, uint8_t attributes,
             const uint8_t* palette,
             int scal, const EffectInfo& effects)
 {
-    const uint8_t* tileData = patternTable + static_cast<int>(tileIndex) * 16;
-
     std::array<uint8_t, 4> tilePalette;
     tilePalette[0] = framePalette[0];
 
@@ -268,25 +1083,107 @@ void PPUx::RenderOAMEntry(int x, int y, uint8_t tileIndex, uint8_t attributes,
         tilePalette[i] = spritePalette[i];
     }
 
-    RenderTile88(x, y, GetSpriteRenderFlags(attributes),
-            tilePalette.data(), tileData, palette, scal, scal, effects);
+    RenderPatternTableTile88(x, y, GetSpriteRenderFlags(attributes),
+            tilePalette.data(), patternTable, tileIndex, palette, scal, scal, effects);
 }
 
 
+void PPUx::MarkPriorityDirty(int x0, int x1, int y)
+{
+    if (m_PriorityAllDirty || m_PriorityTileDirty.empty()) {
+        return;
+    }
+    int row = (y / PRIORITY_TILE_SIZE) * m_PriorityTilesX;
+    for (int tx = x0 / PRIORITY_TILE_SIZE; tx <= (x1 - 1) / PRIORITY_TILE_SIZE; tx++) {
+        uint8_t& dirty = m_PriorityTileDirty[row + tx];
+        if (!dirty) {
+            dirty = 1;
+            m_DirtyPriorityTiles.push_back(row + tx);
+        }
+    }
+}
+
+template <typename F>
+void PPUx::ForEachDirtyPriorityRow(F&& f)
+{
+    if (m_PriorityInfo.size() != RequiredPriorityInfoDataSize(m_Width, m_Height)) {
+        return;
+    }
+    if (m_PriorityAllDirty || m_PriorityTileDirty.empty() || m_ReferenceRendering) {
+        for (int y = 0; y < m_Height; y++) {
+            f(0, y, m_Width);
+        }
+        return;
+    }
+
+    // By index, and only the tiles dirty when starting, as f may mark more
+    size_t count = m_DirtyPriorityTiles.size();
+    for (size_t t = 0; t < count; t++) {
+        int tile = m_DirtyPriorityTiles[t];
+        int x0 = (tile % m_PriorityTilesX) * PRIORITY_TILE_SIZE;
+        int y0 = (tile / m_PriorityTilesX) * PRIORITY_TILE_SIZE;
+        int x1 = std::min(x0 + PRIORITY_TILE_SIZE, m_Width);
+        int y1 = std::min(y0 + PRIORITY_TILE_SIZE, m_Height);
+        for (int y = y0; y < y1; y++) {
+            f(x0, y, x1 - x0);
+        }
+    }
+}
+
 void PPUx::ResetPriority()
 {
     if (m_PriorityStatus == PPUxPriorityStatus::ENABLED) {
-        m_PriorityInfo.assign(RequiredPriorityInfoDataSize(m_Width, m_Height),
-                PPUxPriorityInfoEntry::PPUPRI_NONE);
+        size_t n = RequiredPriorityInfoDataSize(m_Width, m_Height);
+        int tilesX = (m_Width + PRIORITY_TILE_SIZE - 1) / PRIORITY_TILE_SIZE;
+        int tilesY = (m_Height + PRIORITY_TILE_SIZE - 1) / PRIORITY_TILE_SIZE;
+        size_t tiles = static_cast<size_t>(tilesX) * tilesY;
+
+        if (m_PriorityInfo.size() != n || m_PriorityTileDirty.size() != tiles) {
+            m_PriorityInfo.assign(n, PPUxPriorityInfoEntry::PPUPRI_NONE);
+            m_PriorityTilesX = tilesX;
+            m_PriorityTileDirty.assign(tiles, 0);
+        } else if (m_PriorityAllDirty || m_ReferenceRendering ||
+                m_DirtyPriorityTiles.size() * 2 > tiles) {
+            std::fill(m_PriorityInfo.begin(), m_PriorityInfo.end(), PPUxPriorityInfoEntry::PPUPRI_NONE);
+            std::fill(m_PriorityTileDirty.begin(), m_PriorityTileDirty.end(), 0);
+        } else {
+            ForEachDirtyPriorityRow([&](int x, int y, int w){
+                std::memset(m_PriorityInfo.data() + static_cast<size_t>(y) * m_Width + x,
+                        PPUxPriorityInfoEntry::PPUPRI_NONE, w);
+            });
+            for (auto tile : m_DirtyPriorityTiles) {
+                m_PriorityTileDirty[tile] = 0;
+            }
+        }
+        m_DirtyPriorityTiles.clear();
+        m_PriorityAllDirty = false;
+    }
+}
+
+void PPUx::ResetPriorityWithin(int x0, int x1, int y0, int y1)
+{
+    if (m_PriorityStatus != PPUxPriorityStatus::ENABLED) {
+        return;
+    }
+    if (m_PriorityInfo.size() != RequiredPriorityInfoDataSize(m_Width, m_Height)) {
+        ResetPriority();
+        return;
+    }
+    for (int y = y0; y < y1; y++) {
+        std::memset(m_PriorityInfo.data() + static_cast<size_t>(y) * m_Width + x0,
+                PPUxPriorityInfoEntry::PPUPRI_NONE, x1 - x0);
     }
 }
 
 void PPUx::ResetSpritePriorityOnly()
 {
     if (m_PriorityStatus == PPUxPriorityStatus::ENABLED) {
-        for (auto & entry : m_PriorityInfo) {
-            entry &= ~PPUPRI_SPR;
-        }
+        ForEachDirtyPriorityRow([&](int x, int y, int w){
+            uint8_t* pri = m_PriorityInfo.data() + static_cast<size_t>(y) * m_Width + x;
+            for (int k = 0; k < w; k++) {
+                pri[k] &= ~PPUPRI_SPR;
+            }
+        });
     }
 }
 
@@ -297,8 +1194,6 @@ void PPUx::RenderNametableEntry(
         const uint8_t* paletteBGR,
         int scale, const EffectInfo& effects)
 {
-    const uint8_t* tileData = patternTable + static_cast<int>(tileIndex) * 16;
-
     std::array<uint8_t, 4> tilePalette;
     tilePalette[0] = framePalette[0];
     const uint8_t* thisPalette = framePalette + (attributes & 0b00000011) * 4;
@@ -306,8 +1201,8 @@ void PPUx::RenderNametableEntry(
         tilePalette[i] = thisPalette[i];
     }
 
-    RenderTile88(x, y, R88_NAMETABLE,
-            tilePalette.data(), tileData, paletteBGR, scale, scale, effects);
+    RenderPatternTableTile88(x, y, R88_NAMETABLE,
+            tilePalette.data(), patternTable, tileIndex, paletteBGR, scale, scale, effects);
 }
 
 void PPUx::RenderOAMxEntry(
@@ -316,16 +1211,14 @@ void PPUx::RenderOAMxEntry(
     int tx = oamx.X * render.Scale + render.OffX;
     int ty = oamx.Y * render.Scale + render.OffY;
 
-    const uint8_t* tileData =
-        render.PatternTables.at(oamx.PatternTableIndex) + static_cast<int>(oamx.TileIndex) * 16;
-
-    RenderTile88(tx, ty, GetSpriteRenderFlags(oamx.Attributes),
-            oamx.TilePalette.data(), tileData, render.PaletteBGR,
-            render.Scale, render.Scale, effects);
+    RenderPatternTableTile88(tx, ty, GetSpriteRenderFlags(oamx.Attributes),
+            oamx.TilePalette.data(), render.PatternTables.at(oamx.PatternTableIndex), oamx.TileIndex,
+            render.PaletteBGR, render.Scale, render.Scale, effects);
 }
 
 void PPUx::RenderNametableX(
-        const Nametablex& ntx, const RenderInfo& render, const EffectInfo& effects)
+        const Nametablex& ntx, const RenderInfo& render, const EffectInfo& effects,
+        const NametableOverlay* overlay)
 {
     int tx = ntx.X * render.Scale + render.OffX;
     int ty = ntx.Y * render.Scale + render.OffY;
@@ -333,7 +1226,7 @@ void PPUx::RenderNametableX(
     RenderNametable(tx, ty, nes::NAMETABLE_WIDTH_BYTES, nes::NAMETABLE_HEIGHT_BYTES,
             ntx.NametableP->data(), ntx.NametableP->data() + nes::NAMETABLE_ATTRIBUTE_OFFSET,
             render.PatternTables.at(ntx.PatternTableIndex), ntx.FramePalette.data(),
-            render.PaletteBGR, render.Scale, effects);
+            render.PaletteBGR, render.Scale, effects, overlay);
 }
 
 void PPUx::RenderNametable(int x, int y, int width, int height,
@@ -341,14 +1234,23 @@ void PPUx::RenderNametable(int x, int y, int width, int height,
         const uint8_t* patternTable,
         const uint8_t* framePalette,
         const uint8_t* paletteBGR,
-        int scale, const EffectInfo& effects)
+        int scale, const EffectInfo& effects,
+        const NametableOverlay* overlay)
 {
-//    if (overrides) {
-//        if (width != nes::NAMETABLE_WIDTH_BYTES || height !=  nes::NAMETABLE_HEIGHT_BYTES ||
-//                attrStart != tileStart + nes::NAMETABLE_ATTRIBUTE_OFFSET) {
-//            throw std::invalid_argument("unfortunately you need to change how nametableoverridesx offsets are used");
-//        }
-//    }
+    if (overlay && overlay->Empty()) {
+        overlay = nullptr;
+    }
+    if (overlay) {
+        if (width != nes::NAMETABLE_WIDTH_BYTES || height !=  nes::NAMETABLE_HEIGHT_BYTES ||
+                attrStart != tileStart + nes::NAMETABLE_ATTRIBUTE_OFFSET) {
+            throw std::invalid_argument("PPUx::RenderNametable, an overlay needs a full nametable");
+        }
+    }
+
+    DecodedPatternTablePtr decoded;
+    if (!m_ReferenceRendering) {
+        decoded = DecodedFor(patternTable);
+    }
 
     for (int iy = 0; iy < height; iy++) {
         int ty = y + iy * 8 * scale;
@@ -365,25 +1267,108 @@ void PPUx::RenderNametable(int x, int y, int width, int height,
             int attrOffset = cy * (width / 4) + cx;
 
             uint8_t attr = *(attrStart + attrOffset);
+            uint8_t tile = *(tileStart + tileOffset);
+            if (overlay) {
+                attr = overlay->Get(nes::NAMETABLE_ATTRIBUTE_OFFSET + attrOffset, attr);
+                tile = overlay->Get(tileOffset, tile);
+            }
             attr >>= (bx + by * 2) * 2;
 
-            uint8_t tile = *(tileStart + tileOffset);
+            if (decoded) {
+                std::array<uint8_t, 4> tilePalette;
+                tilePalette[0] = framePalette[0];
+                const uint8_t* thisPalette = framePalette + (attr & 0b00000011) * 4;
+                for (int i = 1; i < 4; i++) {
+                    tilePalette[i] = thisPalette[i];
+                }
+                BlitTile88(tx, ty, R88_NAMETABLE, tilePalette.data(), decoded->Tile(tile, false, false),
+                        paletteBGR, scale, scale, effects);
+            } else {
+                RenderNametableEntry(tx, ty, tile, attr,
+                        patternTable, framePalette, paletteBGR, scale, effects);
+            }
+        }
+    }
+}
 
-//            if (overrides) {
-//                auto attrOversIt = overrides->find(tileOffset + nes::NAMETABLE_ATTRIBUTE_OFFSET);
-//                if (attrOversIt != overrides->end()) {
-//                    auto it = std::max_element(attrOversIt->begin(), attrOversIt->end(),
-//                        [&](const std::pair<uint8_t, float>& l, const std::pair<uint8_t, float>& r){
-//                            return l.second < r.second;
-//                        });
-//
-//
-//                }
-//
-//            }
+void PPUx::BlitNametableImage(int x, int y, int scale,
+        const uint8_t* bgr, const uint8_t* backgroundMask,
+        const std::bitset<NAMETABLE_ATTRIBUTE_OFFSET>* skipTiles,
+        const EffectInfo& effects)
+{
+    if (m_OutputFormat != PPUxOutputFormat::BGR || effects.Opacity != 1.0f) {
+        throw std::invalid_argument("PPUx::BlitNametableImage, only opaque into BGR");
+    }
+    if (scale <= 0) {
+        throw std::runtime_error("invalid scale to PPUx::BlitNametableImage");
+    }
+    int tileSize = 8 * scale;
+    int width = NAMETABLE_WIDTH_BYTES * tileSize;
+    int height = NAMETABLE_HEIGHT_BYTES * tileSize;
+
+    // Same rules as BlitTile88
+    int x0 = std::max(x, 0);
+    int x1 = std::min(x + width, m_Width);
+    int y0 = std::max(y, 0);
+    int y1 = std::min(y + height, m_Height);
+    if (effects.CropWithin) {
+        x0 = std::max(x0, effects.Crop.X);
+        x1 = std::min(x1, effects.Crop.X + effects.Crop.Width + 1);
+        y0 = std::max(y0, effects.Crop.Y);
+        y1 = std::min(y1, effects.Crop.Y + effects.Crop.Height + 1);
+    }
+    if (x0 >= x1 || y0 >= y1) {
+        return;
+    }
 
-            RenderNametableEntry(tx, ty, tile, attr,
-                    patternTable, framePalette, paletteBGR, scale, effects);
+    uint8_t alpha = AlphaFor(effects);
+    bool deferred = DeferredAlpha();
+    bool priority = PriorityEnabled();
+    if (priority && m_PriorityInfo.size() != RequiredPriorityInfoDataSize(m_Width, m_Height)) {
+        ResetPriority();
+    }
+
+    for (int ty = y0; ty < y1; ty++) {
+        int sy = ty - y;
+        int tileRow = sy / tileSize;
+        if (priority) {
+            MarkPriorityDirty(x0, x1, ty);
+        }
+
+        // Runs of tiles that aren't skipped
+        int px = x0;
+        while (px < x1) {
+            int column = (px - x) / tileSize;
+            int end = std::min(x + (column + 1) * tileSize, x1);
+            if (skipTiles && skipTiles->test(tileRow * NAMETABLE_WIDTH_BYTES + column)) {
+                px = end;
+                continue;
+            }
+            while (end < x1 && !(skipTiles &&
+                        skipTiles->test(tileRow * NAMETABLE_WIDTH_BYTES + (end - x) / tileSize))) {
+                end = std::min(end + tileSize, x1);
+            }
+
+            int n = end - px;
+            size_t i = static_cast<size_t>(ty) * m_Width + static_cast<size_t>(px);
+            size_t si = static_cast<size_t>(sy) * width + static_cast<size_t>(px - x);
+            std::memcpy(m_BGROut + i * 3, bgr + si * 3, n * 3);
+            if (deferred) {
+                std::memset(m_Alpha.data() + i, alpha, n);
+            }
+            if (priority) {
+                uint8_t* pri = m_PriorityInfo.data() + i;
+                const uint8_t* mask = backgroundMask + si;
+                for (int k = 0; k < n; k++) {
+                    if (mask[k]) {
+                        pri[k] = PPUPRI_BG;
+                    }
+                    if (m_Outlining) {
+                        pri[k] |= PPUPRI_TO_OUTLINE;
+                    }
+                }
+            }
+            px = end;
         }
     }
 }
@@ -399,13 +1384,12 @@ void PPUx::BeginOutline()
 void PPUx::ClearStrokePriority()
 {
     m_Outlining = false;
-    int ix = 0;
-    for (int y = 0; y < m_Height; y++) {
-        for (int x = 0; x < m_Width; x++) {
-            m_PriorityInfo[ix] &= PPUPRI_AFTER_OUTLINE;
-            ix++;
+    ForEachDirtyPriorityRow([&](int x, int y, int w){
+        uint8_t* pri = m_PriorityInfo.data() + static_cast<size_t>(y) * m_Width + x;
+        for (int k = 0; k < w; k++) {
+            pri[k] &= PPUPRI_AFTER_OUTLINE;
         }
-    }
+    });
 }
 
 
@@ -414,11 +1398,12 @@ void PPUx::DoStrokeOutline(const std::vector<Offset>& offsets, uint8_t paletteIn
     if (m_PriorityInfo.empty()) return;
 
     // TODO: this could be optimized... (especially with 'x'
-    const uint8_t* bgr = paletteBGR + paletteIndex * 3;
+    const uint8_t* bgr = PixelValue(paletteBGR, &paletteIndex);
 
-    int ix = 0;
-    for (int y = 0; y < m_Height; y++) {
-        for (int x = 0; x < m_Width; x++) {
+    // Only dirty tiles can have anything to outline
+    ForEachDirtyPriorityRow([&](int x0, int y, int w){
+        int ix = y * m_Width + x0;
+        for (int x = x0; x < x0 + w; x++, ix++) {
             if (m_PriorityInfo[ix] & PPUPRI_TO_OUTLINE) {
                 for (auto [dx, dy, off] : offsets) {
                     int tx = x + dx;
@@ -426,21 +1411,188 @@ void PPUx::DoStrokeOutline(const std::vector<Offset>& offsets, uint8_t paletteIn
 
                     if (tx >= 0 && tx < m_Width &&
                         ty >= 0 && ty < m_Height) {
-                        int tx = ix + off;
-                        uint8_t* out = m_BGROut + tx * 3;
-                        if (((m_PriorityInfo[tx] == PPUPRI_NONE) || (m_PriorityInfo[tx] & PPUPRI_BG)) &&
-                            !(m_PriorityInfo[tx] & PPUPRI_OUTLINED)) {
-
-                            m_PriorityInfo[tx] |= PPUPRI_OUTLINED;
-                            for (int i = 0; i < 3; i++) {
+                        int ti = ix + off;
+                        uint8_t* out = m_BGROut + ti * m_PixelSize;
+                        if (((m_PriorityInfo[ti] == PPUPRI_NONE) || (m_PriorityInfo[ti] & PPUPRI_BG)) &&
+                            !(m_PriorityInfo[ti] & PPUPRI_OUTLINED)) {
+
+                            MarkPriorityDirty(tx, tx + 1, ty);
+                            m_PriorityInfo[ti] |= PPUPRI_OUTLINED;
+                            for (int i = 0; i < m_PixelSize; i++) {
                                 *(out + i) = *(bgr + i);
                             }
+                            if (DeferredAlpha()) {
+                                m_Alpha[ti] = 0xff;
+                            }
                         }
                     }
                 }
             }
+        }
+    });
+    ClearStrokePriority();
+}
+
+void PPUx::DoStrokeOutlineTransform(const std::vector<Offset>& offsets, bool rounded,
+        float outlineRadius, int mr, uint8_t paletteIndex, const uint8_t* paletteBGR)
+{
+    if (m_PriorityInfo.empty()) return;
+
+    const uint8_t* bgr = PixelValue(paletteBGR, &paletteIndex);
+
+    // Bounding box of the pixels to outline
+    int minx = m_Width, maxx = -1;
+    int miny = m_Height, maxy = -1;
+    ForEachDirtyPriorityRow([&](int x0, int y, int w){
+        const uint8_t* pri = m_PriorityInfo.data() + static_cast<size_t>(y) * m_Width + x0;
+        for (int k = 0; k < w; k++) {
+            if (pri[k] & PPUPRI_TO_OUTLINE) {
+                minx = std::min(minx, x0 + k);
+                maxx = std::max(maxx, x0 + k);
+                miny = std::min(miny, y);
+                maxy = std::max(maxy, y);
+            }
+        }
+    });
+    if (maxx < 0) {
+        ClearStrokePriority();
+        return;
+    }
+
+    int bx0 = std::max(minx - mr, 0);
+    int bx1 = std::min(maxx + mr + 1, m_Width);
+    int by0 = std::max(miny - mr, 0);
+    int by1 = std::min(maxy + mr + 1, m_Height);
+    int bw = bx1 - bx0;
+    int bh = by1 - by0;
+    auto isSource = [&](int x, int y){
+        return m_PriorityInfo[static_cast<size_t>(y + by0) * m_Width + x + bx0] & PPUPRI_TO_OUTLINE;
+    };
+
+    // Distance to the nearest source along a line of n pixels, both ways
+    const int INF = bw * bw + bh * bh + 1;
+    auto lineDistance = [&](int n, auto&& source, auto&& get, auto&& set){
+        int d = INF;
+        for (int k = 0; k < n; k++) {
+            d = source(k) ? 0 : std::min(d + 1, INF);
+            set(k, d);
+        }
+        d = INF;
+        for (int k = n - 1; k >= 0; k--) {
+            d = source(k) ? 0 : std::min(d + 1, INF);
+            set(k, std::min(get(k), d));
+        }
+    };
+
+    std::vector<int>& dist = m_OutlineDistance;
+    dist.assign(static_cast<size_t>(bw) * bh, INF);
+    if (rounded) {
+        // Squared distance along each column, then the lower envelope of
+        // parabolas along each row
+        for (int x = 0; x < bw; x++) {
+            lineDistance(bh,
+                    [&](int y){ return isSource(x, y); },
+                    [&](int y){ return dist[y * bw + x]; },
+                    [&](int y, int d){ dist[y * bw + x] = d; });
+            for (int y = 0; y < bh; y++) {
+                int& d = dist[y * bw + x];
+                d = (d >= INF) ? INF : d * d;
+            }
+        }
+
+        std::vector<int> f(bw), v(bw);
+        std::vector<double> z(bw + 1);
+        for (int y = 0; y < bh; y++) {
+            int* row = dist.data() + y * bw;
+            std::copy(row, row + bw, f.begin());
+
+            auto intersect = [&](int q, int p){
+                return (static_cast<double>(f[q] + q * q) - static_cast<double>(f[p] + p * p)) /
+                    static_cast<double>(2 * (q - p));
+            };
+            int k = -1;
+            for (int q = 0; q < bw; q++) {
+                if (f[q] >= INF) continue;
+                double s = -std::numeric_limits<double>::infinity();
+                if (k >= 0) {
+                    s = intersect(q, v[k]);
+                    while (s <= z[k]) {
+                        k--;
+                        s = intersect(q, v[k]);
+                    }
+                }
+                k++;
+                v[k] = q;
+                z[k] = s;
+                z[k + 1] = std::numeric_limits<double>::infinity();
+            }
+            if (k < 0) continue;
+
+            k = 0;
+            for (int q = 0; q < bw; q++) {
+                while (z[k + 1] < q) k++;
+                row[q] = (q - v[k]) * (q - v[k]) + f[v[k]];
+            }
+        }
+    } else {
+        // Distance along each row, then along each column to the nearest row
+        // that is within mr
+        for (int y = 0; y < bh; y++) {
+            lineDistance(bw,
+                    [&](int x){ return isSource(x, y); },
+                    [&](int x){ return dist[y * bw + x]; },
+                    [&](int x, int d){ dist[y * bw + x] = d; });
+        }
+        std::vector<int> col(bh);
+        for (int x = 0; x < bw; x++) {
+            lineDistance(bh,
+                    [&](int y){ return dist[y * bw + x] <= mr; },
+                    [&](int y){ return col[y]; },
+                    [&](int y, int d){ col[y] = d; });
+            for (int y = 0; y < bh; y++) {
+                dist[y * bw + x] = col[y];
+            }
+        }
+    }
+
+    float f = outlineRadius * outlineRadius;
+    for (int y = 0; y < bh; y++) {
+        for (int x = 0; x < bw; x++) {
+            int tx = x + bx0;
+            int ty = y + by0;
+            size_t i = static_cast<size_t>(ty) * m_Width + tx;
+            uint8_t pri = m_PriorityInfo[i];
+            if ((pri & PPUPRI_OUTLINED) || !((pri == PPUPRI_NONE) || (pri & PPUPRI_BG))) {
+                continue;
+            }
+
+            bool within;
+            if (pri & PPUPRI_TO_OUTLINE) {
+                // The transform counts the pixel itself, it needs another
+                within = false;
+                for (auto [dx, dy, off] : offsets) {
+                    int sx = tx + dx;
+                    int sy = ty + dy;
+                    if (sx >= 0 && sx < m_Width && sy >= 0 && sy < m_Height &&
+                        (m_PriorityInfo[i + off] & PPUPRI_TO_OUTLINE)) {
+                        within = true;
+                        break;
+                    }
+                }
+            } else if (rounded) {
+                within = static_cast<float>(dist[y * bw + x]) <= f;
+            } else {
+                within = dist[y * bw + x] <= mr;
+            }
 
-            ix++;
+            if (within) {
+                MarkPriorityDirty(tx, tx + 1, ty);
+                m_PriorityInfo[i] |= PPUPRI_OUTLINED;
+                std::memcpy(m_BGROut + i * m_PixelSize, bgr, m_PixelSize);
+                if (DeferredAlpha()) {
+                    m_Alpha[i] = 0xff;
+                }
+            }
         }
     }
     ClearStrokePriority();
@@ -460,7 +1612,11 @@ void PPUx::StrokeOutlineX(float outlineRadius, uint8_t paletteIndex, const uint8
                 offsets.push_back(off);
             }
         }
-        DoStrokeOutline(offsets, paletteIndex, paletteBGR);
+        if (m_ReferenceRendering) {
+            DoStrokeOutline(offsets, paletteIndex, paletteBGR);
+        } else {
+            DoStrokeOutlineTransform(offsets, false, outlineRadius, mr, paletteIndex, paletteBGR);
+        }
     }
 }
 
@@ -487,7 +1643,12 @@ void PPUx::StrokeOutlineO(float outlineRadius, uint8_t paletteIndex, const uint8
         }
     }
 
-    DoStrokeOutline(offsets, paletteIndex, paletteBGR);
+    // Negative (or nan) radii make for odd offsets, leave them to the original
+    if (m_ReferenceRendering || !(outlineRadius >= 0.0f)) {
+        DoStrokeOutline(offsets, paletteIndex, paletteBGR);
+    } else {
+        DoStrokeOutlineTransform(offsets, true, outlineRadius, mr, paletteIndex, paletteBGR);
+    }
 }
 
 void PPUx::RenderHardcodedSprite(int x, int y, std::vector<std::vector<uint8_t>> pixels,
@@ -498,8 +1659,7 @@ void PPUx::RenderHardcodedSprite(int x, int y, std::vector<std::vector<uint8_t>>
         int c = 0;
         for (auto & pix : row) {
             if (pix != 0x00) {
-                const uint8_t* bgr = paletteBGR + (pix * 3);
-                PutPixel(x + c, y + r, bgr, false, true, false, false, effects);
+                PutPixel(x + c, y + r, PixelValue(paletteBGR, &pix), false, true, false, false, effects);
             }
 
             c++;
@@ -513,22 +1673,116 @@ void PPUx::RenderPaletteData(int x, int y, int width, int height, const uint8_t*
         const uint8_t* paletteBGR, RenderPaletteDataFlags flags,
         const EffectInfo& effects)
 {
+    uint8_t alpha = AlphaFor(effects);
+    if (m_ReferenceRendering) {
+        for (int dy = 0; dy < height; dy++) {
+            for (int dx = 0; dx < width; dx++) {
+                uint8_t paletteIndex = data[dy * width + dx];
+                if ((flags & RPD_AS_SPRITE) || (flags & RPD_AS_NAMETABLE)) {
+                    if (paletteIndex == 0x00) continue;
+                }
+
+                PutPixel(x + dx, y + dy, PixelValue(paletteBGR, data + dy * width + dx), flags == RPD_PLACE_PIXELS_DIRECT,
+                        flags & RPD_AS_SPRITE,
+                        flags & RPD_SPRITE_PRIORITY,
+                        flags & RPD_AS_NAMETABLE, effects);
+            }
+        }
+        return;
+    }
+
+    // The columns that may be written, same rules as PutPixel
+    int x0 = std::max(x, 0);
+    int x1 = std::min(x + width, m_Width);
+    if (effects.CropWithin) {
+        x0 = std::max(x0, effects.Crop.X);
+        x1 = std::min(x1, effects.Crop.X + effects.Crop.Width + 1);
+    }
+    if (x0 >= x1) {
+        return;
+    }
+    int n = x1 - x0;
+
+    bool skipZero = (flags & RPD_AS_SPRITE) || (flags & RPD_AS_NAMETABLE);
+    bool priority = flags != RPD_PLACE_PIXELS_DIRECT && PriorityEnabled();
+    if (priority && m_PriorityInfo.size() != RequiredPriorityInfoDataSize(m_Width, m_Height)) {
+        ResetPriority();
+    }
+    bool opaque = effects.Opacity == 1.0f;
+    bool deferred = DeferredAlpha();
+    int ps = m_PixelSize;
+    m_RowBGR.resize(n * ps);
 
     for (int dy = 0; dy < height; dy++) {
-        for (int dx = 0; dx < width; dx++) {
-            const uint8_t* bgr = paletteBGR + (*data * 3);
-            if ((flags & RPD_AS_SPRITE) || (flags & RPD_AS_NAMETABLE)) {
-                if (*data == 0x00) continue;
+        int ty = y + dy;
+        if (ty < 0) continue;
+        if (ty >= m_Height) break;
+
+        const uint8_t* row = data + dy * width + (x0 - x);
+        size_t i = static_cast<size_t>(ty) * m_Width + static_cast<size_t>(x0);
+        if (priority) {
+            MarkPriorityDirty(x0, x1, ty);
+        }
+        uint8_t* out = m_BGROut + i * ps;
+        uint8_t* src = m_RowBGR.data();
+        for (int k = 0; k < n; k++, i++) {
+            uint8_t paletteIndex = row[k];
+            bool write = !(skipZero && paletteIndex == 0);
+            if (write && priority) {
+                write = UpdatePixelPriority(i, flags & RPD_AS_SPRITE, flags & RPD_SPRITE_PRIORITY,
+                        flags & RPD_AS_NAMETABLE, opaque);
+            }
+
+            const uint8_t* bgr = write ? PixelValue(paletteBGR, row + k) : out + k * ps;
+            if (opaque || deferred) {
+                if (write) {
+                    std::memcpy(out + k * ps, bgr, ps);
+                    if (deferred) {
+                        m_Alpha[i] = alpha;
+                    }
+                }
+            } else {
+                std::memcpy(src + k * ps, bgr, ps);
+            }
+        }
+        if (!opaque && !deferred) {
+            BlendBGR(out, src, n * ps, alpha);
+        }
+    }
+}
+
+bool PPUx::UpdatePixelPriority(size_t i, bool isSprite, bool spritePriority, bool isBackground, bool opaque)
+{
+    uint8_t& pri = m_PriorityInfo[i];
+    if (isSprite) {
+        uint8_t entry = pri;
+        if (opaque) {
+            if (!m_SpritePriorityGlitch && spritePriority && entry != PPUPRI_NONE) {
+                return false;
+            } else {
+                pri = PPUPRI_SPR;
             }
+        }
 
-            // todo i think there are bugs here
-            PutPixel(x + dx, y + dy, bgr, flags == RPD_PLACE_PIXELS_DIRECT,
-                    flags & RPD_AS_SPRITE,
-                    flags & RPD_SPRITE_PRIORITY,
-                    flags & RPD_AS_NAMETABLE, effects);
-            data++;
+        if (spritePriority) { // behind background
+            if (entry != PPUPRI_NONE) {
+                return false;
+            }
+        } else {
+            if (entry & PPUPRI_SPR) {
+                return false;
+            }
         }
+    } else {
+        if (isBackground) {
+            pri = PPUPRI_BG;
+        }
+    }
+
+    if (m_Outlining) {
+        pri |= PPUPRI_TO_OUTLINE;
     }
+    return true;
 }
 
 void PPUx::PutPixel(int x, int y, const uint8_t* bgr,
@@ -543,55 +1797,30 @@ void PPUx::PutPixel(int x, int y, const uint8_t* bgr,
     }
 
     size_t i = static_cast<size_t>(y) * m_Width + static_cast<size_t>(x);
-    if (!overridePriority) {
-        bool priorityenabled = PriorityEnabled();
-        if (priorityenabled) {
-            if (m_PriorityInfo.size() != RequiredPriorityInfoDataSize(m_Width, m_Height)) {
-                ResetPriority();
-            }
-            if (isSprite) {
-                auto entry = m_PriorityInfo[i];
-                if (effects.Opacity == 1.0f) {
-                    if (!m_SpritePriorityGlitch && spritePriority && entry != PPUPRI_NONE) {
-                        return;
-                    } else {
-                        m_PriorityInfo[i] = PPUPRI_SPR;
-                    }
-                }
-
-                if (spritePriority) { // behind background
-                    if (entry != PPUPRI_NONE) {
-                        return;
-                    }
-                } else {
-                    if (entry & PPUPRI_SPR) {
-                        return;
-                    }
-                }
-            } else {
-                if (isBackground) {
-                    m_PriorityInfo[i] = PPUPRI_BG;
-                }
-            }
+    if (!overridePriority && PriorityEnabled()) {
+        if (m_PriorityInfo.size() != RequiredPriorityInfoDataSize(m_Width, m_Height)) {
+            ResetPriority();
         }
-
-        if (m_Outlining && priorityenabled) {
-            m_PriorityInfo[i] |= PPUPRI_TO_OUTLINE;
+        MarkPriorityDirty(x, x + 1, y);
+        if (!UpdatePixelPriority(i, isSprite, spritePriority, isBackground, effects.Opacity == 1.0f)) {
+            return;
         }
     }
 
-    if (effects.Opacity != 1.0f) {
+    if (effects.Opacity != 1.0f && !DeferredAlpha()) {
         uint8_t* dat = m_BGROut + (y * m_Width * 3) + (x * 3);
+        uint8_t alpha = AlphaFor(effects);
         for (int v = 0; v < 3; v++) {
-            *(dat + v) = static_cast<uint8_t>(
-                    static_cast<float>(*(dat + v)) * 1.0f - effects.Opacity +
-                    static_cast<float>(*(bgr + v)) * effects.Opacity);
+            *(dat + v) = BlendChannel(*(dat + v), *(bgr + v), alpha);
         }
     } else {
-        uint8_t* dat = m_BGROut + (y * m_Width * 3) + (x * 3);
-        for (int v = 0; v < 3; v++) {
+        uint8_t* dat = m_BGROut + i * m_PixelSize;
+        for (int v = 0; v < m_PixelSize; v++) {
             *(dat + v) = *(bgr + v);
         }
+        if (DeferredAlpha()) {
+            m_Alpha[i] = AlphaFor(effects);
+        }
     }
 }
 
@@ -601,9 +1830,15 @@ void PPUx::RenderString(int x, int y,
 {
     Render88Flags flags = Render88Flags::R88_IS_SPRITE;
 
+    if (!m_ReferenceRendering) {
+        BlitTextSprite(x, y, *GetTextSprite(DecodedFor(patternTable), str, false),
+                tilePalette, paletteBGR, scale, scale, effects);
+        return;
+    }
+
     for (auto c : str) {
-        const uint8_t* tileData = patternTable + static_cast<int>(c) * 16;
-        RenderTile88(x, y, flags, tilePalette, tileData, paletteBGR, scale, scale, effects);
+        RenderPatternTableTile88(x, y, flags, tilePalette, patternTable, static_cast<uint8_t>(c),
+                paletteBGR, scale, scale, effects);
 
         x += 8 * scale;
     }
@@ -615,52 +1850,92 @@ void PPUx::RenderStringX(int x, int y,
 {
     Render88Flags flags = Render88Flags::R88_IS_SPRITE;
 
+    if (!m_ReferenceRendering) {
+        BlitTextSprite(x, y, *GetTextSprite(DecodedFor(patternTable), strx, true),
+                tilePalette, paletteBGR, scalx, scaly, effects);
+        return;
+    }
 
     int sx = x;
     for (auto c : strx) {
         if (static_cast<int>(c) == -61) {
-            static std::array<uint8_t, 16> dat = {
-                0b11000110,
-                0b00000000,
-                0b11000110,
-                0b11000110,
-                0b11000110,
-                0b11000110,
-                0b01111100,
-                0b00000000,
-                0b00000000,
-                0b00000000,
-                0b00000000,
-                0b00000000,
-                0b00000000,
-                0b00000000,
-                0b00000000,
-                0b00000000,
-            };
-            RenderTile88(x, y, flags, tilePalette, dat.data(), paletteBGR, scalx, scaly, effects);
+            RenderTile88(x, y, flags, tilePalette, STRINGX_U_UMLAUT.data(), paletteBGR, scalx, scaly, effects);
             x += 8 * scalx;
         }
         if (static_cast<int>(c) < 0) {
             continue;
         }
-
         if (c == '\n') {
             y += 8 * scaly;
             x = sx;
         } else {
-            const uint8_t* tileData = patternTable + static_cast<int>(c) * 16;
-            RenderTile88(x, y, flags, tilePalette, tileData, paletteBGR, scalx, scaly, effects);
+            RenderPatternTableTile88(x, y, flags, tilePalette, patternTable, static_cast<uint8_t>(c),
+                    paletteBGR, scalx, scaly, effects);
 
             x += 8 * scalx;
         }
     }
 }
 
+void PPUx::BlitTextSprite(int x, int y, const TextSprite& sprite,
+        const uint8_t* tilePalette, const uint8_t* paletteBGR,
+        int scalx, int scaly, const EffectInfo& effects)
+{
+    for (auto& line : sprite.Lines) {
+        if (line.Columns > 0) {
+            BlitTile88(x, y, Render88Flags::R88_IS_SPRITE, tilePalette, line.Pixels.data(),
+                    paletteBGR, scalx, scaly, effects, line.Columns);
+        }
+        y += 8 * scaly;
+    }
+}
+
 void PPUx::SetSpritePriorityGlitch(bool value)
 {
     m_SpritePriorityGlitch = value;
 }
 
+bool PPUx::GetSpritePriorityGlitch() const
+{
+    return m_SpritePriorityGlitch;
+}
+
+void PPUx::Execute(const PPUxCommandList& list, int offsetY)
+{
+    std::vector<const uint8_t*> patternTables;
+    for (auto& c : list.GetCommands()) {
+        if (c.PatternTable) {
+            patternTables.push_back(c.PatternTable);
+        }
+    }
+    std::sort(patternTables.begin(), patternTables.end());
+    patternTables.erase(std::unique(patternTables.begin(), patternTables.end()), patternTables.end());
+
+    m_BoundPatternTables.clear();
+    if (!m_ReferenceRendering) {
+        for (auto patternTable : patternTables) {
+            m_BoundPatternTables.emplace_back(patternTable, GetDecodedPatternTable(patternTable));
+        }
+    }
+    try {
+        list.Replay(this, offsetY);
+    } catch (...) {
+        m_BoundPatternTables.clear();
+        throw;
+    }
+    m_BoundPatternTables.clear();
+}
+
+void PPUx::SetReferenceRendering(bool value)
+{
+    m_ReferenceRendering = value;
+}
+
+bool PPUx::GetReferenceRendering() const
+{
+    return m_ReferenceRendering;
+}
+
 void PPUx::DrawBorderedBox(
         int x, int y, int w, int h,
         std::array<uint8_t, 9> paletteEntries,
@@ -693,8 +1968,7 @@ void PPUx::DrawBorderedBox(
             }
 
 
-            const uint8_t* bgr = paletteBGR + (t * 3);
-            PutPixel(x + ix, y + iy, bgr, false, true, false, false, effects);
+            PutPixel(x + ix, y + iy, PixelValue(paletteBGR, &t), false, true, false, false, effects);
         }
     }
 }
@@ -702,6 +1976,8 @@ void PPUx::DrawBorderedBox(
 
 std::vector<uint8_t>& PPUx::GetPriorityInfo()
 {
+    // The caller may write anywhere
+    m_PriorityAllDirty = true;
     return m_PriorityInfo;
 }
 
@@ -710,7 +1986,21 @@ void PPUx::CopyPriorityTo(PPUx* other)
     assert(other->GetWidth() == GetWidth());
     assert(other->GetHeight() == GetHeight());
 
-    other->GetPriorityInfo() = GetPriorityInfo();
+    size_t n = RequiredPriorityInfoDataSize(m_Width, m_Height);
+    if (m_PriorityAllDirty || m_PriorityInfo.size() != n ||
+            other->m_PriorityInfo.size() != n || other->m_PriorityStatus != PPUxPriorityStatus::ENABLED) {
+        other->GetPriorityInfo() = m_PriorityInfo;
+        return;
+    }
+
+    // Everything outside of the dirty tiles is PPUPRI_NONE on both sides
+    // after the reset
+    other->ResetPriority();
+    ForEachDirtyPriorityRow([&](int x, int y, int w){
+        size_t i = static_cast<size_t>(y) * m_Width + x;
+        std::memcpy(other->m_PriorityInfo.data() + i, m_PriorityInfo.data() + i, w);
+        other->MarkPriorityDirty(x, x + w, y);
+    });
 }
 
 PPUxPriorityStatus PPUx::GetPriorityStatus() const {
@@ -719,3 +2009,399 @@ PPUxPriorityStatus PPUx::GetPriorityStatus() const {
 void PPUx::SetPriorityStatus(PPUxPriorityStatus status) {
     m_PriorityStatus = status;
 }
+
+////////////////////////////////////////////////////////////////////////////////
+
+static constexpr int ALL_ROWS_TOP = std::numeric_limits<int>::min();
+static constexpr int ALL_ROWS_BOTTOM = std::numeric_limits<int>::max();
+
+// Rows of text, for how far down a string can draw
+static int StringLines(const std::string& str)
+{
+    return 1 + static_cast<int>(std::count(str.begin(), str.end(), '\n'));
+}
+
+// 64 bit FNV-1a
+static void HashBytes(uint64_t* hash, const void* data, size_t n)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < n; i++) {
+        *hash ^= p[i];
+        *hash *= 0x100000001b3ULL;
+    }
+}
+
+template <typename T>
+static void HashValue(uint64_t* hash, const T& value)
+{
+    HashBytes(hash, &value, sizeof(value));
+}
+
+PPUxCommandList::PPUxCommandList()
+    : m_MaxOutlineRadius(0.0f)
+{
+}
+
+PPUxCommandList::~PPUxCommandList()
+{
+}
+
+void PPUxCommandList::Clear()
+{
+    m_Commands.clear();
+    m_MaxOutlineRadius = 0.0f;
+}
+
+const std::vector<PPUxCommand>& PPUxCommandList::GetCommands() const
+{
+    return m_Commands;
+}
+
+float PPUxCommandList::GetMaxOutlineRadius() const
+{
+    return m_MaxOutlineRadius;
+}
+
+uint64_t PPUxCommandList::Hash() const
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    // Pattern tables are big and shared by most commands, hashed once each
+    std::unordered_map<const uint8_t*, uint64_t> patternTables;
+
+    for (auto& c : m_Commands) {
+        HashValue(&hash, c.Type);
+        HashValue(&hash, c.X);
+        HashValue(&hash, c.Y);
+        HashValue(&hash, c.Width);
+        HashValue(&hash, c.Height);
+        HashValue(&hash, c.ScaleX);
+        HashValue(&hash, c.ScaleY);
+        HashValue(&hash, c.TileIndex);
+        HashValue(&hash, c.Attributes);
+        HashValue(&hash, c.PaletteIndex);
+        HashValue(&hash, c.OutlineWidth);
+        HashValue(&hash, c.OutlineRadius);
+        HashBytes(&hash, c.Palette.data(), c.Palette.size());
+        HashValue(&hash, c.Text.size());
+        HashBytes(&hash, c.Text.data(), c.Text.size());
+        HashValue(&hash, c.Effects.Opacity);
+        HashValue(&hash, c.Effects.CropWithin);
+        HashValue(&hash, c.Effects.Crop.X);
+        HashValue(&hash, c.Effects.Crop.Y);
+        HashValue(&hash, c.Effects.Crop.Width);
+        HashValue(&hash, c.Effects.Crop.Height);
+
+        if (c.PatternTable) {
+            auto it = patternTables.find(c.PatternTable);
+            if (it == patternTables.end()) {
+                uint64_t h = 0xcbf29ce484222325ULL;
+                HashBytes(&h, c.PatternTable, PATTERNTABLE_SIZE);
+                it = patternTables.emplace(c.PatternTable, h).first;
+            }
+            HashValue(&hash, it->second);
+        }
+
+        size_t paletteEntries = PALETTE_ENTRIES;
+        if (c.Type == PPUxCommandType::NAMETABLE && c.Width > 0 && c.Height > 0) {
+            HashBytes(&hash, c.Data, static_cast<size_t>(c.Width) * c.Height);
+            // The furthest attribute byte RenderNametable reads
+            size_t attributes = static_cast<size_t>((c.Height - 1) / 4) * (c.Width / 4) + (c.Width - 1) / 4 + 1;
+            HashBytes(&hash, c.AttrData, attributes);
+        } else if (c.Type == PPUxCommandType::PALETTE_DATA && c.Width > 0 && c.Height > 0) {
+            size_t n = static_cast<size_t>(c.Width) * c.Height;
+            HashBytes(&hash, c.Data, n);
+            paletteEntries = static_cast<size_t>(*std::max_element(c.Data, c.Data + n)) + 1;
+        }
+        if (c.PaletteBGR) {
+            HashBytes(&hash, c.PaletteBGR, paletteEntries * 3);
+        }
+    }
+    return hash;
+}
+
+PPUxCommand& PPUxCommandList::Add(PPUxCommandType type, int top, int bottom)
+{
+    PPUxCommand& c = m_Commands.emplace_back();
+    c.Type = type;
+    c.X = c.Y = 0;
+    c.Width = c.Height = 0;
+    c.ScaleX = c.ScaleY = 1;
+    c.TileIndex = 0;
+    c.Attributes = 0;
+    c.PaletteIndex = 0;
+    c.OutlineWidth = 0;
+    c.OutlineRadius = 0.0f;
+    c.PatternTable = nullptr;
+    c.Data = nullptr;
+    c.AttrData = nullptr;
+    c.PaletteBGR = nullptr;
+    c.Palette.fill(0);
+    c.Effects = EffectInfo::Defaults();
+    c.Top = top;
+    c.Bottom = bottom;
+    return c;
+}
+
+void PPUxCommandList::Replay(PPUx* ppux, int offsetY) const
+{
+    for (auto& c : m_Commands) {
+        if (c.Top != ALL_ROWS_TOP &&
+                (c.Bottom + offsetY <= 0 || c.Top + offsetY >= ppux->GetHeight())) {
+            continue;
+        }
+
+        int y = c.Y + offsetY;
+        EffectInfo effects = c.Effects;
+        effects.Crop.Y += offsetY;
+
+        switch (c.Type) {
+            case PPUxCommandType::SPRITE_PRIORITY_GLITCH:
+                ppux->SetSpritePriorityGlitch(c.Attributes != 0);
+                break;
+            case PPUxCommandType::FILL_BACKGROUND:
+                if (c.Attributes) {
+                    ppux->FillBackground(c.PaletteIndex, c.PaletteBGR);
+                } else {
+                    ppux->FillBackground(c.PaletteIndex, c.PaletteBGR, effects);
+                }
+                break;
+            case PPUxCommandType::RESET_PRIORITY:
+                ppux->ResetPriority();
+                break;
+            case PPUxCommandType::RESET_SPRITE_PRIORITY_ONLY:
+                ppux->ResetSpritePriorityOnly();
+                break;
+            case PPUxCommandType::NAMETABLE:
+                ppux->RenderNametable(c.X, y, c.Width, c.Height, c.Data, c.AttrData,
+                        c.PatternTable, c.Palette.data(), c.PaletteBGR, c.ScaleX, effects);
+                break;
+            case PPUxCommandType::NAMETABLE_ENTRY:
+                ppux->RenderNametableEntry(c.X, y, c.TileIndex, c.Attributes,
+                        c.PatternTable, c.Palette.data(), c.PaletteBGR, c.ScaleX, effects);
+                break;
+            case PPUxCommandType::OAM_ENTRY:
+                ppux->RenderOAMEntry(c.X, y, c.TileIndex, c.Attributes,
+                        c.PatternTable, c.Palette.data(), c.PaletteBGR, c.ScaleX, effects);
+                break;
+            case PPUxCommandType::PALETTE_DATA:
+                ppux->RenderPaletteData(c.X, y, c.Width, c.Height, c.Data, c.PaletteBGR,
+                        static_cast<PPUx::RenderPaletteDataFlags>(c.Attributes), effects);
+                break;
+            case PPUxCommandType::STRING:
+                ppux->RenderString(c.X, y, c.Text, c.PatternTable, c.Palette.data(), c.PaletteBGR,
+                        c.ScaleX, effects);
+                break;
+            case PPUxCommandType::STRING_X:
+                ppux->RenderStringX(c.X, y, c.Text, c.PatternTable, c.Palette.data(), c.PaletteBGR,
+                        c.ScaleX, c.ScaleY, effects);
+                break;
+            case PPUxCommandType::BORDERED_BOX: {
+                std::array<uint8_t, 9> entries;
+                std::copy(c.Palette.begin(), c.Palette.begin() + 9, entries.begin());
+                ppux->DrawBorderedBox(c.X, y, c.Width, c.Height, entries, c.PaletteBGR, c.OutlineWidth);
+                break;
+            }
+            case PPUxCommandType::BEGIN_OUTLINE:
+                ppux->BeginOutline();
+                break;
+            case PPUxCommandType::STROKE_OUTLINE_O:
+                ppux->StrokeOutlineO(c.OutlineRadius, c.PaletteIndex, c.PaletteBGR);
+                break;
+            case PPUxCommandType::STROKE_OUTLINE_X:
+                ppux->StrokeOutlineX(c.OutlineRadius, c.PaletteIndex, c.PaletteBGR);
+                break;
+        }
+    }
+}
+
+void PPUxCommandList::SetSpritePriorityGlitch(bool value)
+{
+    Add(PPUxCommandType::SPRITE_PRIORITY_GLITCH, ALL_ROWS_TOP, ALL_ROWS_BOTTOM).Attributes = value ? 1 : 0;
+}
+
+void PPUxCommandList::ResetPriority()
+{
+    Add(PPUxCommandType::RESET_PRIORITY, ALL_ROWS_TOP, ALL_ROWS_BOTTOM);
+}
+
+void PPUxCommandList::ResetSpritePriorityOnly()
+{
+    Add(PPUxCommandType::RESET_SPRITE_PRIORITY_ONLY, ALL_ROWS_TOP, ALL_ROWS_BOTTOM);
+}
+
+void PPUxCommandList::FillBackground(uint8_t paletteIndex, const uint8_t* paletteBGR)
+{
+    // Not quite the same as with default effects, black and white are
+    // filled without looking at paletteBGR
+    FillBackground(paletteIndex, paletteBGR, EffectInfo::Defaults());
+    m_Commands.back().Attributes = 1;
+}
+
+void PPUxCommandList::FillBackground(uint8_t paletteIndex, const uint8_t* paletteBGR, const EffectInfo& effects)
+{
+    // Always replayed, it resets the priority everywhere
+    PPUxCommand& c = Add(PPUxCommandType::FILL_BACKGROUND, ALL_ROWS_TOP, ALL_ROWS_BOTTOM);
+    c.PaletteIndex = paletteIndex;
+    c.PaletteBGR = paletteBGR;
+    c.Effects = effects;
+}
+
+void PPUxCommandList::RenderOAMEntry(int x, int y, uint8_t tileIndex, uint8_t oamAttributes,
+        const uint8_t* patternTable, const uint8_t* framePalette, const uint8_t* paletteBGR,
+        int scale, const EffectInfo& effects)
+{
+    PPUxCommand& c = Add(PPUxCommandType::OAM_ENTRY, y, y + 8 * scale);
+    c.X = x;
+    c.Y = y;
+    c.TileIndex = tileIndex;
+    c.Attributes = oamAttributes;
+    c.PatternTable = patternTable;
+    std::copy(framePalette, framePalette + FRAMEPALETTE_SIZE, c.Palette.begin());
+    c.PaletteBGR = paletteBGR;
+    c.ScaleX = c.ScaleY = scale;
+    c.Effects = effects;
+}
+
+void PPUxCommandList::RenderNametableEntry(int x, int y, uint8_t tileIndex, uint8_t attributes,
+        const uint8_t* patternTable, const uint8_t* framePalette, const uint8_t* paletteBGR,
+        int scale, const EffectInfo& effects)
+{
+    PPUxCommand& c = Add(PPUxCommandType::NAMETABLE_ENTRY, y, y + 8 * scale);
+    c.X = x;
+    c.Y = y;
+    c.TileIndex = tileIndex;
+    c.Attributes = attributes;
+    c.PatternTable = patternTable;
+    std::copy(framePalette, framePalette + FRAMEPALETTE_SIZE, c.Palette.begin());
+    c.PaletteBGR = paletteBGR;
+    c.ScaleX = c.ScaleY = scale;
+    c.Effects = effects;
+}
+
+void PPUxCommandList::RenderNametable(int x, int y, int width, int height,
+        const uint8_t* tileStart, const uint8_t* attrStart,
+        const uint8_t* patternTable, const uint8_t* framePalette, const uint8_t* paletteBGR,
+        int scale, const EffectInfo& effects)
+{
+    PPUxCommand& c = Add(PPUxCommandType::NAMETABLE, y, y + height * 8 * scale);
+    c.X = x;
+    c.Y = y;
+    c.Width = width;
+    c.Height = height;
+    c.Data = tileStart;
+    c.AttrData = attrStart;
+    c.PatternTable = patternTable;
+    std::copy(framePalette, framePalette + FRAMEPALETTE_SIZE, c.Palette.begin());
+    c.PaletteBGR = paletteBGR;
+    c.ScaleX = c.ScaleY = scale;
+    c.Effects = effects;
+}
+
+void PPUxCommandList::RenderOAMxEntry(const OAMxEntry& oamx, const RenderInfo& render, const EffectInfo& effects)
+{
+    // As an OAM entry, with the tile palette where its attributes will find it
+    FramePalette framePalette;
+    framePalette.fill(0);
+    framePalette[0] = oamx.TilePalette[0];
+    int p = 16 + (oamx.Attributes & OAMAttributeBits::OAM_PALETTE) * 4;
+    for (int i = 1; i < 4; i++) {
+        framePalette[p + i] = oamx.TilePalette[i];
+    }
+    RenderOAMEntry(oamx.X * render.Scale + render.OffX, oamx.Y * render.Scale + render.OffY,
+            oamx.TileIndex, oamx.Attributes, render.PatternTables.at(oamx.PatternTableIndex),
+            framePalette.data(), render.PaletteBGR, render.Scale, effects);
+}
+
+void PPUxCommandList::RenderNametableX(const Nametablex& ntx, const RenderInfo& render, const EffectInfo& effects)
+{
+    RenderNametable(ntx.X * render.Scale + render.OffX, ntx.Y * render.Scale + render.OffY,
+            nes::NAMETABLE_WIDTH_BYTES, nes::NAMETABLE_HEIGHT_BYTES,
+            ntx.NametableP->data(), ntx.NametableP->data() + nes::NAMETABLE_ATTRIBUTE_OFFSET,
+            render.PatternTables.at(ntx.PatternTableIndex), ntx.FramePalette.data(),
+            render.PaletteBGR, render.Scale, effects);
+}
+
+void PPUxCommandList::RenderString(int x, int y, const std::string& str,
+        const uint8_t* patternTable, const uint8_t* tilePalette, const uint8_t* paletteBGR,
+        int scale, const EffectInfo& effects)
+{
+    PPUxCommand& c = Add(PPUxCommandType::STRING, y, y + 8 * scale);
+    c.X = x;
+    c.Y = y;
+    c.Text = str;
+    c.PatternTable = patternTable;
+    std::copy(tilePalette, tilePalette + 4, c.Palette.begin());
+    c.PaletteBGR = paletteBGR;
+    c.ScaleX = c.ScaleY = scale;
+    c.Effects = effects;
+}
+
+void PPUxCommandList::RenderStringX(int x, int y, const std::string& strX,
+        const uint8_t* patternTable, const uint8_t* tilePalette, const uint8_t* paletteBGR,
+        int scalx, int scaly, const EffectInfo& effects)
+{
+    PPUxCommand& c = Add(PPUxCommandType::STRING_X, y, y + StringLines(strX) * 8 * scaly);
+    c.X = x;
+    c.Y = y;
+    c.Text = strX;
+    c.PatternTable = patternTable;
+    std::copy(tilePalette, tilePalette + 4, c.Palette.begin());
+    c.PaletteBGR = paletteBGR;
+    c.ScaleX = scalx;
+    c.ScaleY = scaly;
+    c.Effects = effects;
+}
+
+void PPUxCommandList::RenderPaletteData(int x, int y, int width, int height, const uint8_t* data,
+        const uint8_t* paletteBGR, PPUx::RenderPaletteDataFlags flags, const EffectInfo& effects)
+{
+    PPUxCommand& c = Add(PPUxCommandType::PALETTE_DATA, y, y + height);
+    c.X = x;
+    c.Y = y;
+    c.Width = width;
+    c.Height = height;
+    c.Data = data;
+    c.PaletteBGR = paletteBGR;
+    c.Attributes = flags;
+    c.Effects = effects;
+}
+
+void PPUxCommandList::DrawBorderedBox(int x, int y, int w, int h, std::array<uint8_t, 9> paletteEntries,
+        const uint8_t* paletteBGR, int outlineWidth)
+{
+    PPUxCommand& c = Add(PPUxCommandType::BORDERED_BOX, y, y + h);
+    c.X = x;
+    c.Y = y;
+    c.Width = w;
+    c.Height = h;
+    std::copy(paletteEntries.begin(), paletteEntries.end(), c.Palette.begin());
+    c.PaletteBGR = paletteBGR;
+    c.OutlineWidth = outlineWidth;
+}
+
+void PPUxCommandList::BeginOutline()
+{
+    Add(PPUxCommandType::BEGIN_OUTLINE, ALL_ROWS_TOP, ALL_ROWS_BOTTOM);
+}
+
+void PPUxCommandList::StrokeOutlineO(float outlineRadius, uint8_t paletteIndex, const uint8_t* paletteBGR)
+{
+    PPUxCommand& c = Add(PPUxCommandType::STROKE_OUTLINE_O, ALL_ROWS_TOP, ALL_ROWS_BOTTOM);
+    c.OutlineRadius = outlineRadius;
+    c.PaletteIndex = paletteIndex;
+    c.PaletteBGR = paletteBGR;
+    if (outlineRadius > m_MaxOutlineRadius) {
+        m_MaxOutlineRadius = outlineRadius;
+    }
+}
+
+void PPUxCommandList::StrokeOutlineX(float outlineRadius, uint8_t paletteIndex, const uint8_t* paletteBGR)
+{
+    PPUxCommand& c = Add(PPUxCommandType::STROKE_OUTLINE_X, ALL_ROWS_TOP, ALL_ROWS_BOTTOM);
+    c.OutlineRadius = outlineRadius;
+    c.PaletteIndex = paletteIndex;
+    c.PaletteBGR = paletteBGR;
+    if (outlineRadius > m_MaxOutlineRadius) {
+        m_MaxOutlineRadius = outlineRadius;
+    }
+}
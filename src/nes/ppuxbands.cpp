@@ -0,0 +1,210 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2023 Matthew Deutsch
+//
+// Static is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Static is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Static; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <cmath>
+#include <cstring>
+
+#include "nes/ppuxbands.h"
+
+using namespace sta::nes;
+
+PPUxBandRenderer::PPUxBandRenderer(int threads)
+    : m_ThreadCount(threads)
+    , m_Priority(nullptr)
+    , m_Bands(0)
+    , m_NextBand(0)
+    , m_BandsDone(0)
+    , m_Quit(false)
+{
+    if (m_ThreadCount <= 0) {
+        m_ThreadCount = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    }
+    m_BandPixels.resize(m_ThreadCount);
+    m_BandPriority.resize(m_ThreadCount);
+    if (m_ThreadCount > 1) {
+        for (int i = 0; i < m_ThreadCount; i++) {
+            m_Workers.emplace_back(&PPUxBandRenderer::WorkerLoop, this);
+        }
+    }
+}
+
+PPUxBandRenderer::~PPUxBandRenderer()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        m_Quit = true;
+    }
+    m_WorkCV.notify_all();
+    for (auto& worker : m_Workers) {
+        worker.join();
+    }
+}
+
+int PPUxBandRenderer::GetThreadCount() const
+{
+    return m_ThreadCount;
+}
+
+void PPUxBandRenderer::WorkerLoop()
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    while (true) {
+        m_WorkCV.wait(lock, [&]{
+            return m_Quit || m_NextBand < m_Bands;
+        });
+        if (m_Quit) {
+            return;
+        }
+
+        int band = m_NextBand++;
+        lock.unlock();
+        std::exception_ptr error;
+        try {
+            m_Job(band);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        lock.lock();
+
+        if (error && !m_Error) {
+            m_Error = error;
+        }
+        if (++m_BandsDone == m_Bands) {
+            m_DoneCV.notify_all();
+        }
+    }
+}
+
+void PPUxBandRenderer::Render(const PPUxCommandList& list, PPUx* ppux)
+{
+    if (!ppux->GetBGROut()) {
+        throw std::invalid_argument("PPUxBandRenderer, BGR output only");
+    }
+    if (m_ThreadCount == 1) {
+        ppux->Execute(list);
+        return;
+    }
+
+    // How far outside of its rows a band has to draw for the outlines
+    int halo = 0;
+    float radius = list.GetMaxOutlineRadius();
+    if (radius > 0.0f) {
+        halo = static_cast<int>(std::ceil(radius)) + 1;
+    }
+
+    // Rendering reads the rows around each band, so nothing is written back
+    // until every band is done
+    m_Priority = nullptr;
+    if (ppux->GetPriorityStatus() == PPUxPriorityStatus::ENABLED) {
+        m_Priority = &ppux->GetPriorityInfo();
+    }
+    RunBands([&](int band){
+        RenderBand(list, ppux, band, halo);
+    });
+    if (m_Priority) {
+        m_Priority->resize(static_cast<size_t>(ppux->GetWidth()) * ppux->GetHeight(), 0);
+    }
+    RunBands([&](int band){
+        CopyBand(ppux, band, halo);
+    });
+}
+
+void PPUxBandRenderer::RunBands(std::function<void(int)> job)
+{
+    std::unique_lock<std::mutex> lock(m_Mutex);
+    m_Job = std::move(job);
+    m_Error = nullptr;
+    m_BandsDone = 0;
+    m_NextBand = 0;
+    m_Bands = m_ThreadCount;
+    m_WorkCV.notify_all();
+    m_DoneCV.wait(lock, [&]{
+        return m_BandsDone == m_Bands;
+    });
+    m_Bands = 0;
+    m_Job = nullptr;
+
+    if (m_Error) {
+        std::rethrow_exception(m_Error);
+    }
+}
+
+void PPUxBandRenderer::BandRows(int height, int band, int halo, int* y0, int* y1, int* top, int* bottom) const
+{
+    *y0 = static_cast<int>(static_cast<int64_t>(height) * band / m_ThreadCount);
+    *y1 = static_cast<int>(static_cast<int64_t>(height) * (band + 1) / m_ThreadCount);
+    *top = std::max(*y0 - halo, 0);
+    *bottom = std::min(*y1 + halo, height);
+}
+
+void PPUxBandRenderer::RenderBand(const PPUxCommandList& list, PPUx* ppux, int band, int halo)
+{
+    int w = ppux->GetWidth();
+    int y0, y1, top, bottom;
+    BandRows(ppux->GetHeight(), band, halo, &y0, &y1, &top, &bottom);
+    if (y0 >= y1) {
+        return;
+    }
+
+    size_t rowSize = static_cast<size_t>(w) * 3;
+    const uint8_t* bgr = ppux->GetBGROut();
+    auto& pixels = m_BandPixels[band];
+    pixels.assign(bgr + top * rowSize, bgr + bottom * rowSize);
+
+    PPUx bandx(w, bottom - top, pixels.data(), ppux->GetPriorityStatus());
+    bandx.SetReferenceRendering(ppux->GetReferenceRendering());
+    bandx.SetSpritePriorityGlitch(ppux->GetSpritePriorityGlitch());
+    if (m_Priority && m_Priority->size() == static_cast<size_t>(w) * ppux->GetHeight()) {
+        bandx.GetPriorityInfo().assign(m_Priority->begin() + static_cast<size_t>(top) * w,
+                m_Priority->begin() + static_cast<size_t>(bottom) * w);
+    }
+
+    bandx.Execute(list, -top);
+
+    auto& priority = m_BandPriority[band];
+    priority.clear();
+    if (m_Priority) {
+        priority.swap(bandx.GetPriorityInfo());
+    }
+}
+
+void PPUxBandRenderer::CopyBand(PPUx* ppux, int band, int halo)
+{
+    int w = ppux->GetWidth();
+    int y0, y1, top, bottom;
+    BandRows(ppux->GetHeight(), band, halo, &y0, &y1, &top, &bottom);
+    if (y0 >= y1) {
+        return;
+    }
+
+    size_t rowSize = static_cast<size_t>(w) * 3;
+    std::memcpy(ppux->GetBGROut() + y0 * rowSize, m_BandPixels[band].data() + (y0 - top) * rowSize,
+            (y1 - y0) * rowSize);
+
+    // A band that never reset its priority is the same as all none
+    size_t n = static_cast<size_t>(w) * (y1 - y0);
+    uint8_t* out = m_Priority ? m_Priority->data() + static_cast<size_t>(y0) * w : nullptr;
+    auto& priority = m_BandPriority[band];
+    if (out && priority.size() == static_cast<size_t>(w) * (bottom - top)) {
+        std::memcpy(out, priority.data() + static_cast<size_t>(y0 - top) * w, n);
+    } else if (out) {
+        std::memset(out, 0, n);
+    }
+}
@@ -41,6 +41,7 @@
 #include "spdlog/spdlog.h"
 
 #include "smb/rgms.h"
+#include "ext/opensslext/opensslext.h"
 #include "nes/nesui.h"
 #include "util/file.h"
 #include "util/string.h"
@@ -581,11 +582,7 @@ void sta::rgms::ClearSMBMessageProcessorOutput(SMBMessageProcessorOutput* output
 
 int sta::rgms::AreaPointerXFromData(uint8_t screenedge_pageloc, uint8_t screenedge_x_pos, sta::smb::AreaID aid, uint8_t block_buffer_84_disc)
 {
-    int apx = 256 * static_cast<int>(screenedge_pageloc) + static_cast<int>(screenedge_x_pos);
-    if (apx < 512 && aid == sta::smb::AreaID::CASTLE_AREA_6 && block_buffer_84_disc != 0x00) { // #BIG YIKES
-        apx += 1024;
-    }
-    return apx;
+    return smb::AreaPointerXFromData(screenedge_pageloc, screenedge_x_pos, aid, block_buffer_84_disc);
 }
 
 void SMBMessageProcessor::SetOutputFromNESMessageState(const internesceptor::NESMessageState& nes,
@@ -913,10 +910,17 @@ void SMBSerialProcessorThread::SerialThread()
             m_ApproxMessagesPerSecond = t_MessageRateEstimator.TicksPerSecond();
 
             if (obtainedNewOutput) {
-                std::lock_guard<std::mutex> lock(m_OutputMutex);
-                while (auto p = t_SerialProcessor.GetNextProcessorOutput()) {
-                    m_OutputLatest.push_back(p);
-                    m_OutputNext.push_back(p);
+                {
+                    std::lock_guard<std::mutex> lock(m_OutputMutex);
+                    while (auto p = t_SerialProcessor.GetNextProcessorOutput()) {
+                        m_OutputLatest.push_back(p);
+                        m_OutputNext.push_back(p);
+                    }
+                }
+
+                std::lock_guard<std::mutex> lock(m_CallbackMutex);
+                if (m_OutputCallback) {
+                    m_OutputCallback();
                 }
             }
 
@@ -979,6 +983,12 @@ void SMBSerialProcessorThread::StopRecording()
     m_IsRecording = false;
 }
 
+void SMBSerialProcessorThread::SetOutputCallback(std::function<void()> callback)
+{
+    std::lock_guard<std::mutex> lock(m_CallbackMutex);
+    m_OutputCallback = callback;
+}
+
 
 //////////////////////////////////////////////////////////////////////////////
 
@@ -1428,6 +1438,617 @@ SMBMessageProcessorOutputPtr sta::rgms::BytesToOutput(const uint8_t* bytes, size
     return p;
 }
 
+inline constexpr size_t HEARTBEAT_SIZE = 4 + sizeof(int64_t) + sizeof(uint64_t) +
+    sizeof(int) * 4 + sizeof(double) * 2;
+
+void sta::rgms::HeartbeatFromThreadInfo(const SMBSerialProcessorThreadInfo& info, SMBTransmitterHeartbeat* heartbeat)
+{
+    heartbeat->ByteCount = info.ByteCount;
+    heartbeat->ApproxBytesPerSecond = info.ApproxBytesPerSecond;
+    heartbeat->MessageCount = info.MessageCount;
+    heartbeat->ApproxMessagesPerSecond = info.ApproxMessagesPerSecond;
+    heartbeat->ErrorCount = info.ErrorCount;
+}
+
+void sta::rgms::HeartbeatToBytes(const SMBTransmitterHeartbeat& heartbeat, std::vector<uint8_t>* buffer)
+{
+    buffer->resize(HEARTBEAT_SIZE);
+
+    (*buffer)[0] = 0x69;
+    (*buffer)[1] = 0x04;
+    (*buffer)[2] = 0x20;
+    (*buffer)[3] = 0xbb;
+
+    size_t v = 4;
+    v += out_t<int64_t>(&(*buffer)[v], heartbeat.Elapsed);
+    v += out_t<uint64_t>(&(*buffer)[v], heartbeat.Sequence);
+    v += out_t<int>(&(*buffer)[v], heartbeat.ByteCount);
+    v += out_t<double>(&(*buffer)[v], heartbeat.ApproxBytesPerSecond);
+    v += out_t<int>(&(*buffer)[v], heartbeat.MessageCount);
+    v += out_t<double>(&(*buffer)[v], heartbeat.ApproxMessagesPerSecond);
+    v += out_t<int>(&(*buffer)[v], heartbeat.ErrorCount);
+    v += out_t<int>(&(*buffer)[v], heartbeat.FramesSent);
+}
+
+bool sta::rgms::BytesToHeartbeat(const uint8_t* bytes, size_t size, SMBTransmitterHeartbeat* heartbeat)
+{
+    if (size != HEARTBEAT_SIZE) {
+        return false;
+    }
+    if (bytes[0] != 0x69 || bytes[1] != 0x04 || bytes[2] != 0x20 || bytes[3] != 0xbb) {
+        return false;
+    }
+
+    size_t v = 4;
+    v += in_t<int64_t>(&bytes[v], &heartbeat->Elapsed);
+    v += in_t<uint64_t>(&bytes[v], &heartbeat->Sequence);
+    v += in_t<int>(&bytes[v], &heartbeat->ByteCount);
+    v += in_t<double>(&bytes[v], &heartbeat->ApproxBytesPerSecond);
+    v += in_t<int>(&bytes[v], &heartbeat->MessageCount);
+    v += in_t<double>(&bytes[v], &heartbeat->ApproxMessagesPerSecond);
+    v += in_t<int>(&bytes[v], &heartbeat->ErrorCount);
+    v += in_t<int>(&bytes[v], &heartbeat->FramesSent);
+    return true;
+}
+
+int64_t sta::rgms::ToMicros(util::mclock::time_point t)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count();
+}
+
+util::mclock::time_point sta::rgms::FromMicros(int64_t micros)
+{
+    return util::mclock::time_point(std::chrono::duration_cast<util::mclock::duration>(
+                std::chrono::microseconds(micros)));
+}
+
+std::string sta::rgms::ClockEndpointFromFeedEndpoint(const std::string& endpoint)
+{
+    std::size_t pos = endpoint.rfind(':');
+    if (pos == std::string::npos) {
+        throw std::invalid_argument("invalid endpoint: " + endpoint);
+    }
+    int port = std::stoi(endpoint.substr(pos + 1));
+    if (port + SMB_CLOCK_PORT_OFFSET > 65535) {
+        throw std::invalid_argument(fmt::format("no clock port for endpoint: {}, the port must be at most {}",
+                    endpoint, 65535 - SMB_CLOCK_PORT_OFFSET));
+    }
+    return fmt::format("{}:{}", endpoint.substr(0, pos), port + SMB_CLOCK_PORT_OFFSET);
+}
+
+int64_t TransmitterClock::FromLocal(util::mclock::time_point t) const
+{
+    int64_t local = ToMicros(t);
+    return local + OffsetMicros + static_cast<int64_t>(std::llround(
+                static_cast<double>(local) * SkewPPM * 1e-6));
+}
+
+int64_t TransmitterClock::Now() const
+{
+    return FromLocal(util::Now());
+}
+
+int64_t sta::rgms::ClockSampleOffset(const ClockSample& sample)
+{
+    return ((sample.T1 - sample.T0) + (sample.T2 - sample.T3)) / 2;
+}
+
+int64_t sta::rgms::ClockSampleDelay(const ClockSample& sample)
+{
+    return (sample.T3 - sample.T0) - (sample.T2 - sample.T1);
+}
+
+inline constexpr size_t CLOCK_REQUEST_SIZE = 4 + sizeof(int64_t);
+inline constexpr size_t CLOCK_REPLY_SIZE = 4 + sizeof(int64_t) * 3;
+
+void sta::rgms::ClockRequestToBytes(int64_t t0, std::vector<uint8_t>* buffer)
+{
+    buffer->resize(CLOCK_REQUEST_SIZE);
+    (*buffer)[0] = 0x69;
+    (*buffer)[1] = 0x04;
+    (*buffer)[2] = 0x20;
+    (*buffer)[3] = 0xcc;
+    out_t<int64_t>(&(*buffer)[4], t0);
+}
+
+bool sta::rgms::BytesToClockRequest(const uint8_t* bytes, size_t size, int64_t* t0)
+{
+    if (size != CLOCK_REQUEST_SIZE) {
+        return false;
+    }
+    if (bytes[0] != 0x69 || bytes[1] != 0x04 || bytes[2] != 0x20 || bytes[3] != 0xcc) {
+        return false;
+    }
+    in_t<int64_t>(&bytes[4], t0);
+    return true;
+}
+
+void sta::rgms::ClockReplyToBytes(const ClockSample& sample, std::vector<uint8_t>* buffer)
+{
+    buffer->resize(CLOCK_REPLY_SIZE);
+    (*buffer)[0] = 0x69;
+    (*buffer)[1] = 0x04;
+    (*buffer)[2] = 0x20;
+    (*buffer)[3] = 0xcd;
+
+    size_t v = 4;
+    v += out_t<int64_t>(&(*buffer)[v], sample.T0);
+    v += out_t<int64_t>(&(*buffer)[v], sample.T1);
+    v += out_t<int64_t>(&(*buffer)[v], sample.T2);
+}
+
+bool sta::rgms::BytesToClockReply(const uint8_t* bytes, size_t size, ClockSample* sample)
+{
+    if (size != CLOCK_REPLY_SIZE) {
+        return false;
+    }
+    if (bytes[0] != 0x69 || bytes[1] != 0x04 || bytes[2] != 0x20 || bytes[3] != 0xcd) {
+        return false;
+    }
+
+    size_t v = 4;
+    v += in_t<int64_t>(&bytes[v], &sample->T0);
+    v += in_t<int64_t>(&bytes[v], &sample->T1);
+    v += in_t<int64_t>(&bytes[v], &sample->T2);
+    sample->T3 = 0;
+    return true;
+}
+
+ClockOffsetEstimator::ClockOffsetEstimator(size_t windowSize)
+    : m_WindowSize(windowSize)
+{
+    Reset();
+}
+
+ClockOffsetEstimator::~ClockOffsetEstimator()
+{
+}
+
+void ClockOffsetEstimator::Reset()
+{
+    m_Samples.clear();
+    m_Estimate = {};
+    m_Estimate.Valid = false;
+    m_Reference = 0.0;
+    m_Offset = 0.0;
+    m_Skew = 0.0;
+}
+
+bool ClockOffsetEstimator::IsWindowFull() const
+{
+    return m_Samples.size() >= m_WindowSize;
+}
+
+const ClockEstimate& ClockOffsetEstimator::GetEstimate() const
+{
+    return m_Estimate;
+}
+
+void ClockOffsetEstimator::AddSample(const ClockSample& sample)
+{
+    if (ClockSampleDelay(sample) < 0) {
+        return; // nonsense, likely a reply to an older request
+    }
+    m_Samples.push_back(sample);
+    while (m_Samples.size() > m_WindowSize) {
+        m_Samples.pop_front();
+    }
+    Recompute();
+}
+
+void ClockOffsetEstimator::Recompute()
+{
+    // Samples with long round trips were probably queued somewhere along the
+    // way, and so are asymmetric. Like NTP's clock filter only trust the
+    // quicker ones (here the better half of the window)
+    std::vector<const ClockSample*> samples;
+    for (auto & sample : m_Samples) {
+        samples.push_back(&sample);
+    }
+    std::sort(samples.begin(), samples.end(), [&](const ClockSample* a, const ClockSample* b){
+        return ClockSampleDelay(*a) < ClockSampleDelay(*b);
+    });
+    samples.resize(std::max<size_t>(1, (samples.size() + 1) / 2));
+
+    m_Reference = static_cast<double>(m_Samples.back().T0 + m_Samples.back().T3) / 2.0;
+
+    double minx = 0, maxx = 0;
+    double sx = 0, sy = 0;
+    for (auto & sample : samples) {
+        double x = static_cast<double>(sample->T0 + sample->T3) / 2.0 - m_Reference;
+        double y = static_cast<double>(ClockSampleOffset(*sample));
+        minx = std::min(minx, x);
+        maxx = std::max(maxx, x);
+        sx += x;
+        sy += y;
+    }
+    double n = static_cast<double>(samples.size());
+    double mx = sx / n;
+    double my = sy / n;
+
+    // Only fit the skew when the samples span long enough for it to mean
+    // anything, otherwise use the quickest sample as is
+    m_Skew = 0.0;
+    m_Offset = static_cast<double>(ClockSampleOffset(*samples.front()));
+    if (samples.size() >= 4 && (maxx - minx) >= 2e6) {
+        double sxx = 0, sxy = 0;
+        for (auto & sample : samples) {
+            double x = static_cast<double>(sample->T0 + sample->T3) / 2.0 - m_Reference - mx;
+            double y = static_cast<double>(ClockSampleOffset(*sample)) - my;
+            sxx += x * x;
+            sxy += x * y;
+        }
+        if (sxx > 0) {
+            m_Skew = sxy / sxx;
+            m_Offset = my - m_Skew * mx;
+        }
+    }
+
+    double jitter = 0;
+    for (auto & sample : samples) {
+        double x = static_cast<double>(sample->T0 + sample->T3) / 2.0 - m_Reference;
+        double r = static_cast<double>(ClockSampleOffset(*sample)) - (m_Offset + m_Skew * x);
+        jitter += r * r;
+    }
+
+    m_Estimate.Valid = true;
+    m_Estimate.OffsetMicros = static_cast<int64_t>(std::llround(m_Offset));
+    m_Estimate.SkewPPM = m_Skew * 1e6;
+    m_Estimate.JitterMicros = std::sqrt(jitter / n);
+    m_Estimate.DelayMicros = ClockSampleDelay(*samples.front());
+    m_Estimate.SampleCount = static_cast<int>(m_Samples.size());
+}
+
+int64_t ClockOffsetEstimator::TransmitterToReceiver(int64_t transmitterMicros) const
+{
+    if (!m_Estimate.Valid) {
+        return transmitterMicros;
+    }
+    // tx = r + offset + skew * (r - ref), solved for r
+    double tx = static_cast<double>(transmitterMicros);
+    return static_cast<int64_t>(std::llround(
+                (tx - m_Offset + m_Skew * m_Reference) / (1.0 + m_Skew)));
+}
+
+int64_t ClockOffsetEstimator::ReceiverToTransmitter(int64_t receiverMicros) const
+{
+    if (!m_Estimate.Valid) {
+        return receiverMicros;
+    }
+    double r = static_cast<double>(receiverMicros);
+    return static_cast<int64_t>(std::llround(r + m_Offset + m_Skew * (r - m_Reference)));
+}
+
+int sta::rgms::CheckClockOffsetEstimator()
+{
+    int failed = 0;
+    auto check = [&](bool ok, const char* what){
+        if (!ok) {
+            std::cout << "failed: " << what << "\n";
+            failed++;
+        }
+    };
+
+    // transmitter runs 2.5 seconds ahead and 50ppm fast, 300us each way
+    TransmitterClock clock;
+    clock.OffsetMicros = 2500000;
+    clock.SkewPPM = 50.0;
+
+    ClockOffsetEstimator estimator;
+    int64_t r = 1000000000;
+    for (int i = 0; i < 32; i++) {
+        ClockSample sample;
+        sample.T0 = r;
+        sample.T1 = clock.FromLocal(FromMicros(r + 300));
+        sample.T2 = clock.FromLocal(FromMicros(r + 350));
+        sample.T3 = r + 650;
+        estimator.AddSample(sample);
+        r += 1000000;
+    }
+
+    auto& est = estimator.GetEstimate();
+    check(est.Valid, "estimate valid");
+    check(std::abs(est.DelayMicros - 600) <= 1, "delay is the round trip");
+    check(std::abs(est.SkewPPM - 50.0) < 1.0, "skew found");
+    check(est.JitterMicros < 10.0, "jitter small");
+
+    int64_t tx = clock.FromLocal(FromMicros(r));
+    check(std::abs(estimator.TransmitterToReceiver(tx) - r) < 10, "transmitter to receiver");
+    check(std::abs(estimator.ReceiverToTransmitter(r) - tx) < 10, "receiver to transmitter");
+
+    std::cout << fmt::format("clock offset estimator: {} checks failed\n", failed);
+    return failed;
+}
+
+inline constexpr size_t FEED_AUTH_SIZE = 4 + sizeof(uint64_t) * 2 + SHA256_DIGEST_LENGTH;
+inline constexpr size_t FEED_AUTH_RECENT_SESSIONS = 4;
+inline constexpr uint64_t FEED_AUTH_START_WINDOW = 600; // ten seconds of frames
+inline constexpr size_t FEED_AUTH_PAST_NONCES = 64;
+
+bool sta::rgms::ParseFeedKey(const std::string& hex, std::vector<uint8_t>* key)
+{
+    key->clear();
+    if (hex.size() % 2 != 0) {
+        return false;
+    }
+    auto nibble = [](char c) -> int {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        int hi = nibble(hex[i]);
+        int lo = nibble(hex[i + 1]);
+        if (hi < 0 || lo < 0) {
+            key->clear();
+            return false;
+        }
+        key->push_back(static_cast<uint8_t>((hi << 4) | lo));
+    }
+    return true;
+}
+
+std::string sta::rgms::GenerateFeedKey()
+{
+    std::array<uint8_t, 32> key;
+    opensslext::RandomBytes(key.data(), key.size());
+
+    std::string hex;
+    for (auto & v : key) {
+        hex += fmt::format("{:02x}", v);
+    }
+    return hex;
+}
+
+FeedAuthenticator::FeedAuthenticator()
+{
+    opensslext::RandomBytes(reinterpret_cast<uint8_t*>(&m_Nonce), sizeof(m_Nonce));
+}
+
+FeedAuthenticator::~FeedAuthenticator()
+{
+}
+
+void FeedAuthenticator::SetKey(const std::vector<uint8_t>& key)
+{
+    m_Key = key;
+    m_Senders.clear();
+}
+
+bool FeedAuthenticator::HasKey() const
+{
+    return !m_Key.empty();
+}
+
+static opensslext::SHA256Sum FeedMessageHMAC(const std::vector<uint8_t>& key,
+        const uint8_t* nonceAndSequence, const FeedMessageParts& parts)
+{
+    // lengths are included so that bytes can not be shifted between parts
+    std::vector<uint32_t> lengths(parts.size());
+    opensslext::DataParts data;
+    data.reserve(parts.size() * 2 + 1);
+    data.emplace_back(nonceAndSequence, sizeof(uint64_t) * 2);
+    for (size_t i = 0; i < parts.size(); i++) {
+        lengths[i] = static_cast<uint32_t>(parts[i].second);
+        data.emplace_back(reinterpret_cast<const uint8_t*>(&lengths[i]), sizeof(uint32_t));
+        data.emplace_back(parts[i].first, parts[i].second);
+    }
+    return opensslext::ComputeHMACSHA256(key.data(), key.size(), data);
+}
+
+void FeedAuthenticator::Sign(const std::string& name, const FeedMessageParts& parts, std::vector<uint8_t>* auth)
+{
+    auth->resize(FEED_AUTH_SIZE);
+    (*auth)[0] = 0x69;
+    (*auth)[1] = 0x04;
+    (*auth)[2] = 0x20;
+    (*auth)[3] = 0xaa;
+
+    uint64_t sequence = ++m_Sequences[name];
+    size_t v = 4;
+    v += out_t<uint64_t>(&(*auth)[v], m_Nonce);
+    v += out_t<uint64_t>(&(*auth)[v], sequence);
+
+    auto sum = FeedMessageHMAC(m_Key, &(*auth)[4], parts);
+    std::copy(sum.begin(), sum.end(), auth->begin() + v);
+}
+
+bool FeedAuthenticator::IsAuthenticationPart(const uint8_t* bytes, size_t size)
+{
+    return size == FEED_AUTH_SIZE &&
+        bytes[0] == 0x69 && bytes[1] == 0x04 && bytes[2] == 0x20 && bytes[3] == 0xaa;
+}
+
+FeedAuthenticationResult FeedAuthenticator::Verify(const std::string& name,
+        const FeedMessageParts& parts, const uint8_t* auth, size_t authSize)
+{
+    if (!auth || !IsAuthenticationPart(auth, authSize)) {
+        return FeedAuthenticationResult::UNSIGNED;
+    }
+
+    auto sum = FeedMessageHMAC(m_Key, &auth[4], parts);
+    if (!opensslext::ConstantTimeEquals(sum.data(), &auth[4 + sizeof(uint64_t) * 2], sum.size())) {
+        return FeedAuthenticationResult::BAD_SIGNATURE;
+    }
+
+    uint64_t nonce, sequence;
+    in_t<uint64_t>(&auth[4], &nonce);
+    in_t<uint64_t>(&auth[4 + sizeof(uint64_t)], &sequence);
+
+    // A new nonce means the transmitter restarted. Only the start of a
+    // session (its first FEED_AUTH_START_WINDOW messages, some may be lost)
+    // may introduce one, otherwise a packet captured mid session could be
+    // replayed under a nonce that was never seen here. The first session from
+    // a name is taken as it comes, the receiver may have started after the
+    // transmitter
+    Sender& sender = m_Senders[name];
+    if (std::find(sender.PastNonces.begin(), sender.PastNonces.end(), nonce) != sender.PastNonces.end()) {
+        return FeedAuthenticationResult::REPLAYED;
+    }
+
+    // Each recent session keeps its own high water mark, so that a replayed
+    // session start can't lock out the transmitter that is actually running
+    auto session = std::find_if(sender.Recent.begin(), sender.Recent.end(), [&](const Session& s){
+        return s.Nonce == nonce;
+    });
+    if (session == sender.Recent.end()) {
+        if (!sender.Recent.empty() && sequence > FEED_AUTH_START_WINDOW) {
+            return FeedAuthenticationResult::REPLAYED;
+        }
+        sender.Recent.push_back({nonce, sequence});
+        while (sender.Recent.size() > FEED_AUTH_RECENT_SESSIONS) {
+            sender.PastNonces.push_back(sender.Recent.front().Nonce);
+            sender.Recent.pop_front();
+        }
+        while (sender.PastNonces.size() > FEED_AUTH_PAST_NONCES) {
+            sender.PastNonces.pop_front();
+        }
+        return FeedAuthenticationResult::ACCEPTED;
+    }
+
+    if (sequence <= session->Sequence) {
+        return FeedAuthenticationResult::REPLAYED;
+    }
+    session->Sequence = sequence;
+    return FeedAuthenticationResult::ACCEPTED;
+}
+
+int sta::rgms::CheckFeedAuthenticator()
+{
+    int failed = 0;
+    auto check = [&](bool ok, const char* what){
+        if (!ok) {
+            std::cout << "failed: " << what << "\n";
+            failed++;
+        }
+    };
+
+    std::vector<uint8_t> key;
+    check(ParseFeedKey(GenerateFeedKey(), &key), "generated key parses");
+    check(key.size() == 32, "key is 32 bytes");
+
+    FeedAuthenticator tx, rx;
+    tx.SetKey(key);
+    rx.SetKey(key);
+
+    std::string topic = "smb";
+    std::string name = "seat1";
+    std::vector<uint8_t> payload(600, 0x42);
+    std::vector<uint8_t> auth;
+    auto Parts = [&](){
+        return FeedMessageParts{
+            {reinterpret_cast<const uint8_t*>(topic.data()), topic.size()},
+            {reinterpret_cast<const uint8_t*>(name.data()), name.size()},
+            {payload.data(), payload.size()}};
+    };
+
+    // valid traffic is all accepted
+    auto start = util::Now();
+    int accepted = 0;
+    for (int i = 0; i < 100000; i++) {
+        payload[0] = static_cast<uint8_t>(i);
+        tx.Sign(name, Parts(), &auth);
+        if (rx.Verify(name, Parts(), auth.data(), auth.size()) == FeedAuthenticationResult::ACCEPTED) {
+            accepted++;
+        }
+    }
+    check(accepted == 100000, "valid traffic accepted");
+    spdlog::info("feed authentication: 100000 messages in {}ms", util::ElapsedMillisFrom(start));
+
+    // replayed
+    check(rx.Verify(name, Parts(), auth.data(), auth.size()) == FeedAuthenticationResult::REPLAYED, "replayed");
+
+    // unsigned
+    check(rx.Verify(name, Parts(), nullptr, 0) == FeedAuthenticationResult::UNSIGNED, "unsigned");
+
+    // tampered payload, or somebody else's name
+    tx.Sign(name, Parts(), &auth);
+    payload[10] ^= 0x01;
+    check(rx.Verify(name, Parts(), auth.data(), auth.size()) == FeedAuthenticationResult::BAD_SIGNATURE, "tampered payload");
+    payload[10] ^= 0x01;
+    name = "seat2";
+    check(rx.Verify(name, Parts(), auth.data(), auth.size()) == FeedAuthenticationResult::BAD_SIGNATURE, "somebody else's name");
+    name = "seat1";
+    check(rx.Verify(name, Parts(), auth.data(), auth.size()) == FeedAuthenticationResult::ACCEPTED, "untampered");
+
+    // wrong key
+    FeedAuthenticator other;
+    other.SetKey(std::vector<uint8_t>(32, 0x00));
+    other.Sign(name, Parts(), &auth);
+    check(rx.Verify(name, Parts(), auth.data(), auth.size()) == FeedAuthenticationResult::BAD_SIGNATURE, "wrong key");
+
+    // a restarted transmitter is fine, but the old session can't be replayed
+    std::vector<uint8_t> oldauth;
+    tx.Sign(name, Parts(), &oldauth);
+    check(rx.Verify(name, Parts(), oldauth.data(), oldauth.size()) == FeedAuthenticationResult::ACCEPTED, "old session");
+    FeedAuthenticator restarted;
+    restarted.SetKey(key);
+    restarted.Sign(name, Parts(), &auth);
+    check(rx.Verify(name, Parts(), auth.data(), auth.size()) == FeedAuthenticationResult::ACCEPTED, "restarted transmitter");
+    check(rx.Verify(name, Parts(), oldauth.data(), oldauth.size()) == FeedAuthenticationResult::REPLAYED, "old session replayed");
+
+    // a packet from the middle of a session that was never seen here can't
+    // start one, and replaying an earlier session start doesn't lock out the
+    // running transmitter
+    FeedAuthenticator earlier;
+    earlier.SetKey(key);
+    std::vector<uint8_t> earlierstart, earliermid;
+    earlier.Sign(name, Parts(), &earlierstart);
+    for (uint64_t i = 0; i < FEED_AUTH_START_WINDOW; i++) {
+        earlier.Sign(name, Parts(), &earliermid);
+    }
+    check(rx.Verify(name, Parts(), earliermid.data(), earliermid.size()) == FeedAuthenticationResult::REPLAYED, "mid session packet can't start one");
+    check(rx.Verify(name, Parts(), earlierstart.data(), earlierstart.size()) == FeedAuthenticationResult::ACCEPTED, "earlier session start");
+    check(rx.Verify(name, Parts(), earlierstart.data(), earlierstart.size()) == FeedAuthenticationResult::REPLAYED, "earlier session start replayed");
+    restarted.Sign(name, Parts(), &auth);
+    check(rx.Verify(name, Parts(), auth.data(), auth.size()) == FeedAuthenticationResult::ACCEPTED, "running transmitter not locked out");
+
+    // after a restart every seat's sequence starts over, even with the first
+    // messages of a session lost
+    std::string name2 = "seat2";
+    auto Parts2 = [&](){
+        return FeedMessageParts{
+            {reinterpret_cast<const uint8_t*>(topic.data()), topic.size()},
+            {reinterpret_cast<const uint8_t*>(name2.data()), name2.size()},
+            {payload.data(), payload.size()}};
+    };
+    FeedAuthenticator seats;
+    seats.SetKey(key);
+    for (int i = 0; i < 10; i++) {
+        seats.Sign(name, Parts(), &auth);
+        check(rx.Verify(name, Parts(), auth.data(), auth.size()) == FeedAuthenticationResult::ACCEPTED, "seat1 before restart");
+        seats.Sign(name2, Parts2(), &auth);
+        check(rx.Verify(name2, Parts2(), auth.data(), auth.size()) == FeedAuthenticationResult::ACCEPTED, "seat2 before restart");
+    }
+    FeedAuthenticator seatsRestarted;
+    seatsRestarted.SetKey(key);
+    for (int i = 0; i < 10; i++) {
+        seatsRestarted.Sign(name, Parts(), &auth);
+        check(rx.Verify(name, Parts(), auth.data(), auth.size()) == FeedAuthenticationResult::ACCEPTED, "seat1 after restart");
+    }
+    for (int i = 0; i < 5; i++) {
+        seatsRestarted.Sign(name2, Parts2(), &auth); // dropped while reconnecting
+    }
+    for (int i = 0; i < 10; i++) {
+        seatsRestarted.Sign(name2, Parts2(), &auth);
+        check(rx.Verify(name2, Parts2(), auth.data(), auth.size()) == FeedAuthenticationResult::ACCEPTED, "seat2 after restart, first messages lost");
+    }
+
+    // sessions that have aged out are rejected outright
+    for (size_t i = 0; i < FEED_AUTH_RECENT_SESSIONS; i++) {
+        FeedAuthenticator later;
+        later.SetKey(key);
+        later.Sign(name, Parts(), &auth);
+        check(rx.Verify(name, Parts(), auth.data(), auth.size()) == FeedAuthenticationResult::ACCEPTED, "later session");
+    }
+    restarted.Sign(name, Parts(), &auth);
+    check(rx.Verify(name, Parts(), auth.data(), auth.size()) == FeedAuthenticationResult::REPLAYED, "aged out session");
+
+    std::cout << fmt::format("feed authentication: {} checks failed\n", failed);
+    return failed;
+}
+
 bool sta::rgms::OutputPtrsEqual(SMBMessageProcessorOutputPtr a, SMBMessageProcessorOutputPtr b)
 {
     if (!a && !b) return true;
@@ -1486,6 +2107,43 @@ bool sta::rgms::OutputPtrsEqual(SMBMessageProcessorOutputPtr a, SMBMessageProces
     return true;
 }
 
+void sta::rgms::PublishFeedMessage(zmq::socket_t* socket, FeedAuthenticator* authenticator,
+        const FeedMessageParts& parts, std::vector<uint8_t>* authbuffer)
+{
+    bool sign = authenticator->HasKey();
+    if (sign) {
+        std::string name(reinterpret_cast<const char*>(parts.at(1).first), parts.at(1).second);
+        authenticator->Sign(name, parts, authbuffer);
+    }
+    for (size_t i = 0; i < parts.size(); i++) {
+        bool last = !sign && (i + 1) == parts.size();
+        socket->send(zmq::message_t(parts[i].first, parts[i].second),
+                last ? zmq::send_flags::none : zmq::send_flags::sndmore);
+    }
+    if (sign) {
+        socket->send(zmq::message_t(authbuffer->data(), authbuffer->size()), zmq::send_flags::none);
+    }
+}
+
+void sta::rgms::AnswerClockRequests(zmq::socket_t* socket, const TransmitterClock& clock)
+{
+    std::vector<uint8_t> buffer;
+    while (true) {
+        zmq::message_t msg;
+        if (!socket->recv(msg, zmq::recv_flags::dontwait)) {
+            break;
+        }
+        ClockSample sample = {};
+        sample.T1 = clock.Now();
+        if (!BytesToClockRequest(reinterpret_cast<const uint8_t*>(msg.data()), msg.size(), &sample.T0)) {
+            sample.T0 = 0;
+        }
+        sample.T2 = clock.Now();
+        ClockReplyToBytes(sample, &buffer);
+        socket->send(zmq::message_t(buffer.data(), buffer.size()), zmq::send_flags::none);
+    }
+}
+
 class SMBZMQContext
 {
 public:
@@ -1495,9 +2153,14 @@ public:
 
     SMBMessageProcessorOutputPtr GetLatest(size_t tag);
     SMBMessageProcessorOutputPtr GetNext(size_t tag);
+    bool GetHeartbeat(size_t tag, SMBTransmitterHeartbeat* heartbeat, util::mclock::time_point* receivedAt);
+    ClockEstimate GetClockEstimate(size_t tag);
+    FeedAuthenticationCounters GetAuthenticationCounters(size_t tag);
+    void SetFeedKey(const std::string& hexkey);
 
 private:
     void pump();
+    void pump_clocks();
 
     SMBZMQContext();
     ~SMBZMQContext();
@@ -1508,6 +2171,29 @@ private:
     std::unordered_map<std::string, size_t> m_p2_to_tag;
     std::vector<std::deque<SMBMessageProcessorOutputPtr>> m_decks;
     std::vector<SMBMessageProcessorOutputPtr> m_lasts;
+
+    struct ReceivedHeartbeat {
+        bool Any;
+        SMBTransmitterHeartbeat Heartbeat;
+        util::mclock::time_point ReceivedAt;
+    };
+    std::vector<ReceivedHeartbeat> m_heartbeats;
+
+    // One per transmitter endpoint, shared by every name published there
+    struct ClockChannel {
+        std::unique_ptr<zmq::socket_t> Socket;
+        ClockOffsetEstimator Estimator;
+        bool Outstanding;
+        int64_t OutstandingT0;
+        util::mclock::time_point LastRequest;
+    };
+    std::vector<std::unique_ptr<ClockChannel>> m_clocks;
+    std::unordered_map<std::string, size_t> m_bind_to_clock;
+    std::vector<size_t> m_tag_to_clock;
+
+    std::string m_hexkey;
+    FeedAuthenticator m_authenticator;
+    std::vector<FeedAuthenticationCounters> m_auth_counters;
 };
 
 SMBZMQContext* SMBZMQContext::get_context() {
@@ -1533,12 +2219,77 @@ size_t SMBZMQContext::connect(const std::string& bind, const std::string& p2)
     m_socket_t->connect(bind);
     m_decks.emplace_back();
     m_lasts.push_back(nullptr);
+    m_heartbeats.emplace_back();
+    m_heartbeats.back().Any = false;
+    m_auth_counters.push_back({});
     m_p2_to_tag[p2] = tag;
+
+    auto it = m_bind_to_clock.find(bind);
+    if (it != m_bind_to_clock.end()) {
+        m_tag_to_clock.push_back(it->second);
+    } else {
+        auto channel = std::make_unique<ClockChannel>();
+        channel->Socket = std::make_unique<zmq::socket_t>(*m_context_t, zmq::socket_type::req);
+        // allow a new request when a reply never arrives, and ignore stale replies
+        channel->Socket->set(zmq::sockopt::req_relaxed, 1);
+        channel->Socket->set(zmq::sockopt::req_correlate, 1);
+        channel->Socket->set(zmq::sockopt::linger, 0);
+        channel->Socket->connect(ClockEndpointFromFeedEndpoint(bind));
+        channel->Outstanding = false;
+        channel->OutstandingT0 = 0;
+        channel->LastRequest = util::Now() - util::ToDuration(SMB_CLOCK_SYNC_MILLIS);
+
+        size_t index = m_clocks.size();
+        m_clocks.push_back(std::move(channel));
+        m_bind_to_clock[bind] = index;
+        m_tag_to_clock.push_back(index);
+    }
     return tag;
 }
 
+void SMBZMQContext::pump_clocks()
+{
+    std::vector<uint8_t> buffer;
+    for (auto & channel : m_clocks) {
+        while (true) {
+            zmq::message_t msg;
+            zmq::recv_result_t result = channel->Socket->recv(msg, zmq::recv_flags::dontwait);
+            if (!result) {
+                break;
+            }
+            ClockSample sample;
+            if (BytesToClockReply(reinterpret_cast<const uint8_t*>(msg.data()), msg.size(), &sample)) {
+                sample.T3 = ToMicros(util::Now());
+                if (channel->Outstanding && sample.T0 == channel->OutstandingT0) {
+                    channel->Estimator.AddSample(sample);
+                    channel->Outstanding = false;
+                }
+            }
+        }
+
+        auto now = util::Now();
+        int64_t interval = channel->Estimator.IsWindowFull() ?
+            SMB_CLOCK_SYNC_MILLIS : SMB_CLOCK_SYNC_FAST_MILLIS;
+        int64_t elapsed = util::ElapsedMillis(channel->LastRequest, now);
+        if ((!channel->Outstanding && elapsed >= interval) ||
+            (channel->Outstanding && elapsed >= SMB_CLOCK_TIMEOUT_MILLIS)) {
+            int64_t t0 = ToMicros(now);
+            ClockRequestToBytes(t0, &buffer);
+            auto result = channel->Socket->send(zmq::message_t(buffer.data(), buffer.size()),
+                    zmq::send_flags::dontwait);
+            channel->LastRequest = now;
+            if (result) {
+                channel->Outstanding = true;
+                channel->OutstandingT0 = t0;
+            }
+        }
+    }
+}
+
 void SMBZMQContext::pump()
 {
+    pump_clocks();
+
     while (true) {
         std::vector<zmq::message_t> recv_msgs;
         zmq::recv_result_t result = zmq::recv_multipart(*m_socket_t,
@@ -1546,14 +2297,72 @@ void SMBZMQContext::pump()
         if (!result) {
             break;
         }
+        if (recv_msgs.size() < 3) {
+            continue;
+        }
 
         auto it = m_p2_to_tag.find(recv_msgs[1].to_string());
         if (it != m_p2_to_tag.end()) {
             size_t tag = it->second;
-            auto p = BytesToOutput(reinterpret_cast<const uint8_t*>(recv_msgs[2].data()), recv_msgs[2].size());
-            p->ConstructionTime = util::Now();
-            m_lasts[tag] = p;
-            m_decks[tag].push_back(p);
+
+            const uint8_t* auth = nullptr;
+            size_t authSize = 0;
+            const auto& last = recv_msgs.back();
+            if (FeedAuthenticator::IsAuthenticationPart(
+                        reinterpret_cast<const uint8_t*>(last.data()), last.size())) {
+                auth = reinterpret_cast<const uint8_t*>(last.data());
+                authSize = last.size();
+                recv_msgs.pop_back();
+            }
+            if (recv_msgs.size() != 3 && recv_msgs.size() != 4) {
+                continue;
+            }
+
+            if (m_authenticator.HasKey()) {
+                FeedMessageParts parts;
+                for (auto & msg : recv_msgs) {
+                    parts.emplace_back(reinterpret_cast<const uint8_t*>(msg.data()), msg.size());
+                }
+                auto& counters = m_auth_counters[tag];
+                auto verified = m_authenticator.Verify(recv_msgs[1].to_string(), parts, auth, authSize);
+                if (verified == FeedAuthenticationResult::UNSIGNED) {
+                    counters.Unsigned++;
+                    continue;
+                } else if (verified == FeedAuthenticationResult::BAD_SIGNATURE) {
+                    counters.BadSignature++;
+                    continue;
+                } else if (verified == FeedAuthenticationResult::REPLAYED) {
+                    counters.Replayed++;
+                    continue;
+                }
+                counters.Accepted++;
+            }
+
+            const uint8_t* bytes = reinterpret_cast<const uint8_t*>(recv_msgs[2].data());
+            if (recv_msgs[0].to_string() == "smbhb") {
+                auto& hb = m_heartbeats[tag];
+                if (BytesToHeartbeat(bytes, recv_msgs[2].size(), &hb.Heartbeat)) {
+                    hb.Any = true;
+                    hb.ReceivedAt = util::Now();
+                }
+            } else if (auto p = BytesToOutput(bytes, recv_msgs[2].size())) {
+                // Newer transmitters stamp frames with their own clock, map
+                // that into ours when it is known
+                auto now = util::Now();
+                p->ConstructionTime = now;
+                auto& estimator = m_clocks.at(m_tag_to_clock.at(tag))->Estimator;
+                if (recv_msgs.size() == 4 && recv_msgs[3].size() == sizeof(int64_t) &&
+                        estimator.GetEstimate().Valid) {
+                    int64_t txtime;
+                    in_t<int64_t>(reinterpret_cast<const uint8_t*>(recv_msgs[3].data()), &txtime);
+                    auto t = FromMicros(estimator.TransmitterToReceiver(txtime));
+                    if (t < now) {
+                        p->ConstructionTime = t;
+                    }
+                }
+                m_lasts[tag] = p;
+                m_decks[tag].push_back(p);
+            }
         }
 
         //std::cout << recv_msgs[0].to_string() << " " << recv_msgs[1].to_string() << " " << recv_msgs[2].size() << std::endl;
@@ -1578,6 +2387,47 @@ SMBMessageProcessorOutputPtr SMBZMQContext::GetNext(size_t tag)
     return nullptr;
 }
 
+bool SMBZMQContext::GetHeartbeat(size_t tag, SMBTransmitterHeartbeat* heartbeat, util::mclock::time_point* receivedAt)
+{
+    pump();
+    auto& hb = m_heartbeats.at(tag);
+    if (!hb.Any) {
+        return false;
+    }
+    if (heartbeat) *heartbeat = hb.Heartbeat;
+    if (receivedAt) *receivedAt = hb.ReceivedAt;
+    return true;
+}
+
+ClockEstimate SMBZMQContext::GetClockEstimate(size_t tag)
+{
+    pump();
+    return m_clocks.at(m_tag_to_clock.at(tag))->Estimator.GetEstimate();
+}
+
+FeedAuthenticationCounters SMBZMQContext::GetAuthenticationCounters(size_t tag)
+{
+    pump();
+    return m_auth_counters.at(tag);
+}
+
+void SMBZMQContext::SetFeedKey(const std::string& hexkey)
+{
+    if (hexkey == m_hexkey) {
+        return;
+    }
+    m_hexkey = hexkey;
+
+    std::vector<uint8_t> key;
+    if (!ParseFeedKey(hexkey, &key)) {
+        spdlog::warn("invalid feed key, expected hex. Authentication is off");
+    }
+    m_authenticator.SetKey(key);
+    for (auto & counters : m_auth_counters) {
+        counters = {};
+    }
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -1603,6 +2453,23 @@ SMBMessageProcessorOutputPtr SMBZMQRef::GetNextProcessorOutput()
 {
     return SMBZMQContext::get_context()->GetNext(m_tag);
 }
+bool SMBZMQRef::GetLatestHeartbeat(SMBTransmitterHeartbeat* heartbeat, util::mclock::time_point* receivedAt)
+{
+    return SMBZMQContext::get_context()->GetHeartbeat(m_tag, heartbeat, receivedAt);
+}
+ClockEstimate SMBZMQRef::GetClockEstimate()
+{
+    return SMBZMQContext::get_context()->GetClockEstimate(m_tag);
+}
+FeedAuthenticationCounters SMBZMQRef::GetAuthenticationCounters()
+{
+    return SMBZMQContext::get_context()->GetAuthenticationCounters(m_tag);
+}
+
+void sta::rgms::SetSMBZMQFeedKey(const std::string& hexkey)
+{
+    SMBZMQContext::get_context()->SetFeedKey(hexkey);
+}
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -1900,6 +2767,8 @@ void sta::rgms::InitializeSMBCompTournament(SMBCompTournament* tournament)
 
     tournament->TowerName = "any%";
     tournament->CurrentRound = 0;
+
+    tournament->FeedKey = "";
 }
 
 void sta::rgms::InitializeSMBCompConfiguration(SMBCompConfiguration* config)
@@ -1974,19 +2843,25 @@ void sta::rgms::InitializeSMBCompSounds(smb::SMBDatabase* db, SMBCompSounds* sou
 {
     sdlext::SDLExtMixInit init;
 
+    // Decoded straight out of the blob
     for (auto effect : smb::AudibleSoundEffects()) {
-        std::vector<uint8_t> data;
-        if (db->GetSoundEffectWav(effect, &data)) {
-            sounds->SoundEffects[effect] = std::make_shared<sdlext::SDLExtMixChunk>(data);
+        std::shared_ptr<sqliteext::SQLiteExtBlobReader> blob = db->OpenSoundEffectWav(effect);
+        if (blob) {
+            sounds->SoundEffects[effect] = std::make_shared<sdlext::SDLExtMixChunk>(
+                sdlext::SDLExtRWFromReadAt(blob->Size(), [blob](void* data, size_t count, size_t offset){
+                    blob->ReadOrThrow(data, count, offset);
+                    return true;
+                }));
         } else {
             std::cout << smb::ToString(effect) << std::endl;
         }
     }
 
+    // Music is read as it plays, after the database is gone, so it's kept
     for (auto & track : smb::AudibleMusicTracks()) {
         std::vector<uint8_t> data;
         if (db->GetMusicTrackWav(track, &data)) {
-            sounds->Musics[track] = std::make_shared<sdlext::SDLExtMixMusic>(data);
+            sounds->Musics[track] = std::make_shared<sdlext::SDLExtMixMusic>(std::move(data));
         } else {
             std::cout << smb::ToString(track) << std::endl;
         }
@@ -2531,6 +3406,16 @@ void SMBCompConfigurationTournamentComponent::DoControls()
     rgmui::InputText("score name", &tournament->ScoreName);
     rgmui::InputText("file name", &tournament->FileName);
 
+    rgmui::InputText("feed key", &tournament->FeedKey, ImGuiInputTextFlags_Password);
+    ImGui::SameLine();
+    if (ImGui::Button("generate")) {
+        tournament->FeedKey = GenerateFeedKey();
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("copy")) {
+        ImGui::SetClipboardText(tournament->FeedKey.c_str());
+    }
+
     if (rgmui::Combo4("category", &tournament->Category,
                 m_StaticData->Categories.CategoryNames,
                 m_StaticData->Categories.CategoryNames)) {
@@ -2886,6 +3771,41 @@ void SMBCompPlayerWindow::DoControls(const SMBCompPlayer* player)
 
     auto f = ImGuiTreeNodeFlags_DefaultOpen;
     SMBCompFeed* feed = GetPlayerFeed(*player, m_Feeds);
+
+    ImGui::TextUnformatted("feed: ");
+    ImGui::SameLine();
+    std::string health = FeedHealthDescription(feed->Health, util::Now());
+    if (feed->Health.State == FeedHealthState::LIVE) {
+        rgmui::GreenText(health.c_str());
+    } else if (feed->Health.State == FeedHealthState::RECOVERING) {
+        ImGui::TextUnformatted(health.c_str());
+    } else {
+        rgmui::RedText(health.c_str());
+    }
+    if (feed->Health.AnyHeartbeat) {
+        auto& hb = feed->Health.Heartbeat;
+        rgmui::TextFmt("tx: {:10.1f} bps {:8.1f} mps {} errors", hb.ApproxBytesPerSecond,
+                hb.ApproxMessagesPerSecond, hb.ErrorCount);
+    }
+    if (feed->MySMBZMQRef) {
+        auto clock = feed->MySMBZMQRef->GetClockEstimate();
+        if (clock.Valid) {
+            rgmui::TextFmt("clock: offset {:.3f}ms jitter {:.3f}ms delay {:.3f}ms skew {:.1f}ppm",
+                    static_cast<double>(clock.OffsetMicros) / 1000.0, clock.JitterMicros / 1000.0,
+                    static_cast<double>(clock.DelayMicros) / 1000.0, clock.SkewPPM);
+        } else {
+            ImGui::TextUnformatted("clock: not synchronized");
+        }
+
+        auto auth = feed->MySMBZMQRef->GetAuthenticationCounters();
+        if (auth.Unsigned || auth.BadSignature || auth.Replayed) {
+            rgmui::RedText(fmt::format("auth: {} ok, rejected {} unsigned {} bad {} replayed",
+                        auth.Accepted, auth.Unsigned, auth.BadSignature, auth.Replayed).c_str());
+        } else if (auth.Accepted) {
+            rgmui::TextFmt("auth: {} ok", auth.Accepted);
+        }
+    }
+
     if (feed->ErrorMessage != "") {
         rgmui::RedText("Error:");
         ImGui::SameLine();
@@ -3258,7 +4178,7 @@ bool SMBCompCombinedViewComponent::MakeImageIndividual(SMBComp* comp, nes::PPUx*
         int scal = 2;
         ppux->ResetPriority();
         ppux->BeginOutline();
-        ppux->RenderString(WIDTH / 2 - str.size() * 8, 112, str,
+        ppux->RenderString(nes::AlignText(WIDTH / 2, nes::MeasureString(str, scal), nes::TextAlign::CENTER), 112, str,
                 comp->StaticData.Font.data(), tpal.data(), render.PaletteBGR, 2,
                 nes::EffectInfo::Defaults());
         ppux->StrokeOutlineO(2.0f, nes::PALETTE_ENTRY_BLACK, render.PaletteBGR);
@@ -3388,6 +4308,41 @@ void ApplyPlayerColors(nes::OAMxEntry* oamx, const SMBCompPlayer* player)
     }
 }
 
+void sta::rgms::ApplyPlayerColorSlots(nes::OAMxEntry* oamx)
+{
+    if (oamx->TilePalette[1] == 0x16 &&
+        oamx->TilePalette[2] == 0x27 &&
+        oamx->TilePalette[3] == 0x18) {
+
+        oamx->TilePalette[1] = PLAYER_COLOR_SLOTS + 0;
+        oamx->TilePalette[2] = PLAYER_COLOR_SLOTS + 1;
+        oamx->TilePalette[3] = PLAYER_COLOR_SLOTS + 2;
+
+    } else if (oamx->TilePalette[1] == 0x37 &&
+               oamx->TilePalette[2] == 0x27 &&
+               oamx->TilePalette[3] == 0x16) {
+
+        oamx->TilePalette[1] = PLAYER_COLOR_SLOTS + 3;
+        oamx->TilePalette[2] = PLAYER_COLOR_SLOTS + 4;
+        oamx->TilePalette[3] = PLAYER_COLOR_SLOTS + 5;
+    }
+}
+
+void sta::rgms::MakePlayerPaletteBGR(const uint8_t* paletteBGR, const PlayerColors* colors, PlayerPaletteBGR* out)
+{
+    static const std::array<uint8_t, 6> MARIO_SLOTS = {0x16, 0x27, 0x18, 0x37, 0x27, 0x16};
+
+    std::copy(paletteBGR, paletteBGR + nes::PALETTE_SIZE, out->begin());
+    for (int i = 0; i < 6; i++) {
+        uint8_t entry = MARIO_SLOTS[i];
+        if (colors) {
+            entry = i < 3 ? colors->MarioColors[i] : colors->FireMarioColors[i - 3];
+        }
+        std::copy(paletteBGR + entry * 3, paletteBGR + entry * 3 + 3,
+                out->begin() + (PLAYER_COLOR_SLOTS + i) * 3);
+    }
+}
+
 void SMBCompCombinedViewComponent::MakeImage(SMBComp* comp, nes::PPUx* ppux, SMBCompCombinedViewInfo* view)
 {
     nes::RenderInfo render = DefaultSMBCompRenderInfo(*comp);
@@ -3417,8 +4372,8 @@ void SMBCompCombinedViewComponent::MakeImage(SMBComp* comp, nes::PPUx* ppux, SMB
         struct OtherPlayerInfo {
             int Offset;
             SMBMessageProcessorOutputPtr Out;
-            cv::Mat Oam;
-            cv::Mat Mask;
+            std::shared_ptr<nes::PPUx> Oam; // PALETTE_INDEX, drawn where the alpha is
+            PlayerPaletteBGR PaletteBGR;
         };
         std::vector<uint32_t> otherPlayerIds;
         std::unordered_map<uint32_t, OtherPlayerInfo> otherPlayers;
@@ -3438,13 +4393,16 @@ void SMBCompCombinedViewComponent::MakeImage(SMBComp* comp, nes::PPUx* ppux, SMB
 
                         numer(r) += n2(r);
 
+                        // The sprites on their own, keeping the priority of
+                        // the background they were in front of / behind
+                        info.Oam = std::make_shared<nes::PPUx>(w, h, nes::PPUxPriorityStatus::ENABLED,
+                                nes::PPUxOutputFormat::PALETTE_INDEX);
+                        ppux2.CopyPriorityTo(info.Oam.get());
+                        MakePlayerPaletteBGR(render.PaletteBGR,
+                                comp->Config.Visuals.UsePlayerColors ? &player.Colors : nullptr,
+                                &info.PaletteBGR);
 
-                        uint8_t* bgr = ppux2.GetBGROut();
-                        for (int i = 0; i < w * h * 3; i++) {
-                            bgr[i] = 0x69;
-                        }
-
-                        ppux2.BeginOutline();
+                        info.Oam->BeginOutline();
                         nes::EffectInfo effects = nes::EffectInfo::Defaults();
                         bool mariofound = false;
                         int mariox = -1;
@@ -3452,9 +4410,7 @@ void SMBCompCombinedViewComponent::MakeImage(SMBComp* comp, nes::PPUx* ppux, SMB
                         for (auto oamx : info.Out->Frame.OAMX) {
                             oamx.X += info.Offset;
                             if (smb::IsMarioTile(oamx.TileIndex)) {
-                                if (comp->Config.Visuals.UsePlayerColors) {
-                                    ApplyPlayerColors(&oamx, &player);
-                                }
+                                ApplyPlayerColorSlots(&oamx);
                                 if (!mariofound) {
                                     mariofound = true;
                                     mariox = oamx.X;
@@ -3467,9 +4423,9 @@ void SMBCompCombinedViewComponent::MakeImage(SMBComp* comp, nes::PPUx* ppux, SMB
                                     marioy = oamx.Y;
                                 }
                             }
-                            ppux2.RenderOAMxEntry(oamx, render, effects);
+                            info.Oam->RenderOAMxEntry(oamx, render, effects);
                         }
-                        ppux2.StrokeOutlineO(1.0f, player.Colors.RepresentativeColor, render.PaletteBGR);
+                        info.Oam->StrokeOutlineO(1.0f, player.Colors.RepresentativeColor, render.PaletteBGR);
                         if (mariofound && info.Out->Frame.GameEngineSubroutine != 0x00) {
                             PlayerNameInfo nameinfo;
                             nameinfo.x = mariox;
@@ -3478,20 +4434,6 @@ void SMBCompCombinedViewComponent::MakeImage(SMBComp* comp, nes::PPUx* ppux, SMB
                             playerNames.push_back(nameinfo);
                         }
 
-                        m2.copyTo(info.Oam);
-                        info.Mask = cv::Mat::zeros(h, w, CV_8UC3);
-                        uint8_t* msk = info.Mask.data;
-
-                        for (int i = 0; i < w * h * 3; i+=3) {
-                            if (bgr[i + 0] != 0x69 ||
-                                bgr[i + 1] != 0x69 ||
-                                bgr[i + 2] != 0x69) {
-                                msk[i + 0] = 0xff;
-                                msk[i + 1] = 0xff;
-                                msk[i + 2] = 0xff;
-                            }
-                        }
-
                         otherPlayers[player.UniquePlayerID] = info;
                         otherPlayerIds.push_back(player.UniquePlayerID);
                     }
@@ -3511,15 +4453,7 @@ void SMBCompCombinedViewComponent::MakeImage(SMBComp* comp, nes::PPUx* ppux, SMB
         cv::Mat otherOam = m.clone();
         for (auto & id : otherPlayerIds) {
             auto& info = otherPlayers.at(id);
-
-            uint8_t* d = info.Oam.data;
-            uint8_t* msk = info.Mask.data;
-            uint8_t* o = otherOam.data;
-            for (int i = 0; i < w * h * 3; i++) {
-                if (msk[i] == 0xff) {
-                    o[i] = d[i];
-                }
-            }
+            info.Oam->Resolve(info.PaletteBGR.data(), otherOam.data);
         }
 
         float alpha = comp->Config.Visuals.OtherAlpha;
@@ -3855,10 +4789,10 @@ void SMBCompMinimapViewComponent::DoControls()
 
     const auto& route = m_Competition->StaticData.Categories.Routes.at(
         m_Competition->Config.Tournament.Category);
-    std::vector<smb::WorldSection> visibleSections;
     route->RenderMinimapTo(&ppux, minimap->LeftX,
             smb::DefaultMinimapPalette(),
-            m_Competition->StaticData.Nametables.get(), &visibleSections);
+            m_Competition->StaticData.Nametables.get(), nullptr);
+    auto visibleSections = route->VisibleSections(minimap->LeftX, ppux.GetWidth());
 
     nes::RenderInfo render = DefaultSMBCompRenderInfo(*m_Competition);
 
@@ -3875,7 +4809,7 @@ void SMBCompMinimapViewComponent::DoControls()
 
 
             // Adjust text position to look nice
-            int tx = vsec.XLoc;
+            int tx = vsec.XLoc - minimap->LeftX;
             if (i == 0 && tx < 16) {
                 int lastLevel = 0;
                 for (auto & sec : route->Sections()) {
@@ -3893,7 +4827,7 @@ void SMBCompMinimapViewComponent::DoControls()
             int tw = 3 * 16;
             if (i != visibleSections.size() - 1) {
                 if (visibleSections[i + 1].Level != vsec.Level) {
-                    int endx = visibleSections[i + 1].XLoc - 16;
+                    int endx = visibleSections[i + 1].XLoc - minimap->LeftX - 16;
                     if ((tx + tw) > endx) {
                         tx = endx - tw;
                     }
@@ -4968,10 +5902,14 @@ bool SMBCompApp::OnFrame()
         ImGui::EndMainMenuBar();
     }
 
+    SetSMBZMQFeedKey(m_Competition.Config.Tournament.FeedKey);
+
+    auto now = util::Now();
     for (auto & player : m_Competition.Config.Players.Players) {
         auto feed = GetPlayerFeed(player, &m_Competition.Feeds);
         if (feed) {
             feed->CachedOutput = nullptr;
+            StepSMBCompFeedHealth(feed, now);
         }
     }
 
@@ -5109,6 +6047,7 @@ SMBCompFeed* sta::rgms::GetPlayerFeed(const SMBCompPlayer& player, SMBCompFeeds*
         feeds->Feeds[player.UniquePlayerID] = std::make_unique<SMBCompFeed>();
         feeds->Feeds[player.UniquePlayerID]->UniquePlayerID = player.UniquePlayerID;
         feeds->Feeds[player.UniquePlayerID]->Source = nullptr;
+        InitializeFeedHealth(&feeds->Feeds[player.UniquePlayerID]->Health, util::Now());
         return feeds->Feeds[player.UniquePlayerID].get();
     }
     return it->second.get();
@@ -5172,6 +6111,194 @@ void sta::rgms::InitializeFeedRecording(SMBCompFeed* feed, const SMBCompStaticDa
     }
 }
 
+std::string sta::rgms::ToString(FeedHealthState state)
+{
+    switch (state) {
+        case FeedHealthState::LIVE: return "live";
+        case FeedHealthState::STALE: return "stale";
+        case FeedHealthState::LOST: return "lost";
+        case FeedHealthState::RECOVERING: return "recovering";
+        default: break;
+    }
+    return "unknown";
+}
+
+FeedHealthParameters FeedHealthParameters::Defaults()
+{
+    FeedHealthParameters params;
+    params.StaleMillis = 250;
+    params.LostMillis = SMB_HEARTBEAT_MILLIS * 8;
+    params.RecoverMillis = 1000;
+    return params;
+}
+
+void sta::rgms::InitializeFeedHealth(FeedHealth* health, util::mclock::time_point now,
+        FeedHealthParameters params)
+{
+    health->Params = params;
+    health->State = FeedHealthState::LOST;
+    health->StateSince = now;
+    health->AnyFrame = false;
+    health->LastFrame = now;
+    health->AnyHeartbeat = false;
+    health->LastHeartbeat = now;
+    health->Heartbeat = {};
+}
+
+void sta::rgms::FeedHealthOnFrame(FeedHealth* health, util::mclock::time_point now)
+{
+    health->AnyFrame = true;
+    health->LastFrame = now;
+    StepFeedHealth(health, now);
+}
+
+void sta::rgms::FeedHealthOnHeartbeat(FeedHealth* health, const SMBTransmitterHeartbeat& heartbeat,
+        util::mclock::time_point now)
+{
+    health->AnyHeartbeat = true;
+    health->LastHeartbeat = now;
+    health->Heartbeat = heartbeat;
+    StepFeedHealth(health, now);
+}
+
+void sta::rgms::StepFeedHealth(FeedHealth* health, util::mclock::time_point now)
+{
+    auto& params = health->Params;
+    auto SetState = [&](FeedHealthState state){
+        if (health->State != state) {
+            health->State = state;
+            health->StateSince = now;
+        }
+    };
+
+    bool framesFresh = health->AnyFrame &&
+        util::ElapsedMillis(health->LastFrame, now) <= params.StaleMillis;
+    bool framesAlive = health->AnyFrame &&
+        util::ElapsedMillis(health->LastFrame, now) <= params.LostMillis;
+    bool heartbeatAlive = health->AnyHeartbeat &&
+        util::ElapsedMillis(health->LastHeartbeat, now) <= params.LostMillis;
+
+    if (!framesAlive && !heartbeatAlive) {
+        SetState(FeedHealthState::LOST);
+    } else if (!framesFresh) {
+        SetState(FeedHealthState::STALE);
+    } else if (health->State == FeedHealthState::STALE || health->State == FeedHealthState::LOST) {
+        SetState(FeedHealthState::RECOVERING);
+    } else if (health->State == FeedHealthState::RECOVERING &&
+            util::ElapsedMillis(health->StateSince, now) >= params.RecoverMillis) {
+        SetState(FeedHealthState::LIVE);
+    }
+}
+
+std::string sta::rgms::FeedHealthDescription(const FeedHealth& health, util::mclock::time_point now)
+{
+    std::string since = util::SimpleMillisFormat(util::ElapsedMillis(health.StateSince, now),
+            util::SimpleTimeFormatFlags::MSCS);
+    switch (health.State) {
+        case FeedHealthState::LIVE:
+            return fmt::format("live ({})", since);
+        case FeedHealthState::RECOVERING:
+            return fmt::format("recovering ({})", since);
+        case FeedHealthState::STALE:
+            if (health.AnyHeartbeat && health.Heartbeat.ApproxBytesPerSecond <= 0.0) {
+                return fmt::format("stale ({}) transmitter alive, serial silent", since);
+            }
+            return fmt::format("stale ({}) no frames", since);
+        case FeedHealthState::LOST:
+            if (!health.AnyFrame && !health.AnyHeartbeat) {
+                return "lost (never heard from)";
+            }
+            return fmt::format("lost ({}) no frames or heartbeats", since);
+        default: break;
+    }
+    return "unknown";
+}
+
+void sta::rgms::StepSMBCompFeedHealth(SMBCompFeed* feed, util::mclock::time_point now)
+{
+    ISMBSerialSource* source = nullptr;
+    if (feed->MySMBZMQRef) {
+        source = feed->MySMBZMQRef.get();
+
+        SMBTransmitterHeartbeat heartbeat;
+        util::mclock::time_point receivedAt;
+        if (feed->MySMBZMQRef->GetLatestHeartbeat(&heartbeat, &receivedAt)) {
+            if (!feed->Health.AnyHeartbeat || receivedAt != feed->Health.LastHeartbeat) {
+                FeedHealthOnHeartbeat(&feed->Health, heartbeat, receivedAt);
+            }
+        }
+    } else if (feed->MySMBSerialProcessorThread) {
+        // In process, so always alive. The heartbeat is just the thread info
+        source = feed->MySMBSerialProcessorThread.get();
+
+        SMBSerialProcessorThreadInfo info;
+        feed->MySMBSerialProcessorThread->GetInfo(&info);
+        SMBTransmitterHeartbeat heartbeat = {};
+        HeartbeatFromThreadInfo(info, &heartbeat);
+        FeedHealthOnHeartbeat(&feed->Health, heartbeat, now);
+    } else if (feed->MySMBSerialRecording) {
+        source = feed->MySMBSerialRecording.get();
+    }
+
+    if (source) {
+        auto out = source->GetLatestProcessorOutput();
+        if (out && out != feed->HealthLastOutput) {
+            feed->HealthLastOutput = out;
+            FeedHealthOnFrame(&feed->Health, now);
+        }
+    } else {
+        feed->HealthLastOutput = nullptr;
+    }
+    StepFeedHealth(&feed->Health, now);
+}
+
+int sta::rgms::CheckFeedHealth()
+{
+    int failed = 0;
+    auto check = [&](bool ok, const char* what){
+        if (!ok) {
+            std::cout << "failed: " << what << "\n";
+            failed++;
+        }
+    };
+
+    auto t = util::mclock::time_point{};
+    auto ms = [&](int64_t millis){ return t + util::ToDuration(millis); };
+
+    FeedHealth health;
+    InitializeFeedHealth(&health, ms(0));
+    check(health.State == FeedHealthState::LOST, "starts lost");
+
+    // frames start arriving, recover then go live
+    FeedHealthOnFrame(&health, ms(10));
+    check(health.State == FeedHealthState::RECOVERING, "first frame recovers");
+    for (int64_t i = 10; i <= 1100; i += 16) {
+        FeedHealthOnFrame(&health, ms(i));
+    }
+    check(health.State == FeedHealthState::LIVE, "steady frames go live");
+
+    // console paused / cable pulled, heartbeats continue
+    SMBTransmitterHeartbeat heartbeat = {};
+    for (int64_t i = 1100; i <= 5000; i += SMB_HEARTBEAT_MILLIS) {
+        FeedHealthOnHeartbeat(&health, heartbeat, ms(i));
+    }
+    check(health.State == FeedHealthState::STALE, "heartbeats without frames go stale");
+
+    // transmitter dies
+    StepFeedHealth(&health, ms(5000 + health.Params.LostMillis + 1));
+    check(health.State == FeedHealthState::LOST, "no heartbeats go lost");
+
+    // comes back
+    FeedHealthOnFrame(&health, ms(10000));
+    check(health.State == FeedHealthState::RECOVERING, "frames again recover");
+    FeedHealthOnFrame(&health, ms(10000 + health.Params.StaleMillis + 1));
+    StepFeedHealth(&health, ms(10000 + health.Params.StaleMillis * 2 + 2));
+    check(health.State == FeedHealthState::STALE, "a gap in frames goes stale");
+
+    std::cout << fmt::format("feed health: {} checks failed\n", failed);
+    return failed;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
 bool sta::rgms::MarioInOutput(SMBMessageProcessorOutputPtr out, int* mariox, int* marioy)
@@ -5277,7 +6404,8 @@ void sta::rgms::DrawTowerState(nes::PPUx* ppux, int x, int y,
     ppux->BeginOutline();
     ppux->RenderString(x + 6, y + 4, state.Title, font.data(), tpal.data(), palette.data(), 2,
             nes::EffectInfo::Defaults());
-    ppux->RenderString(x + w - 8 * state.Subtitle.size()-4, y + 4, state.Subtitle, font.data(), tpal.data(), palette.data(), 1,
+    ppux->RenderString(nes::AlignText(x + w - 4, nes::MeasureString(state.Subtitle, 1), nes::TextAlign::RIGHT),
+            y + 4, state.Subtitle, font.data(), tpal.data(), palette.data(), 1,
             nes::EffectInfo::Defaults());
 
     ppux->StrokeOutlineO(1.0f, nes::PALETTE_ENTRY_BLACK, palette.data());
@@ -5320,7 +6448,8 @@ void sta::rgms::DrawTowerState(nes::PPUx* ppux, int x, int y,
                  {c, c}},
                  palette.data(), nes::EffectInfo::Defaults());
 
-        ppux->RenderString(qx + 27, qy, entry.Name, font.data(), textpal, palette.data(), 1,
+        // Up to the '+' of the time
+        ppux->RenderString(qx + 27, qy, nes::FitString(entry.Name, 10 * 8, 1), font.data(), textpal, palette.data(), 1,
                 nes::EffectInfo::Defaults());
 
         std::string time;
@@ -5914,7 +7043,8 @@ void sta::rgms::DrawFinalTimes(nes::PPUx* ppux, int x, int y,
         ppux->RenderString(qx - 16, qy, fmt::format("{}", te.Position), font.data(), tpal.data(), palette.data(), 1, nes::EffectInfo::Defaults());
         ppux->RenderString(qx, qy, te.Name, font.data(), tpal.data(), palette.data(), 1, nes::EffectInfo::Defaults());
 
-        ppux->RenderString(w - te.Text.size() * 8 - 16, qy, te.Text, font.data(), tpal.data(), palette.data(), 1, nes::EffectInfo::Defaults());
+        ppux->RenderString(nes::AlignText(w - 16, nes::MeasureString(te.Text, 1), nes::TextAlign::RIGHT),
+                qy, te.Text, font.data(), tpal.data(), palette.data(), 1, nes::EffectInfo::Defaults());
 
         ppux->StrokeOutlineO(1.0f, nes::PALETTE_ENTRY_BLACK, palette.data());
 
@@ -9695,7 +10825,17 @@ void sta::rgms::RenderSMBToPPUX(const SMBFrameInfo& frame, const nes::FramePalet
 RecReviewDB::RecReviewDB(const std::string& path)
     : SQLiteExtDB(path)
 {
-    ExecOrThrow(RecRecordingSchema());
+    MigrateOrThrow("rec_review", Migrations());
+}
+
+const std::vector<sqliteext::SQLiteExtMigration>& RecReviewDB::Migrations()
+{
+    static std::vector<sqliteext::SQLiteExtMigration> s_Migrations = {
+        {1, "recordings", [](sqliteext::SQLiteExtDB* db){
+            db->ExecOrThrow(RecRecordingSchema());
+        }},
+    };
+    return s_Migrations;
 }
 
 const char* RecReviewDB::RecRecordingSchema()
@@ -9716,10 +10856,9 @@ RecReviewDB::~RecReviewDB()
 
 void RecReviewDB::GetAllRecordings(std::vector<db::rec_recording>* recordings)
 {
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         SELECT * FROM rec_recording;
-    )", &stmt);
+    )");
 
     recordings->clear();
     while (sqlite3_step(stmt) == SQLITE_ROW) {
@@ -9732,21 +10871,19 @@ void RecReviewDB::GetAllRecordings(std::vector<db::rec_recording>* recordings)
         recording.elapsed_millis = sqlite3_column_int(stmt, 5);
         recordings->push_back(recording);
     }
-    sqlite3_finalize(stmt);
 }
 
 void RecReviewDB::InsertRecording(const db::rec_recording& recording)
 {
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         INSERT INTO rec_recording (import_path, iso_timestamp, unix_timestamp, offset_millis, elapsed_millis) VALUES (?, ?, ?, ?, ?);
-    )", &stmt);
+    )");
     sqliteext::BindStrOrThrow(stmt, 1, recording.import_path);
     sqliteext::BindStrOrThrow(stmt, 2, recording.iso_timestamp);
     sqliteext::BindInt64OrThrow(stmt, 3, recording.unix_timestamp);
     sqliteext::BindInt64OrThrow(stmt, 4, recording.offset_millis);
     sqliteext::BindInt64OrThrow(stmt, 5, recording.elapsed_millis);
-    sqliteext::StepAndFinalizeOrThrow(stmt);
+    sqliteext::StepDoneOrThrow(stmt);
 }
 
 RecReviewApp::RecReviewApp(sta::RuntimeConfig* config)
@@ -10159,3 +11296,274 @@ void SMBCompLatencyHandler::DoControls()
         ImGui::PopID();
     }
 }
+
+////////////////////////////////////////////////////////////////////////////////
+
+ReplayServerParameters ReplayServerParameters::Defaults()
+{
+    ReplayServerParameters params;
+    params.Target = "tcp://0.0.0.0:5555";
+    params.ControlTarget = "tcp://0.0.0.0:5554";
+    params.TickMillis = 4;
+    params.Play = false;
+    params.Speed = 1.0;
+    params.Key.clear();
+    return params;
+}
+
+void sta::rgms::ReplayServerRecordingsAt(RecReviewDB* db, int64_t unixMillis,
+        std::vector<ReplayServerRecording>* recordings)
+{
+    std::vector<db::rec_recording> recs;
+    db->GetAllRecordings(&recs);
+
+    recordings->clear();
+    for (auto & rec : recs) {
+        int64_t start = rec.unix_timestamp * 1000 + rec.offset_millis;
+        int64_t end = start + rec.elapsed_millis;
+        if (unixMillis >= start && unixMillis <= end) {
+            ReplayServerRecording recording;
+            recording.Path = rec.import_path;
+            recording.Name = fmt::format("seat{}", recordings->size() + 1);
+            recording.Offset = unixMillis - start;
+            recordings->push_back(recording);
+        }
+    }
+}
+
+ReplayServer::ReplayServer(smb::SMBNametableCachePtr nametables,
+        const std::vector<ReplayServerRecording>& recordings,
+        ReplayServerParameters params)
+    : m_Params(params)
+    , m_Playing(params.Play)
+    , m_Speed(params.Speed)
+    , m_ProgramMillis(0.0)
+    , m_LastTick(util::Now())
+    , m_Context(2)
+    , m_Socket(m_Context, zmq::socket_type::pub)
+    , m_ControlSocket(m_Context, zmq::socket_type::rep)
+    , m_ClockSocket(m_Context, zmq::socket_type::rep)
+    , m_ClockBound(false)
+    , m_ShouldStop(false)
+{
+    for (auto & recording : recordings) {
+        Served served;
+        served.Info = recording;
+        served.Recording = std::make_unique<SMBSerialRecording>(recording.Path, nametables);
+        served.Recording->SetPaused(true);
+        served.TotalMillis = served.Recording->GetTotalElapsedMillis();
+        served.Jumped = true;
+        served.Sent = 0;
+        served.Heartbeat = {};
+        m_Served.push_back(std::move(served));
+    }
+
+    m_Authenticator.SetKey(params.Key);
+    m_Socket.bind(params.Target);
+    m_ControlSocket.bind(params.ControlTarget);
+    // Receivers will ask, the recordings are in our time anyway
+    std::string clockTarget = ClockEndpointFromFeedEndpoint(params.Target);
+    try {
+        m_ClockSocket.bind(clockTarget);
+        m_ClockBound = true;
+    } catch (zmq::error_t& e) {
+        spdlog::error("unable to bind clock socket {} (feed port + {}): {}, receivers will assume the clocks agree",
+                clockTarget, SMB_CLOCK_PORT_OFFSET, e.what());
+    }
+
+    m_Thread = std::thread(&ReplayServer::TimerThread, this);
+}
+
+ReplayServer::~ReplayServer()
+{
+    m_ShouldStop = true;
+    m_Thread.join();
+}
+
+void ReplayServer::TimerThread()
+{
+    TransmitterClock clock = {};
+    auto lastHeartbeat = util::Now();
+    auto start = lastHeartbeat;
+    std::vector<uint8_t> authbuffer;
+    std::vector<uint8_t> hbbuffer;
+    const std::string hbTopic = "smbhb";
+
+    std::vector<zmq::pollitem_t> items;
+    items.push_back({static_cast<void*>(m_ControlSocket), 0, ZMQ_POLLIN, 0});
+    if (m_ClockBound) {
+        items.push_back({static_cast<void*>(m_ClockSocket), 0, ZMQ_POLLIN, 0});
+    }
+
+    auto nextTick = util::Now();
+    while (!m_ShouldStop) {
+        auto now = util::Now();
+        int64_t timeout = std::max<int64_t>(0, util::ElapsedMillis(now, nextTick));
+        zmq::poll(items.data(), items.size(), std::chrono::milliseconds(timeout));
+
+        while (true) {
+            zmq::message_t msg;
+            if (!m_ControlSocket.recv(msg, zmq::recv_flags::dontwait)) {
+                break;
+            }
+            std::string reply = HandleCommand(msg.to_string());
+            m_ControlSocket.send(zmq::message_t(reply.data(), reply.size()), zmq::send_flags::none);
+        }
+        if (m_ClockBound) {
+            AnswerClockRequests(&m_ClockSocket, clock);
+        }
+
+        now = util::Now();
+        if (now >= nextTick) {
+            Tick(now);
+            nextTick = now + util::ToDuration(m_Params.TickMillis);
+        }
+
+        if (util::ElapsedMillis(lastHeartbeat, now) >= SMB_HEARTBEAT_MILLIS) {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            for (auto & served : m_Served) {
+                served.Heartbeat.Elapsed = util::ElapsedMillis(start, now);
+                served.Heartbeat.Sequence++;
+                served.Heartbeat.FramesSent = served.Sent;
+                HeartbeatToBytes(served.Heartbeat, &hbbuffer);
+                PublishFeedMessage(&m_Socket, &m_Authenticator, {
+                        {reinterpret_cast<const uint8_t*>(hbTopic.data()), hbTopic.size()},
+                        {reinterpret_cast<const uint8_t*>(served.Info.Name.data()), served.Info.Name.size()},
+                        {hbbuffer.data(), hbbuffer.size()}}, &authbuffer);
+            }
+            lastHeartbeat = now;
+        }
+    }
+}
+
+void ReplayServer::Tick(util::mclock::time_point now)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    if (m_Playing) {
+        m_ProgramMillis += m_Speed * static_cast<double>(
+                std::chrono::duration_cast<std::chrono::microseconds>(now - m_LastTick).count()) / 1000.0;
+    }
+    m_LastTick = now;
+
+    std::vector<uint8_t> buffer;
+    std::vector<uint8_t> authbuffer;
+    const std::string topic = "smb";
+    for (auto & served : m_Served) {
+        int64_t target = std::max<int64_t>(0,
+                served.Info.Offset + static_cast<int64_t>(m_ProgramMillis));
+        if (target < served.Recording->GetCurrentElapsedMillis()) {
+            // the processor only goes forward, so go again from the top
+            served.Recording->Reset();
+            served.Jumped = true;
+        }
+        if (target - served.Recording->GetCurrentElapsedMillis() > 1000) {
+            served.Jumped = true;
+        }
+        served.Recording->StartAt(target);
+
+        // After a seek only the latest frame is of interest
+        SMBMessageProcessorOutputPtr p;
+        if (served.Jumped) {
+            while (auto q = served.Recording->GetNextProcessorOutput()) {
+                p = q;
+            }
+            served.Jumped = false;
+        } else {
+            p = served.Recording->GetNextProcessorOutput();
+        }
+
+        while (p) {
+            if (p->Frame.NTDiffs.size() > 5000) {
+                p->Frame.NTDiffs.resize(5000);
+            }
+            OutputToBytes(p, &buffer);
+            int64_t txtime = ToMicros(now);
+            PublishFeedMessage(&m_Socket, &m_Authenticator, {
+                    {reinterpret_cast<const uint8_t*>(topic.data()), topic.size()},
+                    {reinterpret_cast<const uint8_t*>(served.Info.Name.data()), served.Info.Name.size()},
+                    {buffer.data(), buffer.size()},
+                    {reinterpret_cast<const uint8_t*>(&txtime), sizeof(txtime)}}, &authbuffer);
+            served.Sent++;
+
+            p = served.Recording->GetNextProcessorOutput();
+        }
+    }
+}
+
+std::string ReplayServer::HandleCommand(const std::string& command)
+{
+    std::istringstream is(command);
+    std::string action;
+    is >> action;
+
+    if (action == "status") {
+        return Status().dump();
+    }
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    if (action == "play") {
+        if (!m_Playing) {
+            m_Playing = true;
+            m_LastTick = util::Now();
+        }
+    } else if (action == "pause") {
+        m_Playing = false;
+    } else if (action == "speed") {
+        double speed;
+        if (!(is >> speed) || speed <= 0.0) {
+            return "error: speed <x> expected a positive number";
+        }
+        m_Speed = speed;
+    } else if (action == "seek") {
+        std::vector<std::string> args;
+        std::string arg;
+        while (is >> arg) {
+            args.push_back(arg);
+        }
+
+        try {
+            if (args.size() == 1) {
+                m_ProgramMillis = static_cast<double>(std::stoll(args[0]));
+            } else if (args.size() == 2) {
+                auto it = std::find_if(m_Served.begin(), m_Served.end(), [&](const Served& served){
+                    return served.Info.Name == args[0];
+                });
+                if (it == m_Served.end()) {
+                    return fmt::format("error: no recording named '{}'", args[0]);
+                }
+                it->Info.Offset = std::stoll(args[1]) - static_cast<int64_t>(m_ProgramMillis);
+            } else {
+                return "error: seek <millis> | seek <name> <millis>";
+            }
+        } catch (std::exception& e) {
+            return fmt::format("error: {}", e.what());
+        }
+    } else {
+        return fmt::format("error: unknown command '{}'", action);
+    }
+    return "ok";
+}
+
+nlohmann::json ReplayServer::Status()
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+
+    nlohmann::json j;
+    j["playing"] = m_Playing;
+    j["speed"] = m_Speed;
+    j["program_millis"] = static_cast<int64_t>(m_ProgramMillis);
+    j["recordings"] = nlohmann::json::array();
+    for (auto & served : m_Served) {
+        nlohmann::json r;
+        r["name"] = served.Info.Name;
+        r["path"] = served.Info.Path;
+        r["offset"] = served.Info.Offset;
+        r["position"] = served.Recording->GetCurrentElapsedMillis();
+        r["total"] = served.TotalMillis;
+        r["sent"] = served.Sent;
+        r["done"] = served.Recording->Done();
+        j["recordings"].push_back(r);
+    }
+    return j;
+}
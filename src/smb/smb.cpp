@@ -32,6 +32,16 @@ AreaID sta::smb::AreaIDFromRAM(uint8_t area_data_low, uint8_t area_data_high)
     return static_cast<AreaID>(area_id);
 }
 
+int sta::smb::AreaPointerXFromData(uint8_t screenedge_pageloc, uint8_t screenedge_x_pos,
+        AreaID aid, uint8_t block_buffer_84_disc)
+{
+    int apx = 256 * static_cast<int>(screenedge_pageloc) + static_cast<int>(screenedge_x_pos);
+    if (apx < 512 && aid == AreaID::CASTLE_AREA_6 && block_buffer_84_disc != 0x00) { // #BIG YIKES
+        apx += 1024;
+    }
+    return apx;
+}
+
 const std::vector<AreaID>& sta::smb::KnownAreaIDs()
 {
     static std::vector<AreaID> s_AreaIDs = {
@@ -369,6 +379,101 @@ void sta::smb::RenderMinimapToPPUx(int x, int y, const nes::EffectInfo& effects,
     }
 }
 
+uint64_t Route::AreaKey(AreaID id, int world, int level)
+{
+    // These are in more than one world, and match in any of them
+    if (id == AreaID::UNDERGROUND_AREA_1 || id == AreaID::GROUND_AREA_16) {
+        world = -1;
+        level = -1;
+    }
+    // World and level are a byte of RAM each, well within 16 bits
+    return (static_cast<uint64_t>(id) << 32) |
+        (static_cast<uint64_t>(static_cast<uint16_t>(world)) << 16) |
+        static_cast<uint64_t>(static_cast<uint16_t>(level));
+}
+
+void Route::BuildIndex()
+{
+    m_AreaSections.clear();
+    m_CategoryX.clear();
+    m_XLoc.clear();
+    m_MaxXLocRight.clear();
+    m_SortedByXLoc = true;
+
+    std::map<uint64_t, std::vector<size_t>> byArea;
+    int lx = 0;
+    for (size_t i = 0; i < m_Route.size(); i++) {
+        auto& sec = m_Route[i];
+        m_CategoryX.push_back(lx);
+        lx += sec.Right - sec.Left - 1 + 16;
+
+        if (i > 0 && sec.XLoc < m_Route[i - 1].XLoc) {
+            m_SortedByXLoc = false;
+        }
+        int rx = sec.XLoc + sec.Width();
+        m_XLoc.push_back(sec.XLoc);
+        m_MaxXLocRight.push_back(i == 0 ? rx : std::max(rx, m_MaxXLocRight.back()));
+
+        byArea[AreaKey(sec.AID, sec.World, sec.Level)].push_back(i);
+    }
+
+    for (auto & [key, indices] : byArea) {
+        std::stable_sort(indices.begin(), indices.end(), [&](size_t l, size_t r){
+            return m_Route[l].Left < m_Route[r].Left;
+        });
+        auto& area = m_AreaSections[key];
+        for (auto i : indices) {
+            area.Left.push_back(m_Route[i].Left);
+            area.MaxRight.push_back(area.MaxRight.empty() ? m_Route[i].Right :
+                    std::max(m_Route[i].Right, area.MaxRight.back()));
+            area.Section.push_back(i);
+        }
+    }
+    m_Indexed = true;
+}
+
+// [first, last) from the first visible section to the last
+bool Route::VisibleRange(int xloc, int width, size_t* first, size_t* last) const
+{
+    int rxloc = xloc + width;
+    auto visible = [&](const WorldSection& sec){
+        int rx = sec.XLoc + sec.Width();
+        return !(rx < xloc || sec.XLoc > rxloc);
+    };
+
+    if (m_Indexed && m_SortedByXLoc) {
+        // The first whose right edge (or one before it) reaches xloc, up to
+        // the first that starts past rxloc
+        size_t b = std::lower_bound(m_MaxXLocRight.begin(), m_MaxXLocRight.end(), xloc) - m_MaxXLocRight.begin();
+        size_t e = std::upper_bound(m_XLoc.begin(), m_XLoc.end(), rxloc) - m_XLoc.begin();
+        if (b >= e) {
+            return false;
+        }
+        while (!visible(m_Route[e - 1])) {
+            e--;
+        }
+        *first = b;
+        *last = e;
+        return true;
+    }
+
+    bool found = false;
+    for (size_t i = 0; i < m_Route.size(); i++) {
+        auto& sec = m_Route[i];
+        if (visible(sec)) {
+            if (!found) {
+                *first = i;
+            }
+            *last = i + 1;
+            found = true;
+        }
+        if (sec.XLoc > rxloc) {
+            break;
+        }
+    }
+    return found;
+}
+
 void Route::GetVisibleSections(int xloc, int width, std::vector<WorldSection>* sections) const
 {
     if (!sections || width <= 0) {
@@ -376,9 +481,14 @@ void Route::GetVisibleSections(int xloc, int width, std::vector<WorldSection>* s
     }
     sections->clear();
 
-    int rxloc = xloc + width;
+    size_t first, last;
+    if (!VisibleRange(xloc, width, &first, &last)) {
+        return;
+    }
 
-    for (auto & sec : m_Route) {
+    int rxloc = xloc + width;
+    for (size_t i = first; i < last; i++) {
+        auto& sec = m_Route[i];
         int rx = sec.XLoc + sec.Width();
 
         if (!(rx < xloc || sec.XLoc > rxloc)) {
@@ -387,12 +497,18 @@ void Route::GetVisibleSections(int xloc, int width, std::vector<WorldSection>* s
             vsec.SectionIndex = sections->size();
             sections->push_back(vsec);
         }
-        if (sec.XLoc > rxloc) {
-            break;
-        }
     }
 }
 
+std::span<const WorldSection> Route::VisibleSections(int xloc, int width) const
+{
+    size_t first, last;
+    if (width <= 0 || !VisibleRange(xloc, width, &first, &last)) {
+        return {};
+    }
+    return std::span<const WorldSection>(m_Route.data() + first, last - first);
+}
+
 void Route::RenderMinimapTo(nes::PPUx* ppux, int categoryX,
         const MinimapPalette& minimapPalette,
         const INametableCache* nametables,
@@ -421,6 +537,35 @@ void Route::RenderMinimapTo(nes::PPUx* ppux, int categoryX,
 
 bool Route::InCategory(AreaID id, int apx, int world, int level, int* categoryX, int* sectionIndex) const
 {
+    if (m_Indexed) {
+        auto it = m_AreaSections.find(AreaKey(id, world, level));
+        if (it == m_AreaSections.end()) {
+            return false;
+        }
+
+        // The first section in the route with Left <= apx < Right. Looking
+        // back from the last that starts at or before apx, until none before
+        // reach past it
+        auto& area = it->second;
+        size_t j = std::upper_bound(area.Left.begin(), area.Left.end(), apx) - area.Left.begin();
+        size_t found = m_Route.size();
+        while (j > 0) {
+            j--;
+            if (area.MaxRight[j] <= apx) {
+                break;
+            }
+            if (apx < m_Route[area.Section[j]].Right) {
+                found = std::min(found, area.Section[j]);
+            }
+        }
+        if (found == m_Route.size()) {
+            return false;
+        }
+        if (categoryX) *categoryX = m_CategoryX[found] + apx - m_Route[found].Left;
+        if (sectionIndex) *sectionIndex = static_cast<int>(found);
+        return true;
+    }
+
     int lx = 0;
     int i = 0;
     for (auto & sec : m_Route) {
@@ -448,6 +593,45 @@ bool Route::InCategory(AreaID id, int apx, int world, int level, int* categoryX,
 
 }
 
+void sta::smb::MinimapFromNametable(const nes::NameTable& nametable,
+        const nes::FramePalette& framePalette, const uint8_t* patternTable,
+        MinimapImage* minimap)
+{
+    if (!minimap || !patternTable) return;
+
+    // The shade of each of the frame palette's colors: 1 lightest, 3 darkest
+    const nes::Palette& palette = nes::DefaultPaletteBGR();
+    std::array<uint8_t, nes::FRAMEPALETTE_SIZE> shade;
+    for (int i = 0; i < nes::FRAMEPALETTE_SIZE; i++) {
+        const uint8_t* bgr = palette.data() + (framePalette[i] % nes::PALETTE_ENTRIES) * 3;
+        int luma = (bgr[0] * 29 + bgr[1] * 150 + bgr[2] * 77) >> 8;
+        shade[i] = luma >= 170 ? 1 : (luma >= 85 ? 2 : 3);
+    }
+
+    nes::DecodedPatternTablePtr decoded = nes::GetDecodedPatternTable(patternTable);
+    minimap->fill(0x00);
+    for (int iy = 0; iy < nes::NAMETABLE_HEIGHT_BYTES; iy++) {
+        for (int ix = 0; ix < nes::NAMETABLE_WIDTH_BYTES; ix++) {
+            uint8_t tile = nametable[iy * nes::NAMETABLE_WIDTH_BYTES + ix];
+            uint8_t attr = nametable[nes::NAMETABLE_ATTRIBUTE_OFFSET + (iy / 4) * 8 + ix / 4];
+            attr = (attr >> (((ix % 4) / 2 + ((iy % 4) / 2) * 2) * 2)) & 0b11;
+
+            const uint8_t* pixels = decoded->Tile(tile, false, false);
+            for (int y = 0; y < 8; y++) {
+                for (int x = 0; x < 8; x++) {
+                    uint8_t v = pixels[y * 8 + x];
+                    if (!v) continue;
+
+                    // Four pixels a byte, the leftmost in the low bits, as
+                    // RenderMinimapToPPUx reads them
+                    int i = (iy * 8 + y) * nes::FRAME_WIDTH + ix * 8 + x;
+                    (*minimap)[i / 4] |= shade[attr * 4 + v] << ((i % 4) * 2);
+                }
+            }
+        }
+    }
+}
+
 bool sta::smb::IsMarioTile(uint8_t tileIndex)
 {
     return (tileIndex >= 0x00 && tileIndex <= 0x4f ||
@@ -458,6 +642,211 @@ bool sta::smb::IsMarioTile(uint8_t tileIndex)
 }
 
 
+// 64 bit FNV-1a
+static void HashBytes(uint64_t* hash, const void* data, size_t n)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < n; i++) {
+        *hash ^= p[i];
+        *hash *= 0x100000001b3ULL;
+    }
+}
+
+size_t NametablePageImageCache::Image::Bytes() const
+{
+    return BGR.size() + BackgroundMask.size();
+}
+
+NametablePageImageCache::NametablePageImageCache(size_t budgetBytes)
+    : m_Budget(budgetBytes)
+    , m_Bytes(0)
+    , m_Hits(0)
+    , m_Misses(0)
+    , m_Evictions(0)
+{
+}
+
+NametablePageImageCache::ImagePtr NametablePageImageCache::Get(AreaID id, int page,
+        const nes::NameTable& nametable, const uint8_t* patternTable,
+        const uint8_t* framePalette, const uint8_t* paletteBGR, int scale)
+{
+    if (scale <= 0) {
+        throw std::invalid_argument("NametablePageImageCache::Get, invalid scale");
+    }
+
+    // The decoded table is looked up by address and checked against the
+    // contents, so its address stands in for the pattern table
+    nes::DecodedPatternTablePtr decoded = nes::GetDecodedPatternTable(patternTable);
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    HashBytes(&hash, framePalette, nes::FRAMEPALETTE_SIZE);
+    HashBytes(&hash, paletteBGR, nes::PALETTE_SIZE);
+    const nes::DecodedPatternTable* decodedAddress = decoded.get();
+    HashBytes(&hash, &decodedAddress, sizeof(decodedAddress));
+    Key key(id, page, scale, hash);
+
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        if (m_Budget == 0) {
+            return nullptr;
+        }
+        auto it = m_Images.find(key);
+        if (it != m_Images.end()) {
+            m_Hits++;
+            m_Order.splice(m_Order.begin(), m_Order, it->second.second);
+            return it->second.first;
+        }
+        m_Misses++;
+    }
+
+    // Drawn without the lock held. Two threads missing the same page both
+    // draw it, and the first one stored is kept
+    auto image = std::make_shared<Image>();
+    image->Scale = scale;
+    image->Decoded = decoded;
+
+    int width = nes::NAMETABLE_WIDTH_BYTES * 8 * scale;
+    int height = nes::NAMETABLE_HEIGHT_BYTES * 8 * scale;
+    nes::PPUx ppux(width, height, nes::PPUxPriorityStatus::DISABLED);
+    ppux.RenderNametable(0, 0, nes::NAMETABLE_WIDTH_BYTES, nes::NAMETABLE_HEIGHT_BYTES,
+            nametable.data(), nametable.data() + nes::NAMETABLE_ATTRIBUTE_OFFSET,
+            patternTable, framePalette, paletteBGR, scale, nes::EffectInfo::Defaults());
+    image->BGR.assign(ppux.GetBGROut(), ppux.GetBGROut() + width * height * 3);
+
+    image->BackgroundMask.resize(width * height);
+    for (int iy = 0; iy < nes::NAMETABLE_HEIGHT_BYTES; iy++) {
+        for (int ix = 0; ix < nes::NAMETABLE_WIDTH_BYTES; ix++) {
+            const uint8_t* pixels = decoded->Tile(nametable[iy * nes::NAMETABLE_WIDTH_BYTES + ix], false, false);
+            for (int y = 0; y < 8 * scale; y++) {
+                uint8_t* mask = image->BackgroundMask.data() +
+                    static_cast<size_t>(iy * 8 * scale + y) * width + ix * 8 * scale;
+                const uint8_t* row = pixels + (y / scale) * 8;
+                for (int x = 0; x < 8 * scale; x++) {
+                    mask[x] = row[x / scale] != 0;
+                }
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    auto it = m_Images.find(key);
+    if (it != m_Images.end()) {
+        return it->second.first;
+    }
+    if (image->Bytes() > m_Budget) {
+        return image;
+    }
+    m_Order.push_front(key);
+    m_Images.emplace(key, std::make_pair(image, m_Order.begin()));
+    m_Bytes += image->Bytes();
+    EvictToBudget();
+    return image;
+}
+
+void NametablePageImageCache::EvictToBudget()
+{
+    while (m_Bytes > m_Budget && !m_Order.empty()) {
+        auto it = m_Images.find(m_Order.back());
+        m_Bytes -= it->second.first->Bytes();
+        m_Images.erase(it);
+        m_Order.pop_back();
+        m_Evictions++;
+    }
+}
+
+void NametablePageImageCache::SetBudget(size_t budgetBytes)
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Budget = budgetBytes;
+    EvictToBudget();
+}
+
+size_t NametablePageImageCache::GetBudget() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    return m_Budget;
+}
+
+void NametablePageImageCache::Clear()
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    m_Images.clear();
+    m_Order.clear();
+    m_Bytes = 0;
+    m_Hits = 0;
+    m_Misses = 0;
+    m_Evictions = 0;
+}
+
+NametablePageImageCache::Counters NametablePageImageCache::GetCounters() const
+{
+    std::lock_guard<std::mutex> lock(m_Mutex);
+    Counters counters;
+    counters.Hits = m_Hits;
+    counters.Misses = m_Misses;
+    counters.Evictions = m_Evictions;
+    counters.Bytes = m_Bytes;
+    counters.Pages = m_Images.size();
+    return counters;
+}
+
+NametablePageImageCache* INametableCache::PageImages() const
+{
+    return m_PageImages.get();
+}
+
+// The cached page copied in, with only the tiles that a diff touches (an
+// attribute diff touches the 4x4 tiles under it) drawn again on top
+static void BlitPageImage(nes::PPUx* ppux, const nes::Nametablex& ntx,
+        const nes::RenderInfo& render, const nes::EffectInfo& effects,
+        const NametablePageImageCache::Image& image,
+        const std::vector<SMBNametableDiff>* diffs, int page,
+        const nes::NametableOverlay& overlay)
+{
+    std::bitset<nes::NAMETABLE_ATTRIBUTE_OFFSET> skip;
+    if (diffs) {
+        for (auto & diff : *diffs) {
+            if (diff.NametablePage != page) continue;
+            if (diff.Offset < nes::NAMETABLE_ATTRIBUTE_OFFSET) {
+                skip.set(diff.Offset);
+                continue;
+            }
+            int a = diff.Offset - nes::NAMETABLE_ATTRIBUTE_OFFSET;
+            int cy = a / 8;
+            int cx = a % 8;
+            for (int iy = cy * 4; iy < std::min(cy * 4 + 4, nes::NAMETABLE_HEIGHT_BYTES); iy++) {
+                for (int ix = cx * 4; ix < cx * 4 + 4; ix++) {
+                    skip.set(iy * nes::NAMETABLE_WIDTH_BYTES + ix);
+                }
+            }
+        }
+    }
+
+    int tx = ntx.X * render.Scale + render.OffX;
+    int ty = ntx.Y * render.Scale + render.OffY;
+    ppux->BlitNametableImage(tx, ty, image.Scale, image.BGR.data(), image.BackgroundMask.data(),
+            skip.any() ? &skip : nullptr, effects);
+    if (skip.none()) {
+        return;
+    }
+
+    const uint8_t* nt = ntx.NametableP->data();
+    for (int iy = 0; iy < nes::NAMETABLE_HEIGHT_BYTES; iy++) {
+        for (int ix = 0; ix < nes::NAMETABLE_WIDTH_BYTES; ix++) {
+            int tileOffset = iy * nes::NAMETABLE_WIDTH_BYTES + ix;
+            if (!skip.test(tileOffset)) continue;
+
+            int attrOffset = nes::NAMETABLE_ATTRIBUTE_OFFSET + (iy / 4) * 8 + ix / 4;
+            uint8_t tile = overlay.Get(tileOffset, nt[tileOffset]);
+            uint8_t attr = overlay.Get(attrOffset, nt[attrOffset]);
+            attr >>= ((ix % 4) / 2 + ((iy % 4) / 2) * 2) * 2;
+
+            ppux->RenderNametableEntry(tx + ix * 8 * render.Scale, ty + iy * 8 * render.Scale,
+                    tile, attr & 0b00000011, render.PatternTables.at(ntx.PatternTableIndex),
+                    ntx.FramePalette.data(), render.PaletteBGR, render.Scale, effects);
+        }
+    }
+}
+
 void INametableCache::RenderTo(AreaID id, int apx, int width, nes::PPUx* ppux,
         int x, const nes::Palette& pal, const uint8_t* pt,
         const MinimapPalette* minimap, const uint8_t* fpal,
@@ -488,6 +877,20 @@ void INametableCache::RenderTo(AreaID id, int apx, int width, nes::PPUx* ppux,
     int sx = x - xoff;
     int wr = -xoff;
 
+    // The diffs are drawn over the cached page rather than applied to a copy
+    // of it, so that nothing here changes and several threads can render at
+    // once
+    nes::NametableOverlay overlay;
+
+    // Whole pages are copied from the page images when the result is the
+    // same as drawing them
+    NametablePageImageCache* pageImages = nullptr;
+    if (!minimap && m_PageImages && m_PageImages->GetBudget() > 0 &&
+            ppux->GetOutputFormat() == nes::PPUxOutputFormat::BGR &&
+            !ppux->GetReferenceRendering()) {
+        pageImages = m_PageImages.get();
+    }
+
     while (wr < width) {
         auto* nt = Nametable(id, page);
         if (nt) {
@@ -511,20 +914,25 @@ void INametableCache::RenderTo(AreaID id, int apx, int width, nes::PPUx* ppux,
                 }
                 ntx.PatternTableIndex = 0;
 
+                overlay.Clear();
                 if (diffs) {
                     for (auto & diff : *diffs) {
                         if (diff.NametablePage == page) {
-                            if (ntx.NametableP != &BufferTable) {
-                                ntx.NametableP = &BufferTable;
-                                BufferTable = *nt;
-                            }
-
-                            BufferTable[diff.Offset] = diff.Value;
+                            overlay.Set(diff.Offset, diff.Value);
                         }
                     }
                 }
 
-                ppux->RenderNametableX(ntx, render, effects);
+                NametablePageImageCache::ImagePtr image;
+                if (pageImages) {
+                    image = pageImages->Get(id, page, *nt, pt, ntx.FramePalette.data(),
+                            render.PaletteBGR, render.Scale);
+                }
+                if (image) {
+                    BlitPageImage(ppux, ntx, render, effects, *image, diffs, page, overlay);
+                } else {
+                    ppux->RenderNametableX(ntx, render, effects, &overlay);
+                }
             }
         }
 
@@ -18,6 +18,12 @@
 //
 ////////////////////////////////////////////////////////////////////////////////
 
+#include <thread>
+#include <atomic>
+#include <fstream>
+#include <functional>
+#include <unordered_map>
+
 #include "fmt/fmt.h"
 
 #include "nes/nestopiaimpl.h"
@@ -26,6 +32,7 @@
 #include "util/file.h"
 #include "ext/sqliteext/sqliteext.h"
 #include "ext/opencvext/opencvext.h"
+#include "ext/opensslext/opensslext.h"
 
 using namespace sta;
 using namespace sta::smb;
@@ -65,13 +72,26 @@ SMBDatabase::SMBDatabase(const std::string& path)
     : nes::NESDatabase(path)
     , m_NametableCache(nullptr)
 {
-    ExecOrThrow(SMBDatabase::SoundEffectSchema());
-    ExecOrThrow(SMBDatabase::MusicTrackSchema());
-    ExecOrThrow(SMBDatabase::NametablePageSchema());
-    ExecOrThrow(SMBDatabase::MinimapPageSchema());
-    ExecOrThrow(SMBDatabase::NTExtractRecordSchema());
-    ExecOrThrow(SMBDatabase::RouteSchema());
-    ExecOrThrow(SMBDatabase::RouteSectionSchema());
+    MigrateOrThrow("smb", Migrations());
+}
+
+const std::vector<sqliteext::SQLiteExtMigration>& SMBDatabase::Migrations()
+{
+    static std::vector<sqliteext::SQLiteExtMigration> s_Migrations = {
+        {1, "sounds, nametable and minimap pages, routes", [](sqliteext::SQLiteExtDB* db){
+            db->ExecOrThrow(SMBDatabase::SoundEffectSchema());
+            db->ExecOrThrow(SMBDatabase::MusicTrackSchema());
+            db->ExecOrThrow(SMBDatabase::NametablePageSchema());
+            db->ExecOrThrow(SMBDatabase::MinimapPageSchema());
+            db->ExecOrThrow(SMBDatabase::NTExtractRecordSchema());
+            db->ExecOrThrow(SMBDatabase::RouteSchema());
+            db->ExecOrThrow(SMBDatabase::RouteSectionSchema());
+        }},
+        {2, "build manifest for incremental init", [](sqliteext::SQLiteExtDB* db){
+            db->ExecOrThrow(SMBDatabase::BuildManifestSchema());
+        }},
+    };
+    return s_Migrations;
 }
 
 SMBDatabase::~SMBDatabase()
@@ -149,6 +169,16 @@ const char* SMBDatabase::RouteSectionSchema()
 );)";
 }
 
+const char* SMBDatabase::BuildManifestSchema()
+{
+    return R"(CREATE TABLE IF NOT EXISTS build_manifest (
+    stage                   TEXT NOT NULL,
+    input                   TEXT NOT NULL,
+    hash                    TEXT NOT NULL,
+    PRIMARY KEY (stage, input)
+);)";
+}
+
 bool SMBDatabase::IsInit()
 {
     if (!GetBaseRom()) {
@@ -171,26 +201,29 @@ sta::smb::SMBNametableCachePtr SMBDatabase::GetNametableCache()
     return m_NametableCache;
 }
 
-static bool GetWav(SMBDatabase* db, const char* table, const char* nm, uint32_t v, std::vector<uint8_t>* data)
+static std::unique_ptr<sqliteext::SQLiteExtBlobReader> OpenWav(SMBDatabase* db, const char* table, const char* nm, uint32_t v)
 {
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(db->m_Database, fmt::format(R"(
-        SELECT wav_data FROM {} WHERE {} = ?;
-    )", table, nm), &stmt);
+    // effect / track is the rowid
+    auto stmt = db->PrepareOrThrow(fmt::format(R"(
+        SELECT 1 FROM {} WHERE {} = ?;
+    )", table, nm));
     sqliteext::BindIntOrThrow(stmt, 1, v);
-
-    bool ret = false;
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        int sz = sqlite3_column_bytes(stmt, 0);
-        const uint8_t* dat = reinterpret_cast<const uint8_t*>(sqlite3_column_blob(stmt, 0));
-
-        if (data) {
-            data->assign(dat, dat + sz);
-        }
-        ret = true;
+    if (sqlite3_step(stmt) != SQLITE_ROW) {
+        return nullptr;
     }
+    return std::make_unique<sqliteext::SQLiteExtBlobReader>(db, table, "wav_data", v);
+}
 
-    return ret;
+static bool GetWav(SMBDatabase* db, const char* table, const char* nm, uint32_t v, std::vector<uint8_t>* data)
+{
+    auto blob = OpenWav(db, table, nm, v);
+    if (!blob) {
+        return false;
+    }
+    if (data) {
+        blob->ReadAllOrThrow(data);
+    }
+    return true;
 }
 
 
@@ -204,27 +237,61 @@ bool SMBDatabase::GetMusicTrackWav(MusicTrack track, std::vector<uint8_t>* data)
     return GetWav(this, "music_track", "track", static_cast<uint32_t>(track), data);
 }
 
+std::unique_ptr<sqliteext::SQLiteExtBlobReader> SMBDatabase::OpenSoundEffectWav(SoundEffect effect)
+{
+    return OpenWav(this, "sound_effect", "effect", static_cast<uint32_t>(effect));
+}
+
+std::unique_ptr<sqliteext::SQLiteExtBlobReader> SMBDatabase::OpenMusicTrackWav(MusicTrack track)
+{
+    return OpenWav(this, "music_track", "track", static_cast<uint32_t>(track));
+}
+
+// Streamed from the file into the blob, not read whole first. The row is
+// replaced in one transaction, so a failed read leaves the old one rather than
+// a blob of zeros. An empty file isn't inserted and is false, as it was when
+// read whole, and so is one that can't be opened
 static bool InsertWav(SMBDatabase* db, const char* table, const char* nm, uint32_t v, const std::string& wavpath)
 {
-    std::vector<uint8_t> wav_data;
-    if (!util::ReadFileToVector(wavpath, &wav_data)) {
+    std::ifstream ifs(wavpath, std::ios::in | std::ios::binary);
+    if (!ifs.good()) {
+        return false;
+    }
+    size_t size = util::FileSize(wavpath);
+    if (size == 0) {
         return false;
     }
 
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(db->m_Database, fmt::format(R"(
+    sqliteext::SQLiteExtTransaction transaction(db);
+    auto stmt = db->PrepareOrThrow(fmt::format(R"(
         DELETE FROM {} WHERE {} = ?;
-    )", table, nm), &stmt);
+    )", table, nm));
     sqliteext::BindIntOrThrow(stmt, 1, v);
-    sqliteext::StepAndFinalizeOrThrow(stmt);
+    sqliteext::StepDoneOrThrow(stmt);
 
-    sqliteext::PrepareOrThrow(db->m_Database, fmt::format(R"(
+    stmt = db->PrepareOrThrow(fmt::format(R"(
         INSERT INTO {} ({}, wav_data) VALUES (?, ?);
-    )", table, nm), &stmt);
+    )", table, nm));
 
     sqliteext::BindIntOrThrow(stmt, 1, v);
-    sqliteext::BindBlbOrThrow(stmt, 2, wav_data.data(), wav_data.size());
-    sqliteext::StepAndFinalizeOrThrow(stmt);
+    sqliteext::BindZeroBlbOrThrow(stmt, 2, size);
+    sqliteext::StepDoneOrThrow(stmt);
+    stmt.Release();
+
+    {
+        sqliteext::SQLiteExtBlobWriter blob(db, table, "wav_data", v);
+        std::vector<char> buffer(64 * 1024);
+        for (size_t offset = 0; offset < size; ) {
+            ifs.read(buffer.data(), std::min(buffer.size(), size - offset));
+            size_t n = static_cast<size_t>(ifs.gcount());
+            if (n == 0) {
+                throw std::runtime_error("short read of '" + wavpath + "'");
+            }
+            blob.WriteOrThrow(buffer.data(), n, offset);
+            offset += n;
+        }
+    }
+    transaction.Commit();
     return true;
 }
 
@@ -240,16 +307,70 @@ bool smb::InsertMusicTrack(SMBDatabase* database, MusicTrack track, const std::s
 
 bool smb::InsertNametablePage(SMBDatabase* database, const db::nametable_page& nt)
 {
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(database->m_Database,
-            "INSERT INTO nametable_page (area_id, page, frame_palette, nametable) VALUES (?, ?, ?, ?);",
-            &stmt);
+    auto stmt = database->PrepareOrThrow(
+            "INSERT INTO nametable_page (area_id, page, frame_palette, nametable) VALUES (?, ?, ?, ?);");
 
     sqliteext::BindIntOrThrow(stmt, 1, static_cast<int>(nt.area_id));
     sqliteext::BindIntOrThrow(stmt, 2, nt.page);
     sqliteext::BindBlbOrThrow(stmt, 3, nt.frame_palette.data(), nt.frame_palette.size());
     sqliteext::BindBlbOrThrow(stmt, 4, nt.nametable.data(), nt.nametable.size());
-    sqliteext::StepAndFinalizeOrThrow(stmt);
+    sqliteext::StepDoneOrThrow(stmt);
+    return true;
+}
+
+// On a plain connection too, see SMBNametableCache::MaybeGetMinimap
+static bool WriteMinimapPage(sqliteext::SQLiteExtDB* database, db::minimap_page* mini_page)
+{
+    auto stmt = database->PrepareOrThrow(
+            "INSERT INTO minimap_page (area_id, page, minimap) VALUES (?, ?, ?);");
+
+    sqliteext::BindIntOrThrow(stmt, 1, static_cast<int>(mini_page->area_id));
+    sqliteext::BindIntOrThrow(stmt, 2, mini_page->page);
+    sqliteext::BindBlbOrThrow(stmt, 3, mini_page->minimap.data(), mini_page->minimap.size());
+    sqliteext::StepDoneOrThrow(stmt);
+    mini_page->id = static_cast<int>(sqlite3_last_insert_rowid(database->m_Database));
+    return true;
+}
+
+bool smb::InsertMinimapPage(SMBDatabase* database, db::minimap_page* mini_page)
+{
+    return WriteMinimapPage(database, mini_page);
+}
+
+bool smb::InsertRoute(SMBDatabase* database, db::route* route)
+{
+    sqliteext::SQLiteExtTransaction transaction(database);
+
+    db::route existing;
+    sqliteext::SQLiteExtStatement stmt;
+    if (database->GetRoute(route->name, &existing)) {
+        route->id = existing.id;
+        stmt = database->PrepareOrThrow("DELETE FROM route_section WHERE route_id = ?;");
+        sqliteext::BindIntOrThrow(stmt, 1, route->id);
+        sqliteext::StepDoneOrThrow(stmt);
+    } else {
+        stmt = database->PrepareOrThrow("INSERT INTO route (name) VALUES (?);");
+        sqliteext::BindStrOrThrow(stmt, 1, route->name);
+        sqliteext::StepDoneOrThrow(stmt);
+        route->id = static_cast<int>(sqlite3_last_insert_rowid(database->m_Database));
+    }
+
+    for (auto & sec : route->route) {
+        stmt = database->PrepareOrThrow(R"(
+            INSERT INTO route_section (route_id, area_id, world, level, left, right, xloc)
+            VALUES (?, ?, ?, ?, ?, ?, ?);
+        )");
+        sqliteext::BindIntOrThrow(stmt, 1, route->id);
+        sqliteext::BindIntOrThrow(stmt, 2, static_cast<int>(sec.AID));
+        sqliteext::BindIntOrThrow(stmt, 3, sec.World);
+        sqliteext::BindIntOrThrow(stmt, 4, sec.Level);
+        sqliteext::BindIntOrThrow(stmt, 5, sec.Left);
+        sqliteext::BindIntOrThrow(stmt, 6, sec.Right);
+        sqliteext::BindIntOrThrow(stmt, 7, sec.XLoc);
+        sqliteext::StepDoneOrThrow(stmt);
+    }
+    stmt.Release();
+    transaction.Commit();
     return true;
 }
 
@@ -257,10 +378,9 @@ bool SMBDatabase::GetAllNametablePages(std::vector<db::nametable_page>* nt_pages
 {
     if (!nt_pages) return false;
 
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         SELECT * FROM nametable_page;
-    )", &stmt);
+    )");
 
     nt_pages->clear();
     while (sqlite3_step(stmt) == SQLITE_ROW) {
@@ -272,7 +392,6 @@ bool SMBDatabase::GetAllNametablePages(std::vector<db::nametable_page>* nt_pages
         nes::column_nametable(stmt, 4, &page.nametable);
         nt_pages->push_back(page);
     }
-    sqlite3_finalize(stmt);
     return true;
 }
 
@@ -280,10 +399,9 @@ bool SMBDatabase::GetAllMinimapPages(std::vector<db::minimap_page>* mini_pages)
 {
     if (!mini_pages) return false;
 
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         SELECT * FROM minimap_page;
-    )", &stmt);
+    )");
 
     mini_pages->clear();
     while (sqlite3_step(stmt) == SQLITE_ROW) {
@@ -294,15 +412,36 @@ bool SMBDatabase::GetAllMinimapPages(std::vector<db::minimap_page>* mini_pages)
         smb::column_minimap(stmt, 3, &page.minimap);
         mini_pages->push_back(page);
     }
-    sqlite3_finalize(stmt);
     return true;
 }
 
-bool SMBDatabase::GetMinimapPage(AreaID area_id, int page, db::minimap_page* mini_page)
+static bool ReadMinimapPage(sqliteext::SQLiteExtDB* database, AreaID area_id, int page,
+        db::minimap_page* mini_page)
 {
     if (!mini_page) return false;
-    throw std::runtime_error("not implemented");
-    return false;
+
+    // The last one wins, as when they were all read at once
+    auto stmt = database->PrepareOrThrow(R"(
+        SELECT id, area_id, page, minimap FROM minimap_page
+        WHERE area_id = ? AND page = ? ORDER BY id DESC LIMIT 1;
+    )");
+    sqliteext::BindIntOrThrow(stmt, 1, static_cast<int>(area_id));
+    sqliteext::BindIntOrThrow(stmt, 2, page);
+
+    bool ret = false;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        mini_page->id = sqlite3_column_int(stmt, 0);
+        mini_page->area_id = column_area_id(stmt, 1);
+        mini_page->page = sqlite3_column_int(stmt, 2);
+        smb::column_minimap(stmt, 3, &mini_page->minimap);
+        ret = true;
+    }
+    return ret;
+}
+
+bool SMBDatabase::GetMinimapPage(AreaID area_id, int page, db::minimap_page* mini_page)
+{
+    return ReadMinimapPage(this, area_id, page, mini_page);
 }
 
 bool SMBDatabase::GetAllNTExtractRecords(int nes_tas_id, std::vector<db::nt_extract_record>* records)
@@ -310,10 +449,9 @@ bool SMBDatabase::GetAllNTExtractRecords(int nes_tas_id, std::vector<db::nt_extr
     if (!records) {
         return false;
     }
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         SELECT * FROM nt_extract_record WHERE nes_tas_id = ? ORDER BY frame ASC;
-    )", &stmt);
+    )");
     sqliteext::BindIntOrThrow(stmt, 1, nes_tas_id);
 
     records->clear();
@@ -326,7 +464,6 @@ bool SMBDatabase::GetAllNTExtractRecords(int nes_tas_id, std::vector<db::nt_extr
         records->back().page = sqlite3_column_int(stmt, 4);
         records->back().nt_index = sqlite3_column_int(stmt, 5);
     }
-    sqlite3_finalize(stmt);
     return true;
 }
 
@@ -335,16 +472,14 @@ bool SMBDatabase::GetAllNTExtractTASIDs(std::vector<int>* ids)
     if (!ids) {
         return false;
     }
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         SELECT DISTINCT nes_tas_id FROM nt_extract_record;
-    )", &stmt);
+    )");
     ids->clear();
     while (sqlite3_step(stmt) == SQLITE_ROW) {
         int v = sqlite3_column_int(stmt, 0);
         ids->push_back(v);
     }
-    sqlite3_finalize(stmt);
     return true;
 }
 
@@ -354,25 +489,22 @@ bool SMBDatabase::GetRouteNames(std::vector<std::string>* names)
         return false;
     }
 
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         SELECT name FROM route;
-    )", &stmt);
+    )");
     names->clear();
     while (sqlite3_step(stmt) == SQLITE_ROW) {
         names->push_back(sqliteext::column_str(stmt, 0));
     }
-    sqlite3_finalize(stmt);
     return true;
 }
 
 bool SMBDatabase::GetRoute(const std::string& name, db::route* route)
 {
     bool ret = false;
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         SELECT id FROM route WHERE name = ?;
-    )", &stmt);
+    )");
     sqliteext::BindStrOrThrow(stmt, 1, name);
 
     while (sqlite3_step(stmt) == SQLITE_ROW) {
@@ -382,17 +514,17 @@ bool SMBDatabase::GetRoute(const std::string& name, db::route* route)
         }
         ret = true;
     }
-    sqlite3_finalize(stmt);
+    stmt.Release();
 
     if (route) {
         route->route.clear();
     }
 
     if (route && ret) {
-        sqliteext::PrepareOrThrow(m_Database, R"(
+        stmt = PrepareOrThrow(R"(
             SELECT area_id, world, level, left, right, xloc FROM route_section
             WHERE route_id = ?;
-        )", &stmt);
+        )");
         sqliteext::BindIntOrThrow(stmt, 1, route->id);
 
         while (sqlite3_step(stmt) == SQLITE_ROW) {
@@ -406,7 +538,7 @@ bool SMBDatabase::GetRoute(const std::string& name, db::route* route)
             sec.Right = sqlite3_column_int(stmt, 4);
             sec.XLoc = sqlite3_column_int(stmt, 5);
         }
-        sqlite3_finalize(stmt);
+        stmt.Release();
 
         std::sort(route->route.begin(), route->route.end(),
         [&](const WorldSection& l, const WorldSection& r){
@@ -415,6 +547,7 @@ bool SMBDatabase::GetRoute(const std::string& name, db::route* route)
         for (size_t i = 0; i < route->route.size(); i++) {
             route->route[i].SectionIndex = i;
         }
+        route->route.BuildIndex();
     }
 
     return ret;
@@ -424,6 +557,8 @@ bool SMBDatabase::GetRoute(const std::string& name, db::route* route)
 
 SMBNametableCache::SMBNametableCache(SMBDatabase* database)
     : INametableCache(rom_chr1(database->GetBaseRom()))
+    , m_DatabasePath(database->m_DatabasePath)
+    , m_Rom(database->GetBaseRom())
 {
     std::vector<db::nametable_page> nametables;
     database->GetAllNametablePages(&nametables);
@@ -434,16 +569,6 @@ SMBNametableCache::SMBNametableCache(SMBDatabase* database)
         }
         v[nametable.page] = nametable;
     }
-
-    std::vector<db::minimap_page> minimaps;
-    database->GetAllMinimapPages(&minimaps);
-    for (auto & minimap : minimaps) {
-        auto& v = m_minimaps[minimap.area_id];
-        if (v.size() <= minimap.page) {
-            v.resize(minimap.page + 1);
-        }
-        v[minimap.page] = minimap;
-    }
 }
 
 SMBNametableCache::~SMBNametableCache()
@@ -488,38 +613,73 @@ const db::nametable_page* SMBNametableCache::MaybeGetNametable(AreaID id, int pa
 
 bool SMBNametableCache::KnownMinimap(AreaID id, int page) const
 {
-    auto it = m_minimaps.find(id);
-    if (it == m_minimaps.end()) {
-        return false;
-    }
-    if (static_cast<size_t>(page) >= it->second.size()) {
-        return false;
-    }
-    return true;
+    return MaybeGetMinimap(id, page) != nullptr;
 }
 
 const db::minimap_page& SMBNametableCache::GetMinimap(AreaID id, int page) const
 {
-    auto it = m_minimaps.find(id);
-    if (it == m_minimaps.end()) {
-        throw std::runtime_error(fmt::format("no minimap? {:04x} {:d}",
-                    static_cast<int>(id), page));
-    }
-
-    if (static_cast<size_t>(page) >= it->second.size()) {
+    auto* p = MaybeGetMinimap(id, page);
+    if (!p) {
         throw std::runtime_error(fmt::format("no minimap? {:04x} {:d}",
                     static_cast<int>(id), page));
     }
-
-    return it->second[page];
+    return *p;
 }
 
 const db::minimap_page* SMBNametableCache::MaybeGetMinimap(AreaID id, int page) const
 {
-    if (!KnownMinimap(id, page)) {
-        return nullptr;
+    std::lock_guard<std::mutex> lock(m_MinimapMutex);
+    auto key = std::make_pair(id, page);
+    auto it = m_minimaps.find(key);
+    if (it != m_minimaps.end()) {
+        return it->second.get();
+    }
+
+    auto mini_page = std::make_unique<db::minimap_page>();
+    bool found = false;
+    bool drawn = false;
+    auto draw = [&](){
+        auto* nt = MaybeGetNametable(id, page);
+        if (!nt || nt->id == 0) {
+            return false;
+        }
+        mini_page->id = 0;
+        mini_page->area_id = id;
+        mini_page->page = page;
+        MinimapFromNametable(nt->nametable, nt->frame_palette, rom_chr1(m_Rom),
+                &mini_page->minimap);
+        return true;
+    };
+
+    // This is on the render path, so the database is only a cache here. A
+    // plain connection (no migrations, so no writes or backups just to open
+    // it), and a page is still drawn when it can't be read or kept (a locked
+    // or read only database)
+    try {
+        if (!m_MinimapDatabase) {
+            m_MinimapDatabase = std::make_unique<sqliteext::SQLiteExtDB>(m_DatabasePath);
+        }
+        found = ReadMinimapPage(m_MinimapDatabase.get(), id, page, mini_page.get());
+        if (!found) {
+            drawn = draw();
+            if (drawn) {
+                WriteMinimapPage(m_MinimapDatabase.get(), mini_page.get());
+            }
+        }
+    } catch (std::exception& e) {
+        std::cerr << fmt::format("not reading or saving minimap {:04x} {:d}: {}\n",
+                static_cast<int>(id), page, e.what());
+        if (!found && !drawn) {
+            drawn = draw();
+        }
     }
-    return &GetMinimap(id, page);
+    if (!found && !drawn) {
+        mini_page = nullptr;
+    }
+
+    auto* p = mini_page.get();
+    m_minimaps.emplace(key, std::move(mini_page));
+    return p;
 }
 
 const nes::NameTable* SMBNametableCache::Nametable(AreaID id, int page) const
@@ -542,165 +702,628 @@ const MinimapImage* SMBNametableCache::Minimap(AreaID id, int page) const
 
 ////////////////////////////////////////////////////////////////////////////////
 
-static bool DoInitializeNametablePages(SMBDatabase* database)
+void sta::smb::ValidateRoute(const Route& route, const SMBNametableCache& nametables,
+        std::vector<RouteProblem>* problems)
 {
-    sqliteext::SQLiteExtTransaction transaction(database);
+    if (!problems) return;
+    problems->clear();
+
+    auto problem = [&](int i, std::string message){
+        problems->push_back({i, std::move(message)});
+    };
+    if (route.empty()) {
+        problem(-1, "no sections");
+        return;
+    }
+
+    const auto& known = KnownAreaIDs();
+    for (size_t i = 0; i < route.size(); i++) {
+        const auto& sec = route[i];
+        int si = static_cast<int>(i);
+
+        // As it would be read from RAM
+        uint16_t raw = static_cast<uint16_t>(sec.AID);
+        bool knownArea = std::find(known.begin(), known.end(), sec.AID) != known.end() &&
+            AreaIDFromRAM(raw & 0xff, raw >> 8) == sec.AID;
+        if (!knownArea) {
+            problem(si, fmt::format("area id {:04x} is not one the game has", raw));
+        }
+        if (sec.World < 1 || sec.World > 8 || sec.Level < 1 || sec.Level > 4) {
+            problem(si, fmt::format("{}-{} is not a level", sec.World, sec.Level));
+        }
+        if (sec.Left < 0 || sec.Left >= sec.Right) {
+            problem(si, fmt::format("left {} must be at least 0 and less than right {}", sec.Left, sec.Right));
+            continue;
+        }
+
+        for (int page = sec.Left / 256; knownArea && page <= (sec.Right - 1) / 256; page++) {
+            auto* nt = nametables.MaybeGetNametable(sec.AID, page);
+            if (!nt || nt->id == 0) {
+                problem(si, fmt::format("no nametable for page {} of {}", page, ToString(sec.AID)));
+            }
+        }
+
+        if (i == 0) {
+            continue;
+        }
+        const auto& prev = route[i - 1];
+        if (sec.XLoc < prev.XLoc + prev.Width()) {
+            problem(si, fmt::format("xloc {} overlaps the section before, which ends at {}",
+                        sec.XLoc, prev.XLoc + prev.Width()));
+        }
+        // Pipes and vines skip ahead within an area (8-4), so sections there
+        // only need to not overlap. Whether they join up is for the replay
+        if (sec == prev && prev.Left < prev.Right && sec.Left < prev.Right) {
+            problem(si, fmt::format("left {} overlaps the section before in {}-{}, which ends at {}",
+                        sec.Left, sec.World, sec.Level, prev.Right));
+        }
+    }
+}
+
+bool sta::smb::ReplayRoute(SMBDatabase* database, const Route& route, int tas_id, RouteReplay* replay)
+{
+    if (!database || !replay) return false;
+
+    nes::db::nes_tas tas;
+    if (!database->SelectTAS(tas_id, &tas)) {
+        return false;
+    }
+    auto rom = database->GetRomCached(tas.rom_id);
+    if (!rom) {
+        return false;
+    }
+
+    replay->FirstFailingSection = -1;
+    replay->Frame = -1;
+    replay->Message.clear();
+    replay->EnterFrame.assign(route.size(), -1);
+
+    nes::NestopiaNESEmulator emu;
+    emu.LoadINESData(rom->data(), rom->size());
+
+    int current = -1;
+    for (auto & input : tas.inputs) {
+        emu.Execute(input);
+        if (emu.CPUPeek(smb::RamAddress::GAME_ENGINE_SUBROUTINE) == 0x00) {
+            continue;
+        }
+
+        AreaID aid = AreaIDFromRAM(emu.CPUPeek(smb::RamAddress::AREA_DATA_LOW),
+                                   emu.CPUPeek(smb::RamAddress::AREA_DATA_HIGH));
+        int apx = AreaPointerXFromData(emu.CPUPeek(smb::RamAddress::SCREENEDGE_PAGELOC),
+                emu.CPUPeek(smb::RamAddress::SCREENEDGE_X_POS), aid,
+                emu.CPUPeek(smb::RamAddress::BLOCK_BUFFER_84_DISC));
+        int world = emu.CPUPeek(smb::RamAddress::WORLD_NUMBER) + 1;
+        int level = emu.CPUPeek(smb::RamAddress::LEVEL_NUMBER) + 1;
+
+        int section = -1;
+        if (!route.InCategory(aid, apx, world, level, nullptr, &section) || section == current) {
+            continue;
+        }
+
+        int frame = static_cast<int>(emu.CurrentFrame());
+        if (section != current + 1) {
+            // Going back, or on past a section never entered
+            int failing = section < current ? current : current + 1;
+            replay->FirstFailingSection = failing;
+            replay->Frame = frame;
+            replay->Message = fmt::format("in section {} ({}-{} {} apx {}) when section {} was next",
+                    section, world, level, ToString(aid), apx, current + 1);
+            return true;
+        }
+        replay->EnterFrame[section] = frame;
+        current = section;
+    }
+
+    if (current + 1 < static_cast<int>(route.size())) {
+        replay->FirstFailingSection = current + 1;
+        replay->Frame = static_cast<int>(emu.CurrentFrame());
+        replay->Message = fmt::format("the tas ended without entering section {}", current + 1);
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// One TAS of nt_extract_record, replayed from power on
+static void ExtractTASNametablePages(nes::INESEmulator* emu, const nes::db::nes_tas& tas,
+        std::vector<db::nt_extract_record> records, std::vector<db::nametable_page>* pages)
+{
+    std::sort(records.begin(), records.end(), [&]
+            (const db::nt_extract_record& a, const db::nt_extract_record& b){
+        return a.frame < b.frame;
+    });
+    size_t records_index = 0;
+    for (auto & input : tas.inputs) {
+        if (records_index >= records.size()) {
+            break;
+        }
+        emu->Execute(input);
+        while (records_index < records.size() && emu->CurrentFrame() ==
+                static_cast<uint64_t>(records[records_index].frame)) {
+            const auto& record = records[records_index];
+
+            auto& my_page = pages->emplace_back();
+            my_page.id = 0;
+            my_page.area_id = smb::AreaIDFromRAM(emu->CPUPeek(smb::RamAddress::AREA_DATA_LOW),
+                                                 emu->CPUPeek(smb::RamAddress::AREA_DATA_HIGH));
+            my_page.page = record.page;
+
+            emu->PPUPeekNameTable(record.nt_index, &my_page.nametable);
+
+            // Wipe the top 4 rows (SMB specific)
+            int i = 0;
+            for (int row = 0; row < 4; row++) {
+                for (int col = 0; col < nes::NAMETABLE_WIDTH_BYTES; col++) {
+                    my_page.nametable[i] = 36;
+                    i++;
+                }
+            }
+
+            emu->PPUPeekFramePalette(&my_page.frame_palette);
+            records_index++;
+        }
+    }
+}
+
+bool sta::smb::ExtractNametablePages(SMBDatabase* database, int threads,
+        std::vector<db::nametable_page>* pages)
+{
+    if (!pages) return false;
+    pages->clear();
 
     auto rom = database->GetBaseRom();
     if (!rom) {
         return false;
     }
-    // TODO
-    // const uint8_t* chr0 = rom->data() + 0x8010;
-    // const uint8_t* chr1 = rom->data() + 0x9010;
 
+    // Everything from the database first, it stays on this thread
     std::vector<int> tas_ids;
     if (!database->GetAllNTExtractTASIDs(&tas_ids)) {
         return false;
     }
-
-    for (auto & tas_id : tas_ids) {
-        nes::db::nes_tas tas;
-        if (!database->SelectTAS(tas_id, &tas)) {
-            std::cerr << "failed selected tas " << tas_id << "?" << std::endl;
+    std::vector<nes::db::nes_tas> tases(tas_ids.size());
+    std::vector<std::vector<db::nt_extract_record>> records(tas_ids.size());
+    for (size_t i = 0; i < tas_ids.size(); i++) {
+        if (!database->SelectTAS(tas_ids[i], &tases[i])) {
+            std::cerr << "failed selected tas " << tas_ids[i] << "?" << std::endl;
             return false;
         }
-        std::cout << "execute tas: " << tas.name << " [" << tas.inputs.size() << " frames]" << std::endl;
-
-        nes::NestopiaNESEmulator emu;
-        emu.LoadINESData(rom->data(), rom->size());
-
-        std::vector<db::nt_extract_record> records;
-        if (!database->GetAllNTExtractRecords(tas_id, &records)) {
+        if (!database->GetAllNTExtractRecords(tas_ids[i], &records[i])) {
             std::cerr << "failed getting nt extract records?" << std::endl;
             return false;
         }
-        std::sort(records.begin(), records.end(), [&]
-                (const db::nt_extract_record& a, const db::nt_extract_record& b){
-            return a.frame < b.frame;
-        });
-        size_t records_index = 0;
-        for (auto & input : tas.inputs) {
-            if (records_index >= records.size()) {
-                break;
+    }
+
+    if (threads <= 0) {
+        threads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    }
+    threads = std::max(std::min(threads, static_cast<int>(tases.size())), 1);
+
+    // Each TAS from a fresh emulator, as they always were, so that which
+    // thread replays it doesn't matter
+    nes::NESEmulatorFactory factory([](){
+        return std::make_unique<nes::NestopiaNESEmulator>();
+    }, std::string(rom->begin(), rom->end()));
+
+    std::vector<std::vector<db::nametable_page>> tas_pages(tases.size());
+    std::vector<std::exception_ptr> errors(tases.size());
+    std::atomic<size_t> next(0);
+    auto worker = [&](){
+        size_t i;
+        while ((i = next++) < tases.size()) {
+            try {
+                auto emu = factory.GetEmu();
+                ExtractTASNametablePages(emu.get(), tases[i], records[i], &tas_pages[i]);
+            } catch (...) {
+                errors[i] = std::current_exception();
             }
-            emu.Execute(input);
-            while (emu.CurrentFrame() ==
-                    static_cast<uint64_t>(records[records_index].frame)) {
-                const auto& record = records[records_index];
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; t++) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto & w : workers) {
+        w.join();
+    }
 
+    for (size_t i = 0; i < tases.size(); i++) {
+        if (errors[i]) {
+            std::rethrow_exception(errors[i]);
+        }
+        std::cout << "execute tas: " << tases[i].name << " [" << tases[i].inputs.size() << " frames]" << std::endl;
+        std::cout << "  " << tas_pages[i].size() << " nametables extracted" << std::endl;
+        pages->insert(pages->end(), tas_pages[i].begin(), tas_pages[i].end());
+    }
+    return true;
+}
 
-                smb::db::nametable_page my_page;
+uint64_t sta::smb::NametablePageHash(const db::nametable_page& page)
+{
+    uint64_t h = 14695981039346656037ULL;
+    auto add = [&](const uint8_t* p, size_t n){
+        for (size_t i = 0; i < n; i++) {
+            h = (h ^ p[i]) * 1099511628211ULL;
+        }
+    };
+    int32_t header[2] = {static_cast<int32_t>(page.area_id), page.page};
+    add(reinterpret_cast<const uint8_t*>(header), sizeof(header));
+    add(page.nametable.data(), page.nametable.size());
+    add(page.frame_palette.data(), page.frame_palette.size());
+    return h;
+}
 
-                my_page.area_id = smb::AreaIDFromRAM(emu.CPUPeek(smb::RamAddress::AREA_DATA_LOW),
-                                                     emu.CPUPeek(smb::RamAddress::AREA_DATA_HIGH));
-                my_page.page = record.page;
+static bool DoInitializeNametablePages(SMBDatabase* database, int threads)
+{
+    std::vector<db::nametable_page> pages;
+    if (!ExtractNametablePages(database, threads, &pages)) {
+        return false;
+    }
 
-                emu.PPUPeekNameTable(record.nt_index, &my_page.nametable);
+    sqliteext::SQLiteExtTransaction transaction(database);
+    for (auto & page : pages) {
+        InsertNametablePage(database, page);
+    }
+    transaction.Commit();
+    return true;
+}
 
-                // Wipe the top 4 rows (SMB specific)
-                int i = 0;
-                for (int row = 0; row < 4; row++) {
-                    for (int col = 0; col < nes::NAMETABLE_WIDTH_BYTES; col++) {
-                        my_page.nametable[i] = 36;
-                        i++;
-                    }
-                }
+InitOptions InitOptions::Defaults()
+{
+    InitOptions options;
+    options.Threads = 0;
+    options.DryRun = false;
+    return options;
+}
 
-                emu.PPUPeekFramePalette(&my_page.frame_palette);
-
-                InsertNametablePage(database, my_page);
-
-                //nes::EffectInfo info = nes::EffectInfo::Defaults();
-                //nes::PPUx ppux(nes::FRAME_WIDTH, nes::FRAME_HEIGHT,
-                //        nes::PPUxPriorityStatus::DISABLED);
-                //ppux.RenderNametable(0, 0, nes::NAMETABLE_WIDTH_BYTES, nes::NAMETABLE_HEIGHT_BYTES,
-                //        my_page.nametable.data(),
-                //        my_page.nametable.data() + nes::NAMETABLE_ATTRIBUTE_OFFSET,
-                //        chr1, my_page.frame_palette.data(), nes::DefaultPaletteBGR().data(),
-                //        1, info);
-
-                //cv::Mat m2(ppux.GetHeight(), ppux.GetWidth(), CV_8UC3, ppux.GetBGROut());
-                //cv::imwrite(fmt::format("nt_{}_{}.png",
-                //            static_cast<int>(my_page.area_id),
-                //            static_cast<int>(my_page.page)), m2);
-
-                //nes::Frame f;
-                //emu.ScreenPeekFrame(&f);
-                //cv::Mat m = opencvext::ConstructPaletteImage(
-                //        f.data(), nes::FRAME_WIDTH, nes::FRAME_HEIGHT,
-                //        nes::DefaultPaletteBGR().data(),
-                //        opencvext::PaletteDataOrder::BGR);
-                //cv::imwrite(fmt::format("{}_{}_{}.png", tas_id, emu.CurrentFrame(), record.id), m);
-                records_index++;
-            }
+const std::vector<std::string>& sta::smb::InitStageNames()
+{
+    static std::vector<std::string> s_Names = {
+        "rom",
+        "sound_effects",
+        "music_tracks",
+        "nt_extract",
+        "nametable_pages",
+        "minimap",
+        "pattern_tables",
+        "routes",
+    };
+    return s_Names;
+}
+
+static std::string MD5Hex(const uint8_t* data, size_t size)
+{
+    std::string hex;
+    for (auto & v : opensslext::ComputeMD5Sum(data, size)) {
+        hex += fmt::format("{:02x}", v);
+    }
+    return hex;
+}
+
+static std::string FileMD5Hex(const std::string& path)
+{
+    if (!util::FileExists(path)) {
+        return "missing";
+    }
+    std::vector<uint8_t> contents;
+    util::ReadFileToVector(path, &contents);
+    return MD5Hex(contents.data(), contents.size());
+}
+
+// The ids of 'INSERT INTO <table> VALUES(<id>,...' as sqlite3 .dump writes them
+static std::vector<int> DumpInsertIds(const std::string& sql, const std::string& table)
+{
+    std::vector<int> ids;
+    std::string prefix = "INSERT INTO " + table + " VALUES(";
+    for (size_t pos = sql.find(prefix); pos != std::string::npos; pos = sql.find(prefix, pos)) {
+        pos += prefix.size();
+        ids.push_back(std::atoi(sql.c_str() + pos));
+    }
+    return ids;
+}
+
+// The id and name of each 'INSERT INTO route VALUES(<id>,"<name>")' in
+// routes.sql, either quote
+static std::vector<std::pair<int, std::string>> DumpRoutes(const std::string& sql)
+{
+    std::vector<std::pair<int, std::string>> routes;
+    std::string prefix = "INSERT INTO route VALUES(";
+    for (size_t pos = sql.find(prefix); pos != std::string::npos; pos = sql.find(prefix, pos)) {
+        pos += prefix.size();
+        int id = std::atoi(sql.c_str() + pos);
+        size_t open = sql.find_first_of("'\"", pos);
+        if (open == std::string::npos) {
+            break;
+        }
+        size_t close = sql.find(sql[open], open + 1);
+        if (close == std::string::npos) {
+            break;
         }
-        std::cout << "  " << records_index << " nametables extracted" << std::endl;
+        routes.emplace_back(id, sql.substr(open + 1, close - open - 1));
+        pos = close;
     }
-    return true;
+    return routes;
+}
+
+namespace {
+
+// A step of InitializeSMBDatabase, run again when its inputs or a stage it
+// depends on change
+struct InitStage
+{
+    std::string Name;
+    std::vector<std::string> DependsOn;
+    std::vector<std::pair<std::string, std::string>> Inputs; // name, content hash
+    std::function<bool()> Run;
+
+    std::string Hash; // of the inputs and those of the stages depended on
+};
+
 }
 
 bool sta::smb::InitializeSMBDatabase(SMBDatabase* database,
         const std::string& smb_data_path,
-        const std::vector<uint8_t>& smb_rom)
+        const std::vector<uint8_t>& smb_rom, const InitOptions& options)
 {
-    std::cout << "insert base rom" << std::endl;
-    int smb_id = database->InsertROM("SMB.nes", smb_rom);
-    if (smb_id != 1) {
-        std::cerr << "database not cleared?\n";
-        return false;
+    const auto& names = InitStageNames();
+    for (auto & force : options.Force) {
+        if (force != "all" && std::find(names.begin(), names.end(), force) == names.end()) {
+            std::cerr << "unknown stage '" << force << "'\n";
+            return false;
+        }
     }
 
     util::fs::path base(smb_data_path);
+    auto dataPath = [&](const std::string& file){
+        return std::string(base / util::fs::path(file));
+    };
+    auto soundPath = [&](SoundEffect effect){
+        // No file of its own, it's the death music
+        if (effect == smb::SoundEffect::DEATH_SOUND) {
+            return dataPath(fmt::format("SMB_MUSIC_{:06x}.flac",
+                        static_cast<uint32_t>(smb::MusicTrack::DEATH_MUSIC)));
+        }
+        return dataPath(fmt::format("SMB_SOUND_{:06x}.flac", static_cast<uint32_t>(effect)));
+    };
+    auto musicPath = [&](MusicTrack track){
+        return dataPath(fmt::format("SMB_MUSIC_{:06x}.flac", static_cast<uint32_t>(track)));
+    };
+    auto ExecAndLog = [&](const char* file){
+        std::string sql_path = dataPath(file);
+        std::cout << "execute sql file: " << sql_path << std::endl;
+        database->ExecFileOrThrow(sql_path);
+    };
+    auto sqlInput = [&](const char* file){
+        return std::make_pair(std::string(file), FileMD5Hex(dataPath(file)));
+    };
 
-    for (auto & sound_effect : smb::AudibleSoundEffects()) {
-        if (sound_effect == smb::SoundEffect::DEATH_SOUND) {
-            continue;
+    std::vector<InitStage> stages;
+    stages.push_back({"rom", {}, {{"SMB.nes", MD5Hex(smb_rom.data(), smb_rom.size())}}, [&](){
+        std::cout << "insert base rom" << std::endl;
+        // Not GetBaseRom, the cached one would be stale for the nametable pages
+        bool exists = false;
+        {
+            auto stmt = database->PrepareOrThrow("SELECT 1 FROM nes_rom WHERE id = 1;");
+            exists = sqlite3_step(stmt) == SQLITE_ROW;
         }
-        std::string path = base / util::fs::path(fmt::format("SMB_SOUND_{:06x}.flac",
-                static_cast<uint32_t>(sound_effect)));
-        std::cout << "insert sound effect: " << smb::ToString(sound_effect) << " " << path << std::endl;
-        if (!InsertSoundEffect(database, sound_effect, path)) {
-            std::cerr << "Failed adding sound effect?\n";
-            return false;
+        if (exists) {
+            auto stmt = database->PrepareOrThrow("UPDATE nes_rom SET name = ?, rom = ?, header = ? WHERE id = 1;");
+            sqliteext::BindStrOrThrow(stmt, 1, "SMB.nes");
+            sqliteext::BindBlbOrThrow(stmt, 2, smb_rom.data(), smb_rom.size());
+            sqliteext::BindBlbOrThrow(stmt, 3, smb_rom.data(), 16);
+            sqliteext::StepDoneOrThrow(stmt);
+            return true;
         }
-    }
-
-    for (auto & music_track : smb::AudibleMusicTracks()) {
-        std::string path = base / util::fs::path(fmt::format("SMB_MUSIC_{:06x}.flac",
-                static_cast<uint32_t>(music_track)));
-        std::cout << "insert music track: " << smb::ToString(music_track) << " " << path << std::endl;
-        if (!InsertMusicTrack(database, music_track, path)) {
-            std::cerr << "Failed adding music track?\n";
+        if (database->InsertROM("SMB.nes", smb_rom) != 1) {
+            std::cerr << "database not cleared?\n";
             return false;
         }
-        if (music_track == smb::MusicTrack::DEATH_MUSIC) {
-            auto sound_effect = smb::SoundEffect::DEATH_SOUND;
+        return true;
+    }, ""});
+
+    InitStage sounds{"sound_effects", {}, {}, [&](){
+        database->ExecOrThrow("DELETE FROM sound_effect;");
+        for (auto & sound_effect : smb::AudibleSoundEffects()) {
+            std::string path = soundPath(sound_effect);
             std::cout << "insert sound effect: " << smb::ToString(sound_effect) << " " << path << std::endl;
             if (!InsertSoundEffect(database, sound_effect, path)) {
                 std::cerr << "Failed adding sound effect?\n";
                 return false;
             }
         }
+        return true;
+    }, ""};
+    for (auto & sound_effect : smb::AudibleSoundEffects()) {
+        std::string path = soundPath(sound_effect);
+        sounds.Inputs.emplace_back(util::fs::path(path).filename().string(), FileMD5Hex(path));
+    }
+    stages.push_back(sounds);
+
+    InitStage music{"music_tracks", {}, {}, [&](){
+        database->ExecOrThrow("DELETE FROM music_track;");
+        for (auto & music_track : smb::AudibleMusicTracks()) {
+            std::string path = musicPath(music_track);
+            std::cout << "insert music track: " << smb::ToString(music_track) << " " << path << std::endl;
+            if (!InsertMusicTrack(database, music_track, path)) {
+                std::cerr << "Failed adding music track?\n";
+                return false;
+            }
+        }
+        return true;
+    }, ""};
+    for (auto & music_track : smb::AudibleMusicTracks()) {
+        std::string path = musicPath(music_track);
+        music.Inputs.emplace_back(util::fs::path(path).filename().string(), FileMD5Hex(path));
+    }
+    stages.push_back(music);
+
+    stages.push_back({"nt_extract", {}, {sqlInput("nt_extract_tas.sql"), sqlInput("nt_extract_record.sql")}, [&](){
+        // Only the TASes the records were for and those about to be inserted
+        // again, others may have been added since
+        database->ExecOrThrow(R"(
+            DELETE FROM nes_tas WHERE id IN (SELECT DISTINCT nes_tas_id FROM nt_extract_record);
+            DELETE FROM nt_extract_record;
+        )");
+        for (auto & id : DumpInsertIds(util::ReadFileToString(dataPath("nt_extract_tas.sql")), "nes_tas")) {
+            auto stmt = database->PrepareOrThrow("DELETE FROM nes_tas WHERE id = ?;");
+            sqliteext::BindIntOrThrow(stmt, 1, id);
+            sqliteext::StepDoneOrThrow(stmt);
+        }
+        ExecAndLog("nt_extract_tas.sql");
+        ExecAndLog("nt_extract_record.sql");
+        return true;
+    }, ""});
+
+    stages.push_back({"nametable_pages", {"rom", "nt_extract"}, {}, [&](){
+        database->ExecOrThrow("DELETE FROM nametable_page;");
+        if (!DoInitializeNametablePages(database, options.Threads)) {
+            std::cerr << "Failed initializing nametable pages\n";
+            return false;
+        }
+        return true;
+    }, ""});
+
+    // Also those drawn from the nametable pages since
+    stages.push_back({"minimap", {"nametable_pages"}, {sqlInput("minimap.sql")}, [&](){
+        database->ExecOrThrow("DELETE FROM minimap_page;");
+        if (util::FileExists(dataPath("minimap.sql"))) {
+            ExecAndLog("minimap.sql");
+        }
+        return true;
+    }, ""});
+
+    stages.push_back({"pattern_tables", {}, {sqlInput("pattern_tables.sql")}, [&](){
+        database->ExecOrThrow("DELETE FROM nes_pattern_table;");
+        ExecAndLog("pattern_tables.sql");
+        return true;
+    }, ""});
+
+    // Only the routes routes.sql has are replaced, those from 'smb route
+    // import' are kept unless routes.sql now has their id or name
+    stages.push_back({"routes", {}, {sqlInput("routes.sql")}, [&](){
+        std::string sql = util::ReadFileToString(dataPath("routes.sql"));
+        for (auto & [id, name] : DumpRoutes(sql)) {
+            std::vector<std::pair<int, std::string>> existing;
+            {
+                auto stmt = database->PrepareOrThrow("SELECT id, name FROM route WHERE id = ? OR name = ?;");
+                sqliteext::BindIntOrThrow(stmt, 1, id);
+                sqliteext::BindStrOrThrow(stmt, 2, name);
+                while (sqlite3_step(stmt) == SQLITE_ROW) {
+                    existing.emplace_back(sqlite3_column_int(stmt, 0), sqliteext::column_str(stmt, 1));
+                }
+            }
+            for (auto & [eid, ename] : existing) {
+                if (eid != id || ename != name) {
+                    std::cerr << fmt::format("warning: routes.sql replaces the imported route '{}' (id {}) with '{}'\n",
+                            ename, eid, name);
+                }
+                auto stmt = database->PrepareOrThrow("DELETE FROM route_section WHERE route_id = ?;");
+                sqliteext::BindIntOrThrow(stmt, 1, eid);
+                sqliteext::StepDoneOrThrow(stmt);
+                stmt = database->PrepareOrThrow("DELETE FROM route WHERE id = ?;");
+                sqliteext::BindIntOrThrow(stmt, 1, eid);
+                sqliteext::StepDoneOrThrow(stmt);
+            }
+        }
+        for (auto & id : DumpInsertIds(sql, "route_section")) {
+            auto stmt = database->PrepareOrThrow("DELETE FROM route_section WHERE id = ?;");
+            sqliteext::BindIntOrThrow(stmt, 1, id);
+            sqliteext::StepDoneOrThrow(stmt);
+        }
+        ExecAndLog("routes.sql");
+        return true;
+    }, ""});
+
+    std::unordered_map<std::string, const InitStage*> byName;
+    for (auto & stage : stages) {
+        std::string key = stage.Name + "\n";
+        for (auto & [input, hash] : stage.Inputs) {
+            key += input + "=" + hash + "\n";
+        }
+        for (auto & dep : stage.DependsOn) {
+            key += dep + "=" + byName.at(dep)->Hash + "\n";
+        }
+        stage.Hash = MD5Hex(reinterpret_cast<const uint8_t*>(key.data()), key.size());
+        byName[stage.Name] = &stage;
     }
 
-    auto ExecAndLog = [&](const char* file){
-        std::string sql_path = base / util::fs::path(file);
-        std::cout << "execute sql file: " << sql_path << std::endl;
-        database->ExecFileOrThrow(sql_path);
-    };
+    // Those that ran (or would have) this time. A forced stage keeps its hash,
+    // so the ones depending on it have to be told it ran
+    std::vector<std::string> rebuilt;
+    for (auto & stage : stages) {
+        // What the manifest has from the last time it ran, the stage itself as ""
+        std::map<std::string, std::string> built;
+        {
+            auto stmt = database->PrepareOrThrow("SELECT input, hash FROM build_manifest WHERE stage = ?;");
+            sqliteext::BindStrOrThrow(stmt, 1, stage.Name);
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                built[sqliteext::column_str(stmt, 0)] = sqliteext::column_str(stmt, 1);
+            }
+        }
 
-    ExecAndLog("nt_extract_tas.sql");
-    ExecAndLog("nt_extract_record.sql");
+        std::vector<std::string> why;
+        if (std::find(options.Force.begin(), options.Force.end(), stage.Name) != options.Force.end() ||
+            std::find(options.Force.begin(), options.Force.end(), "all") != options.Force.end()) {
+            why.push_back("forced");
+        }
+        if (built.empty()) {
+            why.push_back("never built");
+        } else {
+            for (auto & [input, hash] : stage.Inputs) {
+                if (built[input] != hash) {
+                    why.push_back(input);
+                }
+            }
+            for (auto & dep : stage.DependsOn) {
+                if (built[dep] != byName.at(dep)->Hash ||
+                    std::find(rebuilt.begin(), rebuilt.end(), dep) != rebuilt.end()) {
+                    why.push_back(dep);
+                }
+            }
+        }
 
-    if (!DoInitializeNametablePages(database)) {
-        std::cerr << "Failed initializing nametable pages\n";
-        return false;
-    }
+        if (why.empty()) {
+            std::cout << "stage " << stage.Name << ": up to date" << std::endl;
+            continue;
+        }
+        rebuilt.push_back(stage.Name);
+        std::string reasons;
+        for (auto & w : why) {
+            reasons += (reasons.empty() ? "" : ", ") + w;
+        }
+        if (options.DryRun) {
+            std::cout << "stage " << stage.Name << ": would rebuild (" << reasons << ")" << std::endl;
+            continue;
+        }
+        std::cout << "stage " << stage.Name << ": rebuild (" << reasons << ")" << std::endl;
+        if (!stage.Run()) {
+            return false;
+        }
 
-    ExecAndLog("minimap.sql");
-    ExecAndLog("pattern_tables.sql");
-    ExecAndLog("routes.sql");
+        // Only once it has run, a stage that fails is run again next time
+        sqliteext::SQLiteExtTransaction transaction(database);
+        auto stmt = database->PrepareOrThrow("DELETE FROM build_manifest WHERE stage = ?;");
+        sqliteext::BindStrOrThrow(stmt, 1, stage.Name);
+        sqliteext::StepDoneOrThrow(stmt);
+        auto record = [&](const std::string& input, const std::string& hash){
+            stmt = database->PrepareOrThrow("INSERT INTO build_manifest (stage, input, hash) VALUES (?, ?, ?);");
+            sqliteext::BindStrOrThrow(stmt, 1, stage.Name);
+            sqliteext::BindStrOrThrow(stmt, 2, input);
+            sqliteext::BindStrOrThrow(stmt, 3, hash);
+            sqliteext::StepDoneOrThrow(stmt);
+        };
+        record("", stage.Hash);
+        for (auto & [input, hash] : stage.Inputs) {
+            record(input, hash);
+        }
+        for (auto & dep : stage.DependsOn) {
+            record(dep, byName.at(dep)->Hash);
+        }
+        stmt.Release();
+        transaction.Commit();
+    }
 
     return true;
 }
@@ -102,9 +102,13 @@ std::shared_ptr<sdlext::SDLExtMixChunk> SMBDBSoundComponent::GetChunk(smb::Sound
 {
     std::shared_ptr<sdlext::SDLExtMixChunk> ptr;
 
-    std::vector<uint8_t> wav_data;
-    if (m_Database->GetSoundEffectWav(effect, &wav_data)) {
-        ptr = std::make_shared<sdlext::SDLExtMixChunk>(wav_data);
+    std::shared_ptr<sqliteext::SQLiteExtBlobReader> blob = m_Database->OpenSoundEffectWav(effect);
+    if (blob) {
+        ptr = std::make_shared<sdlext::SDLExtMixChunk>(
+            sdlext::SDLExtRWFromReadAt(blob->Size(), [blob](void* data, size_t count, size_t offset){
+                blob->ReadOrThrow(data, count, offset);
+                return true;
+            }));
     }
 
     return ptr;
@@ -177,7 +181,7 @@ std::shared_ptr<sdlext::SDLExtMixMusic> SMBDBMusicComponent::GetMusic(smb::Music
 
     std::vector<uint8_t> wav_data;
     if (m_Database->GetMusicTrackWav(track, &wav_data)) {
-        ptr = std::make_shared<sdlext::SDLExtMixMusic>(wav_data);
+        ptr = std::make_shared<sdlext::SDLExtMixMusic>(std::move(wav_data));
     }
 
     return ptr;
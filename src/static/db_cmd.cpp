@@ -19,15 +19,509 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include <fstream>
+#include <cstring>
 
 #include "static/staticdb.h"
 #include "static/main.h"
+#include "util/arg.h"
 #include "util/file.h"
+#include "util/clock.h"
+#include "game/gamedb.h"
+#include "nes/nesdb.h"
+#include "smb/smbdb.h"
+#include "smb/rgms.h"
 
 using namespace sta;
 using namespace sta::util;
 using namespace sta::main;
 
+////////////////////////////////////////////////////////////////////////////////
+
+// The statement cache in SQLiteExtDB: hits, statements out twice, bindings
+// cleared on release, eviction, and statements cached across schema changes
+// and Close. And SQLiteExtTransaction rolling back. Returns the number of
+// checks that failed
+static int CheckStatementCache()
+{
+    int failed = 0;
+    auto check = [&](bool ok, const char* what){
+        if (!ok) {
+            std::cout << "failed: " << what << "\n";
+            failed++;
+        }
+    };
+    auto stepInt = [](sqlite3_stmt* stmt, int column, int fallback){
+        int v = fallback;
+        if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, column) != SQLITE_NULL) {
+            v = sqlite3_column_int(stmt, column);
+        }
+        return v;
+    };
+
+    game::GameDatabase db(":memory:");
+    db.ExecOrThrow("CREATE TABLE t (a INTEGER); INSERT INTO t (a) VALUES (1), (2), (3);");
+
+    {
+        auto before = db.GetStatementCacheCounters();
+        for (int i = 0; i < 3; i++) {
+            auto stmt = db.PrepareOrThrow("SELECT COUNT(*) FROM t;");
+            check(stepInt(stmt, 0, -1) == 3, "count from a cached statement");
+        }
+        auto after = db.GetStatementCacheCounters();
+        check(after.Misses - before.Misses == 1 && after.Hits - before.Hits == 2,
+                "the same sql prepared once");
+    }
+
+    {
+        // The same query while it is out, rows of the one inside a loop over the other
+        int pairs = 0;
+        auto outer = db.PrepareOrThrow("SELECT a FROM t ORDER BY a;");
+        while (sqlite3_step(outer) == SQLITE_ROW) {
+            auto inner = db.PrepareOrThrow("SELECT a FROM t ORDER BY a;");
+            while (sqlite3_step(inner) == SQLITE_ROW) {
+                pairs++;
+            }
+            check(inner.get() != outer.get(), "a second statement for sql already out");
+        }
+        check(pairs == 9, "nested statements with the same sql");
+        size_t statements = db.GetStatementCacheCounters().Statements;
+        outer.Release();
+        check(db.GetStatementCacheCounters().Statements == statements, "the second statement not cached");
+    }
+
+    {
+        auto stmt = db.PrepareOrThrow("SELECT ?;");
+        sqliteext::BindIntOrThrow(stmt, 1, 5);
+        check(stepInt(stmt, 0, -1) == 5, "bound parameter");
+        stmt.Release();
+        stmt = db.PrepareOrThrow("SELECT ?;");
+        check(stepInt(stmt, 0, -1) == -1, "bindings cleared on release");
+    }
+
+    try {
+        auto stmt = db.PrepareOrThrow("INSERT INTO t (a) VALUES (?);");
+        sqliteext::BindIntOrThrow(stmt, 1, 4);
+        throw std::runtime_error("before the step");
+    } catch (std::runtime_error&) {
+    }
+    {
+        auto stmt = db.PrepareOrThrow("INSERT INTO t (a) VALUES (?);");
+        sqliteext::BindIntOrThrow(stmt, 1, 4);
+        sqliteext::StepDoneOrThrow(stmt);
+        check(sqliteext::ExecForSingleInt(db.m_Database, "SELECT COUNT(*) FROM t;") == 4,
+                "a statement released by an exception used again");
+    }
+
+    // Schema changes: sqlite prepares cached statements over again
+    {
+        const char* query = "SELECT * FROM t ORDER BY a;";
+        auto stmt = db.PrepareOrThrow(query);
+        check(sqlite3_column_count(stmt) == 1, "columns before ALTER TABLE");
+        stmt.Release();
+        db.ExecOrThrow("ALTER TABLE t ADD COLUMN b INTEGER DEFAULT 7;");
+        stmt = db.PrepareOrThrow(query);
+        check(stepInt(stmt, 1, -1) == 7 && sqlite3_column_count(stmt) == 2, "columns after ALTER TABLE");
+    }
+    {
+        db.SetInt("check", 11);
+        check(db.GetInt("check", 0) == 11, "kv_int before DROP TABLE");
+        db.ExecOrThrow("DROP TABLE kv_int;");
+        check(db.GetInt("check", 0) == 0, "cached select on a dropped table");
+        bool threw = false;
+        try {
+            db.SetInt("check", 0);
+        } catch (std::runtime_error&) {
+            threw = true;
+        }
+        check(threw, "cached insert on a dropped table");
+
+        // Again, with the columns the other way around
+        db.ExecOrThrow("CREATE TABLE kv_int (value INTEGER NOT NULL, key TEXT PRIMARY KEY);");
+        db.SetInt("check", 12);
+        check(db.GetInt("check", 0) == 12, "cached statement on the table created again");
+    }
+
+    {
+        db.SetStatementCacheCapacity(4);
+        auto before = db.GetStatementCacheCounters();
+        for (int i = 0; i < 10; i++) {
+            auto stmt = db.PrepareOrThrow(fmt::format("SELECT {};", i));
+            check(stepInt(stmt, 0, -1) == i, "statements past the capacity");
+        }
+        auto after = db.GetStatementCacheCounters();
+        check(after.Statements == 4, "cache capacity");
+        check(after.Evictions > before.Evictions, "least recently used evicted");
+        db.SetStatementCacheCapacity(sqliteext::SQLiteExtDB::DEFAULT_STATEMENT_CACHE_CAPACITY);
+    }
+
+    {
+        // Transactions roll back unless committed, thrown out of or not
+        db.SetInt("tx", 1);
+        try {
+            sqliteext::SQLiteExtTransaction transaction(&db);
+            db.SetInt("tx", 2);
+            throw std::runtime_error("tx");
+        } catch (std::runtime_error&) {
+        }
+        check(db.GetInt("tx", 0) == 1, "transaction rolled back when thrown out of");
+        {
+            sqliteext::SQLiteExtTransaction transaction(&db);
+            db.SetInt("tx", 3);
+        }
+        check(db.GetInt("tx", 0) == 1, "transaction rolled back without Commit");
+        {
+            sqliteext::SQLiteExtTransaction transaction(&db);
+            db.SetInt("tx", 4);
+            transaction.Commit();
+        }
+        check(db.GetInt("tx", 0) == 4, "transaction committed");
+    }
+
+    {
+        // Out across Close, finalized when released
+        auto stmt = db.PrepareOrThrow("SELECT 1;");
+        db.Close();
+        check(db.GetStatementCacheCounters().Statements == 0, "Close clears the cache");
+        stmt.Release();
+        db.Open();
+        stmt = db.PrepareOrThrow("SELECT 2;");
+        check(stepInt(stmt, 0, -1) == 2, "statement after reopening");
+    }
+
+    std::cout << fmt::format("statement cache: {} checks failed\n", failed);
+    return failed;
+}
+
+// Blobs read and written in place against those set and got whole, and the
+// decoded image cache against the images set. Returns the number of checks
+// that failed
+static int CheckBlobs()
+{
+    int failed = 0;
+    auto check = [&](bool ok, const char* what){
+        if (!ok) {
+            std::cout << "failed: " << what << "\n";
+            failed++;
+        }
+    };
+
+    game::GameDatabase db(":memory:");
+    std::vector<uint8_t> data(100000);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = static_cast<uint8_t>(i * 7 + i / 251);
+    }
+    db.SetBlob("b", data.data(), data.size());
+
+    std::vector<uint8_t> result;
+    db.GetBlob("b", &result);
+    check(result == data, "GetBlob");
+    check(std::memcmp(db.GetBlob("b"), data.data(), data.size()) == 0, "GetBlob pointer");
+    check(db.OpenBlob("none") == nullptr, "OpenBlob unknown key");
+
+    {
+        auto blob = db.OpenBlob("b");
+        check(blob && blob->Size() == data.size(), "OpenBlob size");
+        std::vector<uint8_t> piece(1000);
+        bool same = true;
+        for (size_t offset = 0; blob && offset < data.size(); offset += piece.size()) {
+            size_t n = std::min(piece.size(), data.size() - offset);
+            blob->ReadOrThrow(piece.data(), n, offset);
+            same = same && std::equal(piece.begin(), piece.begin() + n, data.begin() + offset);
+        }
+        check(same, "blob read in pieces");
+    }
+
+    {
+        db.ExecOrThrow("CREATE TABLE w (id INTEGER PRIMARY KEY, value BLOB NOT NULL);");
+        auto stmt = db.PrepareOrThrow("INSERT INTO w (id, value) VALUES (3, ?);");
+        sqliteext::BindZeroBlbOrThrow(stmt, 1, data.size());
+        sqliteext::StepDoneOrThrow(stmt);
+        stmt.Release();
+        sqliteext::SQLiteExtBlobWriter blob(&db, "w", "value", 3);
+        for (size_t offset = 0; offset < data.size(); offset += 4096) {
+            blob.WriteOrThrow(data.data() + offset, std::min<size_t>(4096, data.size() - offset), offset);
+        }
+        blob.ReadAllOrThrow(&result);
+        check(result == data, "blob written in pieces");
+
+        bool threw = false;
+        try {
+            blob.WriteOrThrow(data.data(), 10, data.size() - 5);
+        } catch (std::runtime_error& e) {
+            threw = true;
+        }
+        check(threw, "blob write past the end throws");
+    }
+
+    cv::Mat a(32, 48, CV_8UC3, cv::Scalar(10, 20, 30));
+    cv::Mat b(16, 16, CV_8UC4, cv::Scalar(1, 2, 3, 4));
+    db.SetImage("img", a);
+    cv::Mat got = db.GetImage("img");
+    check(got.size() == a.size() && cv::norm(got, a, cv::NORM_INF) == 0, "GetImage");
+    got.setTo(cv::Scalar(0, 0, 0));
+    got = db.GetImage("img");
+    check(cv::norm(got, a, cv::NORM_INF) == 0, "GetImage returns a copy of the cached image");
+    db.SetImage("img", b);
+    got = db.GetImage("img");
+    check(got.size() == b.size() && got.channels() == 4 && cv::norm(got, b, cv::NORM_INF) == 0,
+            "GetImage after SetImage");
+    db.SetBlob("img2", data.data(), 10);
+    db.SetImage("img2", a);
+    check(db.GetImage("img2").size() == a.size(), "SetImage over a blob");
+
+    std::cout << fmt::format("blobs: {} checks failed\n", failed);
+    return failed;
+}
+
+// GetInt / SetInt with the statement cache and without it (every call
+// prepares and finalizes)
+static void BenchStatementCache(int iterations)
+{
+    game::GameDatabase db(":memory:");
+    auto run = [&](size_t capacity){
+        db.SetStatementCacheCapacity(capacity);
+        db.ClearStatementCache();
+        int64_t sum = 0;
+        auto start = util::Now();
+        {
+            sqliteext::SQLiteExtTransaction transaction(&db);
+            for (int i = 0; i < iterations; i++) {
+                std::string key = std::to_string(i % 64);
+                db.SetInt(key.c_str(), i);
+                sum += db.GetInt(key.c_str(), 0);
+            }
+            transaction.Commit();
+        }
+        auto elapsed = std::chrono::duration<double, std::milli>(util::Now() - start);
+        return std::make_pair(elapsed.count(), sum);
+    };
+
+    auto [uncachedMs, uncachedSum] = run(0);
+    auto before = db.GetStatementCacheCounters();
+    auto [cachedMs, cachedSum] = run(sqliteext::SQLiteExtDB::DEFAULT_STATEMENT_CACHE_CAPACITY);
+    auto after = db.GetStatementCacheCounters();
+    std::cout << fmt::format("{} GetInt + SetInt: {:.1f}ms uncached, {:.1f}ms cached ({:.2f}x), {} hits {} misses{}\n",
+            iterations, uncachedMs, cachedMs, uncachedMs / std::max(cachedMs, 1e-9),
+            after.Hits - before.Hits, after.Misses - before.Misses,
+            uncachedSum == cachedSum ? "" : ", RESULTS DIFFER");
+}
+
+// GetImage's cache against decoding the png every call (as it did before)
+static void BenchImageCache(int iterations)
+{
+    game::GameDatabase db(":memory:");
+    cv::Mat img(240, 256, CV_8UC3);
+    cv::randu(img, cv::Scalar::all(0), cv::Scalar::all(255));
+    db.SetImage("img", img);
+
+    auto run = [&](bool cached){
+        int64_t sum = 0;
+        auto start = util::Now();
+        for (int i = 0; i < iterations; i++) {
+            cv::Mat got;
+            if (cached) {
+                got = db.GetImage("img");
+            } else {
+                std::vector<uint8_t> png;
+                db.GetBlob("img", &png);
+                got = cv::imdecode(png, cv::IMREAD_UNCHANGED);
+            }
+            sum += got.at<cv::Vec3b>(i % got.rows, i % got.cols)[0];
+        }
+        auto elapsed = std::chrono::duration<double, std::milli>(util::Now() - start);
+        return std::make_pair(elapsed.count(), sum);
+    };
+
+    auto [decodeMs, decodeSum] = run(false);
+    auto [cachedMs, cachedSum] = run(true);
+    std::cout << fmt::format("{} GetImage 256x240: {:.1f}ms decoding, {:.1f}ms cached ({:.2f}x){}\n",
+            iterations, decodeMs, cachedMs, decodeMs / std::max(cachedMs, 1e-9),
+            decodeSum == cachedSum ? "" : ", RESULTS DIFFER");
+}
+
+// A database as an older build left it, frozen as a sqlite3 .dump in
+// data/db/migrations/ as '<Name>_v<version>.sql' for every version before the
+// latest of its last layer: its layers each at that version, 0 for one from
+// before schema_version (the version 1 tables but nothing recorded)
+struct MigrationFixture
+{
+    std::string Name;
+    std::vector<std::pair<const char*, const std::vector<sqliteext::SQLiteExtMigration>*>> Layers;
+    const char* Count; // of the row the dump has, 1 once migrated
+};
+
+static int LatestVersion(const std::vector<sqliteext::SQLiteExtMigration>& migrations)
+{
+    return migrations.empty() ? 0 : migrations.back().Version;
+}
+
+static void LoadMigrationFixture(const std::string& path, const std::string& dump)
+{
+    sqliteext::SQLiteExtDB db(path);
+    db.ExecFileOrThrow(dump);
+}
+
+// The fixtures in fixtureDir opened with the current classes: each migrates
+// to the latest version with its row intact, and is backed up first. Then a
+// step that throws rolls back the others, and a version newer than the build
+// refuses to open. Returns the number of checks that failed
+static int CheckMigrations(const std::string& fixtureDir)
+{
+    int failed = 0;
+    auto check = [&](bool ok, const std::string& what){
+        if (!ok) {
+            std::cout << "failed: " << what << "\n";
+            failed++;
+        }
+    };
+
+    fs::path dir = fs::temp_directory_path() / fs::path("static_check_migrations");
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+
+    auto gameMigrations = &game::GameDatabase::Migrations();
+    auto nesMigrations = &nes::NESDatabase::Migrations();
+    std::vector<MigrationFixture> fixtures = {
+        {"game", {{"game", gameMigrations}},
+            "SELECT COUNT(*) FROM kv_int WHERE key = 'k' AND value = 7;"},
+        {"nes", {{"game", gameMigrations}, {"nes", nesMigrations}},
+            "SELECT COUNT(*) FROM nes_pattern_table WHERE name = 'p';"},
+        {"smb", {{"game", gameMigrations}, {"nes", nesMigrations}, {"smb", &smb::SMBDatabase::Migrations()}},
+            "SELECT COUNT(*) FROM route WHERE name = 'r';"},
+        {"static", {{"static", &StaticDB::Migrations()}},
+            "SELECT COUNT(*) FROM app_cache WHERE name = 'a' AND width = 3;"},
+        {"rec_review", {{"rec_review", &smb::RecReviewDB::Migrations()}},
+            "SELECT COUNT(*) FROM rec_recording WHERE import_path = 'r';"},
+    };
+    auto dumpOf = [&](const std::string& name, int version){
+        return fixtureDir + fmt::format("{}_v{}.sql", name, version);
+    };
+    auto openAs = [&](const std::string& name, const std::string& path){
+        if (name == "game") {
+            game::GameDatabase db(path);
+        } else if (name == "nes") {
+            nes::NESDatabase db(path);
+        } else if (name == "smb") {
+            smb::SMBDatabase db(path);
+        } else if (name == "static") {
+            StaticDB db(path);
+        } else {
+            smb::RecReviewDB db(path);
+        }
+    };
+
+    int opened = 0;
+    for (auto & fixture : fixtures) {
+        int latest = LatestVersion(*fixture.Layers.back().second);
+        for (int version = 0; version < latest; version++) {
+            std::string what = fmt::format("{} v{}", fixture.Name, version);
+            std::string path = dir / fs::path(fmt::format("{}_v{}.db", fixture.Name, version));
+            std::string dump = dumpOf(fixture.Name, version);
+            if (!fs::exists(dump)) {
+                check(false, what + " has no fixture " + dump);
+                continue;
+            }
+            LoadMigrationFixture(path, dump);
+
+            // Named for the first layer behind
+            std::string backup;
+            for (auto & [layer, migrations] : fixture.Layers) {
+                int v = std::min(version, LatestVersion(*migrations));
+                if (v < LatestVersion(*migrations)) {
+                    backup = fmt::format("{}.{}-v{}.bak", path, layer, v);
+                    break;
+                }
+            }
+
+            try {
+                openAs(fixture.Name, path);
+                opened++;
+            } catch (std::exception& e) {
+                check(false, what + " opens: " + e.what());
+                continue;
+            }
+
+            {
+                sqliteext::SQLiteExtDB db(path);
+                for (auto & [layer, migrations] : fixture.Layers) {
+                    check(db.GetSchemaVersion(layer) == LatestVersion(*migrations),
+                            fmt::format("{} migrates '{}' to v{}", what, layer, LatestVersion(*migrations)));
+                }
+                check(sqliteext::ExecForSingleInt(db.m_Database, fixture.Count) == 1, what + " keeps its row");
+            }
+
+            check(fs::exists(backup), what + " backed up to " + backup);
+            if (fs::exists(backup)) {
+                {
+                    sqliteext::SQLiteExtDB old(backup);
+                    check(sqliteext::ExecForSingleInt(old.m_Database, fixture.Count) == 1, what + " backup has the row");
+                    check(old.GetSchemaVersion(fixture.Layers.back().first) == version, what + " backup is the old version");
+                }
+                fs::remove(backup);
+            }
+
+            // Already migrated, opens as it is
+            openAs(fixture.Name, path);
+            check(!fs::exists(backup), what + " not backed up again");
+        }
+    }
+
+    // Off, nothing is backed up
+    {
+        std::string path = dir / fs::path("nobackup.db");
+        LoadMigrationFixture(path, dumpOf("game", 0));
+        sqliteext::SQLiteExtDB::SetBackupBeforeMigrate(false);
+        openAs("game", path);
+        sqliteext::SQLiteExtDB::SetBackupBeforeMigrate(true);
+        check(!fs::exists(path + ".game-v0.bak"), "no backup when turned off");
+    }
+
+    // A step that throws leaves the database as it was
+    {
+        std::string path = dir / fs::path("rollback.db");
+        sqliteext::SQLiteExtDB db(path);
+        std::vector<sqliteext::SQLiteExtMigration> migrations = {
+            {1, "a", [](sqliteext::SQLiteExtDB* db){ db->ExecOrThrow("CREATE TABLE a (x INTEGER);"); }},
+        };
+        db.MigrateOrThrow("t", migrations);
+        migrations.push_back({2, "b", [](sqliteext::SQLiteExtDB* db){ db->ExecOrThrow("CREATE TABLE b (x INTEGER);"); }});
+        migrations.push_back({3, "c", [](sqliteext::SQLiteExtDB* db){ db->ExecOrThrow("INSERT INTO nope VALUES (1);"); }});
+        bool threw = false;
+        try {
+            db.MigrateOrThrow("t", migrations);
+        } catch (std::runtime_error& e) {
+            threw = true;
+        }
+        check(threw, "failing step throws");
+        check(db.GetSchemaVersion("t") == 1, "failing step keeps the version");
+        check(sqliteext::ExecForSingleInt(db.m_Database,
+                    "SELECT COUNT(*) FROM sqlite_master WHERE name = 'b';") == 0, "failing step rolls back the others");
+        migrations.pop_back();
+        db.MigrateOrThrow("t", migrations);
+        check(db.GetSchemaVersion("t") == 2, "migrates once the step is fixed");
+    }
+
+    // From a newer build
+    {
+        std::string path = dir / fs::path("newer.db");
+        {
+            game::GameDatabase db(path);
+            db.ExecOrThrow("UPDATE schema_version SET version = 99 WHERE layer = 'game';");
+        }
+        bool threw = false;
+        try {
+            game::GameDatabase db(path);
+        } catch (std::runtime_error& e) {
+            threw = true;
+        }
+        check(threw, "newer version refuses to open");
+    }
+
+    fs::remove_all(dir);
+    std::cout << fmt::format("migrations: {} fixtures opened, {} checks failed\n", opened, failed);
+    return failed;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // The 'db' command is to
 REGISTER_COMMAND(db, "edit / manage application data stored in static.db",
@@ -35,6 +529,9 @@ R"(
 EXAMPLES
     static db
     static db --reset
+    static db check
+    static db bench --iterations 100000
+    static db check-migrations
 
 USAGE:
     static db [--reset ]
@@ -51,6 +548,22 @@ OPTIONS:
 
     --path
         Print the path to database.
+
+    check
+        Check the prepared statement cache, and blobs read and written in
+        place and the decoded image cache, against an in memory database.
+
+    bench [--iterations <n>]
+        Time GetInt / SetInt with and without the prepared statement cache,
+        and GetImage with and without the decoded image cache (n / 100).
+
+    check-migrations
+        Open databases from every prior schema version of each layer (game,
+        nes, smb, static, rec_review) and check they migrate cleanly. These
+        are the dumps checked in to 'data/db/migrations/' in the source
+        directory. Before adding a migration, dump a database of the current
+        version there as '<name>_v<version>.sql' with sqlite3 .dump, holding
+        the row the check counts.
 )")
 {
     EnsureStaticDirectoryWriteable(*config);
@@ -69,6 +582,26 @@ OPTIONS:
         } else if (arg == "path" || arg == "--path") {
             std::cout << staticdbpath << std::endl;
             return 0;
+        } else if (arg == "check") {
+            int failed = CheckStatementCache();
+            failed += CheckBlobs();
+            return failed ? 1 : 0;
+        } else if (arg == "check-migrations") {
+            return CheckMigrations(config->SourcePathTo("data/db/migrations/")) ? 1 : 0;
+        } else if (arg == "bench") {
+            int iterations = 100000;
+            std::string opt;
+            ArgNext(&argc, &argv);
+            while (ArgReadString(&argc, &argv, &opt)) {
+                if (opt == "--iterations" && ArgReadInt(&argc, &argv, &iterations) && iterations > 0) {
+                    continue;
+                }
+                Error("usage: static db bench [--iterations <n>]");
+                return 1;
+            }
+            BenchStatementCache(iterations);
+            BenchImageCache(std::max(iterations / 100, 1));
+            return 0;
         } else {
             Error("unrecognized argument. '{}'", arg);
             return 1;
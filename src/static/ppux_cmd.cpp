@@ -0,0 +1,1579 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (C) 2023 Matthew Deutsch
+//
+// Static is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// Static is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Static; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <random>
+#include <cmath>
+#include <thread>
+#include <atomic>
+
+#include "static/main.h"
+#include "util/arg.h"
+#include "util/clock.h"
+#include "util/file.h"
+#include "nes/ppux.h"
+#include "nes/ppuxbands.h"
+#include "smb/smbdb.h"
+#include "smb/rgms.h"
+#include "ext/opencvext/opencvext.h"
+
+using namespace sta;
+using namespace sta::main;
+
+// Everything needed to draw one randomized frame the same way twice
+struct PPUxScene
+{
+    int Width, Height;
+    bool Priority;
+    bool Outlining;
+    float OutlineRadiusX, OutlineRadiusO;
+    bool SpritePriorityGlitch;
+    nes::EffectInfo Effects;
+    int Scale;
+    int ScaleY; // for RenderStringX
+
+    std::array<nes::PatternTable, 2> PatternTables;
+    nes::FramePalette FramePalette;
+    nes::NameTable Nametable;
+    int NametableX, NametableY;
+    std::vector<std::array<int, 4>> OAM; // x, y, tile, attributes
+    std::string Text;
+    std::string TextX; // may include the special -61 glyph and line breaks
+    int TextX0, TextY0;
+    int DataX, DataY, DataWidth, DataHeight;
+    std::vector<uint8_t> Data; // for RenderPaletteData
+    nes::PPUx::RenderPaletteDataFlags DataFlags;
+};
+
+static PPUxScene RandomPPUxScene(std::mt19937& gen)
+{
+    // Not uniform_int_distribution, which differs between standard libraries,
+    // so that a seed draws the same scene everywhere (for 'golden')
+    auto rnd = [&](int lo, int hi){
+        return lo + static_cast<int>(gen() % static_cast<uint32_t>(hi - lo + 1));
+    };
+
+    PPUxScene scene;
+    scene.Width = rnd(1, 600);
+    scene.Height = rnd(1, 500);
+    scene.Priority = rnd(0, 1);
+    scene.Outlining = scene.Priority && rnd(0, 3) == 0;
+    scene.SpritePriorityGlitch = rnd(0, 1);
+    // Mostly integer radii, sometimes in between
+    scene.OutlineRadiusX = static_cast<float>(rnd(0, 6)) + (rnd(0, 3) == 0 ? 0.5f : 0.0f);
+    scene.OutlineRadiusO = static_cast<float>(rnd(0, 6)) + (rnd(0, 3) == 0 ? static_cast<float>(rnd(1, 9)) / 10.0f : 0.0f);
+    scene.Effects = nes::EffectInfo::Defaults();
+    if (rnd(0, 2) == 0) {
+        scene.Effects.Opacity = static_cast<float>(rnd(0, 100)) / 100.0f;
+    }
+    if (rnd(0, 2) == 0) {
+        scene.Effects.CropWithin = true;
+        scene.Effects.Crop = {rnd(-20, scene.Width), rnd(-20, scene.Height),
+            rnd(0, scene.Width), rnd(0, scene.Height)};
+    }
+    scene.Scale = rnd(1, 4);
+    scene.ScaleY = rnd(1, 4);
+
+    for (auto& pt : scene.PatternTables) {
+        for (auto& v : pt) {
+            v = static_cast<uint8_t>(rnd(0, 255));
+        }
+    }
+    for (auto& v : scene.FramePalette) {
+        v = static_cast<uint8_t>(rnd(0, nes::PALETTE_ENTRIES - 1));
+    }
+    for (auto& v : scene.Nametable) {
+        v = static_cast<uint8_t>(rnd(0, 255));
+    }
+    scene.NametableX = rnd(-300, scene.Width);
+    scene.NametableY = rnd(-300, scene.Height);
+
+    int n = rnd(0, 64);
+    for (int i = 0; i < n; i++) {
+        scene.OAM.push_back({rnd(-40, scene.Width), rnd(-40, scene.Height),
+                rnd(0, 255), rnd(0, 255)});
+    }
+
+    int l = rnd(0, 12);
+    for (int i = 0; i < l; i++) {
+        char c = static_cast<char>(rnd(32, 126));
+        scene.Text.push_back(c);
+        int special = rnd(0, 9);
+        scene.TextX.push_back(special == 0 ? static_cast<char>(-61) : special == 1 ? '\n' : c);
+    }
+    scene.TextX0 = rnd(-40, scene.Width);
+    scene.TextY0 = rnd(-40, scene.Height);
+
+    scene.DataX = rnd(-100, scene.Width);
+    scene.DataY = rnd(-100, scene.Height);
+    scene.DataWidth = rnd(0, 200);
+    scene.DataHeight = rnd(0, 200);
+    scene.Data.resize(scene.DataWidth * scene.DataHeight);
+    for (auto& v : scene.Data) {
+        v = static_cast<uint8_t>(rnd(0, 3) == 0 ? 0 : rnd(0, nes::PALETTE_ENTRIES - 1));
+    }
+    static const std::array<nes::PPUx::RenderPaletteDataFlags, 4> DATA_FLAGS = {
+        nes::PPUx::RPD_PLACE_PIXELS_DIRECT,
+        nes::PPUx::RPD_AS_SPRITE,
+        static_cast<nes::PPUx::RenderPaletteDataFlags>(nes::PPUx::RPD_AS_SPRITE | nes::PPUx::RPD_SPRITE_PRIORITY),
+        nes::PPUx::RPD_AS_NAMETABLE,
+    };
+    scene.DataFlags = DATA_FLAGS[rnd(0, 3)];
+    return scene;
+}
+
+// Into a PPUx, or recorded into a PPUxCommandList
+template <typename T>
+static void RenderPPUxScene(const PPUxScene& scene, T* ppux)
+{
+    const uint8_t* paletteBGR = nes::DefaultPaletteBGR().data();
+    ppux->SetSpritePriorityGlitch(scene.SpritePriorityGlitch);
+    ppux->FillBackground(scene.FramePalette[0], paletteBGR);
+    if (scene.Effects.Opacity != 1.0f || scene.Effects.CropWithin) {
+        ppux->FillBackground(scene.FramePalette[1], paletteBGR, scene.Effects);
+    }
+    if (scene.Outlining) {
+        ppux->BeginOutline();
+    }
+
+    ppux->RenderNametable(scene.NametableX, scene.NametableY,
+            nes::NAMETABLE_WIDTH_BYTES, nes::NAMETABLE_HEIGHT_BYTES,
+            scene.Nametable.data(), scene.Nametable.data() + nes::NAMETABLE_ATTRIBUTE_OFFSET,
+            scene.PatternTables[0].data(), scene.FramePalette.data(), paletteBGR,
+            scene.Scale, scene.Effects);
+    for (auto& [x, y, tile, attributes] : scene.OAM) {
+        ppux->RenderOAMEntry(x, y, static_cast<uint8_t>(tile), static_cast<uint8_t>(attributes),
+                scene.PatternTables[1].data(), scene.FramePalette.data(), paletteBGR,
+                scene.Scale, scene.Effects);
+    }
+    ppux->RenderPaletteData(scene.DataX, scene.DataY, scene.DataWidth, scene.DataHeight,
+            scene.Data.data(), paletteBGR, scene.DataFlags, scene.Effects);
+    ppux->RenderString(scene.TextX0, scene.TextY0, scene.Text,
+            scene.PatternTables[0].data(), scene.FramePalette.data() + 16, paletteBGR,
+            scene.Scale, scene.Effects);
+    ppux->RenderStringX(scene.TextX0, scene.TextY0 + 8 * scene.Scale, scene.TextX,
+            scene.PatternTables[1].data(), scene.FramePalette.data() + 20, paletteBGR,
+            scene.Scale, scene.ScaleY, scene.Effects);
+
+    if (scene.Outlining) {
+        ppux->StrokeOutlineX(scene.OutlineRadiusX, nes::PALETTE_ENTRY_WHITE, paletteBGR);
+    }
+
+    // A second pass over what is left of the priority, as the combined view
+    // does for each player
+    if (scene.Priority) {
+        if (scene.SpritePriorityGlitch) {
+            ppux->ResetSpritePriorityOnly();
+        } else {
+            ppux->ResetPriority();
+        }
+        ppux->BeginOutline();
+        for (size_t i = 0; i < scene.OAM.size(); i += 2) {
+            auto& [x, y, tile, attributes] = scene.OAM[i];
+            ppux->RenderOAMEntry(y, x, static_cast<uint8_t>(tile), static_cast<uint8_t>(attributes),
+                    scene.PatternTables[0].data(), scene.FramePalette.data(), paletteBGR,
+                    scene.Scale, scene.Effects);
+        }
+        ppux->StrokeOutlineO(scene.OutlineRadiusO, nes::PALETTE_ENTRY_BLACK, paletteBGR);
+    }
+}
+
+// Render the scene with both the reference and the fast renderer, returns the
+// number of differing bytes (colors and priority)
+static size_t ComparePPUxScene(const PPUxScene& scene)
+{
+    auto status = scene.Priority ? nes::PPUxPriorityStatus::ENABLED : nes::PPUxPriorityStatus::DISABLED;
+    nes::PPUx reference(scene.Width, scene.Height, status);
+    nes::PPUx fast(scene.Width, scene.Height, status);
+    reference.SetReferenceRendering(true);
+
+    RenderPPUxScene(scene, &reference);
+    RenderPPUxScene(scene, &fast);
+
+    size_t differences = 0;
+    size_t n = nes::PPUx::RequiredBGROutSize(scene.Width, scene.Height);
+    for (size_t i = 0; i < n; i++) {
+        if (reference.GetBGROut()[i] != fast.GetBGROut()[i]) {
+            differences++;
+        }
+    }
+    if (scene.Priority) {
+        // Copies go through the dirty tiles, into something already used
+        nes::PPUx referenceCopy(scene.Width, scene.Height, status);
+        nes::PPUx fastCopy(scene.Width, scene.Height, status);
+        referenceCopy.SetReferenceRendering(true);
+        RenderPPUxScene(scene, &referenceCopy);
+        RenderPPUxScene(scene, &fastCopy);
+        reference.CopyPriorityTo(&referenceCopy);
+        fast.CopyPriorityTo(&fastCopy);
+        if (referenceCopy.GetPriorityInfo() != fastCopy.GetPriorityInfo()) {
+            differences++;
+        }
+    }
+    if (reference.GetPriorityInfo() != fast.GetPriorityInfo()) {
+        differences++;
+    }
+
+    // Palette indices resolve to the same thing (translucency is deferred, so
+    // only when opaque, see CompareDeferredPPUxScene)
+    if (scene.Effects.Opacity == 1.0f) {
+        nes::PPUx indexed(scene.Width, scene.Height, status, nes::PPUxOutputFormat::PALETTE_INDEX);
+        RenderPPUxScene(scene, &indexed);
+        std::vector<uint8_t> resolved(n);
+        indexed.Resolve(nes::DefaultPaletteBGR().data(), resolved.data());
+        for (size_t i = 0; i < n; i++) {
+            if (resolved[i] != fast.GetBGROut()[i]) {
+                differences++;
+            }
+        }
+    }
+    return differences;
+}
+
+// Recorded and rendered in bands on threads, against drawn directly. Returns
+// the number of differing bytes (colors and priority).
+static size_t CompareBandedPPUxScene(const PPUxScene& scene, nes::PPUxBandRenderer* renderer)
+{
+    auto status = scene.Priority ? nes::PPUxPriorityStatus::ENABLED : nes::PPUxPriorityStatus::DISABLED;
+    nes::PPUx direct(scene.Width, scene.Height, status);
+    nes::PPUx banded(scene.Width, scene.Height, status);
+    nes::PPUxCommandList list;
+    RenderPPUxScene(scene, &direct);
+    RenderPPUxScene(scene, &list);
+    renderer->Render(list, &banded);
+
+    size_t differences = 0;
+    size_t n = nes::PPUx::RequiredBGROutSize(scene.Width, scene.Height);
+    for (size_t i = 0; i < n; i++) {
+        if (direct.GetBGROut()[i] != banded.GetBGROut()[i]) {
+            differences++;
+        }
+    }
+    if (scene.Priority && direct.GetPriorityInfo() != banded.GetPriorityInfo()) {
+        differences++;
+    }
+    return differences;
+}
+
+// Executed (pattern tables bound up front) against drawn directly, and the
+// hash of the recording: the same when recorded again, different when a
+// nametable byte or the opacity changes. Returns the number of differences.
+static size_t CompareExecutedPPUxScene(const PPUxScene& scene)
+{
+    auto status = scene.Priority ? nes::PPUxPriorityStatus::ENABLED : nes::PPUxPriorityStatus::DISABLED;
+    nes::PPUx direct(scene.Width, scene.Height, status);
+    nes::PPUx executed(scene.Width, scene.Height, status);
+    nes::PPUxCommandList list;
+    RenderPPUxScene(scene, &direct);
+    RenderPPUxScene(scene, &list);
+    executed.Execute(list);
+
+    size_t differences = 0;
+    size_t n = nes::PPUx::RequiredBGROutSize(scene.Width, scene.Height);
+    for (size_t i = 0; i < n; i++) {
+        if (direct.GetBGROut()[i] != executed.GetBGROut()[i]) {
+            differences++;
+        }
+    }
+    if (direct.GetPriorityInfo() != executed.GetPriorityInfo()) {
+        differences++;
+    }
+
+    nes::PPUxCommandList again;
+    RenderPPUxScene(scene, &again);
+    if (again.Hash() != list.Hash()) {
+        differences++;
+    }
+    PPUxScene changed = scene;
+    changed.Nametable[0] ^= 0x01;
+    again.Clear();
+    RenderPPUxScene(changed, &again);
+    if (again.Hash() == list.Hash()) {
+        differences++;
+    }
+    changed = scene;
+    changed.Effects.Opacity = scene.Effects.Opacity == 1.0f ? 0.5f : 1.0f;
+    again.Clear();
+    RenderPPUxScene(changed, &again);
+    if (again.Hash() == list.Hash()) {
+        differences++;
+    }
+    return differences;
+}
+
+// The same scene with every position and scale multiplied. Crop, outlines
+// and palette data don't scale that way so they are left out.
+static PPUxScene ScalePPUxScene(const PPUxScene& scene, int scale)
+{
+    PPUxScene scaled = scene;
+    scaled.Width *= scale;
+    scaled.Height *= scale;
+    scaled.Outlining = false;
+    scaled.OutlineRadiusX = 0.0f;
+    scaled.OutlineRadiusO = 0.0f;
+    scaled.Effects = nes::EffectInfo::Defaults();
+    scaled.Scale *= scale;
+    scaled.ScaleY = scaled.Scale;
+    scaled.NametableX *= scale;
+    scaled.NametableY *= scale;
+    for (auto& oam : scaled.OAM) {
+        oam[0] *= scale;
+        oam[1] *= scale;
+    }
+    scaled.TextX0 *= scale;
+    scaled.TextY0 *= scale;
+    scaled.DataWidth = 0;
+    scaled.DataHeight = 0;
+    scaled.Data.clear();
+    return scaled;
+}
+
+// Drawn at 1x as palette indices and then upscaled, against drawn at the
+// larger size directly. Returns the number of differing bytes.
+static size_t CompareUpscaledPPUxScene(const PPUxScene& scene, int scale)
+{
+    PPUxScene native = ScalePPUxScene(scene, 1);
+    native.ScaleY = native.Scale;
+    PPUxScene scaled = ScalePPUxScene(native, scale);
+
+    auto status = scene.Priority ? nes::PPUxPriorityStatus::ENABLED : nes::PPUxPriorityStatus::DISABLED;
+    nes::PPUx indexed(native.Width, native.Height, status, nes::PPUxOutputFormat::PALETTE_INDEX);
+    nes::PPUx direct(scaled.Width, scaled.Height, status);
+    nes::PPUx upscaled(scaled.Width, scaled.Height, status);
+    RenderPPUxScene(native, &indexed);
+    RenderPPUxScene(scaled, &direct);
+    indexed.UpscaleTo(&upscaled, scale, nes::DefaultPaletteBGR().data());
+
+    size_t differences = 0;
+    size_t n = nes::PPUx::RequiredBGROutSize(scaled.Width, scaled.Height);
+    for (size_t i = 0; i < n; i++) {
+        if (direct.GetBGROut()[i] != upscaled.GetBGROut()[i]) {
+            differences++;
+        }
+    }
+    if (direct.GetPriorityInfo() != upscaled.GetPriorityInfo()) {
+        differences++;
+    }
+    return differences;
+}
+
+// One translucent layer (the nametable) drawn as palette indices, with a
+// palette that goes past the 64 NES colors, resolved over the rest of the
+// scene. Against the same layer drawn into BGR on top of it, at 1 + i % 4
+// times the size. Returns the number of differing bytes.
+static size_t CompareDeferredPPUxScene(const PPUxScene& scene, int scale, std::mt19937& gen)
+{
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::vector<uint8_t> paletteBGR(256 * 3);
+    for (auto& v : paletteBGR) v = static_cast<uint8_t>(byte(gen));
+    nes::FramePalette framePalette;
+    for (auto& v : framePalette) v = static_cast<uint8_t>(byte(gen));
+
+    PPUxScene below = scene;
+    below.Effects.Opacity = 1.0f;
+    auto status = scene.Priority ? nes::PPUxPriorityStatus::ENABLED : nes::PPUxPriorityStatus::DISABLED;
+    nes::PPUx base(scene.Width, scene.Height, status);
+    RenderPPUxScene(below, &base);
+    base.SetPriorityStatus(nes::PPUxPriorityStatus::DISABLED);
+
+    auto renderLayer = [&](nes::PPUx* ppux){
+        ppux->RenderNametable(scene.NametableX, scene.NametableY,
+                nes::NAMETABLE_WIDTH_BYTES, nes::NAMETABLE_HEIGHT_BYTES,
+                scene.Nametable.data(), scene.Nametable.data() + nes::NAMETABLE_ATTRIBUTE_OFFSET,
+                scene.PatternTables[0].data(), framePalette.data(), paletteBGR.data(),
+                scene.Scale, scene.Effects);
+    };
+    nes::PPUx layer(scene.Width, scene.Height, nes::PPUxPriorityStatus::DISABLED,
+            nes::PPUxOutputFormat::PALETTE_INDEX);
+    renderLayer(&layer);
+
+    nes::PPUx expected(scene.Width * scale, scene.Height * scale, nes::PPUxPriorityStatus::DISABLED);
+    nes::PPUx resolved(scene.Width * scale, scene.Height * scale, nes::PPUxPriorityStatus::DISABLED);
+    base.Resolve(nullptr, resolved.GetBGROut(), scale);
+    layer.Resolve(paletteBGR.data(), resolved.GetBGROut(), scale);
+    renderLayer(&base);
+    base.Resolve(nullptr, expected.GetBGROut(), scale);
+
+    size_t differences = 0;
+    size_t n = nes::PPUx::RequiredBGROutSize(scene.Width * scale, scene.Height * scale);
+    for (size_t i = 0; i < n; i++) {
+        if (expected.GetBGROut()[i] != resolved.GetBGROut()[i]) {
+            differences++;
+        }
+    }
+    return differences;
+}
+
+// BlendBGR against the exact dst + (src - dst) * opacity, returns the number of
+// bytes that are off by more than 1
+static size_t CheckPPUxBlending(std::mt19937& gen)
+{
+    size_t failures = 0;
+
+    // Every dst, src pair over a range of opacities
+    std::vector<uint8_t> dst(256 * 256), src(256 * 256), out;
+    for (int i = 0; i < 256 * 256; i++) {
+        dst[i] = static_cast<uint8_t>(i / 256);
+        src[i] = static_cast<uint8_t>(i % 256);
+    }
+    for (int o = 0; o <= 1000; o++) {
+        float opacity = static_cast<float>(o) / 1000.0f;
+        uint8_t alpha = nes::OpacityToAlpha(opacity);
+        out = dst;
+        nes::BlendBGR(out.data(), src.data(), out.size(), alpha);
+        for (size_t i = 0; i < out.size(); i++) {
+            double exact = static_cast<double>(dst[i]) +
+                (static_cast<double>(src[i]) - static_cast<double>(dst[i])) * static_cast<double>(opacity);
+            if (std::abs(static_cast<double>(out[i]) - exact) > 1.0 ||
+                out[i] != nes::BlendChannel(dst[i], src[i], alpha)) {
+                failures++;
+            }
+        }
+    }
+
+    // Unaligned starts and odd lengths, so the vector loops and their tails
+    // are both covered
+    std::uniform_int_distribution<int> byte(0, 255);
+    for (int t = 0; t < 1000; t++) {
+        size_t offset = std::uniform_int_distribution<size_t>(0, 31)(gen);
+        size_t n = std::uniform_int_distribution<size_t>(0, 300)(gen);
+        std::vector<uint8_t> a(offset + n), b(offset + n);
+        for (auto& v : a) v = static_cast<uint8_t>(byte(gen));
+        for (auto& v : b) v = static_cast<uint8_t>(byte(gen));
+        uint8_t alpha = static_cast<uint8_t>(byte(gen));
+
+        std::vector<uint8_t> c = a;
+        nes::BlendBGR(c.data() + offset, b.data() + offset, n, alpha);
+        for (size_t i = 0; i < offset + n; i++) {
+            uint8_t expected = i < offset ? a[i] : nes::BlendChannel(a[i], b[i], alpha);
+            if (c[i] != expected) {
+                failures++;
+            }
+        }
+    }
+    return failures;
+}
+
+// MeasureString(X) against the columns RenderString(X) actually draws with
+// solid glyphs, and FitString against its width. Returns the number of strings
+// that don't match.
+static size_t CheckPPUxTextLayout(std::mt19937& gen)
+{
+    auto rnd = [&](int lo, int hi){
+        return lo + static_cast<int>(gen() % static_cast<uint32_t>(hi - lo + 1));
+    };
+    nes::PatternTable solid;
+    for (int i = 0; i < nes::PATTERNTABLE_SIZE; i++) {
+        solid[i] = (i % 16) < 8 ? 0xff : 0x00;
+    }
+    std::array<uint8_t, 4> tilePalette = {0x00, nes::PALETTE_ENTRY_WHITE, 0x00, 0x00};
+    const uint8_t* paletteBGR = nes::DefaultPaletteBGR().data();
+
+    // One past the rightmost column that isn't black, rounded up to whole
+    // glyphs (the ü has a blank right column even with solid glyphs)
+    auto drawnWidth = [](const nes::PPUx& ppux, int scale){
+        int w = 0;
+        const uint8_t* bgr = ppux.GetBGROut();
+        for (int y = 0; y < ppux.GetHeight(); y++) {
+            for (int x = 0; x < ppux.GetWidth(); x++) {
+                const uint8_t* p = bgr + (y * ppux.GetWidth() + x) * 3;
+                if (p[0] || p[1] || p[2]) {
+                    w = std::max(w, x + 1);
+                }
+            }
+        }
+        return (w + 8 * scale - 1) / (8 * scale) * 8 * scale;
+    };
+
+    size_t failures = 0;
+    for (int t = 0; t < 200; t++) {
+        std::string str, strX;
+        int l = rnd(0, 20);
+        for (int i = 0; i < l; i++) {
+            str.push_back(static_cast<char>(rnd(32, 126)));
+            int special = rnd(0, 5);
+            strX.push_back(special == 0 ? static_cast<char>(-61) : special == 1 ? '\n' :
+                    special == 2 ? static_cast<char>(rnd(-128, -1)) : str.back());
+        }
+        int scale = rnd(1, 3);
+
+        nes::PPUx ppux(8 * 21 * scale, 8 * 21 * scale, nes::PPUxPriorityStatus::DISABLED);
+        ppux.FillBackground(nes::PALETTE_ENTRY_BLACK, paletteBGR);
+        ppux.RenderString(0, 0, str, solid.data(), tilePalette.data(), paletteBGR, scale,
+                nes::EffectInfo::Defaults());
+        if (drawnWidth(ppux, scale) != nes::MeasureString(str, scale)) {
+            failures++;
+        }
+
+        ppux.FillBackground(nes::PALETTE_ENTRY_BLACK, paletteBGR);
+        ppux.RenderStringX(0, 0, strX, solid.data(), tilePalette.data(), paletteBGR, scale, scale,
+                nes::EffectInfo::Defaults());
+        if (drawnWidth(ppux, scale) != nes::MeasureStringX(strX, scale)) {
+            failures++;
+        }
+
+        int maxWidth = rnd(0, 8 * 24 * scale);
+        std::string fit = nes::FitString(str, maxWidth, scale);
+        bool cut = fit != str;
+        if (nes::MeasureString(fit, scale) > maxWidth ||
+            (!cut && nes::MeasureString(str, scale) > maxWidth) ||
+            (cut && fit.size() >= 3 && fit.substr(fit.size() - 3) != "...")) {
+            failures++;
+        }
+    }
+    return failures;
+}
+
+// A few generated pages, for checking INametableCache::RenderTo without smb.db
+class CheckNametableCache : public smb::INametableCache
+{
+public:
+    CheckNametableCache(const std::vector<nes::NameTable>& pages)
+        : INametableCache(nullptr)
+        , m_Pages(pages)
+    {
+    }
+
+    const nes::NameTable* Nametable(smb::AreaID id, int page) const final
+    {
+        if (page < 0 || page >= static_cast<int>(m_Pages.size())) {
+            return nullptr;
+        }
+        return &m_Pages[page];
+    }
+
+    const smb::MinimapImage* Minimap(smb::AreaID id, int page) const final
+    {
+        return nullptr;
+    }
+
+private:
+    std::vector<nes::NameTable> m_Pages;
+};
+
+// RenderTo with nametable diffs against the pages with the diffs applied to
+// them and drawn tile by tile, then the same views rendered from the page
+// images by several threads at once from the one cache, and again with a
+// budget of two pages. Sprites behind the background go over each view so
+// that the background priority counts too. Returns the number of differing
+// bytes.
+static size_t CheckNametableOverlay(std::mt19937& gen)
+{
+    auto rnd = [&](int lo, int hi){
+        return lo + static_cast<int>(gen() % static_cast<uint32_t>(hi - lo + 1));
+    };
+    const int PAGES = 4;
+    const int VIEWS = 8;
+    const nes::Palette& palette = nes::DefaultPaletteBGR();
+
+    nes::PatternTable chr;
+    for (auto& v : chr) {
+        v = static_cast<uint8_t>(rnd(0, 255));
+    }
+    nes::FramePalette fpal;
+    for (auto& v : fpal) {
+        v = static_cast<uint8_t>(rnd(0, nes::PALETTE_ENTRIES - 1));
+    }
+    std::vector<nes::NameTable> pages(PAGES);
+    for (auto& page : pages) {
+        for (auto& v : page) {
+            v = static_cast<uint8_t>(rnd(0, 255));
+        }
+    }
+    CheckNametableCache cache(pages);
+
+    struct View
+    {
+        int APX;
+        int X;
+        int Width;
+        std::vector<smb::SMBNametableDiff> Diffs;
+        std::vector<std::array<int, 3>> Sprites; // x, y, tile
+        std::vector<uint8_t> Expected;
+    };
+    auto drawView = [&](const smb::INametableCache& from, const View& view,
+            const std::vector<smb::SMBNametableDiff>* diffs, nes::PPUx* ppux){
+        from.RenderTo(smb::AreaID::GROUND_AREA_6, view.APX, view.Width, ppux, view.X,
+                palette, chr.data(), nullptr, fpal.data(), diffs);
+        for (auto& sprite : view.Sprites) {
+            ppux->RenderOAMEntry(sprite[0], sprite[1], static_cast<uint8_t>(sprite[2]), 0x20,
+                    chr.data(), fpal.data(), palette.data(), 1, nes::EffectInfo::Defaults());
+        }
+    };
+
+    std::vector<View> views(VIEWS);
+    for (auto& view : views) {
+        view.APX = rnd(-100, (PAGES - 1) * nes::FRAME_WIDTH);
+        view.X = rnd(-20, 40);
+        view.Width = rnd(1, nes::FRAME_WIDTH);
+        int n = rnd(0, 40);
+        for (int i = 0; i < n; i++) {
+            // Attributes too, and the same offset more than once
+            int offset = rnd(0, 3) == 0 ? rnd(nes::NAMETABLE_ATTRIBUTE_OFFSET, nes::NAMETABLE_SIZE - 1) :
+                rnd(0, nes::NAMETABLE_SIZE - 1);
+            if (i > 0 && rnd(0, 4) == 0) {
+                offset = view.Diffs.back().Offset;
+            }
+            view.Diffs.push_back({rnd(0, PAGES - 1), offset, static_cast<uint8_t>(rnd(0, 255))});
+        }
+        n = rnd(0, 16);
+        for (int i = 0; i < n; i++) {
+            view.Sprites.push_back({rnd(-4, nes::FRAME_WIDTH - 4), rnd(-4, nes::FRAME_HEIGHT - 4), rnd(0, 255)});
+        }
+
+        std::vector<nes::NameTable> applied = pages;
+        for (auto& diff : view.Diffs) {
+            applied[diff.NametablePage][diff.Offset] = diff.Value;
+        }
+        CheckNametableCache appliedCache(applied);
+        appliedCache.PageImages()->SetBudget(0);
+        nes::PPUx ppux(nes::FRAME_WIDTH, nes::FRAME_HEIGHT, nes::PPUxPriorityStatus::ENABLED);
+        drawView(appliedCache, view, nullptr, &ppux);
+        view.Expected.assign(ppux.GetBGROut(), ppux.GetBGROut() + nes::PPUx::RequiredBGROutSize(ppux.GetWidth(), ppux.GetHeight()));
+    }
+
+    std::atomic<size_t> differences = 0;
+    auto renderViews = [&](int first, int count){
+        for (int r = 0; r < 20; r++) {
+            for (int v = first; v < first + count; v++) {
+                auto& view = views[v];
+                nes::PPUx ppux(nes::FRAME_WIDTH, nes::FRAME_HEIGHT, nes::PPUxPriorityStatus::ENABLED);
+                drawView(cache, view, &view.Diffs, &ppux);
+                const uint8_t* bgr = ppux.GetBGROut();
+                for (size_t i = 0; i < view.Expected.size(); i++) {
+                    if (bgr[i] != view.Expected[i]) {
+                        differences++;
+                    }
+                }
+            }
+        }
+    };
+    renderViews(0, VIEWS);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back(renderViews, t * (VIEWS / 4), VIEWS / 4);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    // Every page is drawn again once it has been evicted
+    size_t pageBytes = nes::PPUx::RequiredBGROutSize(nes::FRAME_WIDTH, nes::FRAME_HEIGHT) +
+        nes::FRAME_WIDTH * nes::FRAME_HEIGHT;
+    cache.PageImages()->SetBudget(2 * pageBytes);
+    renderViews(0, VIEWS);
+    auto counters = cache.PageImages()->GetCounters();
+    if (counters.Pages > 2 || counters.Bytes > 2 * pageBytes) {
+        differences++;
+    }
+    return differences;
+}
+
+// A cropped FillBackground only clears the priority it covers. Returns the
+// number of pixels whose priority is wrong afterwards
+static size_t CheckCroppedFillPriority(std::mt19937& gen)
+{
+    size_t failures = 0;
+    int w = 61, h = 43; // not a whole number of priority tiles
+    nes::PPUx ppux(w, h, nes::PPUxPriorityStatus::ENABLED);
+    const uint8_t* paletteBGR = nes::DefaultPaletteBGR().data();
+    for (int t = 0; t < 100; t++) {
+        ppux.ResetPriority();
+        auto& priority = ppux.GetPriorityInfo();
+        std::fill(priority.begin(), priority.end(), 0x01); // PPUPRI_BG
+
+        nes::EffectInfo effects = nes::EffectInfo::Defaults();
+        effects.CropWithin = true;
+        effects.Crop.X = std::uniform_int_distribution<int>(-4, w)(gen);
+        effects.Crop.Y = std::uniform_int_distribution<int>(-4, h)(gen);
+        effects.Crop.Width = std::uniform_int_distribution<int>(0, w)(gen);
+        effects.Crop.Height = std::uniform_int_distribution<int>(0, h)(gen);
+        ppux.FillBackground(0x22, paletteBGR, effects);
+
+        auto& crop = effects.Crop;
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                bool inside = x >= crop.X && x <= crop.X + crop.Width &&
+                    y >= crop.Y && y <= crop.Y + crop.Height;
+                if (priority[y * w + x] != (inside ? 0x00 : 0x01)) {
+                    failures++;
+                }
+            }
+        }
+    }
+    return failures;
+}
+
+static int DoPPUxCheck(int iterations, uint32_t seed)
+{
+    std::mt19937 gen(seed);
+
+    size_t blendFailures = CheckPPUxBlending(gen);
+    std::cout << fmt::format("blending: {} bytes off by more than 1\n", blendFailures);
+    size_t layoutFailures = CheckPPUxTextLayout(gen);
+    std::cout << fmt::format("text layout: {} strings measured or fit wrong\n", layoutFailures);
+    size_t overlayFailures = CheckNametableOverlay(gen);
+    std::cout << fmt::format("nametable diffs, 4 threads: {} bytes differ\n", overlayFailures);
+    size_t fillFailures = CheckCroppedFillPriority(gen);
+    std::cout << fmt::format("cropped fill: {} pixels with the wrong priority\n", fillFailures);
+
+    std::vector<std::unique_ptr<nes::PPUxBandRenderer>> renderers;
+    for (int threads : {1, 2, 3, 8}) {
+        renderers.push_back(std::make_unique<nes::PPUxBandRenderer>(threads));
+    }
+
+    int sceneFailures = 0;
+    for (int i = 0; i < iterations && !g_SIGINT; i++) {
+        PPUxScene scene = RandomPPUxScene(gen);
+        size_t differences = ComparePPUxScene(scene);
+        differences += CompareUpscaledPPUxScene(scene, 1 + i % 4);
+        differences += CompareDeferredPPUxScene(scene, 1 + i % 4, gen);
+        differences += CompareBandedPPUxScene(scene, renderers[i % renderers.size()].get());
+        differences += CompareExecutedPPUxScene(scene);
+        if (differences) {
+            sceneFailures++;
+            std::cout << fmt::format("scene {}: {}x{} scale {} opacity {:.2f} crop {} priority {} outline {}: {} differences\n",
+                    i, scene.Width, scene.Height, scene.Scale, scene.Effects.Opacity,
+                    scene.Effects.CropWithin, scene.Priority, scene.Outlining, differences);
+        }
+    }
+    std::cout << fmt::format("{} / {} scenes match\n", iterations - sceneFailures, iterations);
+    return (blendFailures || layoutFailures || overlayFailures || fillFailures || sceneFailures) ? 1 : 0;
+}
+
+static double BenchPPUxNametable(bool reference, int scale, int iterations, const PPUxScene& scene)
+{
+    nes::PPUx ppux(nes::FRAME_WIDTH * scale, nes::FRAME_HEIGHT * scale, nes::PPUxPriorityStatus::ENABLED);
+    ppux.SetReferenceRendering(reference);
+    const uint8_t* paletteBGR = nes::DefaultPaletteBGR().data();
+
+    auto start = util::Now();
+    for (int i = 0; i < iterations; i++) {
+        ppux.ResetPriority();
+        ppux.RenderNametable(0, 0,
+                nes::NAMETABLE_WIDTH_BYTES, nes::NAMETABLE_HEIGHT_BYTES,
+                scene.Nametable.data(), scene.Nametable.data() + nes::NAMETABLE_ATTRIBUTE_OFFSET,
+                scene.PatternTables[0].data(), scene.FramePalette.data(), paletteBGR,
+                scale, nes::EffectInfo::Defaults());
+    }
+    auto elapsed = std::chrono::duration<double, std::micro>(util::Now() - start);
+    return elapsed.count() / static_cast<double>(iterations);
+}
+
+// Drawn once at 1x as palette indices, then resolved at the scale
+static double BenchPPUxNametableResolve(int scale, int iterations, const PPUxScene& scene)
+{
+    nes::PPUx ppux(nes::FRAME_WIDTH, nes::FRAME_HEIGHT, nes::PPUxPriorityStatus::ENABLED,
+            nes::PPUxOutputFormat::PALETTE_INDEX);
+    std::vector<uint8_t> bgr(nes::PPUx::RequiredBGROutSize(nes::FRAME_WIDTH * scale, nes::FRAME_HEIGHT * scale));
+    const uint8_t* paletteBGR = nes::DefaultPaletteBGR().data();
+
+    auto start = util::Now();
+    for (int i = 0; i < iterations; i++) {
+        ppux.ResetPriority();
+        ppux.RenderNametable(0, 0,
+                nes::NAMETABLE_WIDTH_BYTES, nes::NAMETABLE_HEIGHT_BYTES,
+                scene.Nametable.data(), scene.Nametable.data() + nes::NAMETABLE_ATTRIBUTE_OFFSET,
+                scene.PatternTables[0].data(), scene.FramePalette.data(), paletteBGR,
+                1, nes::EffectInfo::Defaults());
+        ppux.Resolve(paletteBGR, bgr.data(), scale);
+    }
+    auto elapsed = std::chrono::duration<double, std::micro>(util::Now() - start);
+    return elapsed.count() / static_cast<double>(iterations);
+}
+
+// A timing tower's worth of names and times, as whole strings or a tile at a
+// time the way RenderString used to
+static double BenchPPUxStrings(bool perTile, int scale, int iterations, const PPUxScene& scene)
+{
+    nes::PPUx ppux(nes::FRAME_WIDTH * scale, nes::FRAME_HEIGHT * scale, nes::PPUxPriorityStatus::ENABLED);
+    const uint8_t* paletteBGR = nes::DefaultPaletteBGR().data();
+    std::vector<std::string> lines;
+    for (int i = 0; i < 16; i++) {
+        lines.push_back(fmt::format("PLAYER {:02d}  +{:2d}.{}", i, i * 3, i % 10));
+    }
+
+    auto start = util::Now();
+    for (int i = 0; i < iterations; i++) {
+        for (size_t l = 0; l < lines.size(); l++) {
+            int y = static_cast<int>(l) * 12 * scale;
+            if (perTile) {
+                int x = 8;
+                for (auto c : lines[l]) {
+                    ppux.RenderOAMEntry(x, y, static_cast<uint8_t>(c), 0x00,
+                            scene.PatternTables[0].data(), scene.FramePalette.data() + 12, paletteBGR,
+                            scale, nes::EffectInfo::Defaults());
+                    x += 8 * scale;
+                }
+            } else {
+                ppux.RenderString(8, y, lines[l], scene.PatternTables[0].data(),
+                        scene.FramePalette.data() + 16, paletteBGR, scale, nes::EffectInfo::Defaults());
+            }
+        }
+    }
+    auto elapsed = std::chrono::duration<double, std::micro>(util::Now() - start);
+    return elapsed.count() / static_cast<double>(iterations);
+}
+
+// The combined view pattern: one large canvas (optionally with a background
+// of nametables), then for each player a priority reset, a few outlined
+// sprites and the stroke
+template <typename T>
+static void DrawPPUxCombinedView(const PPUxScene& scene, bool background,
+        float outlineRadius, bool rounded, T* ppux)
+{
+    const uint8_t* paletteBGR = nes::DefaultPaletteBGR().data();
+    const int PLAYERS = 8;
+    const int SCALE = 4;
+
+    ppux->FillBackground(nes::PALETTE_ENTRY_BLACK, paletteBGR);
+    if (background) {
+        for (int x = 0; x < 1920; x += nes::FRAME_WIDTH * SCALE) {
+            ppux->RenderNametable(x, 60,
+                    nes::NAMETABLE_WIDTH_BYTES, nes::NAMETABLE_HEIGHT_BYTES,
+                    scene.Nametable.data(), scene.Nametable.data() + nes::NAMETABLE_ATTRIBUTE_OFFSET,
+                    scene.PatternTables[0].data(), scene.FramePalette.data(), paletteBGR,
+                    SCALE, nes::EffectInfo::Defaults());
+        }
+    }
+    for (int p = 0; p < PLAYERS; p++) {
+        ppux->ResetPriority();
+        ppux->BeginOutline();
+        int px = 100 + p * 200;
+        int py = 400 + (p % 3) * 100;
+        for (int t = 0; t < 8; t++) {
+            ppux->RenderOAMEntry(px + (t % 2) * 8 * SCALE, py + (t / 2) * 8 * SCALE,
+                    static_cast<uint8_t>(t), 0x00,
+                    scene.PatternTables[1].data(), scene.FramePalette.data(), paletteBGR,
+                    SCALE, nes::EffectInfo::Defaults());
+        }
+        if (rounded) {
+            ppux->StrokeOutlineO(outlineRadius, nes::PALETTE_ENTRY_WHITE, paletteBGR);
+        } else {
+            ppux->StrokeOutlineX(outlineRadius, nes::PALETTE_ENTRY_WHITE, paletteBGR);
+        }
+    }
+}
+
+static double BenchPPUxCombinedView(bool reference, int iterations, const PPUxScene& scene,
+        float outlineRadius = 2.0f, bool rounded = true)
+{
+    nes::PPUx ppux(1920, 1080, nes::PPUxPriorityStatus::ENABLED);
+    ppux.SetReferenceRendering(reference);
+
+    auto start = util::Now();
+    for (int i = 0; i < iterations; i++) {
+        DrawPPUxCombinedView(scene, false, outlineRadius, rounded, &ppux);
+    }
+    auto elapsed = std::chrono::duration<double, std::micro>(util::Now() - start);
+    return elapsed.count() / static_cast<double>(iterations);
+}
+
+// The combined view with a background: drawn directly, recorded then
+// executed, and just recorded and hashed (as when a frame is skipped)
+static uint64_t BenchPPUxExecute(int iterations, const PPUxScene& scene,
+        double* direct, double* executed, double* hashed)
+{
+    nes::PPUx ppux(1920, 1080, nes::PPUxPriorityStatus::ENABLED);
+    nes::PPUxCommandList list;
+    uint64_t hash = 0;
+
+    auto start = util::Now();
+    for (int i = 0; i < iterations; i++) {
+        DrawPPUxCombinedView(scene, true, 2.0f, true, &ppux);
+    }
+    auto t0 = util::Now();
+    for (int i = 0; i < iterations; i++) {
+        list.Clear();
+        DrawPPUxCombinedView(scene, true, 2.0f, true, &list);
+        ppux.Execute(list);
+    }
+    auto t1 = util::Now();
+    for (int i = 0; i < iterations; i++) {
+        list.Clear();
+        DrawPPUxCombinedView(scene, true, 2.0f, true, &list);
+        hash = list.Hash();
+    }
+    auto t2 = util::Now();
+
+    *direct = std::chrono::duration<double, std::micro>(t0 - start).count() / iterations;
+    *executed = std::chrono::duration<double, std::micro>(t1 - t0).count() / iterations;
+    *hashed = std::chrono::duration<double, std::micro>(t2 - t1).count() / iterations;
+    return hash;
+}
+
+// The combined view with a background, recorded once and rendered in bands
+static double BenchPPUxBands(int threads, int iterations, const PPUxScene& scene)
+{
+    nes::PPUx ppux(1920, 1080, nes::PPUxPriorityStatus::ENABLED);
+    nes::PPUxCommandList list;
+    DrawPPUxCombinedView(scene, true, 2.0f, true, &list);
+    nes::PPUxBandRenderer renderer(threads);
+
+    auto start = util::Now();
+    for (int i = 0; i < iterations; i++) {
+        renderer.Render(list, &ppux);
+    }
+    auto elapsed = std::chrono::duration<double, std::micro>(util::Now() - start);
+    return elapsed.count() / static_cast<double>(iterations);
+}
+
+// Eight players side by side in the same area a few pages apart, each with a
+// handful of nametable diffs, through INametableCache::RenderTo. The page
+// images off (budget 0) or on
+static double BenchPPUxPageImages(bool cached, int iterations, const PPUxScene& scene,
+        smb::NametablePageImageCache::Counters* counters)
+{
+    const int PLAYERS = 8;
+    const int PAGES = 12;
+    std::mt19937 gen(0);
+    auto rnd = [&](int lo, int hi){
+        return lo + static_cast<int>(gen() % static_cast<uint32_t>(hi - lo + 1));
+    };
+
+    std::vector<nes::NameTable> pages(PAGES, scene.Nametable);
+    for (auto& page : pages) {
+        for (int i = 0; i < 64; i++) {
+            page[rnd(0, nes::NAMETABLE_ATTRIBUTE_OFFSET - 1)] = static_cast<uint8_t>(rnd(0, 255));
+        }
+    }
+    CheckNametableCache cache(pages);
+    if (!cached) {
+        cache.PageImages()->SetBudget(0);
+    }
+
+    std::vector<int> apx(PLAYERS);
+    std::vector<std::vector<smb::SMBNametableDiff>> diffs(PLAYERS);
+    for (int p = 0; p < PLAYERS; p++) {
+        apx[p] = rnd(0, (PAGES - 4) * nes::FRAME_WIDTH);
+        for (int i = 0; i < 8; i++) {
+            diffs[p].push_back({apx[p] / nes::FRAME_WIDTH + rnd(0, 1),
+                    rnd(0, nes::NAMETABLE_ATTRIBUTE_OFFSET - 1), static_cast<uint8_t>(rnd(0, 255))});
+        }
+    }
+
+    nes::PPUx ppux(nes::FRAME_WIDTH * PLAYERS, nes::FRAME_HEIGHT, nes::PPUxPriorityStatus::ENABLED);
+    const nes::Palette& palette = nes::DefaultPaletteBGR();
+    auto start = util::Now();
+    for (int i = 0; i < iterations; i++) {
+        ppux.ResetPriority();
+        for (int p = 0; p < PLAYERS; p++) {
+            // Everyone moves on a little each frame
+            int x = apx[p] + (i * 3) % (2 * nes::FRAME_WIDTH);
+            cache.RenderTo(smb::AreaID::GROUND_AREA_6, x, nes::FRAME_WIDTH, &ppux, p * nes::FRAME_WIDTH,
+                    palette, scene.PatternTables[0].data(), nullptr, scene.FramePalette.data(), &diffs[p]);
+        }
+    }
+    auto elapsed = std::chrono::duration<double, std::micro>(util::Now() - start);
+    *counters = cache.PageImages()->GetCounters();
+    return elapsed.count() / static_cast<double>(iterations);
+}
+
+static int DoPPUxBench(int iterations, uint32_t seed)
+{
+    std::mt19937 gen(seed);
+    PPUxScene scene = RandomPPUxScene(gen);
+
+    std::cout << "RenderNametable, full screen, priority enabled\n";
+    for (int scale : {1, 2, 4}) {
+        double ref = BenchPPUxNametable(true, scale, iterations, scene);
+        double fast = BenchPPUxNametable(false, scale, iterations, scene);
+        double resolve = BenchPPUxNametableResolve(scale, iterations, scene);
+        std::cout << fmt::format("  scale {}: reference {:9.1f}us  fast {:9.1f}us  {:5.1f}x  1x indices + resolve {:9.1f}us\n",
+                scale, ref, fast, ref / fast, resolve);
+    }
+
+    std::cout << "16 lines of text (a timing tower)\n";
+    for (int scale : {1, 2}) {
+        double tiles = BenchPPUxStrings(true, scale, iterations, scene);
+        double strings = BenchPPUxStrings(false, scale, iterations, scene);
+        std::cout << fmt::format("  scale {}: a tile at a time {:9.1f}us  RenderString {:9.1f}us  {:5.1f}x\n",
+                scale, tiles, strings, tiles / strings);
+    }
+
+    std::cout << "Combined view, 1920x1080, 8 outlined players\n";
+    double ref = BenchPPUxCombinedView(true, std::max(iterations / 10, 1), scene);
+    double fast = BenchPPUxCombinedView(false, std::max(iterations / 10, 1), scene);
+    std::cout << fmt::format("  reference {:9.1f}us  fast {:9.1f}us  {:5.1f}x\n",
+            ref, fast, ref / fast);
+
+    std::cout << "Combined view, thick outlines\n";
+    for (bool rounded : {true, false}) {
+        for (float radius : {4.0f, 8.0f, 16.0f}) {
+            double ref = BenchPPUxCombinedView(true, std::max(iterations / 20, 1), scene, radius, rounded);
+            double fast = BenchPPUxCombinedView(false, std::max(iterations / 20, 1), scene, radius, rounded);
+            std::cout << fmt::format("  StrokeOutline{} {:2.0f}: reference {:9.1f}us  fast {:9.1f}us  {:5.1f}x\n",
+                    rounded ? "O" : "X", radius, ref, fast, ref / fast);
+        }
+    }
+
+    std::cout << "Eight players side by side, RenderTo with nametable diffs\n";
+    smb::NametablePageImageCache::Counters uncachedCounters, cachedCounters;
+    double uncached = BenchPPUxPageImages(false, std::max(iterations / 10, 1), scene, &uncachedCounters);
+    double cached = BenchPPUxPageImages(true, std::max(iterations / 10, 1), scene, &cachedCounters);
+    std::cout << fmt::format("  tiles {:9.1f}us  page images {:9.1f}us  {:5.1f}x  ({} hits, {} misses, {} evictions, {} pages, {} KiB)\n",
+            uncached, cached, uncached / cached, cachedCounters.Hits, cachedCounters.Misses,
+            cachedCounters.Evictions, cachedCounters.Pages, cachedCounters.Bytes / 1024);
+
+    std::cout << "Combined view with nametables, command list\n";
+    double direct, executed, hashed;
+    uint64_t hash = BenchPPUxExecute(std::max(iterations / 10, 1), scene, &direct, &executed, &hashed);
+    std::cout << fmt::format("  direct {:9.1f}us  record + execute {:9.1f}us  record + hash {:9.1f}us ({:016x})\n",
+            direct, executed, hashed, hash);
+
+    std::cout << "Combined view with nametables, in bands\n";
+    int hardware = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    std::vector<int> threadCounts;
+    for (int threads = 1; threads < hardware; threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(hardware);
+    double one = 0.0;
+    for (int threads : threadCounts) {
+        double t = BenchPPUxBands(threads, std::max(iterations / 10, 1), scene);
+        if (threads == 1) {
+            one = t;
+        }
+        std::cout << fmt::format("  {:2} threads {:9.1f}us  {:5.1f}x\n", threads, t, one / t);
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Goldens. A fixed corpus of frames, drawn and compared against the PNGs from
+// the last 'static ppux golden --update-goldens'.
+
+struct PPUxGolden
+{
+    std::string Name; // file name without the .png
+    cv::Mat Image;    // BGR
+};
+
+static cv::Mat PPUxToMat(nes::PPUx* ppux)
+{
+    return cv::Mat(ppux->GetHeight(), ppux->GetWidth(), CV_8UC3, ppux->GetBGROut()).clone();
+}
+
+// Pattern tables, palette and nametable of a seeded scene, so that every
+// golden of a kind draws with the same data
+static PPUxScene GoldenPPUxScene(uint32_t seed)
+{
+    std::mt19937 gen(seed);
+    return RandomPPUxScene(gen);
+}
+
+static void AddSceneGoldens(std::vector<PPUxGolden>* goldens)
+{
+    for (uint32_t seed = 0; seed < 16; seed++) {
+        PPUxScene scene = GoldenPPUxScene(seed);
+        auto status = scene.Priority ? nes::PPUxPriorityStatus::ENABLED : nes::PPUxPriorityStatus::DISABLED;
+        nes::PPUx ppux(scene.Width, scene.Height, status);
+        RenderPPUxScene(scene, &ppux);
+        goldens->push_back({fmt::format("scene_{:02d}", seed), PPUxToMat(&ppux)});
+    }
+}
+
+// Every combination of the flip, priority and palette bits. Each sprite is
+// overlapped by one with the other background priority, so that the sprite
+// priority glitch shows too
+static void AddSpriteGoldens(std::vector<PPUxGolden>* goldens)
+{
+    PPUxScene scene = GoldenPPUxScene(100);
+    const uint8_t* paletteBGR = nes::DefaultPaletteBGR().data();
+    for (bool glitch : {false, true}) {
+        for (int scale : {1, 3}) {
+            nes::PPUx ppux(nes::FRAME_WIDTH * scale, nes::FRAME_HEIGHT * scale, nes::PPUxPriorityStatus::ENABLED);
+            ppux.SetSpritePriorityGlitch(glitch);
+            ppux.FillBackground(scene.FramePalette[0], paletteBGR);
+            ppux.RenderNametable(0, 0, nes::NAMETABLE_WIDTH_BYTES, nes::NAMETABLE_HEIGHT_BYTES,
+                    scene.Nametable.data(), scene.Nametable.data() + nes::NAMETABLE_ATTRIBUTE_OFFSET,
+                    scene.PatternTables[0].data(), scene.FramePalette.data(), paletteBGR,
+                    scale, nes::EffectInfo::Defaults());
+            for (int attributes = 0; attributes < 0x100; attributes++) {
+                if (attributes & 0b00011100) {
+                    continue; // unused bits
+                }
+                int i = (attributes & 0x03) | ((attributes >> 3) & 0x1c);
+                int x = 16 + (i % 8) * 28;
+                int y = 24 + (i / 8) * 48;
+                for (int j = 0; j < 2; j++) {
+                    ppux.RenderOAMEntry((x + j * 4) * scale, (y + j * 4) * scale,
+                            static_cast<uint8_t>(0x30 + i + j), static_cast<uint8_t>(attributes ^ (j * 0x20)),
+                            scene.PatternTables[1].data(), scene.FramePalette.data(), paletteBGR,
+                            scale, nes::EffectInfo::Defaults());
+                }
+            }
+            goldens->push_back({fmt::format("sprites_glitch{}_s{}", glitch ? 1 : 0, scale), PPUxToMat(&ppux)});
+        }
+    }
+}
+
+static void AddOpacityGoldens(std::vector<PPUxGolden>* goldens)
+{
+    PPUxScene scene = GoldenPPUxScene(101);
+    const uint8_t* paletteBGR = nes::DefaultPaletteBGR().data();
+    for (int percent : {0, 10, 25, 50, 75, 90, 100}) {
+        nes::EffectInfo effects = nes::EffectInfo::Defaults();
+        effects.Opacity = static_cast<float>(percent) / 100.0f;
+
+        nes::PPUx ppux(nes::FRAME_WIDTH, nes::FRAME_HEIGHT, nes::PPUxPriorityStatus::ENABLED);
+        ppux.FillBackground(nes::PALETTE_ENTRY_WHITE, paletteBGR);
+        ppux.RenderNametable(0, 0, nes::NAMETABLE_WIDTH_BYTES, nes::NAMETABLE_HEIGHT_BYTES,
+                scene.Nametable.data(), scene.Nametable.data() + nes::NAMETABLE_ATTRIBUTE_OFFSET,
+                scene.PatternTables[0].data(), scene.FramePalette.data(), paletteBGR,
+                1, effects);
+        for (auto& [x, y, tile, attributes] : scene.OAM) {
+            ppux.RenderOAMEntry(x % nes::FRAME_WIDTH, y % nes::FRAME_HEIGHT,
+                    static_cast<uint8_t>(tile), static_cast<uint8_t>(attributes),
+                    scene.PatternTables[1].data(), scene.FramePalette.data(), paletteBGR,
+                    2, effects);
+        }
+        ppux.RenderString(8, 8, "OPACITY", scene.PatternTables[0].data(),
+                scene.FramePalette.data() + 16, paletteBGR, 2, effects);
+        goldens->push_back({fmt::format("opacity_{:03d}", percent), PPUxToMat(&ppux)});
+    }
+}
+
+static void AddOutlineGoldens(std::vector<PPUxGolden>* goldens)
+{
+    PPUxScene scene = GoldenPPUxScene(102);
+    const uint8_t* paletteBGR = nes::DefaultPaletteBGR().data();
+    for (bool rounded : {true, false}) {
+        for (float radius : {1.0f, 2.5f, 6.0f}) {
+            nes::PPUx ppux(nes::FRAME_WIDTH * 2, nes::FRAME_HEIGHT * 2, nes::PPUxPriorityStatus::ENABLED);
+            ppux.FillBackground(scene.FramePalette[0], paletteBGR);
+            ppux.BeginOutline();
+            for (auto& [x, y, tile, attributes] : scene.OAM) {
+                ppux.RenderOAMEntry(x % (nes::FRAME_WIDTH * 2), y % (nes::FRAME_HEIGHT * 2),
+                        static_cast<uint8_t>(tile), static_cast<uint8_t>(attributes),
+                        scene.PatternTables[1].data(), scene.FramePalette.data(), paletteBGR,
+                        2, nes::EffectInfo::Defaults());
+            }
+            ppux.RenderString(16, 16, "OUTLINE", scene.PatternTables[0].data(),
+                    scene.FramePalette.data() + 16, paletteBGR, 3, nes::EffectInfo::Defaults());
+            if (rounded) {
+                ppux.StrokeOutlineO(radius, nes::PALETTE_ENTRY_BLACK, paletteBGR);
+            } else {
+                ppux.StrokeOutlineX(radius, nes::PALETTE_ENTRY_WHITE, paletteBGR);
+            }
+            goldens->push_back({fmt::format("outline_{}_r{:.1f}", rounded ? "o" : "x", radius), PPUxToMat(&ppux)});
+        }
+    }
+}
+
+static void AddTextGoldens(std::vector<PPUxGolden>* goldens)
+{
+    PPUxScene scene = GoldenPPUxScene(103);
+    const uint8_t* paletteBGR = nes::DefaultPaletteBGR().data();
+    std::array<uint8_t, 9> boxPalette = {
+        0x0f, 0x30, 0x0f,
+        0x30, 0x21, 0x30,
+        0x0f, 0x30, 0x0f,
+    };
+    std::string textX = "GOLDEN ";
+    textX.push_back(static_cast<char>(-61));
+    textX += " 1-1";
+    for (int scale = 1; scale <= 4; scale++) {
+        nes::PPUx ppux(160 * scale, 96 * scale, nes::PPUxPriorityStatus::ENABLED);
+        ppux.FillBackground(nes::PALETTE_ENTRY_BLACK, paletteBGR);
+        for (int outlineWidth : {1, 2}) {
+            int y = (outlineWidth - 1) * 48 * scale;
+            ppux.DrawBorderedBox(4 * scale, y + 4 * scale, 152 * scale, 40 * scale,
+                    boxPalette, paletteBGR, outlineWidth * scale);
+            ppux.RenderString(8 * scale, y + 8 * scale, "ABC 123 :-!", scene.PatternTables[0].data(),
+                    scene.FramePalette.data() + 16, paletteBGR, scale, nes::EffectInfo::Defaults());
+            ppux.RenderStringX(8 * scale, y + 18 * scale, textX, scene.PatternTables[1].data(),
+                    scene.FramePalette.data() + 20, paletteBGR, scale, scale * outlineWidth,
+                    nes::EffectInfo::Defaults());
+        }
+        goldens->push_back({fmt::format("text_s{}", scale), PPUxToMat(&ppux)});
+    }
+}
+
+// Every nametable page and its minimap as INametableCache::RenderTo draws
+// them, and one span per area across two pages with nametable diffs
+static void AddNametableGoldens(smb::SMBDatabase* smbdb, std::vector<PPUxGolden>* goldens)
+{
+    auto nametables = smbdb->GetNametableCache();
+    auto rom = smbdb->GetBaseRom();
+    const uint8_t* chr1 = smb::rom_chr1(rom);
+    const nes::Palette& palette = nes::DefaultPaletteBGR();
+
+    std::vector<smb::db::nametable_page> pages;
+    smbdb->GetAllNametablePages(&pages);
+    std::sort(pages.begin(), pages.end(), [](const auto& l, const auto& r){
+        return std::make_tuple(l.area_id, l.page) < std::make_tuple(r.area_id, r.page);
+    });
+
+    for (auto& page : pages) {
+        int aid = static_cast<int>(page.area_id);
+        {
+            nes::PPUx ppux(nes::FRAME_WIDTH, nes::FRAME_HEIGHT, nes::PPUxPriorityStatus::ENABLED);
+            ppux.FillBackground(page.frame_palette[0], palette.data());
+            nametables->RenderTo(page.area_id, page.page * nes::FRAME_WIDTH, nes::FRAME_WIDTH,
+                    &ppux, 0, palette, chr1, nullptr, page.frame_palette.data());
+            goldens->push_back({fmt::format("nametable_{:02x}_{:02d}", aid, page.page), PPUxToMat(&ppux)});
+        }
+        {
+            nes::PPUx ppux(nes::FRAME_WIDTH, nes::FRAME_HEIGHT, nes::PPUxPriorityStatus::ENABLED);
+            ppux.FillBackground(nes::PALETTE_ENTRY_BLACK, palette.data());
+            nametables->RenderTo(page.area_id, page.page * nes::FRAME_WIDTH, nes::FRAME_WIDTH,
+                    &ppux, 0, palette, nullptr, &smb::DefaultMinimapPalette());
+            goldens->push_back({fmt::format("minimap_{:02x}_{:02d}", aid, page.page), PPUxToMat(&ppux)});
+        }
+    }
+
+    for (size_t i = 0; i < pages.size(); i++) {
+        auto& page = pages[i];
+        if (i > 0 && pages[i - 1].area_id == page.area_id) {
+            continue;
+        }
+        std::vector<smb::SMBNametableDiff> diffs;
+        for (int offset : {0x0000, 0x0021, 0x0150, 0x03c9}) {
+            diffs.push_back({page.page, offset, 0x24});
+            diffs.push_back({page.page + 1, offset + 2, 0x25});
+        }
+        nes::PPUx ppux(nes::FRAME_WIDTH * 2, nes::FRAME_HEIGHT, nes::PPUxPriorityStatus::ENABLED);
+        ppux.FillBackground(page.frame_palette[0], palette.data());
+        nametables->RenderTo(page.area_id, page.page * nes::FRAME_WIDTH + 100, nes::FRAME_WIDTH * 2 - 32,
+                &ppux, 16, palette, chr1, nullptr, page.frame_palette.data(), &diffs);
+        goldens->push_back({fmt::format("nametable_diffs_{:02x}", static_cast<int>(page.area_id)), PPUxToMat(&ppux)});
+    }
+}
+
+static void AddTowerGoldens(smb::SMBDatabase* smbdb, std::vector<PPUxGolden>* goldens)
+{
+    auto rom = smbdb->GetBaseRom();
+    nes::PatternTable font;
+    std::copy(smb::rom_chr1(rom), smb::rom_chr1(rom) + font.size(), font.begin());
+
+    rgms::TimingTowerState state;
+    state.Title = "1-1";
+    state.Subtitle = "LAP 2";
+    const std::array<const char*, 8> names = {
+        "ALICE", "BOB", "CAROL", "DAVE", "EVE", "FRANK", "GRACE", "HEIDI",
+    };
+    for (int i = 0; i < static_cast<int>(names.size()); i++) {
+        rgms::TimingTowerEntry entry;
+        entry.Position = i + 1;
+        entry.Color = static_cast<uint8_t>(0x11 + i);
+        entry.Name = names[i];
+        entry.IntervalMS = i == 7 ? -1 : i * 1234;
+        entry.IsFinalTime = i < 2;
+        entry.InSection = i % 3 != 0;
+        entry.IsHighlight = i == 4;
+        entry.Y = i * TIMING_TOWER_Y_SPACING;
+        state.Entries.push_back(entry);
+    }
+
+    int w = 0, h = 0;
+    rgms::DrawTowerStateSize(state, &w, &h);
+    for (bool fromLeader : {false, true}) {
+        nes::PPUx ppux(w, h, nes::PPUxPriorityStatus::ENABLED);
+        rgms::DrawTowerState(&ppux, 0, 0, nes::DefaultPaletteBGR(), font, state, fromLeader);
+        goldens->push_back({fmt::format("tower_leader{}", fromLeader ? 1 : 0), PPUxToMat(&ppux)});
+    }
+}
+
+// RenderSMBToPPUX of every nth frame of a recording
+static void AddRecordingGoldens(smb::SMBDatabase* smbdb, const std::string& path, int every,
+        std::vector<PPUxGolden>* goldens)
+{
+    auto nametables = smbdb->GetNametableCache();
+    auto rom = smbdb->GetBaseRom();
+
+    rgms::SMBSerialRecording recording(path, nametables);
+    std::vector<rgms::SMBMessageProcessorOutputPtr> outputs;
+    recording.GetAllOutputs(&outputs);
+
+    std::string stem = util::fs::path(path).stem().string();
+    for (size_t i = 0; i < outputs.size(); i += every) {
+        auto& output = outputs[i];
+        nes::PPUx ppux(nes::FRAME_WIDTH, nes::FRAME_HEIGHT, nes::PPUxPriorityStatus::ENABLED);
+        ppux.FillBackground(output->FramePalette[0], nes::DefaultPaletteBGR().data());
+        rgms::RenderSMBToPPUX(output->Frame, output->FramePalette, nametables, &ppux, rom);
+        goldens->push_back({fmt::format("rec_{}_{:06d}", stem, i), PPUxToMat(&ppux)});
+    }
+}
+
+// The golden, the image and where they differ (red over the dimmed golden)
+// side by side
+static cv::Mat GoldenDiffImage(const cv::Mat& golden, const cv::Mat& image, const cv::Mat& mask)
+{
+    int w = std::max(golden.cols, image.cols);
+    int h = std::max(golden.rows, image.rows);
+    cv::Mat out(h, w * 3, CV_8UC3, cv::Scalar(0, 0, 0));
+    golden.copyTo(out(cv::Rect(0, 0, golden.cols, golden.rows)));
+    image.copyTo(out(cv::Rect(w, 0, image.cols, image.rows)));
+
+    cv::Mat diff = golden / 3;
+    if (!mask.empty()) {
+        diff.setTo(cv::Scalar(0, 0, 255), mask);
+    }
+    diff.copyTo(out(cv::Rect(w * 2, 0, diff.cols, diff.rows)));
+    return out;
+}
+
+// The synthetic goldens are checked in to 'directory'. The ones drawn from
+// smb.db are of the ROM's graphics so only ever live in 'smbDirectory'
+static int DoPPUxGolden(sta::RuntimeConfig* config, const std::string& directory,
+        const std::string& smbDirectory, const std::string& failureDirectory, bool update,
+        int tolerance, const std::vector<std::string>& recordings, int every)
+{
+    std::vector<PPUxGolden> goldens;
+    AddSceneGoldens(&goldens);
+    AddSpriteGoldens(&goldens);
+    AddOpacityGoldens(&goldens);
+    AddOutlineGoldens(&goldens);
+    AddTextGoldens(&goldens);
+
+    std::vector<PPUxGolden> smbGoldens;
+    smb::SMBDatabase smbdb(config->StaticPathTo("smb.db"));
+    if (smbdb.IsInit()) {
+        AddNametableGoldens(&smbdb, &smbGoldens);
+        AddTowerGoldens(&smbdb, &smbGoldens);
+        for (auto& path : recordings) {
+            AddRecordingGoldens(&smbdb, path, every, &smbGoldens);
+        }
+    } else {
+        std::cout << "smb.db is not initialized, skipping the nametable, tower and recording goldens\n";
+        if (!recordings.empty()) {
+            Error("--rec needs smb.db, run 'static smb db init'");
+            return 1;
+        }
+    }
+
+    std::vector<std::pair<const std::vector<PPUxGolden>*, std::string>> sets = {
+        {&goldens, directory}, {&smbGoldens, smbDirectory}};
+    if (update) {
+        for (auto& [set, dir] : sets) {
+            if (set->empty()) {
+                continue;
+            }
+            util::fs::create_directories(dir);
+            for (auto& golden : *set) {
+                cv::imwrite(dir + golden.Name + ".png", golden.Image);
+            }
+            std::cout << fmt::format("wrote {} goldens to {}\n", set->size(), dir);
+        }
+        return 0;
+    }
+
+    int failures = 0;
+    size_t total = 0;
+    for (auto& [set, dir] : sets) {
+        total += set->size();
+        for (auto& golden : *set) {
+            std::string path = dir + golden.Name + ".png";
+            if (!util::FileExists(path)) {
+                failures++;
+                std::cout << fmt::format("{}: no golden at {}, run with --update-goldens\n", golden.Name, path);
+                continue;
+            }
+            cv::Mat expected = cv::imread(path, cv::IMREAD_COLOR);
+
+            cv::Mat mask;
+            int differing = 0;
+            if (expected.size() != golden.Image.size()) {
+                std::cout << fmt::format("{}: golden is {}x{}, rendered {}x{}\n", golden.Name,
+                        expected.cols, expected.rows, golden.Image.cols, golden.Image.rows);
+            } else {
+                cv::Mat diff;
+                cv::absdiff(expected, golden.Image, diff);
+                cv::Mat channels[3];
+                cv::split(diff, channels);
+                cv::Mat largest = cv::max(channels[0], cv::max(channels[1], channels[2]));
+                mask = largest > tolerance;
+                differing = cv::countNonZero(mask);
+                if (differing == 0) {
+                    continue;
+                }
+                std::cout << fmt::format("{}: {} pixels off by more than {}\n", golden.Name, differing, tolerance);
+            }
+
+            failures++;
+            util::fs::create_directories(failureDirectory);
+            cv::imwrite(failureDirectory + golden.Name + ".png", golden.Image);
+            cv::imwrite(failureDirectory + golden.Name + ".diff.png",
+                    GoldenDiffImage(expected, golden.Image, mask));
+        }
+    }
+    std::cout << fmt::format("{} / {} goldens match\n", total - failures, total);
+    if (failures) {
+        std::cout << fmt::format("renders and diffs (golden | rendered | differences) in {}\n", failureDirectory);
+    }
+    return failures ? 1 : 0;
+}
+
+REGISTER_COMMAND(ppux, "Check, benchmark and golden test the PPUx renderer",
+R"(
+EXAMPLES:
+    static ppux check
+    static ppux check --iterations 5000 --seed 7
+    static ppux bench
+    static ppux golden
+    static ppux golden --update-goldens
+    static ppux golden --rec 20230101_1200_smb_alice.rec --every 300
+
+USAGE:
+    static ppux <action> [<args>...]
+
+DESCRIPTION:
+    The 'ppux' command is for working on the PPUx renderer.
+
+    'check' draws randomized scenes (nametables, sprites, strings, outlines,
+    crop, opacity and priority at several scales) with both the original pixel
+    at a time renderer and the faster one, and reports any scene where the
+    colors or priority information differ.
+
+    It also checks the opacity blending against the exact (double precision)
+    result, which must be within 1, and that MeasureString, MeasureStringX and
+    FitString agree with what RenderString and RenderStringX draw. And that
+    INametableCache::RenderTo with nametable diffs, copying cached page images
+    and drawing over the tiles the diffs touch, draws the same as the pages
+    with the diffs applied drawn a tile at a time. Also when 4 threads render
+    from one cache at once, and with a budget small enough to evict pages.
+
+    The same scenes are also drawn as palette indices, both at their size and
+    at 1x then upscaled, which must resolve to the same pixels. And a
+    translucent layer of palette indices (with a palette past the 64 NES
+    colors) resolved over a scene must match the layer drawn straight into it.
+    And recorded, then executed and rendered in bands on 1, 2, 3 and 8
+    threads, they must match being drawn directly. Recording a scene twice
+    must hash the same, and changing it must not.
+
+    'bench' times full screen RenderNametable calls at scales 1, 2 and 4 (also
+    drawn at 1x as palette indices and resolved at the scale), a timing
+    tower's worth of strings against drawing them a tile at a time, and
+    a combined view like frame (per player priority resets and outlines on a
+    1920x1080 canvas). That frame with nametables behind it is then recorded
+    and executed, recorded and only hashed (a skipped frame), and rendered in
+    bands on 1, 2, 4, ... threads. And eight players side by side through
+    INametableCache::RenderTo with and without the cached page images.
+
+    'golden' draws a fixed corpus and compares it against the PNGs written by
+    the last 'golden --update-goldens'. Seeded scenes, every combination of
+    sprite flip/priority/palette bits, opacity levels, both outline styles at
+    several radii, and strings and bordered boxes at scales 1 to 4. Those are
+    checked in to 'data/ppux/golden/' in the source directory. If smb.db is
+    initialized, also every nametable page and its minimap through the
+    nametable cache (and a span of each area with nametable diffs), the timing
+    tower, and every nth frame of any recordings given with '--rec'. Those are
+    the ROM's graphics so they are kept in 'golden/' in the static directory.
+    A missing golden is a failure. On a mismatch the render and a diff image
+    (golden, rendered, differences in red) are written to 'golden/failures/'
+    in the static directory, and the command fails.
+
+OPTIONS:
+    --iterations <n>
+        Number of scenes to check, or renders per scale to time.
+
+    --seed <n>
+        Seed for the randomized scenes. Default 0.
+
+    --dir <path>
+        Directory of all the goldens (and 'failures/') instead of the defaults.
+
+    --update-goldens
+        Write the goldens instead of comparing against them.
+
+    --tolerance <n>
+        Largest per channel difference that still matches. Default 0 (exact).
+
+    --rec <path>
+        Also draw frames of this recording with RenderSMBToPPUX. Repeatable.
+
+    --every <n>
+        Draw every nth frame of the recordings. Default 600.
+)")
+{
+    std::string action;
+    if (!util::ArgReadString(&argc, &argv, &action)) {
+        Error("action required");
+        return 1;
+    }
+
+    int iterations = -1;
+    int seed = 0;
+    std::string directory;
+    bool update = false;
+    int tolerance = 0;
+    std::vector<std::string> recordings;
+    int every = 600;
+    std::string arg;
+    while (util::ArgReadString(&argc, &argv, &arg)) {
+        if (arg == "--iterations") {
+            if (!util::ArgReadInt(&argc, &argv, &iterations) || iterations <= 0) {
+                Error("positive integer required after --iterations");
+                return 1;
+            }
+        } else if (arg == "--seed") {
+            if (!util::ArgReadInt(&argc, &argv, &seed)) {
+                Error("integer required after --seed");
+                return 1;
+            }
+        } else if (arg == "--dir") {
+            if (!util::ArgReadString(&argc, &argv, &directory)) {
+                Error("path required after --dir");
+                return 1;
+            }
+            if (!directory.empty() && directory.back() != '/') {
+                directory.push_back('/');
+            }
+        } else if (arg == "--update-goldens") {
+            update = true;
+        } else if (arg == "--tolerance") {
+            if (!util::ArgReadInt(&argc, &argv, &tolerance) || tolerance < 0) {
+                Error("non negative integer required after --tolerance");
+                return 1;
+            }
+        } else if (arg == "--rec") {
+            std::string path;
+            if (!util::ArgReadString(&argc, &argv, &path)) {
+                Error("path required after --rec");
+                return 1;
+            }
+            recordings.push_back(path);
+        } else if (arg == "--every") {
+            if (!util::ArgReadInt(&argc, &argv, &every) || every <= 0) {
+                Error("positive integer required after --every");
+                return 1;
+            }
+        } else {
+            Error("unknown argument '{}'", arg);
+            return 1;
+        }
+    }
+
+    if (action == "check") {
+        return DoPPUxCheck(iterations > 0 ? iterations : 1000, static_cast<uint32_t>(seed));
+    } else if (action == "bench") {
+        return DoPPUxBench(iterations > 0 ? iterations : 200, static_cast<uint32_t>(seed));
+    } else if (action == "golden") {
+        if (directory.empty()) {
+            return DoPPUxGolden(config, config->SourcePathTo("data/ppux/golden/"),
+                    config->StaticPathTo("golden/"), config->StaticPathTo("golden/failures/"),
+                    update, tolerance, recordings, every);
+        }
+        return DoPPUxGolden(config, directory, directory, directory + "failures/",
+                update, tolerance, recordings, every);
+    }
+    Error("unknown action '{}'", action);
+    return 1;
+}
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <fstream>
 
 #include "fmt/bundled/color.h"
 #include "zmq.hpp"
@@ -280,50 +281,173 @@ static int DoWatch(int argc, char** argv, const sta::RuntimeConfig* config)
     return r;
 }
 
-static int DoTransmitStuff(const std::string& ttypath, const std::string& target, const std::string& name, const sta::RuntimeConfig* config, bool norecord) {
+struct TransmitSeat
+{
+    std::string TTYPath;
+    std::string Name;
+
+    // declared before Thread so that the thread is joined first
+    std::unique_ptr<zmq::socket_t> Notify;
+    std::unique_ptr<sta::rgms::SMBSerialProcessorThread> Thread;
+
+    sta::rgms::SMBTransmitterHeartbeat Heartbeat;
+    int Sent;
+};
+
+static int DoTransmitStuff(const std::vector<std::pair<std::string, std::string>>& ttypathsAndNames,
+        const std::string& target, const sta::RuntimeConfig* config, bool norecord,
+        const sta::rgms::TransmitterClock& clock, const std::vector<uint8_t>& key) {
     smb::SMBDatabase db(config->StaticPathTo("smb.db"));
     auto nametables = db.GetNametableCache();
 
     util::fs::create_directories(fmt::format("{}rec/", config->StaticDirectory));
-    std::string recordingPath = fmt::format("{}rec/{}_{}.rec", config->StaticDirectory,
-            util::GetTimestampNow(), name);
-
-    sta::rgms::SMBSerialProcessorThreadInfo tinfo;
-    sta::rgms::SMBSerialProcessorThread thread(ttypath, nametables);
-    if (!norecord) {
-        thread.StartRecording(recordingPath);
-    }
+    std::string timestamp = util::GetTimestampNow();
 
     zmq::context_t context(2);
     zmq::socket_t socket(context, zmq::socket_type::pub);
     socket.bind(target);
 
+    // The serial threads poke this whenever they have output so that the loop
+    // below can sleep in zmq::poll rather than waking up every few millis
+    const char* notifyEndpoint = "inproc://rgms-transmit-notify";
+    zmq::socket_t notifySocket(context, zmq::socket_type::pull);
+    notifySocket.bind(notifyEndpoint);
+
+    // Answers the receivers' clock requests, see ClockOffsetEstimator
+    std::string clockTarget;
+    try {
+        clockTarget = sta::rgms::ClockEndpointFromFeedEndpoint(target);
+    } catch (std::exception& e) {
+        Error("{}", e.what());
+        return 1;
+    }
+    zmq::socket_t clockSocket(context, zmq::socket_type::rep);
+    try {
+        clockSocket.bind(clockTarget);
+    } catch (zmq::error_t& e) {
+        Error("unable to bind clock socket {} (feed port + {}): {}", clockTarget,
+                sta::rgms::SMB_CLOCK_PORT_OFFSET, e.what());
+        return 1;
+    }
+
+    std::vector<std::unique_ptr<TransmitSeat>> seats;
+    for (auto & [ttypath, name] : ttypathsAndNames) {
+        auto seat = std::make_unique<TransmitSeat>();
+        seat->TTYPath = ttypath;
+        seat->Name = name;
+        seat->Heartbeat = {};
+        seat->Sent = 0;
+
+        seat->Notify = std::make_unique<zmq::socket_t>(context, zmq::socket_type::push);
+        seat->Notify->set(zmq::sockopt::sndhwm, 1);
+        seat->Notify->connect(notifyEndpoint);
+
+        seat->Thread = std::make_unique<sta::rgms::SMBSerialProcessorThread>(ttypath, nametables);
+        if (!norecord) {
+            seat->Thread->StartRecording(fmt::format("{}rec/{}_{}.rec", config->StaticDirectory,
+                        timestamp, name));
+        }
+
+        zmq::socket_t* notify = seat->Notify.get();
+        seat->Thread->SetOutputCallback([notify](){
+            // dropped when one is already pending, which is fine as all
+            // output is drained on every wake up
+            notify->send(zmq::str_buffer("!"), zmq::send_flags::dontwait);
+        });
+        seats.push_back(std::move(seat));
+    }
+
     std::vector<uint8_t> buffer;
+    std::vector<uint8_t> hbbuffer;
+    std::vector<uint8_t> authbuffer;
+
+    sta::rgms::FeedAuthenticator authenticator;
+    authenticator.SetKey(key);
+    const std::string smbTopic = "smb";
+    const std::string hbTopic = "smbhb";
+    auto StringPart = [](const std::string& str) {
+        return std::make_pair(reinterpret_cast<const uint8_t*>(str.data()), str.size());
+    };
+
+    sta::rgms::SMBSerialProcessorThreadInfo tinfo;
+    auto start = util::Now();
+    auto lastHeartbeat = start;
+    auto lastStats = start;
+
+    std::vector<zmq::pollitem_t> items;
+    items.push_back({static_cast<void*>(notifySocket), 0, ZMQ_POLLIN, 0});
+    items.push_back({static_cast<void*>(clockSocket), 0, ZMQ_POLLIN, 0});
 
-    int sleeps = 0;
-    int totsent = 0;
     for (;;) {
-        while (auto p = thread.GetNextProcessorOutput()) {
-            if (p->Frame.NTDiffs.size() > 5000) {
-                p->Frame.NTDiffs.resize(5000);
+        auto now = util::Now();
+        int64_t untilHeartbeat = sta::rgms::SMB_HEARTBEAT_MILLIS - util::ElapsedMillis(lastHeartbeat, now);
+        int64_t timeout = std::clamp<int64_t>(untilHeartbeat, 0, 100); // for g_SIGINT
+        zmq::poll(items.data(), items.size(), std::chrono::milliseconds(timeout));
+
+        if (items[0].revents & ZMQ_POLLIN) {
+            zmq::message_t msg;
+            while (notifySocket.recv(msg, zmq::recv_flags::dontwait)) {
             }
-            OutputToBytes(p, &buffer);
-            socket.send(zmq::str_buffer("smb"), zmq::send_flags::sndmore);
-            socket.send(zmq::message_t(name.data(), name.size()), zmq::send_flags::sndmore);
-            socket.send(zmq::message_t(buffer.data(), buffer.size()), zmq::send_flags::none);
-            totsent++;
         }
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(2));
-        sleeps++;
-        if (sleeps == 250) {
-            thread.GetInfo(&tinfo);
-            fmt::print("bytes: {:10s} bps: {:8.1f} msgs: {:10d} mps: {:8.1f} err: {:5d} tot: {:6d}\n",
+        for (auto & seat : seats) {
+            while (auto p = seat->Thread->GetNextProcessorOutput()) {
+                if (p->Frame.NTDiffs.size() > 5000) {
+                    p->Frame.NTDiffs.resize(5000);
+                }
+                OutputToBytes(p, &buffer);
+                int64_t txtime = clock.FromLocal(p->ConstructionTime);
+                sta::rgms::PublishFeedMessage(&socket, &authenticator, {
+                        StringPart(smbTopic),
+                        StringPart(seat->Name),
+                        {buffer.data(), buffer.size()},
+                        {reinterpret_cast<const uint8_t*>(&txtime), sizeof(txtime)}}, &authbuffer);
+                seat->Sent++;
+            }
+        }
 
-                    util::BytesFmt(tinfo.ByteCount), tinfo.ApproxBytesPerSecond,
-                    tinfo.MessageCount, tinfo.ApproxMessagesPerSecond, tinfo.ErrorCount, totsent);
+        sta::rgms::AnswerClockRequests(&clockSocket, clock);
+
+        now = util::Now();
+        if (util::ElapsedMillis(lastHeartbeat, now) >= sta::rgms::SMB_HEARTBEAT_MILLIS) {
+            for (auto & seat : seats) {
+                seat->Thread->GetInfo(&tinfo);
+                sta::rgms::HeartbeatFromThreadInfo(tinfo, &seat->Heartbeat);
+                seat->Heartbeat.Elapsed = util::ElapsedMillis(start, now);
+                seat->Heartbeat.Sequence++;
+                seat->Heartbeat.FramesSent = seat->Sent;
+                sta::rgms::HeartbeatToBytes(seat->Heartbeat, &hbbuffer);
+                sta::rgms::PublishFeedMessage(&socket, &authenticator, {
+                        StringPart(hbTopic),
+                        StringPart(seat->Name),
+                        {hbbuffer.data(), hbbuffer.size()}}, &authbuffer);
+            }
+            lastHeartbeat = now;
+        }
 
-            sleeps = 0;
+        if (util::ElapsedMillis(lastStats, now) >= 500) {
+            int bytes = 0, msgs = 0, errs = 0, tot = 0;
+            double bps = 0.0, mps = 0.0;
+            for (auto & seat : seats) {
+                seat->Thread->GetInfo(&tinfo);
+                if (seats.size() > 1) {
+                    fmt::print("{:>8s} bytes: {:10s} bps: {:8.1f} msgs: {:10d} mps: {:8.1f} err: {:5d} tot: {:6d}\n",
+                            seat->Name,
+                            util::BytesFmt(tinfo.ByteCount), tinfo.ApproxBytesPerSecond,
+                            tinfo.MessageCount, tinfo.ApproxMessagesPerSecond, tinfo.ErrorCount, seat->Sent);
+                }
+                bytes += tinfo.ByteCount;
+                bps += tinfo.ApproxBytesPerSecond;
+                msgs += tinfo.MessageCount;
+                mps += tinfo.ApproxMessagesPerSecond;
+                errs += tinfo.ErrorCount;
+                tot += seat->Sent;
+            }
+            fmt::print("{:>8s} bytes: {:10s} bps: {:8.1f} msgs: {:10d} mps: {:8.1f} err: {:5d} tot: {:6d}\n",
+                    seats.size() > 1 ? "all" : seats.front()->Name,
+                    util::BytesFmt(bytes), bps, msgs, mps, errs, tot);
+
+            lastStats = now;
         }
         if (g_SIGINT) {
             fmt::print("\n");
@@ -337,16 +461,206 @@ static int DoTransmitStuff(const std::string& ttypath, const std::string& target
 
 static int DoTransmit(int argc, char** argv, sta::RuntimeConfig* config)
 {
-    if (argc < 3 || argc > 4) {
-        Error("transmit <tty> <target> <name>");
+    if (argc < 3) {
+        Error("transmit <tty> <target> <name> [--seat <tty> <name>]... [norecord] [--key <hex> | --key-config <file>] [--clock-offset <millis>] [--clock-skew <ppm>]");
         Error("transmit /dev/ttyUSB1 tcp://0.0.0.0:5555 seat1");
+        Error("transmit /dev/ttyUSB1 tcp://0.0.0.0:5555 seat1 --seat /dev/ttyUSB2 seat2");
         return 1;
     }
-    std::string ttypath(argv[0]);
+    std::vector<std::pair<std::string, std::string>> ttypathsAndNames;
+    ttypathsAndNames.emplace_back(argv[0], argv[2]);
     std::string target(argv[1]);
-    std::string name(argv[2]);
+    argc -= 3;
+    argv += 3;
+
+    // The clock flags pretend this host's clock is off, for trying out the
+    // clock alignment on a single machine
+    bool norecord = false;
+    sta::rgms::TransmitterClock clock = {};
+    std::string hexkey;
+    std::string arg;
+    while (util::ArgReadString(&argc, &argv, &arg)) {
+        if (arg == "--key") {
+            if (!util::ArgReadString(&argc, &argv, &hexkey)) {
+                Error("--key <hex>");
+                return 1;
+            }
+        } else if (arg == "--key-config") {
+            // the FeedKey of a saved smbcomp configuration
+            std::string path;
+            if (!util::ArgReadString(&argc, &argv, &path)) {
+                Error("--key-config <file>");
+                return 1;
+            }
+            try {
+                std::ifstream ifs(path);
+                nlohmann::json j = nlohmann::json::parse(ifs);
+                hexkey = j.at("Tournament").at("FeedKey").get<std::string>();
+            } catch (std::exception& e) {
+                Error("unable to read FeedKey from '{}': {}", path, e.what());
+                return 1;
+            }
+        } else if (arg == "--seat") {
+            std::string ttypath, name;
+            if (!util::ArgReadString(&argc, &argv, &ttypath) ||
+                !util::ArgReadString(&argc, &argv, &name)) {
+                Error("--seat <tty> <name>");
+                return 1;
+            }
+            ttypathsAndNames.emplace_back(ttypath, name);
+        } else if (arg == "--clock-offset") {
+            int millis;
+            if (!util::ArgReadInt(&argc, &argv, &millis)) {
+                Error("--clock-offset <millis>");
+                return 1;
+            }
+            clock.OffsetMicros = static_cast<int64_t>(millis) * 1000;
+        } else if (arg == "--clock-skew") {
+            if (!util::ArgReadDouble(&argc, &argv, &clock.SkewPPM)) {
+                Error("--clock-skew <ppm>");
+                return 1;
+            }
+        } else if (arg == "norecord" || arg == "--norecord") {
+            norecord = true;
+        } else {
+            Error("unrecognized argument. '{}'", arg);
+            return 1;
+        }
+    }
 
-    return DoTransmitStuff(ttypath, target, name, config, argc == 4);
+    for (size_t i = 0; i < ttypathsAndNames.size(); i++) {
+        for (size_t j = i + 1; j < ttypathsAndNames.size(); j++) {
+            if (ttypathsAndNames[i].second == ttypathsAndNames[j].second) {
+                Error("duplicate seat name '{}'", ttypathsAndNames[i].second);
+                return 1;
+            }
+        }
+    }
+
+    std::vector<uint8_t> key;
+    if (!sta::rgms::ParseFeedKey(hexkey, &key)) {
+        Error("invalid feed key, expected hex");
+        return 1;
+    }
+
+    return DoTransmitStuff(ttypathsAndNames, target, config, norecord, clock, key);
+}
+
+static int DoReplayServer(int argc, char** argv, sta::RuntimeConfig* config)
+{
+    sta::rgms::ReplayServerParameters params = sta::rgms::ReplayServerParameters::Defaults();
+    std::vector<sta::rgms::ReplayServerRecording> recordings;
+
+    std::string arg;
+    while (util::ArgReadString(&argc, &argv, &arg)) {
+        if (arg == "--target") {
+            if (!util::ArgReadString(&argc, &argv, &params.Target)) {
+                Error("--target <endpoint>");
+                return 1;
+            }
+        } else if (arg == "--control") {
+            if (!util::ArgReadString(&argc, &argv, &params.ControlTarget)) {
+                Error("--control <endpoint>");
+                return 1;
+            }
+        } else if (arg == "--tick") {
+            int tick;
+            if (!util::ArgReadInt(&argc, &argv, &tick) || tick <= 0) {
+                Error("--tick <millis>");
+                return 1;
+            }
+            params.TickMillis = tick;
+        } else if (arg == "--speed") {
+            if (!util::ArgReadDouble(&argc, &argv, &params.Speed) || params.Speed <= 0.0) {
+                Error("--speed <x>");
+                return 1;
+            }
+        } else if (arg == "--play") {
+            params.Play = true;
+        } else if (arg == "--key") {
+            std::string hexkey;
+            if (!util::ArgReadString(&argc, &argv, &hexkey) ||
+                !sta::rgms::ParseFeedKey(hexkey, &params.Key)) {
+                Error("--key <hex>");
+                return 1;
+            }
+        } else if (arg == "--rec") {
+            sta::rgms::ReplayServerRecording recording;
+            int offset;
+            if (!util::ArgReadString(&argc, &argv, &recording.Path) ||
+                !util::ArgReadString(&argc, &argv, &recording.Name) ||
+                !util::ArgReadInt(&argc, &argv, &offset)) {
+                Error("--rec <path> <name> <offset millis>");
+                return 1;
+            }
+            recording.Offset = offset;
+            recordings.push_back(recording);
+        } else if (arg == "--at") {
+            // everything that was recording at that moment, from 'rgms recreview'
+            int64_t unixtime;
+            if (!util::ArgReadInt64(&argc, &argv, &unixtime) || unixtime < 0) {
+                Error("--at <unix seconds>");
+                return 1;
+            }
+            sta::rgms::RecReviewDB db(config->StaticPathTo("static.db"));
+            std::vector<sta::rgms::ReplayServerRecording> at;
+            sta::rgms::ReplayServerRecordingsAt(&db, unixtime * 1000, &at);
+            recordings.insert(recordings.end(), at.begin(), at.end());
+        } else {
+            Error("unknown argument '{}'", arg);
+            return 1;
+        }
+    }
+
+    if (recordings.empty()) {
+        Error("no recordings, expected --rec or --at");
+        return 1;
+    }
+
+    smb::SMBDatabase db(config->StaticPathTo("smb.db"));
+    sta::rgms::ReplayServer server(db.GetNametableCache(), recordings, params);
+    for (auto & recording : recordings) {
+        fmt::print("{:>8s} {} @ {}\n", recording.Name, recording.Path, recording.Offset);
+    }
+    fmt::print("serving on {}, clock on {}, control on {}\n", params.Target,
+            sta::rgms::ClockEndpointFromFeedEndpoint(params.Target), params.ControlTarget);
+
+    while (!g_SIGINT) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    fmt::print("\n");
+    fmt::print("Interrupted\n");
+    return 0;
+}
+
+static int DoReplayControl(int argc, char** argv)
+{
+    if (argc < 2) {
+        Error("replay-control <control endpoint> <command...>");
+        Error("replay-control tcp://localhost:5554 seek 60000");
+        return 1;
+    }
+    std::string endpoint(argv[0]);
+    std::string command;
+    for (int i = 1; i < argc; i++) {
+        if (i != 1) command += " ";
+        command += argv[i];
+    }
+
+    zmq::context_t context(1);
+    zmq::socket_t socket(context, zmq::socket_type::req);
+    socket.set(zmq::sockopt::linger, 0);
+    socket.set(zmq::sockopt::rcvtimeo, 2000);
+    socket.connect(endpoint);
+    socket.send(zmq::message_t(command.data(), command.size()), zmq::send_flags::none);
+
+    zmq::message_t reply;
+    if (!socket.recv(reply)) {
+        Error("no reply from {}", endpoint);
+        return 1;
+    }
+    fmt::print("{}\n", reply.to_string());
+    return reply.to_string().rfind("error", 0) == 0 ? 1 : 0;
 }
 
 static int DoReceiveStuff(const std::vector<std::string>& bindings)
@@ -465,10 +779,23 @@ EXAMPLES:
     static rgms list serial
     static rgms watch serial --tty /dev/ttyUSB1
     static rgms transmit serial /dev/ttyUSB1 tcp://0.0.0.0:5555 seat1
+    static rgms transmit /dev/ttyUSB2 tcp://0.0.0.0:5557 seat2 --clock-offset 2500 --clock-skew 50
+    static rgms transmit /dev/ttyUSB1 tcp://0.0.0.0:5555 seat1 --seat /dev/ttyUSB2 seat2
+    static rgms transmit /dev/ttyUSB1 tcp://0.0.0.0:5555 seat1 --key-config ~/.static/anyp.smbconfig.json
+    static rgms replay-server --at 1688620861 --play
+    static rgms replay-server --rec a.rec seat1 0 --rec b.rec seat2 1500 --control tcp://0.0.0.0:5554
+    static rgms replay-control tcp://localhost:5554 seek 60000
+    static rgms check
 
 USAGE:
 
 DESCRIPTION:
+    transmit and replay-server also answer clock requests on their feed port
+    + 1000, so 'tcp://0.0.0.0:5555' binds 6555 as well and feed ports must be
+    at most 64535.
+
+    check runs the clock offset estimator, feed authentication and feed
+    health checks and exits non zero if any fail.
 
 OPTIONS:
 
@@ -492,8 +819,17 @@ OPTIONS:
         return DoSMBComp(argc, argv, config);
     } else if (action == "recreview") {
         return DoRecReview(argc, argv, config);
+    } else if (action == "replay-server") {
+        return DoReplayServer(argc, argv, config);
+    } else if (action == "replay-control") {
+        return DoReplayControl(argc, argv);
+    } else if (action == "check") {
+        int failed = sta::rgms::CheckClockOffsetEstimator();
+        failed += sta::rgms::CheckFeedAuthenticator();
+        failed += sta::rgms::CheckFeedHealth();
+        return failed ? 1 : 0;
     } else {
-        Error("unknown action. '{}' expected 'list', 'watch', 'transmit', 'receive', 'smbcomp', or 'recreview'", action);
+        Error("unknown action. '{}' expected 'list', 'watch', 'transmit', 'receive', 'smbcomp', 'recreview', 'replay-server', 'replay-control', or 'check'", action);
         return 1;
     }
 
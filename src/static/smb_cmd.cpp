@@ -18,9 +18,14 @@
 //
 ////////////////////////////////////////////////////////////////////////////////
 
+#include <random>
+#include <fstream>
+#include <numeric>
+
 #include "static/main.h"
 #include "util/arg.h"
 #include "util/file.h"
+#include "util/clock.h"
 
 #include "ext/opensslext/opensslext.h"
 #include "ext/nfdext/nfdext.h"
@@ -105,35 +110,90 @@ static bool GetSMBRom(int argc, char** argv, const sta::RuntimeConfig* config, s
 }
 
 // static smb db init
+// Only the stages whose inputs changed since the last init are run again, on a
+// copy of the database that replaces it once they all succeed
 int DoSMBDBInit(const sta::RuntimeConfig* config, smb::SMBDatabase* orig, int argc, char** argv)
 {
-    if (argc > 1) {
+    smb::InitOptions options = smb::InitOptions::Defaults();
+    std::vector<char*> romArgs;
+    while (argc > 0) {
+        std::string arg(argv[0]);
+        if (arg == "--threads") {
+            ArgNext(&argc, &argv);
+            if (!ArgReadInt(&argc, &argv, &options.Threads) || options.Threads < 0) {
+                Error("integer (0 for one per hardware thread) required after --threads");
+                return 1;
+            }
+        } else if (arg == "--force") {
+            ArgNext(&argc, &argv);
+            std::string stage;
+            const auto& names = smb::InitStageNames();
+            if (!ArgReadString(&argc, &argv, &stage) ||
+                (stage != "all" && std::find(names.begin(), names.end(), stage) == names.end())) {
+                std::string known = "'all'";
+                for (auto & name : names) {
+                    known += ", '" + name + "'";
+                }
+                Error("stage required after --force, one of {}", known);
+                return 1;
+            }
+            options.Force.push_back(stage);
+        } else if (arg == "--dry-run") {
+            ArgNext(&argc, &argv);
+            options.DryRun = true;
+        } else {
+            romArgs.push_back(argv[0]);
+            ArgNext(&argc, &argv);
+        }
+    }
+    if (romArgs.size() > 1) {
         Error("expected at most one argument (the path to the smb rom)");
         return 1;
     }
 
     std::vector<uint8_t> smb_rom;
-    if (!GetSMBRom(argc, argv, config, &smb_rom)) {
+    if (!GetSMBRom(static_cast<int>(romArgs.size()), romArgs.data(), config, &smb_rom)) {
         Error("Failed to init smb rom");
         return 1;
     }
 
+    std::string data_path = config->SourcePathTo("data/smb/");
+    if (options.DryRun) {
+        if (!smb::InitializeSMBDatabase(orig, data_path, smb_rom, options)) {
+            Error("Failed to initialize SMBDatabase");
+            return 1;
+        }
+        return 0;
+    }
+
+    // orig is open again however this ends, a stage may throw
     std::string TEMP_SMB_DB_PATH = "smbtemp.db";
-    {
+    orig->Close();
+    bool ok = false;
+    try {
         if (fs::exists(TEMP_SMB_DB_PATH)) {
             fs::remove(TEMP_SMB_DB_PATH);
         }
-        smb::SMBDatabase smbdb(TEMP_SMB_DB_PATH);
-        std::string data_path = config->SourcePathTo("data/smb/");
-        if (!smb::InitializeSMBDatabase(&smbdb, data_path, smb_rom)) {
-            Error("Failed to initialize SMBDatabase");
-            return 1;
+        if (fs::exists(orig->m_DatabasePath)) {
+            fs::copy_file(orig->m_DatabasePath, TEMP_SMB_DB_PATH);
+        }
+        {
+            smb::SMBDatabase smbdb(TEMP_SMB_DB_PATH);
+            ok = smb::InitializeSMBDatabase(&smbdb, data_path, smb_rom, options);
         }
+        if (ok) {
+            fs::remove(orig->m_DatabasePath);
+            fs::rename(TEMP_SMB_DB_PATH, orig->m_DatabasePath);
+        }
+    } catch (...) {
+        orig->Open();
+        throw;
     }
-    orig->Close();
-    fs::remove(orig->m_DatabasePath);
-    fs::rename(TEMP_SMB_DB_PATH, orig->m_DatabasePath);
     orig->Open();
+    if (!ok) {
+        Error("Failed to initialize SMBDatabase");
+        return 1;
+    }
     return 0;
 }
 
@@ -147,6 +207,144 @@ bool SMBDBInit(const sta::RuntimeConfig* config, smb::SMBDatabase* smbdb) {
     return true;
 }
 
+// static smb db check-extract
+// Nametable pages extracted with one thread and with many, compared by hash
+// with each other and with those in the database
+int DoSMBDBCheckExtract(const sta::RuntimeConfig* config, smb::SMBDatabase* smbdb, int argc, char** argv)
+{
+    int threads = 0;
+    std::string arg;
+    while (ArgReadString(&argc, &argv, &arg)) {
+        if (arg == "--threads" && ArgReadInt(&argc, &argv, &threads) && threads >= 0) {
+            continue;
+        }
+        Error("usage: static smb db check-extract [--threads <n>]");
+        return 1;
+    }
+    if (!SMBDBInit(config, smbdb)) {
+        return 1;
+    }
+
+    auto extract = [&](int n, std::vector<uint64_t>* hashes){
+        std::vector<smb::db::nametable_page> pages;
+        auto start = util::Now();
+        if (!smb::ExtractNametablePages(smbdb, n, &pages)) {
+            return -1.0;
+        }
+        auto elapsed = std::chrono::duration<double>(util::Now() - start);
+        hashes->clear();
+        for (auto & page : pages) {
+            hashes->push_back(smb::NametablePageHash(page));
+        }
+        return elapsed.count();
+    };
+
+    std::vector<uint64_t> serial, parallel, stored;
+    double serialSeconds = extract(1, &serial);
+    double parallelSeconds = extract(threads, &parallel);
+    if (serialSeconds < 0 || parallelSeconds < 0) {
+        Error("failed extracting nametable pages");
+        return 1;
+    }
+
+    std::vector<smb::db::nametable_page> pages;
+    smbdb->GetAllNametablePages(&pages);
+    std::sort(pages.begin(), pages.end(), [](const smb::db::nametable_page& a, const smb::db::nametable_page& b){
+        return a.id < b.id;
+    });
+    for (auto & page : pages) {
+        stored.push_back(smb::NametablePageHash(page));
+    }
+
+    auto differ = [](const std::vector<uint64_t>& a, const std::vector<uint64_t>& b){
+        size_t n = std::max(a.size(), b.size()) - std::min(a.size(), b.size());
+        for (size_t i = 0; i < std::min(a.size(), b.size()); i++) {
+            n += a[i] != b[i];
+        }
+        return n;
+    };
+    size_t parallelDiffer = differ(serial, parallel);
+    size_t storedDiffer = differ(serial, stored);
+    std::cout << fmt::format("{} pages: {:.2f}s with 1 thread, {:.2f}s with {} ({:.2f}x), {} differ, {} differ from the database\n",
+            serial.size(), serialSeconds, parallelSeconds,
+            threads > 0 ? std::to_string(threads) : "one per hardware thread",
+            serialSeconds / std::max(parallelSeconds, 1e-9), parallelDiffer, storedDiffer);
+    return (parallelDiffer || storedDiffer) ? 1 : 0;
+}
+
+// static smb db bench-assets
+// The sound effects and music read as SMBComp loads them at startup, in place
+// from the blobs against copying each out with a SELECT (as it did before)
+int DoSMBDBBenchAssets(const sta::RuntimeConfig* config, smb::SMBDatabase* smbdb, int argc, char** argv)
+{
+    int iterations = 20;
+    std::string arg;
+    while (ArgReadString(&argc, &argv, &arg)) {
+        if (arg == "--iterations" && ArgReadInt(&argc, &argv, &iterations) && iterations > 0) {
+            continue;
+        }
+        Error("usage: static smb db bench-assets [--iterations <n>]");
+        return 1;
+    }
+    if (!SMBDBInit(config, smbdb)) {
+        return 1;
+    }
+
+    auto selectCopy = [&](const char* table, const char* nm, uint32_t v, std::vector<uint8_t>* data){
+        auto stmt = smbdb->PrepareOrThrow(fmt::format("SELECT wav_data FROM {} WHERE {} = ?;", table, nm));
+        sqliteext::BindIntOrThrow(stmt, 1, v);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            const uint8_t* dat = reinterpret_cast<const uint8_t*>(sqlite3_column_blob(stmt, 0));
+            data->assign(dat, dat + sqlite3_column_bytes(stmt, 0));
+        }
+    };
+
+    // sums the bytes so both read the same
+    auto run = [&](bool inPlace){
+        uint64_t sum = 0;
+        auto start = util::Now();
+        for (int i = 0; i < iterations; i++) {
+            for (auto effect : smb::AudibleSoundEffects()) {
+                if (inPlace) {
+                    // As SDL reads it, a piece at a time
+                    auto blob = smbdb->OpenSoundEffectWav(effect);
+                    std::array<uint8_t, 4096> piece;
+                    for (size_t offset = 0; blob && offset < blob->Size(); offset += piece.size()) {
+                        size_t n = std::min(piece.size(), blob->Size() - offset);
+                        blob->ReadOrThrow(piece.data(), n, offset);
+                        sum = std::accumulate(piece.begin(), piece.begin() + n, sum);
+                    }
+                } else {
+                    std::vector<uint8_t> data;
+                    selectCopy("sound_effect", "effect", static_cast<uint32_t>(effect), &data);
+                    sum = std::accumulate(data.begin(), data.end(), sum);
+                }
+            }
+            for (auto track : smb::AudibleMusicTracks()) {
+                std::vector<uint8_t> kept;
+                if (inPlace) {
+                    smbdb->GetMusicTrackWav(track, &kept);
+                } else {
+                    // and copied again into SDLExtMixMusic
+                    std::vector<uint8_t> data;
+                    selectCopy("music_track", "track", static_cast<uint32_t>(track), &data);
+                    kept = data;
+                }
+                sum = std::accumulate(kept.begin(), kept.end(), sum);
+            }
+        }
+        auto elapsed = std::chrono::duration<double, std::milli>(util::Now() - start);
+        return std::make_pair(elapsed.count() / iterations, sum);
+    };
+
+    auto [copyMs, copySum] = run(false);
+    auto [inPlaceMs, inPlaceSum] = run(true);
+    std::cout << fmt::format("sound effects and music: {:.2f}ms copied, {:.2f}ms in place ({:.2f}x){}\n",
+            copyMs, inPlaceMs, copyMs / std::max(inPlaceMs, 1e-9),
+            copySum == inPlaceSum ? "" : ", RESULTS DIFFER");
+    return copySum == inPlaceSum ? 0 : 1;
+}
+
 // 'static smb db'
 int DoSMBDB(const sta::RuntimeConfig* config, smb::SMBDatabase* smbdb, int argc, char** argv)
 {
@@ -170,8 +368,447 @@ int DoSMBDB(const sta::RuntimeConfig* config, smb::SMBDatabase* smbdb, int argc,
         return 0;
     } else if (arg ==  "init") {
         return DoSMBDBInit(config, smbdb, argc, argv);
+    } else if (arg == "check-extract") {
+        return DoSMBDBCheckExtract(config, smbdb, argc, argv);
+    } else if (arg == "bench-assets") {
+        return DoSMBDBBenchAssets(config, smbdb, argc, argv);
     } else {
-        Error("unrecognized argument. '{}', expected 'edit', 'ui', 'path', or 'init'", arg);
+        Error("unrecognized argument. '{}', expected 'edit', 'ui', 'path', 'init', 'check-extract' or 'bench-assets'", arg);
+        return 1;
+    }
+    return 0;
+}
+
+// Random InCategory and visible section queries against the route's index,
+// compared with the same sections looked through one at a time. Returns the
+// number of queries that differ
+static size_t CheckRouteIndex(const std::string& name, const smb::Route& route,
+        int iterations, std::mt19937& gen)
+{
+    auto rnd = [&](int lo, int hi){
+        return lo + static_cast<int>(gen() % static_cast<uint32_t>(hi - lo + 1));
+    };
+
+    smb::Route linear;
+    for (auto & sec : route) {
+        linear.emplace_back() = sec;
+    }
+    if (route.empty()) {
+        std::cout << fmt::format("route '{}': no sections\n", name);
+        return 0;
+    }
+
+    size_t mismatches = 0;
+    std::vector<smb::WorldSection> indexedVisible, linearVisible;
+    for (int i = 0; i < iterations && !g_SIGINT; i++) {
+        // Near a section of the route, sometimes in the wrong world
+        const auto& sec = route[rnd(0, static_cast<int>(route.size()) - 1)];
+        int world = rnd(0, 3) == 0 ? rnd(1, 8) : sec.World;
+        int level = rnd(0, 3) == 0 ? rnd(1, 4) : sec.Level;
+        int apx = rnd(sec.Left - 64, sec.Right + 64);
+        int ix = -1, iindex = -1, lx = -1, lindex = -1;
+        bool in = route.InCategory(sec.AID, apx, world, level, &ix, &iindex);
+        bool ln = linear.InCategory(sec.AID, apx, world, level, &lx, &lindex);
+        if (in != ln || ix != lx || iindex != lindex) {
+            mismatches++;
+        }
+
+        int xloc = rnd(-300, route.TotalWidth() + 300);
+        int width = rnd(-8, 2000);
+        indexedVisible.assign(3, sec);
+        linearVisible.assign(3, sec);
+        route.GetVisibleSections(xloc, width, &indexedVisible);
+        linear.GetVisibleSections(xloc, width, &linearVisible);
+        auto span = route.VisibleSections(xloc, width);
+        bool same = indexedVisible.size() == linearVisible.size() &&
+            (width <= 0 || span.size() == linearVisible.size());
+        for (size_t j = 0; same && j < linearVisible.size(); j++) {
+            const auto& a = indexedVisible[j];
+            const auto& b = linearVisible[j];
+            same = a == b && a.Left == b.Left && a.Right == b.Right &&
+                a.XLoc == b.XLoc && a.SectionIndex == b.SectionIndex;
+            if (same && width > 0) {
+                same = span[j] == b && span[j].XLoc - xloc == b.XLoc;
+            }
+        }
+        if (!same) {
+            mismatches++;
+        }
+    }
+
+    // The same lookups over again, only timed
+    std::vector<std::tuple<smb::AreaID, int, int, int>> queries;
+    for (int i = 0; i < 1000; i++) {
+        const auto& sec = route[rnd(0, static_cast<int>(route.size()) - 1)];
+        queries.emplace_back(sec.AID, rnd(sec.Left, sec.Right - 1), sec.World, sec.Level);
+    }
+    auto time = [&](const smb::Route& r){
+        int found = 0;
+        auto start = util::Now();
+        for (auto & [id, apx, world, level] : queries) {
+            found += r.InCategory(id, apx, world, level, nullptr, nullptr);
+        }
+        auto elapsed = std::chrono::duration<double, std::nano>(util::Now() - start);
+        return std::make_pair(elapsed.count() / queries.size(), found);
+    };
+    auto [indexedNs, indexedFound] = time(route);
+    auto [linearNs, linearFound] = time(linear);
+    if (indexedFound != linearFound) {
+        mismatches++;
+    }
+
+    std::cout << fmt::format("route '{}': {} sections, {} / {} queries differ, InCategory {:.0f}ns indexed {:.0f}ns linear\n",
+            name, route.size(), mismatches, iterations, indexedNs, linearNs);
+    return mismatches;
+}
+
+// A route with every section from the database's routes, the same areas many
+// times over with overlapping extents
+static smb::Route ShuffledRoute(const std::vector<smb::Route>& routes, std::mt19937& gen)
+{
+    std::vector<smb::WorldSection> sections;
+    for (auto & route : routes) {
+        sections.insert(sections.end(), route.begin(), route.end());
+    }
+    std::shuffle(sections.begin(), sections.end(), gen);
+
+    smb::Route shuffled;
+    int xloc = 0;
+    for (auto & sec : sections) {
+        auto& s = shuffled.emplace_back() = sec;
+        s.Left += static_cast<int>(gen() % 64) - 32;
+        s.Right = std::max(s.Right + static_cast<int>(gen() % 64) - 32, s.Left + 1);
+        s.XLoc = xloc;
+        s.SectionIndex = shuffled.size() - 1;
+        xloc += s.Width() + 16;
+    }
+    shuffled.BuildIndex();
+    return shuffled;
+}
+
+// Routes as json, with the areas by name (as in smb::ToString) so that they
+// can be edited by hand
+static nlohmann::json RouteToJson(const smb::db::route& route)
+{
+    nlohmann::json sections = nlohmann::json::array();
+    for (auto & sec : route.route) {
+        std::string area = smb::ToString(sec.AID);
+        sections.push_back({
+            {"area_id", area.substr(0, area.find(' '))},
+            {"world", sec.World},
+            {"level", sec.Level},
+            {"left", sec.Left},
+            {"right", sec.Right},
+            {"xloc", sec.XLoc},
+        });
+    }
+    return {{"name", route.name}, {"sections", sections}};
+}
+
+static bool AreaIDFromJson(const nlohmann::json& j, smb::AreaID* aid)
+{
+    if (j.is_number_integer()) {
+        *aid = static_cast<smb::AreaID>(j.get<int>());
+        return true;
+    }
+    std::string v = j.get<std::string>();
+    for (auto & known : smb::KnownAreaIDs()) {
+        std::string area = smb::ToString(known);
+        if (v == area.substr(0, area.find(' '))) {
+            *aid = known;
+            return true;
+        }
+    }
+    try {
+        *aid = static_cast<smb::AreaID>(std::stoi(v, nullptr, 0));
+        return true;
+    } catch (std::exception&) {
+    }
+    return false;
+}
+
+static bool RouteFromJson(const nlohmann::json& j, smb::db::route* route, std::string* error)
+{
+    try {
+        route->id = 0;
+        route->name = j.at("name").get<std::string>();
+        route->route.clear();
+        for (auto & js : j.at("sections")) {
+            auto& sec = route->route.emplace_back();
+            if (!AreaIDFromJson(js.at("area_id"), &sec.AID)) {
+                *error = fmt::format("unknown area_id {} in section {}",
+                        js.at("area_id").dump(), route->route.size() - 1);
+                return false;
+            }
+            sec.World = js.at("world").get<int>();
+            sec.Level = js.at("level").get<int>();
+            sec.Left = js.at("left").get<int>();
+            sec.Right = js.at("right").get<int>();
+            sec.XLoc = js.at("xloc").get<int>();
+            sec.SectionIndex = route->route.size() - 1;
+        }
+    } catch (std::exception& e) {
+        *error = e.what();
+        return false;
+    }
+    if (route->name.empty()) {
+        *error = "route name is empty";
+        return false;
+    }
+    route->route.BuildIndex();
+    return true;
+}
+
+// By name, or by id
+static bool FindTAS(smb::SMBDatabase* smbdb, const std::string& nameOrID, int* id)
+{
+    std::vector<nes::db::nes_tas> tases;
+    smbdb->SelectAllTasesLight(&tases);
+    for (auto & tas : tases) {
+        if (tas.name == nameOrID || std::to_string(tas.id) == nameOrID) {
+            *id = tas.id;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void PrintRouteProblems(const std::string& name, const std::vector<smb::RouteProblem>& problems)
+{
+    for (auto & problem : problems) {
+        if (problem.SectionIndex < 0) {
+            std::cout << fmt::format("route '{}': {}\n", name, problem.Message);
+        } else {
+            std::cout << fmt::format("route '{}' section {}: {}\n", name, problem.SectionIndex, problem.Message);
+        }
+    }
+}
+
+// A route from the database validates, and comes back the same from json (as
+// export then import would). Returns the number of problems
+static size_t CheckRouteRoundTrip(smb::SMBDatabase* smbdb, const smb::db::route& route)
+{
+    std::vector<smb::RouteProblem> problems;
+    smb::ValidateRoute(route.route, *smbdb->GetNametableCache(), &problems);
+    PrintRouteProblems(route.name, problems);
+    size_t failed = problems.size();
+
+    smb::db::route back;
+    std::string error;
+    if (!RouteFromJson(nlohmann::json::parse(RouteToJson(route).dump()), &back, &error)) {
+        std::cout << fmt::format("route '{}': not read back from json: {}\n", route.name, error);
+        return failed + 1;
+    }
+    bool same = back.name == route.name && back.route.size() == route.route.size();
+    for (size_t i = 0; same && i < route.route.size(); i++) {
+        const auto& a = route.route[i];
+        const auto& b = back.route[i];
+        same = a == b && a.Left == b.Left && a.Right == b.Right && a.XLoc == b.XLoc;
+    }
+    if (!same) {
+        std::cout << fmt::format("route '{}': differs once read back from json\n", route.name);
+        failed++;
+    }
+    std::cout << fmt::format("route '{}': {} problems\n", route.name, failed);
+    return failed;
+}
+
+// 'static smb route'
+int DoSMBRoute(const sta::RuntimeConfig* config, smb::SMBDatabase* smbdb, int argc, char** argv)
+{
+    std::string arg;
+    if (!ArgReadString(&argc, &argv, &arg)) {
+        Error("expected an action after 'route'");
+        return 1;
+    }
+
+    int iterations = 10000;
+    int seed = 0;
+    bool force = false;
+    std::string tasName;
+    std::vector<std::string> positional;
+    std::string opt;
+    while (ArgReadString(&argc, &argv, &opt)) {
+        if (opt == "--iterations") {
+            if (!ArgReadInt(&argc, &argv, &iterations) || iterations <= 0) {
+                Error("positive integer required after --iterations");
+                return 1;
+            }
+        } else if (opt == "--seed") {
+            if (!ArgReadInt(&argc, &argv, &seed)) {
+                Error("integer required after --seed");
+                return 1;
+            }
+        } else if (opt == "--tas") {
+            if (!ArgReadString(&argc, &argv, &tasName)) {
+                Error("tas name or id required after --tas");
+                return 1;
+            }
+        } else if (opt == "--force") {
+            force = true;
+        } else if (opt.starts_with("--")) {
+            Error("unknown argument '{}'", opt);
+            return 1;
+        } else {
+            positional.push_back(opt);
+        }
+    }
+
+    auto expectPositional = [&](size_t lo, size_t hi, const char* usage){
+        if (positional.size() < lo || positional.size() > hi) {
+            Error("usage: static smb route {} {}", arg, usage);
+            return false;
+        }
+        return true;
+    };
+    auto getRoute = [&](const std::string& name, smb::db::route* route){
+        if (!smbdb->GetRoute(name, route)) {
+            Error("no route named '{}'", name);
+            return false;
+        }
+        return true;
+    };
+
+    if (arg == "list") {
+        if (!expectPositional(0, 0, "") || !SMBDBInit(config, smbdb)) {
+            return 1;
+        }
+        std::vector<std::string> names;
+        smbdb->GetRouteNames(&names);
+        for (auto & name : names) {
+            smb::db::route route;
+            if (!getRoute(name, &route)) {
+                return 1;
+            }
+            std::cout << fmt::format("{:<32} {:>3} sections {:>6} wide\n",
+                    name, route.route.size(), route.route.TotalWidth());
+        }
+    } else if (arg == "show") {
+        if (!expectPositional(1, 1, "<name>") || !SMBDBInit(config, smbdb)) {
+            return 1;
+        }
+        smb::db::route route;
+        if (!getRoute(positional[0], &route)) {
+            return 1;
+        }
+        std::cout << fmt::format("route '{}' id {}\n", route.name, route.id);
+        std::cout << fmt::format("{:>3}  {:<26} {:>3} {:>6} {:>6} {:>6}\n",
+                "#", "area", "w-l", "left", "right", "xloc");
+        for (size_t i = 0; i < route.route.size(); i++) {
+            const auto& sec = route.route[i];
+            std::cout << fmt::format("{:>3}  {:<26} {}-{} {:>6} {:>6} {:>6}\n",
+                    i, smb::ToString(sec.AID), sec.World, sec.Level,
+                    sec.Left, sec.Right, sec.XLoc);
+        }
+    } else if (arg == "validate") {
+        if (!expectPositional(1, 1, "<name> [--tas <name|id>]") || !SMBDBInit(config, smbdb)) {
+            return 1;
+        }
+        smb::db::route route;
+        if (!getRoute(positional[0], &route)) {
+            return 1;
+        }
+
+        std::vector<smb::RouteProblem> problems;
+        smb::ValidateRoute(route.route, *smbdb->GetNametableCache(), &problems);
+        PrintRouteProblems(route.name, problems);
+
+        bool ok = problems.empty();
+        if (!tasName.empty()) {
+            int tasID;
+            if (!FindTAS(smbdb, tasName, &tasID)) {
+                Error("no tas named '{}'", tasName);
+                return 1;
+            }
+            smb::RouteReplay replay;
+            if (!smb::ReplayRoute(smbdb, route.route, tasID, &replay)) {
+                Error("unable to replay tas '{}'", tasName);
+                return 1;
+            }
+            if (replay.FirstFailingSection >= 0) {
+                std::cout << fmt::format("route '{}' section {}: frame {}, {}\n", route.name,
+                        replay.FirstFailingSection, replay.Frame, replay.Message);
+                ok = false;
+            } else {
+                std::cout << fmt::format("route '{}': tas '{}' enters all {} sections in order, the last on frame {}\n",
+                        route.name, tasName, route.route.size(),
+                        replay.EnterFrame.empty() ? -1 : replay.EnterFrame.back());
+            }
+        }
+        if (problems.empty()) {
+            std::cout << fmt::format("route '{}': {} sections ok\n", route.name, route.route.size());
+        }
+        return ok ? 0 : 1;
+    } else if (arg == "import") {
+        if (!expectPositional(1, 1, "<file.json> [--force]") || !SMBDBInit(config, smbdb)) {
+            return 1;
+        }
+        smb::db::route route;
+        std::string error;
+        try {
+            std::ifstream ifs(positional[0]);
+            if (!ifs.good()) {
+                Error("unable to open '{}'", positional[0]);
+                return 1;
+            }
+            if (!RouteFromJson(nlohmann::json::parse(ifs), &route, &error)) {
+                Error("'{}': {}", positional[0], error);
+                return 1;
+            }
+        } catch (std::exception& e) {
+            Error("'{}': {}", positional[0], e.what());
+            return 1;
+        }
+
+        std::vector<smb::RouteProblem> problems;
+        smb::ValidateRoute(route.route, *smbdb->GetNametableCache(), &problems);
+        PrintRouteProblems(route.name, problems);
+        if (!problems.empty() && !force) {
+            Error("not importing route '{}' with problems (--force to anyway)", route.name);
+            return 1;
+        }
+
+        smb::InsertRoute(smbdb, &route);
+        std::cout << fmt::format("route '{}' id {}: {} sections imported\n",
+                route.name, route.id, route.route.size());
+    } else if (arg == "export") {
+        if (!expectPositional(1, 2, "<name> [file.json]") || !SMBDBInit(config, smbdb)) {
+            return 1;
+        }
+        smb::db::route route;
+        if (!getRoute(positional[0], &route)) {
+            return 1;
+        }
+        std::string txt = RouteToJson(route).dump(4) + "\n";
+        if (positional.size() == 2) {
+            util::WriteStringToFile(positional[1], txt);
+        } else {
+            std::cout << txt;
+        }
+    } else if (arg == "check") {
+        if (!expectPositional(0, 0, "[--iterations <n>] [--seed <n>]") || !SMBDBInit(config, smbdb)) {
+            return 1;
+        }
+        std::mt19937 gen(static_cast<uint32_t>(seed));
+        std::vector<std::string> names;
+        smbdb->GetRouteNames(&names);
+
+        size_t mismatches = 0;
+        std::vector<smb::Route> routes;
+        for (auto & name : names) {
+            smb::db::route route;
+            if (!smbdb->GetRoute(name, &route)) {
+                Error("failed to read route '{}'", name);
+                return 1;
+            }
+            mismatches += CheckRouteIndex(name, route.route, iterations, gen);
+            mismatches += CheckRouteRoundTrip(smbdb, route);
+            routes.push_back(route.route);
+        }
+        mismatches += CheckRouteIndex("shuffled", ShuffledRoute(routes, gen), iterations, gen);
+        return mismatches ? 1 : 0;
+    } else {
+        Error("unrecognized argument. '{}', expected 'list', 'show', 'validate', 'import', 'export' or 'check'", arg);
         return 1;
     }
     return 0;
@@ -183,7 +820,12 @@ REGISTER_COMMAND(smb, "Nintendo Entertainment System, Super Mario Bros., 1985",
 R"(
 EXAMPLES:
     static smb db init
+    static smb db init --dry-run
     static smb db ui
+    static smb route list
+    static smb route validate any% --tas happylee
+    static smb route export any% any.json
+    static smb route check
 
 USAGE:
     static smb <action> [<args>...]
@@ -193,8 +835,22 @@ DESCRIPTION:
     Mario Bros.' This was the first game supported.
 
 OPTIONS:
-    db init [rom path]
-        Initialize the database using the smb rom
+    db init [rom path] [--threads <n>] [--force <stage>]... [--dry-run]
+        Initialize the database using the smb rom. Only the stages whose input
+        files (or those of the stages they depend on) changed since the last
+        init are run again, --force <stage> ('all' for every one) runs it
+        anyway and --dry-run only prints what would be. The stages are rom,
+        sound_effects, music_tracks, nt_extract, nametable_pages, minimap,
+        pattern_tables and routes. The nametable pages are extracted on
+        --threads emulators (default one per hardware thread).
+
+    db check-extract [--threads <n>]
+        Extract the nametable pages with one thread and with --threads, and
+        compare their hashes with each other and the database's.
+
+    db bench-assets [--iterations <n>]
+        Time reading the sound effects and music as SMBComp does at startup,
+        in place from the database against copying them out.
 
     db edit
         Edit the smb database in sqlite.
@@ -205,6 +861,34 @@ OPTIONS:
     db path
         Print the path to the smb database.
 
+    route list
+        List the routes in the database, with their sections and width.
+
+    route show <name>
+        Print the sections of a route.
+
+    route validate <name> [--tas <name|id>]
+        Check that every section of a route has Left < Right and doesn't
+        overlap the one before, that its area is one the game has, and that
+        each of its pages has a nametable. With --tas also play the tas and
+        report the first section Mario doesn't go through in order.
+
+    route import <file.json> [--force]
+        Add a route from json (or replace the one of the same name). Routes
+        that don't validate are only imported with --force. Imported routes
+        are kept by 'db init', except one that data/smb/routes.sql gives the
+        same name or id, which is replaced with a warning.
+
+    route export <name> [file.json]
+        Write a route as json, to stdout if no file is given.
+
+    route check [--iterations <n>] [--seed <n>]
+        Compare InCategory and the visible sections of every route in the
+        database (and a shuffled one with every section of them) against
+        looking through the sections one at a time, at random positions.
+        Every route must also validate, before and after an export / import
+        through json.
+
 )")
 {
     std::string action;
@@ -217,8 +901,10 @@ OPTIONS:
 
     if (action == "db") {
         return DoSMBDB(config, &smbdb, argc, argv);
+    } else if (action == "route") {
+        return DoSMBRoute(config, &smbdb, argc, argv);
     } else {
-        Error("unrecognized action. '{}', expected 'db'", action);
+        Error("unrecognized action. '{}', expected 'db' or 'route'", action);
         return 1;
     }
 
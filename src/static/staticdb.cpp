@@ -62,21 +62,30 @@ void AppCache::SetWinRect(const util::Rect2I& rect)
 StaticDB::StaticDB(const std::string& path)
     : sqliteext::SQLiteExtDB(path)
 {
-    ExecOrThrow(AppCacheSchema());
+    MigrateOrThrow("static", Migrations());
 }
 
 StaticDB::~StaticDB()
 {
 }
 
+const std::vector<sqliteext::SQLiteExtMigration>& StaticDB::Migrations()
+{
+    static std::vector<sqliteext::SQLiteExtMigration> s_Migrations = {
+        {1, "app cache", [](sqliteext::SQLiteExtDB* db){
+            db->ExecOrThrow(AppCacheSchema());
+        }},
+    };
+    return s_Migrations;
+}
+
 bool StaticDB::LoadAppCache(AppCache* cache)
 {
     if (!cache) return false;
 
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         SELECT window_x, window_y, width, height, display, ini_data FROM app_cache WHERE name = ?;
-    )", &stmt);
+    )");
     sqliteext::BindStrOrThrow(stmt, 1, cache->Name);
 
     bool ret = false;
@@ -91,18 +100,16 @@ bool StaticDB::LoadAppCache(AppCache* cache)
 
         ret = true;
     }
-    sqlite3_finalize(stmt);
 
     return ret;
 }
 
 void StaticDB::SaveAppCache(const AppCache& cache)
 {
-    sqlite3_stmt* stmt;
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    auto stmt = PrepareOrThrow(R"(
         UPDATE app_cache
         SET window_x=?, window_y=?, width=?, height=?, display=?, ini_data=? WHERE name = ?;
-    )", &stmt);
+    )");
 
     auto bindexec = [&](){
         sqliteext::BindIntOrThrow(stmt, 1, cache.WindowX);
@@ -112,14 +119,14 @@ void StaticDB::SaveAppCache(const AppCache& cache)
         sqliteext::BindIntOrThrow(stmt, 5, cache.Display);
         sqliteext::BindStrOrThrow(stmt, 6, cache.IniData);
         sqliteext::BindStrOrThrow(stmt, 7, cache.Name);
-        sqliteext::StepAndFinalizeOrThrow(stmt);
+        sqliteext::StepDoneOrThrow(stmt);
     };
     bindexec();
 
-    sqliteext::PrepareOrThrow(m_Database, R"(
+    stmt = PrepareOrThrow(R"(
     INSERT OR IGNORE INTO app_cache (window_x, window_y, width, height, display, ini_data, name)
     VALUES (?, ?, ?, ?, ?, ?, ?);
-    )", &stmt);
+    )");
     bindexec();
 }
 